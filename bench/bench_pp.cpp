@@ -0,0 +1,508 @@
+// Throughput benchmarks for pp.hpp, on Google Benchmark. Build from the
+// repository root with
+//
+//   g++ -std=c++17 -O2 -I. bench/bench_pp.cpp -o bench_pp -lbenchmark -pthread
+//
+// Every benchmark reports bytes/sec over its input and "allocs", the global
+// heap allocations one run makes. The header corpus is every *.h directly
+// in $PP_BENCH_CORPUS (default /usr/include/linux) that preprocesses
+// cleanly, with <> includes searched along the colon-separated
+// $PP_BENCH_INCLUDE; files using something pp.hpp does not support are
+// dropped.
+#include "pp.hpp"
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <dirent.h>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+
+static std::atomic<size_t> allocationCount{0};
+
+void *operator new(std::size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+// GCC cannot see that the replaced operator new pairs with these, and warns
+// about every inlined delete.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  size_t align = static_cast<size_t>(alignment);
+  if (void *p = std::aligned_alloc(align, (size + align - 1) / align * align))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+// Counts the allocations made between construction and finish()
+class AllocationCounter {
+public:
+  AllocationCounter() : start_(allocationCount.load()) {}
+
+  void finish(benchmark::State &state, size_t bytesPerRun) {
+    state.counters["allocs"] =
+        benchmark::Counter(static_cast<double>(allocationCount.load() - start_),
+                           benchmark::Counter::kAvgIterations);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                            static_cast<int64_t>(bytesPerRun));
+  }
+
+private:
+  size_t start_;
+};
+
+static std::string repeatUntil(const std::string &unit, size_t size) {
+  std::string text;
+  text.reserve(size + unit.size());
+  while (text.size() < size)
+    text += unit;
+  return text;
+}
+
+// Ordinary C with comments, literals and punctuators but no macros to
+// expand, about a megabyte of it
+static const std::string &plainSource() {
+  static const std::string text = repeatUntil(
+      "/* Compute the checksum of a block.\n * Returns 0 on success. */\n"
+      "static int checksum(const unsigned char *p, size_t n, unsigned *out) {\n"
+      "  unsigned sum = 0x811c9dc5u; // FNV offset basis\n"
+      "  for (size_t i = 0; i < n; ++i) {\n"
+      "    sum ^= p[i];\n    sum *= 16777619u;\n  }\n"
+      "  if (out != NULL && n >= 1.5e3) *out = sum >> 3 | sum << 29;\n"
+      "  return printf(\"%u: %s\\n\", sum, n ? \"ok\" : \"empty\") < 0;\n"
+      "}\n\n",
+      1 << 20);
+  return text;
+}
+
+static const std::string &objectMacroSource() {
+  static const std::string text = [] {
+    std::string defines;
+    for (int i = 0; i < 500; i++) {
+      std::string n = std::to_string(i);
+      defines += "#define K" + n + " (K" + std::to_string(i / 2) + " + " + n +
+                 ")\n";
+    }
+    defines.replace(defines.find("(K0 + 0)"), 8, "1");
+    std::string uses;
+    for (int i = 0; i < 500; i += 7)
+      uses += "int v" + std::to_string(i) + " = K" + std::to_string(i) +
+              " * BUFSIZE;\n";
+    return defines + "#define BUFSIZE 4096\n" + repeatUntil(uses, 1 << 20);
+  }();
+  return text;
+}
+
+static const std::string &functionMacroSource() {
+  static const std::string text =
+      "#define MAX(a, b) ((a) > (b) ? (a) : (b))\n"
+      "#define MIN(a, b) ((a) < (b) ? (a) : (b))\n"
+      "#define CLAMP(x, lo, hi) MIN(MAX(x, lo), hi)\n"
+      "#define STR_(x) #x\n#define STR(x) STR_(x)\n"
+      "#define CAT(a, b) a ## b\n"
+      "#define LOG(...) log_write(__FILE__, __VA_ARGS__)\n" +
+      repeatUntil("int CAT(r, 1) = CLAMP(v[i], MIN(lo, 0), MAX(hi, 255));\n"
+                  "LOG(\"%s %d\", STR(CLAMP(a, b, c)), CAT(x, 2));\n"
+                  "int m = MAX(MAX(a, b),\n            MAX(c, MIN(d, e)));\n",
+                  1 << 20);
+  return text;
+}
+
+// depth conditionals open at once, alternating taken and not-taken groups
+static std::string nestedIfSource(int depth) {
+  std::string unit;
+  for (int i = 0; i < depth; i++)
+    unit += i % 3 == 2 ? "#if LEVEL > " + std::to_string(depth) +
+                             "\nnot_taken();\n#else\n"
+                       : "#if LEVEL > " + std::to_string(i) + "\n";
+  unit += "body();\n";
+  for (int i = depth; i-- > 0;)
+    unit += "#endif\n";
+  return "#define LEVEL " + std::to_string(depth) + "\n" +
+         repeatUntil(unit, 1 << 20);
+}
+
+// Mostly code inside #if 0, with nested conditionals, comments and literals
+static const std::string &deadRegionSource() {
+  static const std::string text = [] {
+    std::string dead = "#if 0\n";
+    dead += repeatUntil("#ifdef NESTED\nint hidden(void);\n#else\n"
+                        "x = \"#endif\"; /* #else\n#endif */\n#endif\n"
+                        "int skipped = 0; // #if 1\n",
+                        16 << 10);
+    dead += "#endif\nint live;\n";
+    return repeatUntil(dead, 4 << 20);
+  }();
+  return text;
+}
+
+// Ten megabytes of headers pasted together the way amalgamated builds are:
+// guarded sections, macro definitions and uses, dead configuration blocks
+static const std::string &amalgamationSource() {
+  static const std::string text = [] {
+    std::string all;
+    for (int file = 0; all.size() < (10u << 20); file++) {
+      std::string n = std::to_string(file);
+      all += "/*** begin file part" + n + ".h ***/\n#ifndef PART" + n +
+             "_H\n#define PART" + n + "_H\n#define PART" + n +
+             "_VERSION " + n + "\n"
+             "#define PART" + n + "_CALL(f, ...) part" + n +
+             "_ ## f(__VA_ARGS__)\n"
+             "#if defined(_WIN32) && !defined(PART" + n + "_STATIC)\n"
+             "__declspec(dllexport) int part" + n + "_init(void);\n"
+             "#elif PART" + n + "_VERSION >= 0\n"
+             "int part" + n + "_init(void);\n#endif\n";
+      all += repeatUntil("typedef struct { int id; const char *name; } item_t;\n"
+                         "static int lookup(item_t *items, int n) {\n"
+                         "  return PART" + n + "_CALL(find, items, n, \"key\")"
+                         " + PART" + n + "_VERSION; /* hot */\n}\n"
+                         "#if 0\nint unused(void) { return 1; }\n#endif\n",
+                         2048);
+      all += "#endif /* PART" + n + "_H */\n/*** end file ***/\n";
+    }
+    return all;
+  }();
+  return text;
+}
+
+struct Corpus {
+  FileCache cache; // Keeps the files mapped, so runs measure no I/O
+  std::vector<std::string> files;
+  size_t bytes = 0; // One pass over every file, included ones too
+};
+
+static void addCorpusIncludePaths(PreProcessor &pp) {
+  const char *paths = std::getenv("PP_BENCH_INCLUDE");
+  std::string list =
+      paths ? paths : "/usr/include/x86_64-linux-gnu:/usr/include";
+  for (size_t start = 0, end; start < list.size(); start = end + 1) {
+    end = std::min(list.find(':', start), list.size());
+    if (end > start)
+      pp.addSystemIncludePath(list.substr(start, end - start));
+  }
+}
+
+static Corpus &headerCorpus() {
+  static Corpus corpus;
+  static bool loaded = false;
+  if (loaded)
+    return corpus;
+  loaded = true;
+  const char *dir = std::getenv("PP_BENCH_CORPUS");
+  std::string root = dir ? dir : "/usr/include/linux";
+  DIR *listing = opendir(root.c_str());
+  if (!listing)
+    return corpus;
+  std::vector<std::string> names;
+  while (dirent *entry = readdir(listing)) {
+    std::string name = entry->d_name;
+    if (name.size() > 2 && name.compare(name.size() - 2, 2, ".h") == 0)
+      names.push_back(root + "/" + name);
+  }
+  closedir(listing);
+  std::sort(names.begin(), names.end());
+  for (const std::string &path : names) {
+    try {
+      PreProcessor pp = PreProcessor::fromFile(path, corpus.cache);
+      addCorpusIncludePaths(pp);
+      IncludeGraph graph = pp.scanDependencies();
+      PreProcessor check = PreProcessor::fromFile(path, corpus.cache);
+      addCorpusIncludePaths(check);
+      check.expandMacros();
+      for (const IncludeGraph::File &file : graph.files)
+        corpus.bytes += corpus.cache.load(file.path)->text().size();
+      corpus.files.push_back(path);
+    } catch (const std::runtime_error &) {
+    }
+  }
+  return corpus;
+}
+
+static void BM_LexOnly(benchmark::State &state) {
+  const std::string &text = plainSource();
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    PreProcessor pp(text);
+    size_t tokens = 0;
+    while (pp.next().kind != TokenKind::T_EOF)
+      tokens++;
+    benchmark::DoNotOptimize(tokens);
+  }
+  allocations.finish(state, text.size());
+}
+BENCHMARK(BM_LexOnly)->Unit(benchmark::kMillisecond);
+
+static void expandText(benchmark::State &state, const std::string &text) {
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    PreProcessor pp(text);
+    std::string out = pp.expandMacros();
+    benchmark::DoNotOptimize(out.data());
+  }
+  allocations.finish(state, text.size());
+}
+
+static void BM_PlainText(benchmark::State &state) {
+  expandText(state, plainSource());
+}
+BENCHMARK(BM_PlainText)->Unit(benchmark::kMillisecond);
+
+static void BM_ObjectMacros(benchmark::State &state) {
+  expandText(state, objectMacroSource());
+}
+BENCHMARK(BM_ObjectMacros)->Unit(benchmark::kMillisecond);
+
+static void BM_FunctionMacros(benchmark::State &state) {
+  expandText(state, functionMacroSource());
+}
+BENCHMARK(BM_FunctionMacros)->Unit(benchmark::kMillisecond);
+
+static void BM_NestedIf(benchmark::State &state) {
+  expandText(state, nestedIfSource(static_cast<int>(state.range(0))));
+}
+BENCHMARK(BM_NestedIf)->Arg(8)->Arg(64)->Arg(512)->Unit(benchmark::kMillisecond);
+
+static void BM_DeadRegions(benchmark::State &state) {
+  expandText(state, deadRegionSource());
+}
+BENCHMARK(BM_DeadRegions)->Unit(benchmark::kMillisecond);
+
+static void BM_Amalgamation(benchmark::State &state) {
+  expandText(state, amalgamationSource());
+}
+BENCHMARK(BM_Amalgamation)->Unit(benchmark::kMillisecond);
+
+// The same amalgamation through one PreProcessor reused with reset()
+static void BM_AmalgamationReset(benchmark::State &state) {
+  const std::string &text = amalgamationSource();
+  PreProcessor pp(text);
+  std::string out;
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    pp.reset(text);
+    out.clear();
+    StringSink sink(out);
+    pp.expandMacros(sink);
+    benchmark::DoNotOptimize(out.data());
+  }
+  allocations.finish(state, text.size());
+}
+BENCHMARK(BM_AmalgamationReset)->Unit(benchmark::kMillisecond);
+
+// The amalgamation tokenized up front by prelex() on range(0) threads
+static void BM_AmalgamationPrelex(benchmark::State &state) {
+  const std::string &text = amalgamationSource();
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    PreProcessor pp(text);
+    pp.prelex(static_cast<unsigned>(state.range(0)));
+    std::string out = pp.expandMacros();
+    benchmark::DoNotOptimize(out.data());
+  }
+  allocations.finish(state, text.size());
+}
+BENCHMARK(BM_AmalgamationPrelex)
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(16)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// The amalgamation's tokens pulled in batches, as a parser would read them
+static void BM_NextBatch(benchmark::State &state) {
+  const std::string &text = amalgamationSource();
+  TokenBatch batch;
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    PreProcessor pp(text);
+    size_t tokens = 0;
+    while (size_t n = pp.nextBatch(batch, static_cast<size_t>(state.range(0))))
+      tokens += n;
+    benchmark::DoNotOptimize(tokens);
+  }
+  allocations.finish(state, text.size());
+}
+BENCHMARK(BM_NextBatch)->Arg(256)->Arg(4096)->Unit(benchmark::kMillisecond);
+
+// The same with location tracking off (0) and on (1)
+static void BM_NextBatchLocations(benchmark::State &state) {
+  const std::string &text = amalgamationSource();
+  TokenBatch batch;
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    PreProcessor pp(text);
+    pp.setLocationTracking(state.range(0) != 0);
+    size_t tokens = 0;
+    while (size_t n = pp.nextBatch(batch, 4096))
+      tokens += n;
+    benchmark::DoNotOptimize(tokens);
+  }
+  allocations.finish(state, text.size());
+}
+BENCHMARK(BM_NextBatchLocations)
+    ->Arg(0)
+    ->Arg(1)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_HeaderCorpus(benchmark::State &state) {
+  Corpus &corpus = headerCorpus();
+  if (corpus.files.empty()) {
+    state.SkipWithError("no header corpus; set PP_BENCH_CORPUS");
+    return;
+  }
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    for (const std::string &path : corpus.files) {
+      PreProcessor pp = PreProcessor::fromFile(path, corpus.cache);
+      addCorpusIncludePaths(pp);
+      std::string out = pp.expandMacros();
+      benchmark::DoNotOptimize(out.data());
+    }
+  }
+  state.counters["files"] = static_cast<double>(corpus.files.size());
+  allocations.finish(state, corpus.bytes);
+}
+BENCHMARK(BM_HeaderCorpus)->Unit(benchmark::kMillisecond);
+
+// The corpus with #includes looked up ahead on an IncludePrefetcher. With
+// every file already cached this measures the overhead; the gain is on
+// file systems where stat and open are slow.
+static void BM_HeaderCorpusPrefetch(benchmark::State &state) {
+  Corpus &corpus = headerCorpus();
+  if (corpus.files.empty()) {
+    state.SkipWithError("no header corpus; set PP_BENCH_CORPUS");
+    return;
+  }
+  IncludePrefetcher prefetcher(corpus.cache);
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    for (const std::string &path : corpus.files) {
+      PreProcessor pp = PreProcessor::fromFile(path, corpus.cache);
+      addCorpusIncludePaths(pp);
+      pp.setIncludePrefetcher(prefetcher);
+      std::string out = pp.expandMacros();
+      benchmark::DoNotOptimize(out.data());
+    }
+  }
+  state.counters["files"] = static_cast<double>(corpus.files.size());
+  allocations.finish(state, corpus.bytes);
+}
+BENCHMARK(BM_HeaderCorpusPrefetch)->Unit(benchmark::kMillisecond);
+
+// A configuration header full of conditional groups, included a thousand
+// times, as unguarded X-macro style headers are, with its settings changed
+// every so often.
+// Written once to /tmp; returns the main file and the bytes
+// one pass reads.
+static const std::pair<std::string, size_t> &repeatedHeaderMain() {
+  static const std::pair<std::string, size_t> input = [] {
+    std::string root = "/tmp/pp_bench_repeated";
+    std::system(("mkdir -p " + root).c_str());
+    std::string header = "#define AT_LEAST(major, minor) "
+                         "(MODE > (major) || (MODE == (major) && 2 >= (minor)))\n";
+    for (int i = 0; i < 64; i++) {
+      std::string n = std::to_string(i);
+      std::string body = repeatUntil("int call" + n + "(struct state *s, "
+                                     "const char *name); /* #else */\n",
+                                     512);
+      header += "#if AT_LEAST(" + std::to_string(i % 4) + ", " +
+                std::to_string(i % 3) + ") && defined(FEATURE" +
+                std::to_string(i % 8) + ")\n" + body +
+                "#elif MODE > 2\nlong wide" + n + ";\n"
+                "#else\n#ifdef LEGACY\n" + body + "#endif\n"
+                "#endif\n";
+    }
+    std::ofstream(root + "/config.h", std::ios::binary) << header;
+    std::string main;
+    for (int i = 0; i < 1000; i++) {
+      if (i % 250 == 0)
+        main += "#undef MODE\n#define MODE " + std::to_string(i / 250) + "\n";
+      if (i % 125 == 0)
+        main += "#define FEATURE" + std::to_string(i / 125) + "\n";
+      main += "#include \"config.h\"\n";
+    }
+    std::ofstream(root + "/main.c", std::ios::binary) << main;
+    return std::make_pair(root + "/main.c", main.size() + 1000 * header.size());
+  }();
+  return input;
+}
+
+static void BM_RepeatedHeader(benchmark::State &state) {
+  FileCache cache;
+  const auto &[path, bytes] = repeatedHeaderMain();
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    PreProcessor pp = PreProcessor::fromFile(path, cache);
+    std::string out = pp.expandMacros();
+    benchmark::DoNotOptimize(out.data());
+  }
+  allocations.finish(state, bytes);
+}
+BENCHMARK(BM_RepeatedHeader)->Unit(benchmark::kMillisecond);
+
+// Translation units that each include one large guarded header, read through
+// a FileCache per unit (0) or one they share (1). Sharing, every unit after
+// the first two looks the header's tokens up instead of lexing it.
+static const std::pair<std::string, size_t> &sharedHeaderUnit() {
+  static const std::pair<std::string, size_t> input = [] {
+    std::string root = "/tmp/pp_bench_shared";
+    std::system(("mkdir -p " + root).c_str());
+    std::string header =
+        "#ifndef BIG_H\n#define BIG_H\n" +
+        repeatUntil("struct node { int key; const char *name; /* field */ "
+                    "}; extern int visit(struct node *n, long depth);\n",
+                    512 * 1024) +
+        "#endif\n";
+    std::ofstream(root + "/big.h", std::ios::binary) << header;
+    std::string unit = "#include \"big.h\"\nint unit(void) { return 0; }\n";
+    std::ofstream(root + "/unit.c", std::ios::binary) << unit;
+    return std::make_pair(root + "/unit.c", unit.size() + header.size());
+  }();
+  return input;
+}
+
+static void BM_SharedHeaderTokens(benchmark::State &state) {
+  FileCache shared;
+  const auto &[path, bytes] = sharedHeaderUnit();
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    FileCache own;
+    PreProcessor pp =
+        PreProcessor::fromFile(path, state.range(0) ? shared : own);
+    std::string out = pp.expandMacros();
+    benchmark::DoNotOptimize(out.data());
+  }
+  allocations.finish(state, bytes);
+}
+BENCHMARK(BM_SharedHeaderTokens)
+    ->Arg(0)
+    ->Arg(1)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_DependencyScan(benchmark::State &state) {
+  const std::string &text = amalgamationSource();
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    PreProcessor pp(text);
+    IncludeGraph graph = pp.scanDependencies();
+    benchmark::DoNotOptimize(graph.files.data());
+  }
+  allocations.finish(state, text.size());
+}
+BENCHMARK(BM_DependencyScan)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
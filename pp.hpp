@@ -1,14 +1,65 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <list>
 #include <map>
-#include <sstream>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define PP_SIMD_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) ||                                \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PP_SIMD_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PP_SIMD_NEON 1
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Define PP_ENABLE_STATS before including this header to have every
+// PreProcessor count what its hot paths do (see PreprocessStats). Without
+// it PP_STAT() drops the statement it wraps, so the counters cost nothing.
+#if defined(PP_ENABLE_STATS)
+#define PP_STAT(...) __VA_ARGS__
+#else
+#define PP_STAT(...) ((void)0)
+#endif
+
 /*
 
 
@@ -180,13 +231,16 @@ punctuator: one of
 
 
 
-// TokenKind: Represents the type of tokens in the preprocessor
-enum class TokenKind {
+// TokenKind: Represents the type of tokens in the preprocessor. One byte,
+// so that a Token packs into eight.
+enum class TokenKind : std::int8_t {
   T_EOF = -1,
   Unknown = 0,
 
   Ident,
 
+  // Directive keywords. These stay contiguous after Ident so that
+  // isIdentifierLike() is a range check.
   Include, // #include
   Define,  // #define
   Undef,   // #undef
@@ -195,6 +249,10 @@ enum class TokenKind {
   IfDef,   // #ifdef
   IfNDef,  // #ifndef
   Endif,   // #endif
+  Elif,    // #elif
+  Line,    // #line
+  Error,   // #error
+  Pragma,  // #pragma
 
   // literals
   PPNumber,
@@ -253,824 +311,5107 @@ enum class TokenKind {
 
 };
 
+// Directive keywords are still identifiers outside of directive position.
+inline bool isIdentifierLike(TokenKind kind) {
+  return kind >= TokenKind::Ident && kind <= TokenKind::Pragma;
+}
+
+// The enumerator's name, for dumps and diagnostics
+inline const char *tokenKindName(TokenKind kind) {
+  static const char *const names[] = {
+      "T_EOF", "Unknown", "Ident", "Include", "Define", "Undef", "If", "Else",
+      "IfDef", "IfNDef", "Endif", "Elif", "Line", "Error", "Pragma", "PPNumber",
+      "CharLiteral", "StringLiteral", "L_Bracket", "R_Bracket", "L_Paren",
+      "R_Paren", "L_Brace", "R_Brace", "Dot", "Arrow", "PlusPlus", "MinusMinus",
+      "Ampersand", "Star", "Plus", "Minus", "Tilde", "Not", "Slash", "Percent",
+      "LessLess", "GreaterGreater", "Less", "Greater", "LessEqual",
+      "GreaterEqual", "EqualEqual", "ExclamationEqual", "XOR", "BitOr",
+      "LogicAnd", "LogicOr", "Question", "Colon", "Semicolon", "Ellipsis",
+      "Assign", "MulAssign", "DivAssign", "ModAssign", "AddAssign",
+      "MinusEqual", "LessLessEqual", "GreaterGreaterEqual", "BitAndEqual",
+      "XorAssign", "OrAssign", "Comma", "Hash", "HashHash"};
+  size_t i = static_cast<size_t>(static_cast<int>(kind) + 1);
+  return i < std::size(names) ? names[i] : "?";
+}
+
 // Token: Represents a single token
+//
+// Packed into eight bytes, as files keep whole arrays of them (see
+// FileEntry::tokens()): a 32-bit offset, a 24-bit length and the kind.
 struct Token {
-  unsigned begin;
-  unsigned len;
+  static constexpr unsigned kMaxLen = (1u << 24) - 1;
+
+  uint32_t begin;
+  uint32_t len : 24;
+  TokenKind kind : 8;
+
+  Token(unsigned b, unsigned l, TokenKind k) : begin(b), len(l), kind(k) {
+    if (l > kMaxLen)
+      throw std::runtime_error("token longer than 16 MiB");
+  }
+};
+static_assert(sizeof(Token) == 8, "Token should pack into eight bytes");
+
+// Byte scanning helpers used by the lexer hot paths. Each routine has a
+// vector path (AVX2, SSE2 or NEON, picked at compile time) and a scalar tail
+// that also serves as the fallback on other targets.
+namespace pp_detail {
+
+// Character classes for the lexer, one table lookup per byte instead of the
+// locale-dependent <cctype> calls. Bytes >= 0x80 have no class.
+enum CharClass : unsigned char {
+  CC_Digit = 1 << 0,
+  CC_Letter = 1 << 1,
+  CC_Underscore = 1 << 2,
+  CC_HSpace = 1 << 3, // ' ', '\t', '\v', '\f', '\r'; not '\n'
+
+  CC_IdentStart = CC_Letter | CC_Underscore,
+  CC_IdentBody = CC_Letter | CC_Underscore | CC_Digit,
+};
+
+struct CharClassTable {
+  unsigned char cls[256] = {};
+};
+
+constexpr CharClassTable makeCharClassTable() {
+  CharClassTable t;
+  for (int c = '0'; c <= '9'; c++)
+    t.cls[c] |= CC_Digit;
+  for (int c = 'a'; c <= 'z'; c++)
+    t.cls[c] |= CC_Letter;
+  for (int c = 'A'; c <= 'Z'; c++)
+    t.cls[c] |= CC_Letter;
+  t.cls[static_cast<unsigned char>('_')] |= CC_Underscore;
+  for (char c : {' ', '\t', '\v', '\f', '\r'})
+    t.cls[static_cast<unsigned char>(c)] |= CC_HSpace;
+  return t;
+}
+
+inline constexpr CharClassTable kCharClass = makeCharClassTable();
+
+inline bool hasClass(char c, unsigned char mask) {
+  return (kCharClass.cls[static_cast<unsigned char>(c)] & mask) != 0;
+}
+
+// ' ', '\t', '\v', '\f', '\r' -- what std::isspace accepts in the "C" locale,
+// minus '\n', which the lexer reports as a token.
+inline bool isHorizontalSpace(unsigned char c) {
+  return (kCharClass.cls[c] & CC_HSpace) != 0;
+}
+
+// Directive keywords, looked up with a perfect hash over the first byte, the
+// last byte and the length. kKeywordTable below is checked at compile time to
+// be collision free.
+struct Keyword {
+  std::string_view spelling;
   TokenKind kind;
+};
 
-  Token(unsigned b, unsigned l, TokenKind k) : begin(b), len(l), kind(k) {}
+inline constexpr Keyword kKeywords[] = {
+    {"include", TokenKind::Include}, {"define", TokenKind::Define},
+    {"undef", TokenKind::Undef},     {"if", TokenKind::If},
+    {"else", TokenKind::Else},       {"endif", TokenKind::Endif},
+    {"ifdef", TokenKind::IfDef},     {"ifndef", TokenKind::IfNDef},
+    {"elif", TokenKind::Elif},       {"line", TokenKind::Line},
+    {"error", TokenKind::Error},     {"pragma", TokenKind::Pragma},
 };
 
-struct LinColQuery {
-  std::vector<unsigned> lineoffset;
+constexpr size_t kKeywordMinLen = 2;
+constexpr size_t kKeywordMaxLen = 7;
+constexpr unsigned kKeywordTableSize = 32;
+
+constexpr unsigned keywordHash(const char *s, size_t len) {
+  return (static_cast<unsigned char>(s[0]) +
+          static_cast<unsigned char>(s[len - 1]) + 5 * unsigned(len)) &
+         (kKeywordTableSize - 1);
+}
 
-  LinColQuery() {
-    lineoffset.push_back(0); // Line 1 starts at offset 0
+struct KeywordTable {
+  Keyword slots[kKeywordTableSize] = {};
+  bool collisionFree = true;
+};
+
+constexpr KeywordTable makeKeywordTable() {
+  KeywordTable t;
+  for (const Keyword &kw : kKeywords) {
+    Keyword &slot = t.slots[keywordHash(kw.spelling.data(), kw.spelling.size())];
+    if (!slot.spelling.empty())
+      t.collisionFree = false;
+    slot = kw;
   }
+  return t;
+}
+
+inline constexpr KeywordTable kKeywordTable = makeKeywordTable();
+static_assert(kKeywordTable.collisionFree,
+              "keywordHash() must be a perfect hash over kKeywords");
+
+// Returns the directive keyword kind for an identifier, or TokenKind::Ident.
+inline TokenKind lookupKeyword(const char *s, size_t len) {
+  if (len < kKeywordMinLen || len > kKeywordMaxLen)
+    return TokenKind::Ident;
+  const Keyword &slot = kKeywordTable.slots[keywordHash(s, len)];
+  if (slot.spelling.size() == len &&
+      std::memcmp(slot.spelling.data(), s, len) == 0)
+    return slot.kind;
+  return TokenKind::Ident;
+}
+
+// Punctuators indexed by their first byte. Almost every C punctuator is one
+// of X, X=, XX or XX=; the rest ('->', '...') are special-cased in the lexer.
+struct PunctRule {
+  TokenKind single = TokenKind::Unknown;       // X
+  TokenKind withEqual = TokenKind::Unknown;    // X=
+  TokenKind doubled = TokenKind::Unknown;      // XX
+  TokenKind doubledEqual = TokenKind::Unknown; // XX=
+};
 
-  void addLine(unsigned lineStartOffset, bool isInclude = false) {
-    if (isInclude)
-      return;
+struct PunctTable {
+  PunctRule rules[256] = {};
+};
 
-    lineoffset.push_back(lineStartOffset);
+constexpr PunctTable makePunctTable() {
+  PunctTable t;
+  auto set = [&t](char c, TokenKind single,
+                  TokenKind withEqual = TokenKind::Unknown,
+                  TokenKind doubled = TokenKind::Unknown,
+                  TokenKind doubledEqual = TokenKind::Unknown) {
+    PunctRule &r = t.rules[static_cast<unsigned char>(c)];
+    r.single = single;
+    r.withEqual = withEqual;
+    r.doubled = doubled;
+    r.doubledEqual = doubledEqual;
+  };
+  set('[', TokenKind::L_Bracket);
+  set(']', TokenKind::R_Bracket);
+  set('(', TokenKind::L_Paren);
+  set(')', TokenKind::R_Paren);
+  set('{', TokenKind::L_Brace);
+  set('}', TokenKind::R_Brace);
+  set('.', TokenKind::Dot);
+  set('~', TokenKind::Tilde);
+  set('?', TokenKind::Question);
+  set(':', TokenKind::Colon);
+  set(';', TokenKind::Semicolon);
+  set(',', TokenKind::Comma);
+  set('+', TokenKind::Plus, TokenKind::AddAssign, TokenKind::PlusPlus);
+  set('-', TokenKind::Minus, TokenKind::MinusEqual, TokenKind::MinusMinus);
+  set('&', TokenKind::Ampersand, TokenKind::BitAndEqual, TokenKind::LogicAnd);
+  set('|', TokenKind::BitOr, TokenKind::OrAssign, TokenKind::LogicOr);
+  set('<', TokenKind::Less, TokenKind::LessEqual, TokenKind::LessLess,
+      TokenKind::LessLessEqual);
+  set('>', TokenKind::Greater, TokenKind::GreaterEqual,
+      TokenKind::GreaterGreater, TokenKind::GreaterGreaterEqual);
+  set('=', TokenKind::Assign, TokenKind::EqualEqual);
+  set('!', TokenKind::Not, TokenKind::ExclamationEqual);
+  set('*', TokenKind::Star, TokenKind::MulAssign);
+  set('/', TokenKind::Slash, TokenKind::DivAssign);
+  set('%', TokenKind::Percent, TokenKind::ModAssign);
+  set('^', TokenKind::XOR, TokenKind::XorAssign);
+  set('#', TokenKind::Hash, TokenKind::Unknown, TokenKind::HashHash);
+  return t;
+}
+
+inline constexpr PunctTable kPunctTable = makePunctTable();
+
+#if defined(PP_SIMD_AVX2)
+inline unsigned hspaceMask(const char *p) {
+  __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  __m256i space = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+  __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+  __m256i ctrl = _mm256_cmpeq_epi8(_mm256_subs_epu8(t, _mm256_set1_epi8(4)),
+                                   _mm256_setzero_si256());
+  __m256i nl = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+  __m256i m = _mm256_or_si256(space, _mm256_andnot_si256(nl, ctrl));
+  return static_cast<unsigned>(_mm256_movemask_epi8(m));
+}
+
+inline unsigned commentEndMask(const char *p) {
+  __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 1));
+  __m256i m = _mm256_and_si256(_mm256_cmpeq_epi8(a, _mm256_set1_epi8('*')),
+                               _mm256_cmpeq_epi8(b, _mm256_set1_epi8('/')));
+  return static_cast<unsigned>(_mm256_movemask_epi8(m));
+}
+
+inline unsigned skipStopMask(const char *p) {
+  __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  __m256i m = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'))),
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\''))));
+  return static_cast<unsigned>(_mm256_movemask_epi8(m));
+}
+
+inline unsigned newlineMask(const char *p) {
+  __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  return static_cast<unsigned>(
+      _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))));
+}
+constexpr size_t kVectorWidth = 32;
+#elif defined(PP_SIMD_SSE2)
+inline unsigned hspaceMask(const char *p) {
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  __m128i space = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+  __m128i t = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+  __m128i ctrl =
+      _mm_cmpeq_epi8(_mm_subs_epu8(t, _mm_set1_epi8(4)), _mm_setzero_si128());
+  __m128i nl = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+  __m128i m = _mm_or_si128(space, _mm_andnot_si128(nl, ctrl));
+  return static_cast<unsigned>(_mm_movemask_epi8(m));
+}
+
+inline unsigned commentEndMask(const char *p) {
+  __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 1));
+  __m128i m = _mm_and_si128(_mm_cmpeq_epi8(a, _mm_set1_epi8('*')),
+                            _mm_cmpeq_epi8(b, _mm_set1_epi8('/')));
+  return static_cast<unsigned>(_mm_movemask_epi8(m));
+}
+
+inline unsigned skipStopMask(const char *p) {
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  __m128i m =
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                                _mm_cmpeq_epi8(v, _mm_set1_epi8('/'))),
+                   _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                _mm_cmpeq_epi8(v, _mm_set1_epi8('\''))));
+  return static_cast<unsigned>(_mm_movemask_epi8(m));
+}
+
+inline unsigned newlineMask(const char *p) {
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  return static_cast<unsigned>(
+      _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+}
+constexpr size_t kVectorWidth = 16;
+#elif defined(PP_SIMD_NEON)
+// NEON has no movemask; narrow each byte lane to a nibble instead, giving a
+// 64-bit mask with four bits per input byte.
+inline uint64_t neonMask(uint8x16_t m) {
+  uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(n), 0);
+}
+
+inline uint64_t hspaceMask(const char *p) {
+  uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+  uint8x16_t space = vceqq_u8(v, vdupq_n_u8(' '));
+  uint8x16_t ctrl = vcleq_u8(vsubq_u8(v, vdupq_n_u8('\t')), vdupq_n_u8(4));
+  uint8x16_t nl = vceqq_u8(v, vdupq_n_u8('\n'));
+  return neonMask(vorrq_u8(space, vbicq_u8(ctrl, nl)));
+}
+
+inline uint64_t commentEndMask(const char *p) {
+  uint8x16_t a = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+  uint8x16_t b = vld1q_u8(reinterpret_cast<const uint8_t *>(p + 1));
+  return neonMask(
+      vandq_u8(vceqq_u8(a, vdupq_n_u8('*')), vceqq_u8(b, vdupq_n_u8('/'))));
+}
+
+inline uint64_t skipStopMask(const char *p) {
+  uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+  return neonMask(vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')),
+                                    vceqq_u8(v, vdupq_n_u8('/'))),
+                           vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')),
+                                    vceqq_u8(v, vdupq_n_u8('\'')))));
+}
+
+inline uint64_t newlineMask(const char *p) {
+  uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+  return neonMask(vceqq_u8(v, vdupq_n_u8('\n')));
+}
+constexpr size_t kVectorWidth = 16;
+#endif
+
+#if defined(PP_SIMD_AVX2) || defined(PP_SIMD_SSE2) || defined(PP_SIMD_NEON)
+#define PP_SIMD 1
+template <typename Mask> inline unsigned firstSetLane(Mask m) {
+#if defined(PP_SIMD_NEON)
+  return static_cast<unsigned>(__builtin_ctzll(m)) / 4;
+#elif defined(_MSC_VER) && !defined(__clang__)
+  unsigned long idx;
+  _BitScanForward(&idx, m);
+  return static_cast<unsigned>(idx);
+#else
+  return static_cast<unsigned>(__builtin_ctz(m));
+#endif
+}
+
+// m without the bits of its first set lane
+template <typename Mask> inline Mask clearFirstLane(Mask m) {
+#if defined(PP_SIMD_NEON)
+  return m & ~(Mask(0xF) << (firstSetLane(m) * 4));
+#else
+  return m & (m - 1);
+#endif
+}
+
+// All-ones mask for a full vector, used to invert hspaceMask().
+#if defined(PP_SIMD_NEON)
+constexpr uint64_t kFullMask = ~uint64_t(0);
+#elif defined(PP_SIMD_AVX2)
+constexpr unsigned kFullMask = 0xFFFFFFFFu;
+#else
+constexpr unsigned kFullMask = 0xFFFFu;
+#endif
+#endif
+
+// Returns the first index in [pos, end) that is not horizontal whitespace,
+// or end.
+inline size_t skipHorizontalSpace(const char *p, size_t pos, size_t end) {
+#if defined(PP_SIMD)
+  while (pos + kVectorWidth <= end) {
+    auto other = hspaceMask(p + pos) ^ kFullMask;
+    if (other)
+      return pos + firstSetLane(other);
+    pos += kVectorWidth;
+  }
+#endif
+  while (pos < end && isHorizontalSpace(static_cast<unsigned char>(p[pos])))
+    pos++;
+  return pos;
+}
+
+// Returns the first index in [pos, end) holding '\n', or end.
+inline size_t findNewline(const char *p, size_t pos, size_t end) {
+  if (pos >= end)
+    return end;
+  // memchr is already vectorised by every libc we care about.
+  const void *hit = std::memchr(p + pos, '\n', end - pos);
+  return hit ? static_cast<size_t>(static_cast<const char *>(hit) - p) : end;
+}
+
+// Returns the index of the '*' of the first "*/" starting in [pos, end - 1),
+// or end if the comment is unterminated.
+inline size_t findBlockCommentEnd(const char *p, size_t pos, size_t end) {
+#if defined(PP_SIMD)
+  // Each vector step reads one byte past its lanes for the '/' check.
+  while (pos + kVectorWidth + 1 <= end) {
+    auto hits = commentEndMask(p + pos);
+    if (hits)
+      return pos + firstSetLane(hits);
+    pos += kVectorWidth;
+  }
+#endif
+  for (; pos + 1 < end; pos++) {
+    if (p[pos] == '*' && p[pos + 1] == '/')
+      return pos;
+  }
+  return end;
+}
+
+// Appends the offset just past every '\n' in [pos, end) to lineStarts.
+inline void appendLineStarts(const char *p, size_t pos, size_t end,
+                             std::vector<unsigned> &lineStarts) {
+#if defined(PP_SIMD)
+  while (pos + kVectorWidth <= end) {
+    for (auto hits = newlineMask(p + pos); hits; hits = clearFirstLane(hits))
+      lineStarts.push_back(static_cast<unsigned>(pos + firstSetLane(hits) + 1));
+    pos += kVectorWidth;
+  }
+#endif
+  for (; pos < end; pos++) {
+    if (p[pos] == '\n')
+      lineStarts.push_back(static_cast<unsigned>(pos + 1));
+  }
+}
+
+// Returns the first index in [pos, end) holding a byte that can change how
+// the rest of a skipped line is read: '\n', '/', '"' or '\'', or end.
+inline size_t findSkipStop(const char *p, size_t pos, size_t end) {
+#if defined(PP_SIMD)
+  while (pos + kVectorWidth <= end) {
+    auto hits = skipStopMask(p + pos);
+    if (hits)
+      return pos + firstSetLane(hits);
+    pos += kVectorWidth;
+  }
+#endif
+  for (; pos < end; pos++) {
+    char c = p[pos];
+    if (c == '\n' || c == '/' || c == '"' || c == '\'')
+      return pos;
+  }
+  return end;
+}
+
+} // namespace pp_detail
+
+// LinColQuery: Maps offsets in one buffer to 1-based lines and columns
+//
+// Nothing is recorded while lexing. The table of line starts is built on
+// the first query, only as far as the offset asked about and a chunk at a
+// time, by a vectorised newline scan; every query after that is a binary
+// search.
+class LinColQuery {
+public:
+  explicit LinColQuery(std::string_view text = {}) : text_(text) {
+    lineStarts_.push_back(0); // Line 1 starts at offset 0
   }
 
-  std::pair<unsigned, unsigned> getLineCol(unsigned offset) const {
-    unsigned line = 1;
-    unsigned col = offset + 1; // Columns are 1-based
+  // Forget the table; with text, map offsets into it from now on. The
+  // table keeps its capacity.
+  void reset(std::string_view text) {
+    text_ = text;
+    reset();
+  }
+  void reset() {
+    lineStarts_.resize(1);
+    scanned_ = 0;
+  }
 
-    auto it = std::lower_bound(lineoffset.begin(), lineoffset.end(), offset);
-    if (it == lineoffset.end()) {
-      line = lineoffset.size();
-      col = offset - lineoffset.back() + 1;
-    } else if (it == lineoffset.begin()) {
-      line = 1;
-      col = offset + 1;
-    } else {
-      line = std::distance(lineoffset.begin(), it);
-      col = offset - *(it) + 1;
-    }
+  std::string_view text() const { return text_; }
 
-    return {line, col};
+  std::pair<unsigned, unsigned> getLineCol(unsigned offset) {
+    extendTo(offset);
+    auto it = std::upper_bound(lineStarts_.begin(), lineStarts_.end(), offset);
+    unsigned line = static_cast<unsigned>(it - lineStarts_.begin());
+    return {line, offset - *(it - 1) + 1};
   }
-};
 
-// PreProcessor: The main class for the preprocessor
-class PreProcessor {
 private:
-  std::string buffer;
-  unsigned cursor = 0;
-  std::map<std::string, std::string> macros; // Stores object macros
-  std::map<std::string, std::vector<std::string>>
-      functionMacros; // Stores function macros
-  std::map<std::string, std::string>
-      functionMacroReplacements; // Stores function macro replacement text
+  static constexpr size_t kChunkSize = 64 * 1024;
+
+  // Record every line starting at or before offset.
+  void extendTo(size_t offset) {
+    size_t limit = std::min(offset, text_.size());
+    while (scanned_ < limit) {
+      size_t end = std::min(text_.size(), std::max(limit, scanned_ + kChunkSize));
+      pp_detail::appendLineStarts(text_.data(), scanned_, end, lineStarts_);
+      scanned_ = end;
+    }
+  }
+
+  std::string_view text_;
+  std::vector<unsigned> lineStarts_;
+  size_t scanned_ = 0; // Bytes of text_ searched for newlines so far
+};
+
+// SourceLocation: A position for diagnostics
+struct SourceLocation {
+  std::string_view file; // Path as opened, or "<input>"/"<command line>"
+  unsigned line;
+  unsigned column;
+};
 
-  std::vector<int> includes_;
-  LinColQuery lincol_;
+// TokenOrigin: Where an output token came from, for sinks that ask
+struct TokenOrigin {
+  std::string_view file;  // As in SourceLocation
+  unsigned line;          // For expanded tokens, the line of the macro name
+  std::string_view macro; // Outermost macro it was expanded from, or empty
+  uint32_t loc = 0;       // In PreProcessor::locations(), if tracked
+};
 
+// LocationTable: 32-bit token locations, all in one offset space
+//
+// As in Clang, every buffer read is given a range of the space as long as
+// its text, so a location in it is the start of the range plus an offset.
+// Every macro expansion is given a range as long as the replacement list,
+// and a location in it stands for the token spelled at that point of the
+// #define, expanded where the macro was invoked: another location, in a
+// buffer or in the expansion that produced the macro name. A buffer read
+// again gets a new range. 0 is no location.
+//
+// An expansion costs one 12-byte entry however many tokens it makes.
+// Lookups are a binary search over the entries.
+class LocationTable {
 public:
-  PreProcessor(std::string input) : buffer(std::move(input)) {}
+  static constexpr uint32_t kNone = 0;
+
+  // Give text, read as file, a range and return its start. text must stay
+  // valid while locations in it are resolved.
+  uint32_t addBuffer(std::string_view file, std::string_view text) {
+    uint32_t start = allocate(text.size());
+    byAddress_[text.data()] = buffers_.size();
+    lastBuffer_ = SIZE_MAX;
+    buffers_.push_back({start, file, text});
+    return start;
+  }
 
-  // Get the text content of a token
-  std::string getTokenText(const Token &token) const {
-    if (token.begin + token.len > buffer.size()) {
-      return "";
-    }
-    return std::string(buffer.c_str() + token.begin, token.len);
+  // Give one expansion of the macro whose replacement list is text a range
+  // and return its start. The list is looked up among the buffers by
+  // address; spelled in none of them, its tokens have no spelling
+  // location.
+  uint32_t addExpansion(std::string_view text, uint32_t expansion) {
+    uint32_t start = allocate(text.size());
+    uint32_t spelling = kNone;
+    if (const Buffer *buffer = bufferHolding(text.data()))
+      spelling = buffer->start +
+                 static_cast<uint32_t>(text.data() - buffer->text.data());
+    expansions_.push_back({start, spelling, expansion});
+    return start;
   }
 
-  // Get the current buffer (for testing purposes)
-  const std::string &getBuffer() const { return buffer; }
+  bool isExpansion(uint32_t loc) const { return findExpansion(loc); }
 
-  // Expand macros in the input and return the result
-  std::string expandMacros() {
-    // Create a new buffer with processed content
-    std::string processedBuffer = processAndExpand();
-    return processedBuffer;
+  // Where the token at loc was written: loc itself in a buffer, or the
+  // place in the #define for an expanded token
+  uint32_t spellingLoc(uint32_t loc) const {
+    while (const Expansion *e = findExpansion(loc))
+      loc = e->spelling ? e->spelling + (loc - e->start) : kNone;
+    return loc;
   }
 
-  std::string processAndExpand() {
-    std::ostringstream result;
+  // Where an expanded token's macro was invoked, one level up; loc itself
+  // in a buffer
+  uint32_t invocationLoc(uint32_t loc) const {
+    const Expansion *e = findExpansion(loc);
+    return e ? e->expansion : loc;
+  }
 
-    while (cursor < buffer.size()) {
-      Token token = next();
-      if (token.kind == TokenKind::T_EOF) {
-        break;
-      }
+  // The buffer location of the outermost invocation loc was expanded from
+  uint32_t expansionLoc(uint32_t loc) const {
+    while (const Expansion *e = findExpansion(loc))
+      loc = e->expansion;
+    return loc;
+  }
 
-      // Handle preprocessor directives
-      if (token.kind == TokenKind::Hash) {
-        Token directive = next();
-        if (directive.kind == TokenKind::Include) {
-          handle_include();
-        } else if (directive.kind == TokenKind::Define) {
-          handle_define();
-        } else if (directive.kind == TokenKind::Undef) {
-          handle_undef();
-        } else if (directive.kind == TokenKind::If) {
-          handle_if_with_expansion(result);
-        } else if (directive.kind == TokenKind::Else) {
-          handle_else();
-        } else if (directive.kind == TokenKind::Endif) {
-          handle_endif();
-        }
-        continue;
-      }
+  // File, line and column of loc, of its outermost invocation if it is
+  // an expanded token. {"", 0, 0} for no location.
+  SourceLocation resolve(uint32_t loc) const {
+    loc = expansionLoc(loc);
+    const Buffer *buffer = loc == kNone ? nullptr : last(buffers_, loc);
+    if (!buffer)
+      return {"", 0, 0};
+    LinColQuery &table =
+        lines_.try_emplace(buffer->text.data(), buffer->text).first->second;
+    auto [line, column] = table.getLineCol(loc - buffer->start);
+    return {buffer->file, line, column};
+  }
 
-      // Handle newlines
-      if (token.kind == TokenKind::Unknown) {
-        result << "\n";
-        continue;
-      }
+  // Entries made since construction or clear()
+  size_t size() const { return buffers_.size() + expansions_.size(); }
+
+  // Where the next range will start, and the number of expansions so far:
+  // marks around a piece of work, for copyExpansions()
+  uint32_t end() const { return next_; }
+  size_t expansions() const { return expansions_.size(); }
+
+  // Make the expansions [first, last), which filled the range [begin,
+  // end), again in a range of their own, as when a cached result is used
+  // in place of expanding once more. Invocations inside the range move
+  // with it and others go through map. Returns how far the range moved.
+  template <class Map>
+  uint32_t copyExpansions(size_t first, size_t last, uint32_t begin,
+                          uint32_t end, Map map) {
+    uint32_t delta = reserve(end - begin) - begin;
+    for (size_t i = first; i < last; i++) {
+      Expansion copy = expansions_[i];
+      copy.start += delta;
+      copy.expansion = copy.expansion >= begin && copy.expansion < end
+                           ? copy.expansion + delta
+                           : map(copy.expansion);
+      expansions_.push_back(copy);
+    }
+    return delta;
+  }
 
-      // Check if this identifier is a macro
-      if (token.kind == TokenKind::Ident) {
-        std::string tokenText = getTokenText(token);
+  void clear() {
+    next_ = 1;
+    buffers_.clear();
+    expansions_.clear();
+    byAddress_.clear();
+    lines_.clear();
+    lastBuffer_ = SIZE_MAX;
+  }
 
-        // Check for function macro first
-        if (functionMacros.find(tokenText) != functionMacros.end()) {
-          // Look ahead to see if there's a '('
-          unsigned savedCursor = cursor;
-          skip_whitespace_and_comments();
+private:
+  struct Buffer {
+    uint32_t start;
+    std::string_view file, text;
+  };
+  struct Expansion {
+    uint32_t start;
+    uint32_t spelling;  // Of the start of the replacement list, or kNone
+    uint32_t expansion; // Of the macro name invoked
+  };
+
+  // A range for size bytes and the offset just past them
+  uint32_t allocate(size_t size) {
+    return reserve(size < UINT32_MAX ? static_cast<uint32_t>(size) + 1
+                                     : UINT32_MAX);
+  }
 
-          if (cursor < buffer.size() && buffer[cursor] == '(') {
-            std::string expanded = expandFunctionMacro(tokenText);
-            result << expanded;
-            continue;
-          } else {
-            // Not a function call, restore cursor and treat as regular
-            // identifier
-            cursor = savedCursor;
-            // Fall through to regular token processing
-          }
-        }
+  uint32_t reserve(uint32_t count) {
+    if (count > UINT32_MAX - next_)
+      throw std::runtime_error(
+          "Too much text and macro expansion for 32-bit source locations");
+    uint32_t start = next_;
+    next_ += count;
+    return start;
+  }
 
-        // Check for object macro
-        if (macros.find(tokenText) != macros.end()) {
-          result << macros[tokenText];
-          continue;
-        }
-      }
+  // The last of entries starting at or before loc
+  template <class Entry>
+  static const Entry *last(const std::vector<Entry> &entries, uint32_t loc) {
+    auto it = std::upper_bound(
+        entries.begin(), entries.end(), loc,
+        [](uint32_t at, const Entry &entry) { return at < entry.start; });
+    return it == entries.begin() ? nullptr : &*(it - 1);
+  }
 
-      // Regular token - add with appropriate spacing
-      std::string tokenText = getTokenText(token);
+  // The expansion whose range holds loc, unless a buffer's does
+  const Expansion *findExpansion(uint32_t loc) const {
+    const Expansion *e = last(expansions_, loc);
+    if (!e)
+      return nullptr;
+    const Buffer *b = last(buffers_, loc);
+    return b && b->start > e->start ? nullptr : e;
+  }
 
-      // Add space before certain operators
-      if (token.kind == TokenKind::Assign || token.kind == TokenKind::Plus ||
-          token.kind == TokenKind::Minus || token.kind == TokenKind::Star ||
-          token.kind == TokenKind::Slash) {
-        result << " ";
-      }
+  // The latest buffer whose text holds p. Definitions tend to come from a
+  // few buffers, so the last one found is tried first.
+  const Buffer *bufferHolding(const char *p) {
+    auto holds = [p](const Buffer &b) {
+      return p >= b.text.data() && p <= b.text.data() + b.text.size();
+    };
+    if (lastBuffer_ < buffers_.size() && holds(buffers_[lastBuffer_]))
+      return &buffers_[lastBuffer_];
+    auto it = byAddress_.upper_bound(p);
+    if (it == byAddress_.begin() || !holds(buffers_[std::prev(it)->second]))
+      return nullptr;
+    lastBuffer_ = std::prev(it)->second;
+    return &buffers_[lastBuffer_];
+  }
 
-      result << tokenText;
+  uint32_t next_ = 1;
+  std::vector<Buffer> buffers_;       // By start
+  std::vector<Expansion> expansions_; // By start
+  std::map<const char *, size_t> byAddress_; // Text to its latest buffer
+  size_t lastBuffer_ = SIZE_MAX; // Index bufferHolding() found last
+  mutable std::unordered_map<const char *, LinColQuery> lines_;
+};
 
-      // Add space after certain tokens for readability, but not before
-      // semicolons or when the next token starts with certain characters
-      if ((token.kind == TokenKind::Ident || token.kind == TokenKind::PPNumber ||
-           token.kind == TokenKind::Assign || token.kind == TokenKind::Plus ||
-           token.kind == TokenKind::Minus || token.kind == TokenKind::Star ||
-           token.kind == TokenKind::Slash) &&
-          cursor < buffer.size() && buffer[cursor] != ';' &&
-          buffer[cursor] != '(' && buffer[cursor] != ')') {
-        result << " ";
-      }
+// StringArena: Chunked storage for strings that must outlive their source
+//
+// Views returned by store() stay valid until clear() or destruction. clear()
+// keeps the first chunk so a reused arena does not go back to the heap.
+class StringArena {
+public:
+  std::string_view store(std::string_view s) {
+    if (s.size() > chunkLeft_)
+      newChunk(s.size());
+    if (!s.empty())
+      std::memcpy(chunkCur_, s.data(), s.size());
+    std::string_view stored(chunkCur_, s.size());
+    chunkCur_ += s.size();
+    chunkLeft_ -= s.size();
+    return stored;
+  }
 
-      // Add space after semicolon
-      if (token.kind == TokenKind::Semicolon) {
-        result << " ";
-      }
-    }
+  void clear() {
+    if (chunks_.empty())
+      return;
+    chunks_.resize(1);
+    chunkCur_ = chunks_.front().get();
+    chunkLeft_ = firstChunkSize_;
+  }
 
-    return result.str();
+private:
+  static constexpr size_t kChunkSize = 16 * 1024;
+
+  void newChunk(size_t atLeast) {
+    size_t size = std::max(kChunkSize, atLeast);
+    chunks_.emplace_back(new char[size]);
+    if (chunks_.size() == 1)
+      firstChunkSize_ = size;
+    chunkCur_ = chunks_.back().get();
+    chunkLeft_ = size;
   }
 
-  // Tokenize the input buffer
-  Token next() {
-    skip_whitespace_and_comments();
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  char *chunkCur_ = nullptr;
+  size_t chunkLeft_ = 0;
+  size_t firstChunkSize_ = 0;
+};
 
-    if (cursor >= buffer.size()) {
-      return {cursor, 0, TokenKind::T_EOF};
-    }
+// IdentifierTable: Interns identifier spellings to dense integer IDs
+//
+// IDs are assigned in first-seen order starting at 0. Spellings are copied
+// into an arena owned by the table, so the string_views handed out by
+// spelling() stay valid for the table's lifetime.
+//
+// A table may extend a frozen parent: the parent's IDs and spellings are
+// visible unchanged, and new identifiers get IDs after the parent's. Many
+// tables can share one parent across threads, since it is only read.
+class IdentifierTable {
+public:
+  static constexpr uint32_t kInvalidId = ~uint32_t(0);
 
-    unsigned start = cursor;
-    char c = buffer[cursor];
+  IdentifierTable() { slots_.resize(kInitialSlots); }
 
-    // Newline
-    if (c == '\n') {
-      cursor++;
+  explicit IdentifierTable(std::shared_ptr<const IdentifierTable> parent)
+      : parent_(std::move(parent)),
+        base_(static_cast<uint32_t>(parent_->size())) {
+    slots_.resize(kInitialSlots);
+  }
 
-      lincol_.addLine(cursor);
+  // Forget every identifier and start over on top of parent, keeping the
+  // slot table and spelling storage for reuse.
+  void reset(std::shared_ptr<const IdentifierTable> parent = nullptr) {
+    parent_ = std::move(parent);
+    base_ = parent_ ? static_cast<uint32_t>(parent_->size()) : 0;
+    std::fill(slots_.begin(), slots_.end(), Slot());
+    spellings_.clear();
+    storage_.clear();
+  }
 
-      return {start, 1, TokenKind::Unknown};
+  // Return the ID for s, assigning a new one if s has not been seen.
+  uint32_t intern(std::string_view s) {
+    uint32_t h = hash(s);
+    if (parent_) {
+      uint32_t id = parent_->findHashed(s, h);
+      if (id != kInvalidId)
+        return id;
     }
+    size_t i = probe(s, h);
+    if (slots_[i].id != kInvalidId)
+      return slots_[i].id;
+
+    uint32_t id = base_ + static_cast<uint32_t>(spellings_.size());
+    spellings_.push_back(storage_.store(s));
+    slots_[i] = {h, id};
+    if (spellings_.size() * 4 > slots_.size() * 3)
+      rehash(slots_.size() * 2);
+    return id;
+  }
 
-    // Identifier or Keyword
-    if (std::isalpha(c) || c == '_') {
-      while (cursor < buffer.size() &&
-             (std::isalnum(buffer[cursor]) || buffer[cursor] == '_')) {
-        cursor++;
-      }
-      std::string_view value =
-          std::string_view(buffer.c_str() + start, cursor - start);
-      if (value == "include")
-        return {start, cursor - start, TokenKind::Include};
-      if (value == "define")
-        return {start, cursor - start, TokenKind::Define};
-      if (value == "undef")
-        return {start, cursor - start, TokenKind::Undef};
-      if (value == "if")
-        return {start, cursor - start, TokenKind::If};
-      if (value == "else")
-        return {start, cursor - start, TokenKind::Else};
-      if (value == "endif")
-        return {start, cursor - start, TokenKind::Endif};
-      return {start, cursor - start, TokenKind::Ident};
-    }
+  // Return the ID for s, or kInvalidId if s was never interned.
+  uint32_t find(std::string_view s) const { return findHashed(s, hash(s)); }
 
-    // PPNumber - C preprocessor number parsing
-    if (std::isdigit(c) || (c == '.' && cursor + 1 < buffer.size() && std::isdigit(buffer[cursor + 1]))) {
-      return parsePPNumber(start);
-    }
+  std::string_view spelling(uint32_t id) const {
+    return id < base_ ? parent_->spelling(id) : spellings_[id - base_];
+  }
 
-    // String Literal
-    if (c == '"') {
-      cursor++;
-      while (cursor < buffer.size() && buffer[cursor] != '"') {
-        if (buffer[cursor] == '\\')
-          cursor++; // Skip escaped characters
-        cursor++;
-      }
-      if (cursor < buffer.size())
-        cursor++; // Skip closing quote
-      return {start, cursor - start, TokenKind::StringLiteral};
-    }
+  size_t size() const { return base_ + spellings_.size(); }
 
-    // Hash (#)
-    if (c == '#') {
-      cursor++;
-      if (cursor < buffer.size() && buffer[cursor] == '#') {
-        cursor++;
-        return {start, 2, TokenKind::HashHash};
-      }
-      return {start, 1, TokenKind::Hash};
+private:
+  struct Slot {
+    uint32_t hash = 0;
+    uint32_t id = kInvalidId;
+  };
+
+  static constexpr size_t kInitialSlots = 256;
+
+  uint32_t findHashed(std::string_view s, uint32_t h) const {
+    if (parent_) {
+      uint32_t id = parent_->findHashed(s, h);
+      if (id != kInvalidId)
+        return id;
     }
+    return slots_[probe(s, h)].id;
+  }
 
-    // Punctuators
-    cursor++;
-    // Punctuators
-    if (c == '[')
-      return {start, 1, TokenKind::L_Bracket};
-    if (c == ']')
-      return {start, 1, TokenKind::R_Bracket};
-    if (c == '(')
-      return {start, 1, TokenKind::L_Paren};
-    if (c == ')')
-      return {start, 1, TokenKind::R_Paren};
-    if (c == '{')
-      return {start, 1, TokenKind::L_Brace};
-    if (c == '}')
-      return {start, 1, TokenKind::R_Brace};
-    if (c == '.') {
-      if (cursor + 2 < buffer.size() && buffer[cursor] == '.' &&
-          buffer[cursor + 1] == '.') {
-        cursor += 2;
-        return {start, 3, TokenKind::Ellipsis};
-      }
-      return {start, 1, TokenKind::Dot};
-    }
-    if (c == '-' && cursor < buffer.size() && buffer[cursor] == '>') {
-      cursor++;
-      return {start, 2, TokenKind::Arrow};
-    }
-    if (c == '+' && cursor < buffer.size() && buffer[cursor] == '+') {
-      cursor++;
-      return {start, 2, TokenKind::PlusPlus};
-    }
-    if (c == '-' && cursor < buffer.size() && buffer[cursor] == '-') {
-      cursor++;
-      return {start, 2, TokenKind::MinusMinus};
-    }
-    if (c == '&' && cursor < buffer.size() && buffer[cursor] == '&') {
-      cursor++;
-      return {start, 2, TokenKind::LogicAnd};
-    }
-    if (c == '|' && cursor < buffer.size() && buffer[cursor] == '|') {
-      cursor++;
-      return {start, 2, TokenKind::LogicOr};
-    }
-    if (c == '<' && cursor < buffer.size() && buffer[cursor] == '<') {
-      cursor++;
-      if (cursor < buffer.size() && buffer[cursor] == '=') {
-        cursor++;
-        return {start, 3, TokenKind::LessLessEqual};
-      }
-      return {start, 2, TokenKind::LessLess};
-    }
-    if (c == '>' && cursor < buffer.size() && buffer[cursor] == '>') {
-      cursor++;
-      if (cursor < buffer.size() && buffer[cursor] == '=') {
-        cursor++;
-        return {start, 3, TokenKind::GreaterGreaterEqual};
-      }
-      return {start, 2, TokenKind::GreaterGreater};
-    }
-    if (c == '<' && cursor < buffer.size() && buffer[cursor] == '=') {
-      cursor++;
-      return {start, 2, TokenKind::LessEqual};
-    }
-    if (c == '>' && cursor < buffer.size() && buffer[cursor] == '=') {
-      cursor++;
-      return {start, 2, TokenKind::GreaterEqual};
-    }
-    if (c == '=' && cursor < buffer.size() && buffer[cursor] == '=') {
-      cursor++;
-      return {start, 2, TokenKind::EqualEqual};
-    }
-    if (c == '!' && cursor < buffer.size() && buffer[cursor] == '=') {
-      cursor++;
-      return {start, 2, TokenKind::ExclamationEqual};
+  // FNV-1a; identifiers are short, so this beats anything wider.
+  static uint32_t hash(std::string_view s) {
+    uint32_t h = 2166136261u;
+    for (char c : s) {
+      h ^= static_cast<unsigned char>(c);
+      h *= 16777619u;
     }
-    if (c == '*' && cursor < buffer.size() && buffer[cursor] == '=') {
-      cursor++;
-      return {start, 2, TokenKind::MulAssign};
-    }
-    if (c == '/' && cursor < buffer.size() && buffer[cursor] == '=') {
-      cursor++;
-      return {start, 2, TokenKind::DivAssign};
-    }
-    if (c == '%' && cursor < buffer.size() && buffer[cursor] == '=') {
-      cursor++;
-      return {start, 2, TokenKind::ModAssign};
-    }
-    if (c == '+' && cursor < buffer.size() && buffer[cursor] == '=') {
-      cursor++;
-      return {start, 2, TokenKind::AddAssign};
-    }
-    if (c == '-' && cursor < buffer.size() && buffer[cursor] == '=') {
-      cursor++;
-      return {start, 2, TokenKind::MinusEqual};
-    }
-    if (c == '&' && cursor < buffer.size() && buffer[cursor] == '=') {
-      cursor++;
-      return {start, 2, TokenKind::BitAndEqual};
-    }
-    if (c == '^' && cursor < buffer.size() && buffer[cursor] == '=') {
-      cursor++;
-      return {start, 2, TokenKind::XorAssign};
-    }
-    if (c == '|' && cursor < buffer.size() && buffer[cursor] == '=') {
-      cursor++;
-      return {start, 2, TokenKind::OrAssign};
-    }
-    if (c == '&')
-      return {start, 1, TokenKind::Ampersand};
-    if (c == '*')
-      return {start, 1, TokenKind::Star};
-    if (c == '+')
-      return {start, 1, TokenKind::Plus};
-    if (c == '-')
-      return {start, 1, TokenKind::Minus};
-    if (c == '~')
-      return {start, 1, TokenKind::Tilde};
-    if (c == '!')
-      return {start, 1, TokenKind::Not};
-    if (c == '/')
-      return {start, 1, TokenKind::Slash};
-    if (c == '%')
-      return {start, 1, TokenKind::Percent};
-    if (c == '<')
-      return {start, 1, TokenKind::Less};
-    if (c == '>')
-      return {start, 1, TokenKind::Greater};
-    if (c == '^')
-      return {start, 1, TokenKind::XOR};
-    if (c == '|')
-      return {start, 1, TokenKind::BitOr};
-    if (c == '?')
-      return {start, 1, TokenKind::Question};
-    if (c == ':')
-      return {start, 1, TokenKind::Colon};
-    if (c == ';')
-      return {start, 1, TokenKind::Semicolon};
-    if (c == '=')
-      return {start, 1, TokenKind::Assign};
-    if (c == ',')
-      return {start, 1, TokenKind::Comma};
-
-    // If no match, return unknown punctuator
-    return {start, 1, TokenKind::Unknown};
+    return h;
   }
 
-  // Process the buffer and handle preprocessor directives
-  void process() {
-    while (true) {
-      Token token = next();
-      if (token.kind == TokenKind::T_EOF)
-        break;
-
-      if (token.kind == TokenKind::Hash) {
-        Token directive = next();
-        if (directive.kind == TokenKind::Include) {
-          handle_include();
-        } else if (directive.kind == TokenKind::Define) {
-          handle_define();
-        } else if (directive.kind == TokenKind::Undef) {
-          handle_undef();
-        } else if (directive.kind == TokenKind::If) {
-          handle_if();
-        } else if (directive.kind == TokenKind::Else) {
-          handle_else();
-        } else if (directive.kind == TokenKind::Endif) {
-          handle_endif();
-        } else {
-          assert(0 && "unexpect kind");
-        }
-      }
+  // Index of the slot holding s, or of the empty slot where it would go.
+  size_t probe(std::string_view s, uint32_t h) const {
+    size_t mask = slots_.size() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+      const Slot &slot = slots_[i];
+      if (slot.id == kInvalidId ||
+          (slot.hash == h && spellings_[slot.id - base_] == s))
+        return i;
     }
   }
 
-private:
-  void skip_whitespace_and_comments() {
-    while (cursor < buffer.size()) {
-      if (std::isspace(buffer[cursor]) && buffer[cursor] != '\n') {
-        cursor++;
-        continue;
-      }
-      // Single-line comment
-      if (cursor + 1 < buffer.size() && buffer[cursor] == '/' &&
-          buffer[cursor + 1] == '/') {
-        while (cursor < buffer.size() && buffer[cursor] != '\n') {
-          cursor++;
-        }
-        continue;
-      }
-      // Multi-line comment
-      if (cursor + 1 < buffer.size() && buffer[cursor] == '/' &&
-          buffer[cursor + 1] == '*') {
-        cursor += 2;
-        while (cursor + 1 < buffer.size() &&
-               !(buffer[cursor] == '*' && buffer[cursor + 1] == '/')) {
-          cursor++;
-        }
-        if (cursor + 1 < buffer.size()) {
-          cursor += 2;
-        }
+  void rehash(size_t count) {
+    std::vector<Slot> old(count);
+    old.swap(slots_);
+    size_t mask = slots_.size() - 1;
+    for (const Slot &slot : old) {
+      if (slot.id == kInvalidId)
         continue;
-      }
-      break;
+      size_t i = slot.hash & mask;
+      while (slots_[i].id != kInvalidId)
+        i = (i + 1) & mask;
+      slots_[i] = slot;
     }
   }
 
-  void handle_include() {
-    Token header = next();
+  std::shared_ptr<const IdentifierTable> parent_;
+  uint32_t base_ = 0; // parent_->size(): the first ID this table assigns
+  std::vector<Slot> slots_;
+  std::vector<std::string_view> spellings_; // Indexed by ID - base_
+  StringArena storage_;
+};
 
-    if (header.kind != TokenKind::StringLiteral) {
-      throw std::runtime_error("Expected a header name after #include");
-    }
-  }
+enum class MacroKind { Object, Function };
 
-  void handle_define() {
-    Token name = next();
-    if (name.kind != TokenKind::Ident) {
-      throw std::runtime_error("Expected identifier after #define");
-    }
+// ReplacementToken: One element of a replacement list, compiled at #define
+// time so that expansion never has to look parameter names up again
+struct ReplacementToken {
+  enum Flags : unsigned char {
+    LeadingSpace = 1 << 0, // Whitespace preceded it in the #define
+    Stringify = 1 << 1,    // #param; the '#' itself is dropped
+    PasteLeft = 1 << 2,    // Preceded by ##: paste onto the previous result
+    PasteRight = 1 << 3,   // Followed by ##
+  };
 
-    std::string macroName = get_token_text(name);
+  Token token;    // Offsets relative to MacroDef::text
+  int param = -1; // Parameter index, or -1 for a literal token
+  unsigned char flags = 0;
 
-    // Check if it's a function-like macro
-    if (cursor < buffer.size() && buffer[cursor] == '(') {
-      handle_function_macro(macroName);
-    } else {
-      handle_object_macro(macroName);
-    }
+  ReplacementToken(Token t) : token(t) {}
+};
+
+// MacroDef: Everything recorded for one #define
+//
+// Nothing is copied out of the defining buffer: text and params view it
+// directly, and body holds the compiled replacement list with token offsets
+// relative to text.data(). The '##' operators and the '#' of stringified
+// parameters are folded into the flags of their operands. The vectors
+// allocate from the resource of the table holding the definition.
+struct MacroDef {
+  MacroKind kind = MacroKind::Object;
+  std::pmr::vector<std::string_view> params; // Function macros only
+  bool variadic = false;                     // Last parameter is __VA_ARGS__
+  std::string_view text;                     // Replacement list, trimmed
+  std::pmr::vector<ReplacementToken> body;   // Compiled replacement list
+
+  explicit MacroDef(
+      std::pmr::memory_resource *memory = std::pmr::get_default_resource())
+      : params(memory), body(memory) {}
+
+  // Forget the definition, keeping the vectors' storage for the next one.
+  void reset() {
+    kind = MacroKind::Object;
+    params.clear();
+    variadic = false;
+    text = {};
+    body.clear();
   }
 
-  void handle_undef() {
-    Token name = next();
-    if (name.kind != TokenKind::Ident) {
-      throw std::runtime_error("Expected identifier after #undef");
-    }
+  std::string_view tokenText(const Token &token) const {
+    return text.substr(token.begin, token.len);
+  }
+};
+
+// PPToken: A token travelling through macro expansion
+//
+// Unlike Token, it carries its spelling directly, since expansion mixes
+// tokens from the buffer, from macro bodies and from ## and #.
+struct PPToken {
+  enum Flags : unsigned char {
+    LeadingSpace = 1 << 0, // Print a space before it
+  };
+
+  std::string_view text;
+  TokenKind kind = TokenKind::Unknown;
+  uint32_t hideSet = 0; // HideSetTable ID; 0 is the empty set
+  uint32_t loc = 0;     // LocationTable location, when tracked
+  unsigned char flags = 0;
+};
+
+using TokenList = std::pmr::vector<PPToken>;
 
-    std::string macroName = get_token_text(name);
-    macros.erase(macroName);
-    functionMacros.erase(macroName);
+// HideSetTable: Interned macro-ID sets for Prosser-style rescanning
+//
+// A token may not be expanded by any macro in its hide set. Sets are sorted
+// ID vectors stored once each; set operations are memoised, so the common
+// case of re-adding the same macro to the same set is a single hash lookup.
+class HideSetTable {
+public:
+  static constexpr uint32_t kEmpty = 0;
+
+  explicit HideSetTable(
+      std::pmr::memory_resource *memory = std::pmr::get_default_resource())
+      : sets_(memory), index_(memory), addMemo_(memory), uniteMemo_(memory),
+        intersectMemo_(memory) {
+    sets_.emplace_back();
+    index_.emplace(Set(memory), kEmpty);
   }
 
-  void handle_if() {
-    // For now, implement a simple version that evaluates constant expressions
-    // Skip to end of line and evaluate the condition
-    std::string condition = read_line();
+  // Number of macros in set
+  size_t size(uint32_t set) const { return sets_[set].size(); }
 
-    // Simple evaluation - check if macro is defined or if it's a number != 0
-    bool result = evaluate_condition(condition);
+  bool contains(uint32_t set, uint32_t macro) const {
+    const Set &members = sets_[set];
+    return std::binary_search(members.begin(), members.end(), macro);
+  }
 
-    if (!result) {
-      skip_until_else_or_endif();
+  uint32_t add(uint32_t set, uint32_t macro) {
+    auto [it, inserted] = addMemo_.try_emplace(key(set, macro), 0);
+    if (inserted) {
+      Set members(sets_[set], sets_.get_allocator());
+      members.insert(
+          std::lower_bound(members.begin(), members.end(), macro), macro);
+      it->second = intern(std::move(members));
     }
+    return it->second;
   }
 
-  void handle_else() {
-    // Skip until #endif since we're in the else branch
-    skip_until_endif();
+  uint32_t unite(uint32_t a, uint32_t b) {
+    if (a == b || b == kEmpty)
+      return a;
+    if (a == kEmpty)
+      return b;
+    auto [it, inserted] = uniteMemo_.try_emplace(key(a, b), 0);
+    if (inserted) {
+      Set members(sets_.get_allocator());
+      std::set_union(sets_[a].begin(), sets_[a].end(), sets_[b].begin(),
+                     sets_[b].end(), std::back_inserter(members));
+      it->second = intern(std::move(members));
+    }
+    return it->second;
   }
 
-  void handle_endif() {
-    // Nothing to do - just marks the end of conditional block
+  // Drop every set but the empty one. The tables keep their buckets.
+  void clear() {
+    sets_.resize(1);
+    index_.erase(std::next(index_.begin()), index_.end()); // {} sorts first
+    addMemo_.clear();
+    uniteMemo_.clear();
+    intersectMemo_.clear();
   }
 
-  // Helper functions
-  std::string get_token_text(const Token &token) {
-    return std::string(buffer.c_str() + token.begin, token.len);
+  uint32_t intersect(uint32_t a, uint32_t b) {
+    if (a == b)
+      return a;
+    if (a == kEmpty || b == kEmpty)
+      return kEmpty;
+    auto [it, inserted] = intersectMemo_.try_emplace(key(a, b), 0);
+    if (inserted) {
+      Set members(sets_.get_allocator());
+      std::set_intersection(sets_[a].begin(), sets_[a].end(),
+                            sets_[b].begin(), sets_[b].end(),
+                            std::back_inserter(members));
+      it->second = intern(std::move(members));
+    }
+    return it->second;
   }
 
-  void handle_object_macro(const std::string &macroName) {
-    skip_whitespace_and_comments();
-
-    // Read the replacement text until end of line
-    std::string replacement = read_line();
-    macros[macroName] = replacement;
+private:
+  static uint64_t key(uint32_t a, uint32_t b) {
+    return (uint64_t(a) << 32) | b;
   }
 
-  void handle_function_macro(const std::string &macroName) {
-    // Skip the opening parenthesis
-    cursor++;
+  using Set = std::pmr::vector<uint32_t>; // Sorted macro IDs
 
-    std::vector<std::string> parameters;
+  uint32_t intern(Set members) {
+    auto [it, inserted] =
+        index_.try_emplace(members, static_cast<uint32_t>(sets_.size()));
+    if (inserted)
+      sets_.push_back(std::move(members));
+    return it->second;
+  }
 
-    // Parse parameters
-    while (cursor < buffer.size()) {
-      skip_whitespace_and_comments();
+  std::pmr::vector<Set> sets_;
+  std::pmr::map<Set, uint32_t> index_;
+  std::pmr::unordered_map<uint64_t, uint32_t> addMemo_;
+  std::pmr::unordered_map<uint64_t, uint32_t> uniteMemo_;
+  std::pmr::unordered_map<uint64_t, uint32_t> intersectMemo_;
+};
 
-      if (cursor < buffer.size() && buffer[cursor] == ')') {
-        cursor++;
-        break;
+// ExpansionCache: Fully rescanned results of function-like macro
+// invocations, bounded, least recently used out first
+//
+// An entry is keyed on the macro, the hide set and spacing of the
+// invocation and every argument token; hashes only pick the candidates,
+// which are then compared in full. Each entry also lists the macros its
+// expansion looked up and the macroChanges() count it was made at, so the
+// PreProcessor can tell when a #define or #undef has made it stale.
+// Spellings are copied into the entry. Tokens handed out from an evicted
+// entry may still be in use, so its storage is kept until releaseRetired().
+class ExpansionCache {
+public:
+  static constexpr size_t kDefaultCapacity = 1024; // Entries
+  static constexpr size_t kMaxTokens = 512; // Longer results are not kept
+
+  using Args = std::pmr::vector<TokenList>;
+  using Reads = std::pmr::vector<uint32_t>;
+
+  // One invocation and its result. The tokens, argument sizes, reads and
+  // spellings share a single block, so an entry costs two allocations.
+  struct Entry {
+    explicit Entry(std::pmr::memory_resource *memory) : memory(memory) {}
+    Entry(const Entry &) = delete;
+    Entry &operator=(const Entry &) = delete;
+    ~Entry() {
+      if (block)
+        memory->deallocate(block, bytes, alignof(PPToken));
+    }
+
+    const PPToken *result() const { return tokens + argTokens; }
+
+    std::pmr::memory_resource *memory;
+    void *block = nullptr;
+    size_t bytes = 0;
+    uint64_t hash = 0;
+    uint32_t macro = 0;
+    uint32_t hideSet = 0;
+    bool spaced = false;
+    bool readUnknown = false; // Some name looked up was never defined
+    size_t stamp = 0;         // macroChanges() when it was made
+    PPToken *tokens = nullptr; // The arguments one after another, then
+    uint32_t argTokens = 0;    // the result
+    uint32_t resultSize = 0;
+    uint32_t *argSizes = nullptr;
+    uint32_t argCount = 0;
+    uint32_t *reads = nullptr; // Sorted macro IDs looked up
+    uint32_t readCount = 0;
+    // With location tracking, the LocationTable range and expansions the
+    // result's locations are in, and where the macro was invoked
+    uint32_t locBegin = 0, locEnd = 0, invocationLoc = 0;
+    size_t firstExpansion = 0, lastExpansion = 0;
+  };
+
+  explicit ExpansionCache(
+      std::pmr::memory_resource *memory = std::pmr::get_default_resource())
+      : lru_(memory), index_(memory), retired_(memory) {}
+
+  static uint64_t hash(uint32_t macro, uint32_t hideSet, bool spaced,
+                       const Args &args) {
+    uint64_t h = mix(mix(mix(14695981039346656037ull, macro), hideSet),
+                     spaced);
+    for (const TokenList &arg : args) {
+      h = mix(h, arg.size());
+      for (const PPToken &tok : arg) {
+        h = mix(h, (uint64_t(tok.hideSet) << 16) |
+                       (uint64_t(static_cast<uint8_t>(tok.kind)) << 8) |
+                       tok.flags);
+        for (char c : tok.text)
+          h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
       }
+    }
+    return h;
+  }
 
-      Token param = next();
-      if (param.kind != TokenKind::Ident) {
-        throw std::runtime_error("Expected parameter name in function macro");
+  // The entry for this invocation, now the most recently used, or null
+  Entry *find(uint64_t h, uint32_t macro, uint32_t hideSet, bool spaced,
+              const Args &args) {
+    auto range = index_.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it) {
+      Entry &entry = *it->second;
+      if (entry.macro == macro && entry.hideSet == hideSet &&
+          entry.spaced == spaced && sameArgs(entry, args)) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return &entry;
       }
+    }
+    return nullptr;
+  }
 
-      parameters.push_back(get_token_text(param));
+  // Store result[0, count) for this invocation, evicting the least
+  // recently used entry if full. Returns the entry, or null if the result
+  // is not kept.
+  Entry *insert(uint64_t h, uint32_t macro, uint32_t hideSet, bool spaced,
+              const Args &args, const PPToken *result, size_t count,
+              const Reads &reads, bool readUnknown, size_t stamp) {
+    if (capacity_ == 0 || count > kMaxTokens)
+      return nullptr;
+    if (lru_.size() >= capacity_)
+      retire(std::prev(lru_.end()));
+    if (index_.empty())
+      index_.reserve(capacity_); // Buckets once, rather than on each growth
+
+    size_t argTokens = 0, chars = 0;
+    for (const TokenList &arg : args) {
+      argTokens += arg.size();
+      for (const PPToken &tok : arg)
+        chars += tok.text.size();
+    }
+    for (size_t i = 0; i < count; i++)
+      chars += result[i].text.size();
+    size_t tokenCount = argTokens + count;
+    size_t bytes = tokenCount * sizeof(PPToken) +
+                   (args.size() + reads.size()) * sizeof(uint32_t) + chars;
+
+    lru_.emplace_front(lru_.get_allocator().resource());
+    Entry &entry = lru_.front();
+    entry.block = entry.memory->allocate(bytes, alignof(PPToken));
+    entry.bytes = bytes;
+    entry.hash = h;
+    entry.macro = macro;
+    entry.hideSet = hideSet;
+    entry.spaced = spaced;
+    entry.readUnknown = readUnknown;
+    entry.stamp = stamp;
+    entry.tokens = static_cast<PPToken *>(entry.block);
+    entry.argTokens = static_cast<uint32_t>(argTokens);
+    entry.resultSize = static_cast<uint32_t>(count);
+    entry.argSizes = reinterpret_cast<uint32_t *>(entry.tokens + tokenCount);
+    entry.argCount = static_cast<uint32_t>(args.size());
+    entry.reads = entry.argSizes + args.size();
+    entry.readCount = static_cast<uint32_t>(reads.size());
+    std::copy(reads.begin(), reads.end(), entry.reads);
+    char *text = reinterpret_cast<char *>(entry.reads + reads.size());
+
+    PPToken *tok = entry.tokens;
+    auto keep = [&](const PPToken &from) {
+      *tok = from;
+      if (!from.text.empty())
+        std::memcpy(text, from.text.data(), from.text.size());
+      tok->text = std::string_view(text, from.text.size());
+      text += from.text.size();
+      tok++;
+    };
+    for (size_t i = 0; i < args.size(); i++) {
+      entry.argSizes[i] = static_cast<uint32_t>(args[i].size());
+      for (const PPToken &arg : args[i])
+        keep(arg);
+    }
+    for (size_t i = 0; i < count; i++)
+      keep(result[i]);
+    index_.emplace(h, lru_.begin());
+    return &entry;
+  }
 
-      skip_whitespace_and_comments();
-      if (cursor < buffer.size() && buffer[cursor] == ',') {
+  // Drop an entry found to be stale
+  void erase(Entry *entry) {
+    auto range = index_.equal_range(entry->hash);
+    for (auto it = range.first; it != range.second; ++it)
+      if (&*it->second == entry) {
+        retire(it->second);
+        return;
+      }
+  }
+
+  void setCapacity(size_t entries) {
+    capacity_ = entries;
+    while (lru_.size() > capacity_)
+      retire(std::prev(lru_.end()));
+  }
+
+  size_t capacity() const { return capacity_; }
+  size_t size() const { return lru_.size(); }
+
+  // Free evicted entries once nothing can point into them
+  void releaseRetired() { retired_.clear(); }
+
+  void clear() {
+    lru_.clear();
+    index_.clear();
+    retired_.clear();
+  }
+
+private:
+  static uint64_t mix(uint64_t h, uint64_t value) {
+    return (h ^ value) * 1099511628211ull;
+  }
+
+  static bool sameArgs(const Entry &entry, const Args &args) {
+    if (entry.argCount != args.size())
+      return false;
+    const PPToken *tok = entry.tokens;
+    for (size_t i = 0; i < args.size(); i++) {
+      if (entry.argSizes[i] != args[i].size())
+        return false;
+      for (const PPToken &arg : args[i]) {
+        if (arg.kind != tok->kind || arg.flags != tok->flags ||
+            arg.hideSet != tok->hideSet || arg.text != tok->text)
+          return false;
+        tok++;
+      }
+    }
+    return true;
+  }
+
+  void retire(std::pmr::list<Entry>::iterator it) {
+    auto range = index_.equal_range(it->hash);
+    for (auto at = range.first; at != range.second; ++at)
+      if (at->second == it) {
+        index_.erase(at);
+        break;
+      }
+    retired_.splice(retired_.end(), lru_, it);
+  }
+
+  size_t capacity_ = kDefaultCapacity;
+  std::pmr::list<Entry> lru_; // Most recently used first
+  std::pmr::unordered_multimap<uint64_t, std::pmr::list<Entry>::iterator>
+      index_;
+  std::pmr::list<Entry> retired_;
+};
+
+// MacroTable: Open-addressing map from identifier ID to MacroDef
+//
+// Slots only hold the key and an index into defs_, so probing touches a
+// dense array of 8-byte entries. Records live in a deque and are recycled
+// through a free list, which keeps MacroDef pointers stable across later
+// defines. #undef leaves a tombstone; the slots are rebuilt once tombstones
+// and live entries fill 3/4 of the table.
+//
+// A table may be layered over a frozen base, which is then shared copy-on-
+// write: lookups fall through to the base, a define shadows its entry, and
+// an #undef of a base macro leaves a hidden entry in this table.
+class MacroTable {
+public:
+  explicit MacroTable(
+      std::pmr::memory_resource *memory = std::pmr::get_default_resource())
+      : MacroTable(nullptr, memory) {}
+
+  MacroTable(std::shared_ptr<const MacroTable> base,
+             std::pmr::memory_resource *memory =
+                 std::pmr::get_default_resource())
+      : base_(std::move(base)), slots_(memory), defs_(memory),
+        freeDefs_(memory) {
+    slots_.resize(size_t(1) << slotBits_);
+  }
+
+  const MacroDef *find(uint32_t id) const {
+    if (id == IdentifierTable::kInvalidId)
+      return nullptr;
+    const Slot &slot = slots_[probe(id)];
+    if (slot.id == id)
+      return slot.def == kHidden ? nullptr : &defs_[slot.def];
+    return base_ ? base_->find(id) : nullptr;
+  }
+
+  bool contains(uint32_t id) const { return find(id) != nullptr; }
+
+  // Return the (reset) definition record for id, creating it if needed.
+  MacroDef &define(uint32_t id) {
+    auto [i, inserted] = claim(id);
+    if (!inserted && slots_[i].def != kHidden) {
+      MacroDef &def = defs_[slots_[i].def];
+      def.reset();
+      return def;
+    }
+    if (!inserted)
+      hidden_--;
+    uint32_t def;
+    if (!freeDefs_.empty()) {
+      def = freeDefs_.back();
+      freeDefs_.pop_back();
+    } else {
+      def = static_cast<uint32_t>(defs_.size());
+      defs_.emplace_back(defs_.get_allocator().resource());
+    }
+    slots_[i].def = def;
+    grow();
+    return defs_[def];
+  }
+
+  // Remove the definition for id. Returns false if id was not defined.
+  bool undef(uint32_t id) {
+    if (id == IdentifierTable::kInvalidId)
+      return false;
+    bool inBase = base_ && base_->contains(id);
+    size_t i = probe(id);
+    if (slots_[i].id == id) {
+      if (slots_[i].def == kHidden)
+        return false;
+      defs_[slots_[i].def].reset();
+      freeDefs_.push_back(slots_[i].def);
+      if (inBase) {
+        slots_[i].def = kHidden;
+        hidden_++;
+      } else {
+        slots_[i].id = kTombstone;
+        live_--;
+      }
+      return true;
+    }
+    if (!inBase)
+      return false;
+    slots_[claim(id).first].def = kHidden;
+    hidden_++;
+    grow();
+    return true;
+  }
+
+  // Drop every definition and layer over base instead. The records keep
+  // their storage and go back on the free list.
+  void reset(std::shared_ptr<const MacroTable> base = nullptr) {
+    base_ = std::move(base);
+    std::fill(slots_.begin(), slots_.end(), Slot());
+    freeDefs_.clear();
+    for (uint32_t def = static_cast<uint32_t>(defs_.size()); def-- > 0;) {
+      defs_[def].reset();
+      freeDefs_.push_back(def);
+    }
+    live_ = used_ = hidden_ = shadowed_ = 0;
+  }
+
+  // Number of macros visible through this table, base included
+  size_t size() const {
+    return live_ - hidden_ + (base_ ? base_->size() - shadowed_ : 0);
+  }
+
+  // Call visit(id, def) for every visible macro, in no particular order.
+  template <typename Visit> void forEach(Visit &&visit) const {
+    for (const MacroTable *table = this; table; table = table->base_.get()) {
+      for (const Slot &slot : table->slots_) {
+        if (slot.id == kEmpty || slot.id == kTombstone ||
+            slot.def == kHidden || claimedAbove(table, slot.id))
+          continue;
+        visit(slot.id, table->defs_[slot.def]);
+      }
+    }
+  }
+
+private:
+  struct Slot {
+    uint32_t id = kEmpty;
+    uint32_t def = 0;
+  };
+
+  static constexpr uint32_t kEmpty = IdentifierTable::kInvalidId;
+  static constexpr uint32_t kTombstone = kEmpty - 1;
+  static constexpr uint32_t kHidden = ~uint32_t(0); // def: #undef of base
+  static constexpr size_t kNoSlot = ~size_t(0);
+
+  // Index of id's slot, and whether it had to be taken for id. A new slot
+  // reuses the first tombstone on the probe path, if any; its def is left
+  // for the caller to fill in.
+  std::pair<size_t, bool> claim(uint32_t id) {
+    size_t mask = slots_.size() - 1;
+    size_t target = kNoSlot;
+    size_t i = home(id);
+    for (;; i = (i + 1) & mask) {
+      uint32_t key = slots_[i].id;
+      if (key == id)
+        return {i, false};
+      if (key == kEmpty)
+        break;
+      if (key == kTombstone && target == kNoSlot)
+        target = i;
+    }
+    if (target == kNoSlot) {
+      target = i;
+      used_++;
+    }
+    slots_[target].id = id;
+    live_++;
+    if (base_ && base_->contains(id))
+      shadowed_++;
+    return {target, true};
+  }
+
+  // Whether a table between this one and lower has its own entry for id
+  bool claimedAbove(const MacroTable *lower, uint32_t id) const {
+    for (const MacroTable *table = this; table != lower;
+         table = table->base_.get()) {
+      if (table->slots_[table->probe(id)].id == id)
+        return true;
+    }
+    return false;
+  }
+
+  void grow() {
+    if (used_ * 4 > slots_.size() * 3)
+      rehash(live_ * 2 > slots_.size() ? slotBits_ + 1 : slotBits_);
+  }
+
+  // Fibonacci hashing spreads the dense IDs over the whole table.
+  size_t home(uint32_t id) const {
+    return static_cast<size_t>((uint64_t(id) * 0x9E3779B97F4A7C15ull) >>
+                               (64 - slotBits_));
+  }
+
+  // Index of the slot holding id, or of the empty slot ending its probe
+  // sequence.
+  size_t probe(uint32_t id) const {
+    size_t mask = slots_.size() - 1;
+    for (size_t i = home(id);; i = (i + 1) & mask) {
+      uint32_t key = slots_[i].id;
+      if (key == id || key == kEmpty)
+        return i;
+    }
+  }
+
+  void rehash(unsigned bits) {
+    std::pmr::vector<Slot> old(size_t(1) << bits, slots_.get_allocator());
+    old.swap(slots_);
+    slotBits_ = bits;
+    size_t mask = slots_.size() - 1;
+    for (const Slot &slot : old) {
+      if (slot.id == kEmpty || slot.id == kTombstone)
+        continue;
+      size_t i = home(slot.id);
+      while (slots_[i].id != kEmpty)
+        i = (i + 1) & mask;
+      slots_[i] = slot;
+    }
+    used_ = live_;
+  }
+
+  std::shared_ptr<const MacroTable> base_;
+  std::pmr::vector<Slot> slots_;
+  std::pmr::deque<MacroDef> defs_;
+  std::pmr::vector<uint32_t> freeDefs_;
+  size_t live_ = 0;
+  size_t used_ = 0;     // live entries plus tombstones
+  size_t hidden_ = 0;   // live entries that #undef a base macro
+  size_t shadowed_ = 0; // live entries whose ID the base defines
+  unsigned slotBits_ = 6;
+};
+
+// MacroSnapshot: A frozen copy of a PreProcessor's macros
+//
+// Holds the identifiers and macro definitions of a configured PreProcessor
+// (its -D options, a common prelude) with every spelling copied into the
+// snapshot, so it outlives the PreProcessor it was taken from. Any number of
+// PreProcessors can start from one snapshot at once: setMacroSnapshot()
+// layers their tables over the snapshot's without copying or re-lexing
+// anything. save() and load() keep a snapshot in a compact binary file.
+class MacroSnapshot {
+public:
+  // Copy the visible macros of macros, whose IDs come from identifiers
+  MacroSnapshot(const IdentifierTable &identifiers, const MacroTable &macros) {
+    for (uint32_t id = 0; id < identifiers.size(); id++)
+      identifiers_.intern(identifiers.spelling(id));
+    macros.forEach([&](uint32_t id, const MacroDef &def) {
+      MacroDef &copy = macros_.define(id);
+      copy.kind = def.kind;
+      copy.variadic = def.variadic;
+      for (std::string_view param : def.params)
+        copy.params.push_back(storage_.store(param));
+      copy.text = storage_.store(def.text);
+      copy.body = def.body;
+    });
+  }
+
+  MacroSnapshot(const MacroSnapshot &) = delete;
+  MacroSnapshot &operator=(const MacroSnapshot &) = delete;
+
+  const IdentifierTable &identifiers() const { return identifiers_; }
+  const MacroTable &macros() const { return macros_; }
+
+  // Write the snapshot to path. Multi-byte fields are little-endian.
+  void save(const std::string &path) const {
+    std::string out(kMagic, sizeof(kMagic));
+    putU32(out, static_cast<uint32_t>(identifiers_.size()));
+    for (uint32_t id = 0; id < identifiers_.size(); id++)
+      putString(out, identifiers_.spelling(id));
+    putU32(out, static_cast<uint32_t>(macros_.size()));
+    macros_.forEach([&](uint32_t id, const MacroDef &def) {
+      putU32(out, id);
+      out += static_cast<char>(def.kind);
+      out += static_cast<char>(def.variadic);
+      putU32(out, static_cast<uint32_t>(def.params.size()));
+      for (std::string_view param : def.params)
+        putString(out, param);
+      putString(out, def.text);
+      putU32(out, static_cast<uint32_t>(def.body.size()));
+      for (const ReplacementToken &token : def.body) {
+        putU32(out, token.token.begin);
+        putU32(out, token.token.len);
+        out += static_cast<char>(token.token.kind);
+        putU32(out, static_cast<uint32_t>(token.param));
+        out += static_cast<char>(token.flags);
+      }
+    });
+
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    if (!file)
+      throw std::runtime_error("Cannot write macro snapshot '" + path + "'");
+    bool ok = std::fwrite(out.data(), 1, out.size(), file) == out.size();
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok)
+      throw std::runtime_error("Cannot write macro snapshot '" + path + "'");
+  }
+
+  // Read a snapshot written by save()
+  static std::shared_ptr<const MacroSnapshot> load(const std::string &path) {
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    if (!file)
+      throw std::runtime_error("'" + path + "' file not found");
+    std::string data;
+    char chunk[16 * 1024];
+    size_t n;
+    while ((n = std::fread(chunk, 1, sizeof(chunk), file)) > 0)
+      data.append(chunk, n);
+    std::fclose(file);
+
+    std::shared_ptr<MacroSnapshot> snapshot(new MacroSnapshot());
+    Reader in{data, 0, path};
+    if (data.compare(0, sizeof(kMagic), kMagic, sizeof(kMagic)) != 0)
+      in.fail();
+    in.pos = sizeof(kMagic);
+    snapshot->read(in);
+    return snapshot;
+  }
+
+private:
+  static constexpr char kMagic[8] = {'P', 'P', 'S', 'N', 'A', 'P', 0, 1};
+
+  struct Reader {
+    std::string_view data;
+    size_t pos;
+    const std::string &path;
+
+    [[noreturn]] void fail() const {
+      throw std::runtime_error("'" + path + "' is not a valid macro snapshot");
+    }
+    uint8_t u8() {
+      if (pos >= data.size())
+        fail();
+      return static_cast<uint8_t>(data[pos++]);
+    }
+    uint32_t u32() {
+      uint32_t value = 0;
+      for (int shift = 0; shift < 32; shift += 8)
+        value |= uint32_t(u8()) << shift;
+      return value;
+    }
+    std::string_view string() {
+      uint32_t len = u32();
+      if (len > data.size() - pos)
+        fail();
+      std::string_view s = data.substr(pos, len);
+      pos += len;
+      return s;
+    }
+  };
+
+  MacroSnapshot() = default;
+
+  static void putU32(std::string &out, uint32_t value) {
+    for (int shift = 0; shift < 32; shift += 8)
+      out += static_cast<char>(value >> shift);
+  }
+
+  static void putString(std::string &out, std::string_view s) {
+    putU32(out, static_cast<uint32_t>(s.size()));
+    out += s;
+  }
+
+  // Everything read is checked, so a damaged file cannot produce a table
+  // the expander would index out of bounds.
+  void read(Reader &in) {
+    uint32_t identifiers = in.u32();
+    for (uint32_t id = 0; id < identifiers; id++) {
+      if (identifiers_.intern(in.string()) != id)
+        in.fail(); // Duplicate spelling
+    }
+    uint32_t macros = in.u32();
+    for (uint32_t m = 0; m < macros; m++) {
+      uint32_t id = in.u32();
+      if (id >= identifiers || macros_.contains(id))
+        in.fail();
+      MacroDef &def = macros_.define(id);
+      uint8_t kind = in.u8();
+      if (kind > static_cast<uint8_t>(MacroKind::Function))
+        in.fail();
+      def.kind = static_cast<MacroKind>(kind);
+      def.variadic = in.u8() != 0;
+      uint32_t params = in.u32();
+      for (uint32_t p = 0; p < params; p++)
+        def.params.push_back(storage_.store(in.string()));
+      def.text = storage_.store(in.string());
+      uint32_t body = in.u32();
+      for (uint32_t t = 0; t < body; t++) {
+        unsigned begin = in.u32();
+        unsigned len = in.u32();
+        uint8_t tokenKind = in.u8();
+        if (tokenKind > static_cast<uint8_t>(TokenKind::HashHash) ||
+            begin > def.text.size() || len > def.text.size() - begin)
+          in.fail();
+        ReplacementToken token(
+            Token(begin, len, static_cast<TokenKind>(tokenKind)));
+        token.param = static_cast<int>(in.u32());
+        if (token.param < -1 || token.param >= static_cast<int>(params))
+          in.fail();
+        token.flags = in.u8();
+        def.body.push_back(token);
+      }
+    }
+    if (in.pos != in.data.size())
+      in.fail();
+  }
+
+  IdentifierTable identifiers_;
+  MacroTable macros_;
+  StringArena storage_; // Parameter names and replacement lists
+};
+
+// ConditionEvaluator: Evaluates a macro-expanded #if expression
+//
+// Follows C99 6.10.1: arithmetic is done in intmax_t, or uintmax_t once
+// either operand is unsigned; &&, || and ?: short-circuit, so dividing by
+// zero in an unevaluated operand is not an error; identifiers left over
+// after expansion read as 0. defined must already have been replaced by
+// 0 or 1. The precedence-climbing parser walks the tokens in place and
+// never allocates. Nesting is capped at kMaxDepth, which bounds the stack
+// the recursion can use.
+class ConditionEvaluator {
+public:
+  static constexpr int kMaxDepth = 256;
+
+  ConditionEvaluator(const PPToken *begin, const PPToken *end)
+      : pos_(begin), end_(end) {}
+
+  bool evaluate() {
+    if (pos_ == end_)
+      throw std::runtime_error("#if with no expression");
+    Value value = parse(kCommaPrec, true, 0);
+    if (pos_ != end_)
+      throw unexpected();
+    return value.bits != 0;
+  }
+
+private:
+  struct Value {
+    uintmax_t bits;   // Two's complement bits; read as intmax_t if signed
+    bool isUnsigned;
+  };
+
+  enum : int { kCommaPrec = 1, kTernaryPrec = 2 };
+
+  static int binaryPrecedence(TokenKind kind) {
+    switch (kind) {
+    case TokenKind::Comma:
+      return kCommaPrec;
+    case TokenKind::Question:
+      return kTernaryPrec;
+    case TokenKind::LogicOr:
+      return 3;
+    case TokenKind::LogicAnd:
+      return 4;
+    case TokenKind::BitOr:
+      return 5;
+    case TokenKind::XOR:
+      return 6;
+    case TokenKind::Ampersand:
+      return 7;
+    case TokenKind::EqualEqual:
+    case TokenKind::ExclamationEqual:
+      return 8;
+    case TokenKind::Less:
+    case TokenKind::Greater:
+    case TokenKind::LessEqual:
+    case TokenKind::GreaterEqual:
+      return 9;
+    case TokenKind::LessLess:
+    case TokenKind::GreaterGreater:
+      return 10;
+    case TokenKind::Plus:
+    case TokenKind::Minus:
+      return 11;
+    case TokenKind::Star:
+    case TokenKind::Slash:
+    case TokenKind::Percent:
+      return 12;
+    default:
+      return 0;
+    }
+  }
+
+  static Value boolean(bool b) { return {b ? 1u : 0u, false}; }
+
+  std::runtime_error unexpected() const {
+    if (pos_ == end_)
+      return std::runtime_error("#if expression ends unexpectedly");
+    return std::runtime_error("Invalid token in #if expression: '" +
+                              std::string(pos_->text) + "'");
+  }
+
+  void expect(TokenKind kind, const char *message) {
+    if (pos_ == end_ || pos_->kind != kind)
+      throw std::runtime_error(message);
+    ++pos_;
+  }
+
+  // Parse operators that bind at least as tightly as minPrec. eval is false
+  // inside operands that short-circuiting skips.
+  Value parse(int minPrec, bool eval, int depth) {
+    Value lhs = parseUnary(eval, depth);
+    while (pos_ != end_) {
+      TokenKind op = pos_->kind;
+      int prec = binaryPrecedence(op);
+      if (prec == 0 || prec < minPrec)
+        break;
+      ++pos_;
+
+      if (op == TokenKind::Question) {
+        bool cond = lhs.bits != 0;
+        Value then = parse(kCommaPrec, eval && cond, depth + 1);
+        expect(TokenKind::Colon, "Expected ':' in #if expression");
+        // Right associative: the else operand may hold another ?:
+        Value otherwise = parse(kTernaryPrec, eval && !cond, depth + 1);
+        lhs = cond ? then : otherwise;
+        lhs.isUnsigned = then.isUnsigned || otherwise.isUnsigned;
+      } else if (op == TokenKind::LogicAnd) {
+        bool left = lhs.bits != 0;
+        Value rhs = parse(prec + 1, eval && left, depth + 1);
+        lhs = boolean(left && rhs.bits != 0);
+      } else if (op == TokenKind::LogicOr) {
+        bool left = lhs.bits != 0;
+        Value rhs = parse(prec + 1, eval && !left, depth + 1);
+        lhs = boolean(left || rhs.bits != 0);
+      } else {
+        Value rhs = parse(prec + 1, eval, depth + 1);
+        lhs = apply(op, lhs, rhs, eval);
+      }
+    }
+    return lhs;
+  }
+
+  Value parseUnary(bool eval, int depth) {
+    if (depth > kMaxDepth)
+      throw std::runtime_error("#if expression nested too deeply");
+    if (pos_ == end_)
+      throw unexpected();
+
+    const PPToken &tok = *pos_++;
+    switch (tok.kind) {
+    case TokenKind::Plus:
+      return parseUnary(eval, depth + 1);
+    case TokenKind::Minus: {
+      Value v = parseUnary(eval, depth + 1);
+      v.bits = uintmax_t(0) - v.bits;
+      return v;
+    }
+    case TokenKind::Tilde: {
+      Value v = parseUnary(eval, depth + 1);
+      v.bits = ~v.bits;
+      return v;
+    }
+    case TokenKind::Not:
+      return boolean(parseUnary(eval, depth + 1).bits == 0);
+    case TokenKind::L_Paren: {
+      Value v = parse(kCommaPrec, eval, depth + 1);
+      expect(TokenKind::R_Paren, "Missing ')' in #if expression");
+      return v;
+    }
+    case TokenKind::PPNumber:
+      return parseNumber(tok.text);
+    case TokenKind::CharLiteral:
+      return parseChar(tok.text);
+    default:
+      if (isIdentifierLike(tok.kind))
+        return {0, false};
+      --pos_;
+      throw unexpected();
+    }
+  }
+
+  static Value apply(TokenKind op, Value l, Value r, bool eval) {
+    bool isUnsigned = l.isUnsigned || r.isUnsigned;
+    intmax_t ls = static_cast<intmax_t>(l.bits);
+    intmax_t rs = static_cast<intmax_t>(r.bits);
+    switch (op) {
+    case TokenKind::Comma:
+      return r;
+    case TokenKind::Star:
+      return {l.bits * r.bits, isUnsigned};
+    case TokenKind::Plus:
+      return {l.bits + r.bits, isUnsigned};
+    case TokenKind::Minus:
+      return {l.bits - r.bits, isUnsigned};
+    case TokenKind::Slash:
+    case TokenKind::Percent: {
+      if (r.bits == 0) {
+        if (eval)
+          throw std::runtime_error("Division by zero in #if");
+        return {0, isUnsigned};
+      }
+      bool div = op == TokenKind::Slash;
+      if (isUnsigned)
+        return {div ? l.bits / r.bits : l.bits % r.bits, true};
+      if (ls == INTMAX_MIN && rs == -1) // Overflows; wrap like the others
+        return {div ? l.bits : 0, false};
+      return {static_cast<uintmax_t>(div ? ls / rs : ls % rs), false};
+    }
+    case TokenKind::LessLess:
+    case TokenKind::GreaterGreater: {
+      // The result has the type of the left operand. A negative count
+      // shifts the other way; counts past the width shift everything out.
+      bool left = op == TokenKind::LessLess;
+      uintmax_t count = r.bits;
+      if (!r.isUnsigned && rs < 0) {
+        left = !left;
+        count = uintmax_t(0) - r.bits;
+      }
+      const unsigned width = sizeof(uintmax_t) * 8;
+      if (left)
+        return {count >= width ? 0 : l.bits << count, l.isUnsigned};
+      if (l.isUnsigned)
+        return {count >= width ? 0 : l.bits >> count, true};
+      if (count >= width)
+        return {ls < 0 ? ~uintmax_t(0) : 0, false};
+      return {static_cast<uintmax_t>(ls < 0 ? ~(~ls >> count) : ls >> count),
+              false};
+    }
+    case TokenKind::Less:
+      return boolean(isUnsigned ? l.bits < r.bits : ls < rs);
+    case TokenKind::Greater:
+      return boolean(isUnsigned ? l.bits > r.bits : ls > rs);
+    case TokenKind::LessEqual:
+      return boolean(isUnsigned ? l.bits <= r.bits : ls <= rs);
+    case TokenKind::GreaterEqual:
+      return boolean(isUnsigned ? l.bits >= r.bits : ls >= rs);
+    case TokenKind::EqualEqual:
+      return boolean(l.bits == r.bits);
+    case TokenKind::ExclamationEqual:
+      return boolean(l.bits != r.bits);
+    case TokenKind::Ampersand:
+      return {l.bits & r.bits, isUnsigned};
+    case TokenKind::XOR:
+      return {l.bits ^ r.bits, isUnsigned};
+    case TokenKind::BitOr:
+      return {l.bits | r.bits, isUnsigned};
+    default:
+      return {0, false};
+    }
+  }
+
+  // Integer constant with an optional u/l/ll suffix in either order
+  static Value parseNumber(std::string_view text) {
+    size_t i = 0;
+    unsigned base = 10;
+    if (text.size() > 1 && text[0] == '0') {
+      if (text[1] == 'x' || text[1] == 'X') {
+        base = 16;
+        i = 2;
+      } else if (text[1] == 'b' || text[1] == 'B') {
+        base = 2;
+        i = 2;
+      } else {
+        base = 8;
+        i = 1;
+      }
+    }
+
+    uintmax_t value = 0;
+    bool overflow = false;
+    size_t digits = 0;
+    for (; i < text.size(); i++, digits++) {
+      char c = text[i];
+      unsigned d;
+      if (c >= '0' && c <= '9')
+        d = c - '0';
+      else if (c >= 'a' && c <= 'f')
+        d = c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F')
+        d = c - 'A' + 10;
+      else
+        break;
+      if (d >= base) {
+        if (base == 16 || base == 2 || !(c >= '0' && c <= '9'))
+          break;
+        throw invalidNumber(text); // 8 or 9 in an octal constant
+      }
+      if (value > (UINTMAX_MAX - d) / base)
+        overflow = true;
+      value = value * base + d;
+    }
+    if (digits == 0 && base != 8)
+      throw invalidNumber(text);
+
+    bool isUnsigned = false;
+    int longs = 0;
+    for (; i < text.size(); i++) {
+      char c = text[i];
+      if ((c == 'u' || c == 'U') && !isUnsigned) {
+        isUnsigned = true;
+      } else if ((c == 'l' || c == 'L') && longs == 0) {
+        longs = 1;
+        if (i + 1 < text.size() && text[i + 1] == c) {
+          longs = 2;
+          i++;
+        }
+      } else {
+        throw invalidNumber(text);
+      }
+    }
+    if (overflow)
+      throw std::runtime_error("Integer constant is too large for #if: " +
+                               std::string(text));
+    return {value, isUnsigned || value > uintmax_t(INTMAX_MAX)};
+  }
+
+  static std::runtime_error invalidNumber(std::string_view text) {
+    return std::runtime_error("Invalid integer constant in #if: " +
+                              std::string(text));
+  }
+
+  // Character constant; plain char is signed, several characters combine
+  // big-endian as GCC does.
+  static Value parseChar(std::string_view text) {
+    if (text.size() < 3 || text.back() != '\'')
+      throw std::runtime_error("Invalid character constant in #if: " +
+                               std::string(text));
+    intmax_t value = 0;
+    for (size_t i = 1; i + 1 < text.size();) {
+      unsigned c = static_cast<unsigned char>(text[i++]);
+      if (c == '\\' && i + 1 < text.size()) {
+        char e = text[i++];
+        switch (e) {
+        case 'n': c = '\n'; break;
+        case 't': c = '\t'; break;
+        case 'r': c = '\r'; break;
+        case 'a': c = '\a'; break;
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'v': c = '\v'; break;
+        case 'x':
+          c = 0;
+          while (i + 1 < text.size() && std::isxdigit(
+                                            static_cast<unsigned char>(text[i]))) {
+            char h = text[i++];
+            c = c * 16 + (h <= '9' ? h - '0' : (h | 0x20) - 'a' + 10);
+          }
+          break;
+        default:
+          if (e >= '0' && e <= '7') {
+            c = e - '0';
+            for (int n = 1; n < 3 && i + 1 < text.size() && text[i] >= '0' &&
+                            text[i] <= '7';
+                 n++)
+              c = c * 8 + (text[i++] - '0');
+          } else {
+            c = static_cast<unsigned char>(e); // \\ \' \" \?
+          }
+        }
+      }
+      value = (value << 8) | (c & 0xFF);
+    }
+    if (text.size() == 3 || value < 0x100)
+      value = static_cast<signed char>(value);
+    return {static_cast<uintmax_t>(value), false};
+  }
+
+  const PPToken *pos_;
+  const PPToken *end_;
+};
+
+// DirectiveIndex: Every directive in a file, as skipping a group finds
+// them, so later skips can jump straight to where a group continues
+//
+// Entries are in file order. next links each one to the first #elif,
+// #else or #endif after it at the same level, with nested groups jumped
+// over: for an #if, #elif or #else that is where its group ends, for any
+// other directive where the group around it continues.
+struct DirectiveIndex {
+  static constexpr uint32_t kNone = ~0u;
+
+  struct Entry {
+    uint32_t lineEnd; // The line end the scan reaches first after the name
+    uint32_t nameEnd; // Just past the directive name
+    uint32_t next;    // Entry index, or kNone if the file ends first
+    TokenKind kind;   // Of the name; Ident when it is no directive
+  };
+
+  std::vector<Entry> entries;
+
+  // The index of the entry whose line ends at offset, or kNone
+  uint32_t atLineEnd(size_t offset) const {
+    auto it = std::lower_bound(
+        entries.begin(), entries.end(), offset,
+        [](const Entry &e, size_t at) { return e.lineEnd < at; });
+    return it != entries.end() && it->lineEnd == offset
+               ? static_cast<uint32_t>(it - entries.begin())
+               : kNone;
+  }
+};
+
+// FileEntry: One file's contents as loaded by FileCache
+//
+// Entries are immutable once published and are handed out as shared_ptrs,
+// so a PreProcessor can keep views into text() after the cache has moved
+// on to a newer version of the file.
+class FileEntry {
+public:
+  FileEntry(std::string path, uint64_t inode, int64_t mtime, uint64_t size)
+      : path_(std::move(path)), inode_(inode), mtime_(mtime), size_(size) {}
+
+  ~FileEntry() {
+#if !defined(_WIN32)
+    if (mapping_)
+      ::munmap(mapping_, static_cast<size_t>(size_));
+#endif
+  }
+
+  FileEntry(const FileEntry &) = delete;
+  FileEntry &operator=(const FileEntry &) = delete;
+
+  const std::string &path() const { return path_; }
+  std::string_view text() const { return text_; }
+
+  // Directory part of path(), including the trailing separator
+  std::string_view directory() const {
+    size_t slash = path_.find_last_of("/\\");
+    return slash == std::string::npos
+               ? std::string_view()
+               : std::string_view(path_).substr(0, slash + 1);
+  }
+
+  bool sameVersion(uint64_t inode, int64_t mtime, uint64_t size) const {
+    return inode_ == inode && mtime_ == mtime && size_ == size;
+  }
+
+  // Multiple-include optimisation. The first PreProcessor to get through
+  // the file records whether its contents are wrapped in an include guard;
+  // since that only depends on the text, every later user can trust it.
+  // The first recorded result wins.
+  bool guardScanned() const { return guardState_.load() >= kNoGuard; }
+
+  // The guard macro, or empty if there is none or the file is unscanned
+  std::string_view guardMacro() const {
+    if (guardState_.load(std::memory_order_acquire) != kGuarded)
+      return {};
+    return guard_;
+  }
+
+  void setGuard(std::string_view macro) const {
+    unsigned char expected = kUnscanned;
+    if (!guardState_.compare_exchange_strong(expected, kWriting))
+      return;
+    guard_.assign(macro.data(), macro.size());
+    guardState_.store(kGuarded, std::memory_order_release);
+  }
+
+  void setNoGuard() const {
+    unsigned char expected = kUnscanned;
+    guardState_.compare_exchange_strong(expected, kNoGuard);
+  }
+
+  bool pragmaOnce() const { return pragmaOnce_.load(); }
+  void setPragmaOnce() const { pragmaOnce_.store(true); }
+
+  // Times a PreProcessor has started reading the file, counting this one
+  unsigned noteRead() const { return reads_.fetch_add(1) + 1; }
+  unsigned reads() const { return reads_.load(); }
+
+  // The file's directives, made by build() on first use. Threads asking at
+  // once wait for the first to finish.
+  template <class Build>
+  const DirectiveIndex &directiveIndex(Build build) const {
+    std::call_once(indexOnce_, [&] {
+      directives_ = build();
+      indexed_.store(true, std::memory_order_release);
+    });
+    return directives_;
+  }
+  bool hasDirectiveIndex() const {
+    return indexed_.load(std::memory_order_acquire);
+  }
+  // The index if made already, else null
+  const DirectiveIndex *builtDirectiveIndex() const {
+    return hasDirectiveIndex() ? &directives_ : nullptr;
+  }
+
+  // The file's tokens, what lex() returns reading it from the start, made
+  // by build() on first use like directiveIndex(). Later readers, in this
+  // translation unit or another sharing the cache, look tokens up here
+  // instead of lexing.
+  template <class Build>
+  const std::vector<Token> &tokens(Build build) const {
+    std::call_once(tokensOnce_, [&] {
+      tokens_ = build();
+      lexed_.store(true, std::memory_order_release);
+    });
+    return tokens_;
+  }
+  bool hasTokens() const { return lexed_.load(std::memory_order_acquire); }
+
+private:
+  friend class FileCache;
+
+  enum : unsigned char { kUnscanned, kWriting, kNoGuard, kGuarded };
+
+  std::string path_;
+  uint64_t inode_;
+  int64_t mtime_;
+  uint64_t size_;
+  std::string_view text_;
+  void *mapping_ = nullptr; // mmap of the whole file, if it was mapped
+  std::string contents_;    // Otherwise the file read into memory
+  mutable std::atomic<unsigned char> guardState_{kUnscanned};
+  mutable std::string guard_; // Written once, before kGuarded is published
+  mutable std::atomic<bool> pragmaOnce_{false};
+  mutable std::atomic<unsigned> reads_{0};
+  mutable std::once_flag indexOnce_;
+  mutable DirectiveIndex directives_; // Written once, inside indexOnce_
+  mutable std::atomic<bool> indexed_{false};
+  mutable std::once_flag tokensOnce_;
+  mutable std::vector<Token> tokens_; // Written once, inside tokensOnce_
+  mutable std::atomic<bool> lexed_{false};
+};
+
+// FileCache: Process-wide cache of source files, each loaded once
+//
+// Entries are keyed on the path used to open them and checked against the
+// file's inode, mtime and size on every load(), so an edited file is read
+// again while unchanged headers are shared by every PreProcessor that
+// includes them. Files are mmapped where the platform allows it. All
+// members are safe to call from several threads at once.
+class FileCache {
+public:
+  static FileCache &shared() {
+    static FileCache cache;
+    return cache;
+  }
+
+  // Return the current contents of path, or nullptr if it cannot be opened.
+  std::shared_ptr<const FileEntry> load(const std::string &path) {
+    struct stat info;
+    if (::stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+      return nullptr;
+    uint64_t inode = static_cast<uint64_t>(info.st_ino);
+    int64_t mtime = modificationTime(info);
+    uint64_t size = static_cast<uint64_t>(info.st_size);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = entries_.find(path);
+      if (it != entries_.end() && it->second->sameVersion(inode, mtime, size))
+        return it->second;
+    }
+
+    // Read outside the lock; if another thread got there first, keep the
+    // entry it published.
+    std::shared_ptr<FileEntry> entry =
+        std::make_shared<FileEntry>(path, inode, mtime, size);
+    if (!read(*entry))
+      return nullptr;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::shared_ptr<const FileEntry> &slot = entries_[path];
+    if (!slot || !slot->sameVersion(inode, mtime, size))
+      slot = std::move(entry);
+    return slot;
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+  }
+
+  // Drop every entry. Files still in use stay alive through their owners.
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+  }
+
+private:
+#if !defined(S_ISREG)
+  static bool S_ISREG(unsigned short mode) { return (mode & S_IFMT) == S_IFREG; }
+#endif
+
+  static int64_t modificationTime(const struct stat &info) {
+#if defined(__APPLE__)
+    return int64_t(info.st_mtimespec.tv_sec) * 1000000000 +
+           info.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    return int64_t(info.st_mtime) * 1000000000;
+#else
+    return int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+  }
+
+  static bool read(FileEntry &entry) {
+    size_t size = static_cast<size_t>(entry.size_);
+#if !defined(_WIN32)
+    if (size > 0) {
+      int fd = ::open(entry.path_.c_str(), O_RDONLY);
+      if (fd < 0)
+        return false;
+      void *mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (mapping != MAP_FAILED) {
+        entry.mapping_ = mapping;
+        entry.text_ = std::string_view(static_cast<char *>(mapping), size);
+        return true;
+      }
+    }
+#endif
+    std::FILE *file = std::fopen(entry.path_.c_str(), "rb");
+    if (!file)
+      return false;
+    entry.contents_.resize(size);
+    size_t got = size ? std::fread(&entry.contents_[0], 1, size, file) : 0;
+    std::fclose(file);
+    entry.contents_.resize(got);
+    entry.text_ = entry.contents_;
+    return true;
+  }
+
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, std::shared_ptr<const FileEntry>> entries_;
+};
+
+// IncludePrefetcher: Loads #included files into a FileCache ahead of use
+//
+// PreProcessors given one with setIncludePrefetcher() scan each file they
+// enter for #include lines and queue a lookup per header name: the paths
+// the search would try, in order. A few worker threads run the lookups
+// through FileCache::load(), so on a slow file system the stat and open
+// calls along the search paths overlap with preprocessing. A lookup that
+// is needed before a worker has taken it is run by the thread asking.
+// Must outlive the PreProcessors using it. All members are safe to call
+// from several threads at once.
+class IncludePrefetcher {
+public:
+  class Request;
+
+  explicit IncludePrefetcher(FileCache &cache = FileCache::shared(),
+                             unsigned threads = kDefaultThreads)
+      : cache_(cache) {
+    // With fewer workers than asked for, or none if no thread could be
+    // started, more lookups are just run in wait()
+    workers_.reserve(std::max(1u, threads));
+    for (unsigned i = 0; i < std::max(1u, threads); i++) {
+      try {
+        workers_.emplace_back([this] { work(); });
+      } catch (...) {
+        break;
+      }
+    }
+  }
+
+  // Lookups still queued are dropped; ones being run are finished first.
+  ~IncludePrefetcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &worker : workers_)
+      worker.join();
+  }
+
+  IncludePrefetcher(const IncludePrefetcher &) = delete;
+  IncludePrefetcher &operator=(const IncludePrefetcher &) = delete;
+
+  static constexpr unsigned kDefaultThreads = 4;
+
+  FileCache &fileCache() const { return cache_; }
+
+  // Queue a lookup of candidates, tried in order; the ones from
+  // systemFrom on are -isystem directories. A lookup nobody holds on to
+  // any more by the time a worker gets to it is not run.
+  std::shared_ptr<Request> prefetch(std::vector<std::string> candidates,
+                                    size_t systemFrom) {
+    auto request = std::make_shared<Request>();
+    request->candidates_ = std::move(candidates);
+    request->systemFrom_ = systemFrom;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(request);
+    }
+    wake_.notify_one();
+    return request;
+  }
+
+  // The first candidate of request that loaded, null if none did, and
+  // whether it was found through an -isystem directory. Runs the lookup
+  // here if no worker has started it, else waits for it.
+  std::shared_ptr<const FileEntry> wait(Request &request, bool &system) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (request.state_ == Request::Queued) {
+      request.state_ = Request::Running;
+      lock.unlock();
+      run(request);
+      lock.lock();
+      request.state_ = Request::Done;
+      done_.notify_all();
+    }
+    done_.wait(lock, [&] { return request.state_ == Request::Done; });
+    system = request.found_ >= request.systemFrom_;
+    return request.file_;
+  }
+
+  // One queued lookup, opaque to its users
+  class Request {
+  private:
+    friend class IncludePrefetcher;
+    enum State { Queued, Running, Done };
+    State state_ = Queued; // Guarded by the prefetcher's mutex
+    std::vector<std::string> candidates_;
+    size_t systemFrom_ = 0;
+    std::shared_ptr<const FileEntry> file_;
+    size_t found_ = 0; // Index of the candidate loaded
+  };
+
+private:
+  void run(Request &request) {
+    for (size_t &i = request.found_; i < request.candidates_.size(); i++)
+      if ((request.file_ = cache_.load(request.candidates_[i])))
+        return;
+  }
+
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      wake_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (stopping_)
+        return;
+      std::shared_ptr<Request> request = std::move(queue_.front());
+      queue_.pop_front();
+      if (request->state_ != Request::Queued || request.use_count() == 1)
+        continue;
+      request->state_ = Request::Running;
+      lock.unlock();
+      run(*request);
+      lock.lock();
+      request->state_ = Request::Done;
+      done_.notify_all();
+    }
+  }
+
+  FileCache &cache_;
+  std::mutex mutex_;
+  std::condition_variable wake_; // Work was queued, or stopping_ set
+  std::condition_variable done_; // Some request became Done
+  std::deque<std::shared_ptr<Request>> queue_;
+  bool stopping_ = false;
+  std::vector<std::thread> workers_;
+};
+
+// InputSource: Input that a streaming PreProcessor reads a piece at a
+// time, for sources too large to hold in memory or not in a file at all
+class InputSource {
+public:
+  virtual ~InputSource() = default;
+  // Copy up to size bytes of the input to data and return how many; 0
+  // means the input is exhausted.
+  virtual size_t read(char *data, size_t size) = 0;
+};
+
+// FileSource: Reads input from a file descriptor or FILE*, such as a pipe
+// or standard input
+class FileSource : public InputSource {
+public:
+  explicit FileSource(int fd) : fd_(fd) {}
+  explicit FileSource(std::FILE *file) : file_(file) {}
+
+  size_t read(char *data, size_t size) override {
+    if (file_) {
+      size_t got = std::fread(data, 1, size, file_);
+      if (got == 0 && std::ferror(file_))
+        throw std::runtime_error("Failed to read preprocessor input");
+      return got;
+    }
+    while (true) {
+#if defined(_WIN32)
+      int n = _read(fd_, data, static_cast<unsigned>(size));
+#else
+      ssize_t n = ::read(fd_, data, size);
+#endif
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        throw std::runtime_error("Failed to read preprocessor input");
+      return static_cast<size_t>(n);
+    }
+  }
+
+private:
+  int fd_ = -1;
+  std::FILE *file_ = nullptr;
+};
+
+// OutputSink: Where expanded output goes
+//
+// The preprocessor hands every output token to token() and every line end
+// to newline(). spaced is true when whitespace must separate the token from
+// the previous one; sinks that print text write a single space for it.
+class OutputSink {
+public:
+  virtual ~OutputSink() = default;
+  virtual void token(std::string_view text, TokenKind kind, bool spaced) = 0;
+  virtual void newline() = 0;
+  // Called once the input is exhausted.
+  virtual void flush() {}
+  // Sinks that map output back to the source return true, and then get
+  // origin() before every token().
+  virtual bool wantsOrigins() const { return false; }
+  virtual void origin(const TokenOrigin &) {}
+};
+
+// StringSink: Appends output to a std::string
+class StringSink : public OutputSink {
+public:
+  explicit StringSink(std::string &out) : out_(out) {}
+
+  void token(std::string_view text, TokenKind, bool spaced) override {
+    if (spaced)
+      out_ += ' ';
+    out_ += text;
+  }
+  void newline() override { out_ += '\n'; }
+
+private:
+  std::string &out_;
+};
+
+// FileSink: Writes output to a file descriptor or FILE* through a fixed
+// chunk, so memory use does not depend on the size of the output
+//
+// Whenever the chunk fills up it is written out in one call and reused from
+// the start. The destructor flushes but cannot report errors, so call
+// flush() first.
+class FileSink : public OutputSink {
+public:
+  static constexpr size_t kChunkSize = 64 * 1024;
+
+  explicit FileSink(int fd, size_t chunkSize = kChunkSize)
+      : fd_(fd), buffer_(new char[chunkSize]), size_(chunkSize) {}
+  explicit FileSink(std::FILE *file, size_t chunkSize = kChunkSize)
+      : file_(file), buffer_(new char[chunkSize]), size_(chunkSize) {}
+
+  ~FileSink() override {
+    try {
+      flush();
+    } catch (const std::exception &) {
+    }
+  }
+
+  FileSink(const FileSink &) = delete;
+  FileSink &operator=(const FileSink &) = delete;
+
+  void token(std::string_view text, TokenKind, bool spaced) override {
+    if (spaced)
+      put(' ');
+    if (text.size() <= size_ - used_) {
+      std::memcpy(buffer_.get() + used_, text.data(), text.size());
+      used_ += text.size();
+      return;
+    }
+    while (!text.empty()) {
+      if (used_ == size_)
+        drain();
+      size_t n = std::min(text.size(), size_ - used_);
+      std::memcpy(buffer_.get() + used_, text.data(), n);
+      used_ += n;
+      text.remove_prefix(n);
+    }
+  }
+
+  void newline() override { put('\n'); }
+
+  void flush() override {
+    drain();
+    if (file_ && std::fflush(file_) != 0)
+      throw std::runtime_error("Failed to write preprocessor output");
+  }
+
+private:
+  void put(char c) {
+    if (used_ == size_)
+      drain();
+    buffer_[used_++] = c;
+  }
+
+  void drain() {
+    const char *data = buffer_.get();
+    size_t left = used_;
+    used_ = 0;
+    if (file_) {
+      if (std::fwrite(data, 1, left, file_) != left)
+        throw std::runtime_error("Failed to write preprocessor output");
+      return;
+    }
+    while (left > 0) {
+#if defined(_WIN32)
+      int n = _write(fd_, data, static_cast<unsigned>(left));
+#else
+      ssize_t n = ::write(fd_, data, left);
+#endif
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        throw std::runtime_error("Failed to write preprocessor output");
+      data += n;
+      left -= static_cast<size_t>(n);
+    }
+  }
+
+  int fd_ = -1;
+  std::FILE *file_ = nullptr;
+  std::unique_ptr<char[]> buffer_;
+  size_t size_;
+  size_t used_ = 0;
+};
+
+// TokenCallbackSink: Passes each output token to a callback instead of
+// printing it. Line ends arrive as a "\n" token of kind Unknown.
+class TokenCallbackSink : public OutputSink {
+public:
+  using Callback =
+      std::function<void(std::string_view text, TokenKind kind, bool spaced)>;
+
+  explicit TokenCallbackSink(Callback callback)
+      : callback_(std::move(callback)) {}
+
+  void token(std::string_view text, TokenKind kind, bool spaced) override {
+    callback_(text, kind, spaced);
+  }
+  void newline() override { callback_("\n", TokenKind::Unknown, false); }
+
+private:
+  Callback callback_;
+};
+
+// TokenBatch: Fully expanded tokens from PreProcessor::nextBatch(), one
+// array per field so a parser can scan kinds without touching the rest
+struct TokenBatch {
+  enum Flags : unsigned char {
+    LeadingSpace = 1 << 0, // Whitespace before it in the source or macro body
+    StartOfLine = 1 << 1,  // First token of an output line
+  };
+
+  std::vector<TokenKind> kinds;
+  std::vector<std::string_view> texts;
+  std::vector<unsigned char> flags;
+  std::vector<uint32_t> locs; // Only with location tracking on
+
+  size_t size() const { return kinds.size(); }
+  bool empty() const { return kinds.empty(); }
+
+  void clear() {
+    kinds.clear();
+    texts.clear();
+    flags.clear();
+    locs.clear();
+  }
+
+  void push(TokenKind kind, std::string_view text, unsigned char flag) {
+    kinds.push_back(kind);
+    texts.push_back(text);
+    flags.push_back(flag);
+  }
+};
+
+// Binary output: what a sink is handed, in a compact form tools can read
+// back with BinaryReader instead of lexing text again
+//
+// The stream is "PPB" and a version byte, then records. Every record
+// starts with a varint (LEB128) whose low two bits say what it is:
+//
+//   0  token: string v >> 3, spaced if bit 2 is set
+//   1  string: kind and length as varints, then the bytes. Strings are
+//      numbered from 0 in the order they appear, so each distinct spelling
+//      is written once, the first time it is needed.
+//   2  v >> 2 line ends
+//   3  end of stream when v >> 2 is 0. Otherwise an origin for the tokens
+//      that follow, v >> 2 saying which parts changed: 1 the file (a
+//      string varint), 2 the line (zigzag varint of the difference), 4
+//      the macro (string varint plus one, 0 for none).
+//
+// Nothing written is ever patched afterwards, so the stream goes out in
+// chunks as it is made.
+namespace pp_binary {
+constexpr char kMagic[4] = {'P', 'P', 'B', 1};
+enum Record : unsigned {
+  TokenRecord,
+  StringRecord,
+  NewlineRecord,
+  EndOrOrigin,
+};
+enum OriginParts : unsigned { File = 1, Line = 2, Macro = 4 };
+} // namespace pp_binary
+
+// BinarySink: Writes output in the binary format above, with token
+// origins if asked for
+//
+// Bytes are collected in a fixed chunk and handed to write whenever it
+// fills up, and by flush(), which also ends the stream.
+class BinarySink : public OutputSink {
+public:
+  static constexpr size_t kChunkSize = 64 * 1024;
+  using Write = std::function<void(std::string_view bytes)>;
+
+  explicit BinarySink(std::string &out, bool origins = false)
+      : BinarySink([&out](std::string_view bytes) { out += bytes; },
+                   origins) {}
+  explicit BinarySink(Write write, bool origins = false,
+                      size_t chunkSize = kChunkSize)
+      : write_(std::move(write)), origins_(origins) {
+    chunk_.reserve(std::max<size_t>(chunkSize, 16));
+    chunk_.append(pp_binary::kMagic, sizeof pp_binary::kMagic);
+  }
+
+  BinarySink(const BinarySink &) = delete;
+  BinarySink &operator=(const BinarySink &) = delete;
+
+  void token(std::string_view text, TokenKind kind, bool spaced) override {
+    uint64_t id = intern(text, kind);
+    writeNewlines();
+    record(pp_binary::TokenRecord, id << 1 | spaced);
+  }
+
+  void newline() override { newlines_++; }
+
+  bool wantsOrigins() const override { return origins_; }
+
+  void origin(const TokenOrigin &where) override {
+    unsigned parts = 0;
+    uint64_t file = 0, macro = 0;
+    if (where.file != file_ || !haveFile_) {
+      file = intern(where.file, TokenKind::Unknown, &file_);
+      haveFile_ = true;
+      parts |= pp_binary::File;
+    }
+    if (where.line != line_)
+      parts |= pp_binary::Line;
+    if (where.macro != macro_) {
+      macro = where.macro.empty()
+                  ? 0
+                  : intern(where.macro, TokenKind::Ident, &macro_) + 1;
+      if (where.macro.empty())
+        macro_ = {};
+      parts |= pp_binary::Macro;
+    }
+    if (!parts)
+      return;
+    record(pp_binary::EndOrOrigin, parts);
+    if (parts & pp_binary::File)
+      varint(file);
+    if (parts & pp_binary::Line) {
+      int64_t delta =
+          static_cast<int64_t>(where.line) - static_cast<int64_t>(line_);
+      varint(static_cast<uint64_t>(delta) << 1 ^
+             static_cast<uint64_t>(delta >> 63));
+      line_ = where.line;
+    }
+    if (parts & pp_binary::Macro)
+      varint(macro);
+  }
+
+  // Ends the stream and writes out what is left; nothing goes in after.
+  void flush() override {
+    if (!ended_) {
+      writeNewlines();
+      record(pp_binary::EndOrOrigin, 0);
+      ended_ = true;
+    }
+    drain();
+  }
+
+  size_t strings() const { return ids_.size(); }
+
+private:
+  struct Key {
+    std::string_view text;
+    TokenKind kind;
+    bool operator==(const Key &other) const {
+      return kind == other.kind && text == other.text;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      return std::hash<std::string_view>()(key.text) ^
+             static_cast<size_t>(key.kind);
+    }
+  };
+
+  // The number of text spelled as kind, writing it out the first time.
+  // stored, if given, is pointed at the sink's own copy.
+  uint64_t intern(std::string_view text, TokenKind kind,
+                  std::string_view *stored = nullptr) {
+    auto it = ids_.find({text, kind});
+    if (it == ids_.end()) {
+      Key key{text_.store(text), kind};
+      it = ids_.emplace(key, static_cast<uint32_t>(ids_.size())).first;
+      record(pp_binary::StringRecord, static_cast<uint64_t>(kind));
+      varint(text.size());
+      bytes(text);
+    }
+    if (stored)
+      *stored = it->first.text;
+    return it->second;
+  }
+
+  void writeNewlines() {
+    if (newlines_)
+      record(pp_binary::NewlineRecord, newlines_);
+    newlines_ = 0;
+  }
+
+  void record(pp_binary::Record type, uint64_t value) {
+    varint(value << 2 | type);
+  }
+
+  void varint(uint64_t value) {
+    if (chunk_.capacity() - chunk_.size() < 10)
+      drain();
+    while (value >= 0x80) {
+      chunk_ += static_cast<char>(value | 0x80);
+      value >>= 7;
+    }
+    chunk_ += static_cast<char>(value);
+  }
+
+  void bytes(std::string_view text) {
+    while (!text.empty()) {
+      if (chunk_.size() == chunk_.capacity())
+        drain();
+      size_t n = std::min(text.size(), chunk_.capacity() - chunk_.size());
+      chunk_.append(text.data(), n);
+      text.remove_prefix(n);
+    }
+  }
+
+  void drain() {
+    if (chunk_.empty())
+      return;
+    write_(chunk_);
+    chunk_.clear();
+  }
+
+  Write write_;
+  std::string chunk_;
+  bool origins_;
+  bool ended_ = false;
+  uint64_t newlines_ = 0; // Line ends not written yet
+  std::unordered_map<Key, uint32_t, KeyHash> ids_;
+  StringArena text_; // Copies of the strings, as the keys of ids_
+  // The last origin written
+  std::string_view file_;
+  bool haveFile_ = false;
+  unsigned line_ = 0;
+  std::string_view macro_;
+};
+
+// BinaryReader: Decodes a BinarySink stream, into token batches or back
+// into any OutputSink
+//
+// Texts point straight into data, which must outlive what is read.
+// Malformed or truncated streams throw.
+class BinaryReader {
+public:
+  explicit BinaryReader(std::string_view data) : data_(data) {
+    if (data.size() < sizeof pp_binary::kMagic ||
+        std::memcmp(data.data(), pp_binary::kMagic,
+                    sizeof pp_binary::kMagic) != 0)
+      throw std::runtime_error("Not a binary preprocessor stream");
+    at_ = sizeof pp_binary::kMagic;
+  }
+
+  // Like PreProcessor::nextBatch(): replace out's contents with the next
+  // tokens, at most cap of them, and return how many there are; 0 at the
+  // end. LeadingSpace is the spacing the stream recorded. With origins,
+  // it gets where each token came from, if the stream says.
+  size_t nextBatch(TokenBatch &out, size_t cap,
+                   std::vector<TokenOrigin> *origins = nullptr) {
+    out.clear();
+    if (origins)
+      origins->clear();
+    while (out.size() < cap && nextToken()) {
+      newlines_ = 0;
+      unsigned char flags = (spaced_ ? TokenBatch::LeadingSpace : 0) |
+                            (lineStart_ ? TokenBatch::StartOfLine : 0);
+      out.push(strings_[id_].second, strings_[id_].first, flags);
+      if (origins)
+        origins->push_back(origin_);
+      lineStart_ = false;
+    }
+    return out.size();
+  }
+
+  // Hand the rest of the stream to out as the preprocessor would have,
+  // then flush it
+  void replay(OutputSink &out) {
+    bool origins = out.wantsOrigins();
+    for (;;) {
+      bool more = nextToken();
+      for (; newlines_; newlines_--)
+        out.newline();
+      if (!more)
+        break;
+      if (origins)
+        out.origin(origin_);
+      out.token(strings_[id_].first, strings_[id_].second, spaced_);
+    }
+    out.flush();
+  }
+
+  bool done() const { return ended_; }
+
+private:
+  // Read records up to the next token; false at the end of the stream.
+  // Line ends on the way are counted in newlines_.
+  bool nextToken() {
+    using namespace pp_binary;
+    while (!ended_) {
+      uint64_t value = varint();
+      uint64_t arg = value >> 2;
+      switch (static_cast<Record>(value & 3)) {
+      case TokenRecord:
+        if ((arg >> 1) >= strings_.size())
+          throw std::runtime_error("Binary preprocessor stream is corrupt");
+        id_ = static_cast<size_t>(arg >> 1);
+        spaced_ = arg & 1;
+        return true;
+      case StringRecord: {
+        if (arg > static_cast<uint64_t>(TokenKind::HashHash))
+          throw std::runtime_error("Binary preprocessor stream is corrupt");
+        uint64_t size = varint();
+        if (size > data_.size() - at_)
+          throw std::runtime_error("Binary preprocessor stream is truncated");
+        strings_.emplace_back(data_.substr(at_, static_cast<size_t>(size)),
+                              static_cast<TokenKind>(arg));
+        at_ += static_cast<size_t>(size);
+        break;
+      }
+      case NewlineRecord:
+        newlines_ += arg;
+        lineStart_ = true;
+        break;
+      case EndOrOrigin:
+        if (arg == 0)
+          ended_ = true;
+        else
+          readOrigin(static_cast<unsigned>(arg));
+        break;
+      }
+    }
+    return false;
+  }
+
+  void readOrigin(unsigned parts) {
+    if (parts & pp_binary::File)
+      origin_.file = string(varint());
+    if (parts & pp_binary::Line) {
+      uint64_t zigzag = varint();
+      int64_t delta = static_cast<int64_t>(zigzag >> 1) ^
+                      -static_cast<int64_t>(zigzag & 1);
+      origin_.line = static_cast<unsigned>(origin_.line + delta);
+    }
+    if (parts & pp_binary::Macro) {
+      uint64_t macro = varint();
+      origin_.macro = macro ? string(macro - 1) : std::string_view();
+    }
+  }
+
+  std::string_view string(uint64_t id) const {
+    if (id >= strings_.size())
+      throw std::runtime_error("Binary preprocessor stream is corrupt");
+    return strings_[static_cast<size_t>(id)].first;
+  }
+
+  uint64_t varint() {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      if (at_ == data_.size())
+        throw std::runtime_error("Binary preprocessor stream is truncated");
+      unsigned char byte = static_cast<unsigned char>(data_[at_++]);
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        return value;
+    }
+    throw std::runtime_error("Binary preprocessor stream is corrupt");
+  }
+
+  std::string_view data_;
+  size_t at_ = 0;
+  std::vector<std::pair<std::string_view, TokenKind>> strings_;
+  // The token nextToken() stopped at, and what leads up to it
+  size_t id_ = 0;
+  bool spaced_ = false;
+  bool lineStart_ = true; // A line end since the last batched token
+  uint64_t newlines_ = 0; // Line ends replay() has not passed on yet
+  bool ended_ = false;
+  TokenOrigin origin_{{}, 0, {}};
+};
+
+// PreprocessStats: What a PreProcessor's hot paths have done, from
+// PreProcessor::stats(). Only collected when pp.hpp is included with
+// PP_ENABLE_STATS defined; otherwise everything stays zero.
+struct PreprocessStats {
+#if defined(PP_ENABLE_STATS)
+  static constexpr bool kEnabled = true;
+#else
+  static constexpr bool kEnabled = false;
+#endif
+
+  // Time is charged to the innermost phase running: reading text lines,
+  // running directives, expanding macros or handing text to the sink.
+  enum Phase { Lex, Directive, Expand, Output, kPhases };
+  static constexpr size_t kTokenKinds =
+      static_cast<size_t>(TokenKind::HashHash) + 2;
+
+  struct Header {
+    std::string path;
+    uint64_t entered = 0; // Times its text was read
+    uint64_t skipped = 0; // Times #pragma once or its guard skipped it
+    uint64_t bytes = 0;   // Text read, over all entries
+    uint64_t nanos = 0;   // Wall time inside it, nested headers included
+  };
+  struct Macro {
+    std::string name;
+    uint64_t expansions = 0;
+  };
+
+  uint64_t tokens[kTokenKinds] = {}; // Lexed by next(), by kind; see tokenCount()
+  uint64_t skippedBytes = 0;         // Jumped over in groups not taken
+  uint64_t macroLookups = 0;         // Names looked up as macros
+  uint64_t macroHits = 0;            // Lookups that found a definition
+  uint64_t objectExpansions = 0;
+  uint64_t functionExpansions = 0;
+  uint64_t rescannedTokens = 0; // Produced by expansions and rescanned
+  uint64_t peakExpansionDepth = 0; // Most macros one token was expanded from
+  uint64_t includeCacheHits = 0;   // #include names resolved before
+  uint64_t includeCacheMisses = 0; // Looked up along the search paths
+  uint64_t expansionCacheHits = 0;   // Function macro results reused
+  uint64_t expansionCacheMisses = 0; // Not cached yet, or stale
+  uint64_t indexedSkips = 0;        // Groups skipped through a DirectiveIndex
+  uint64_t conditionCacheHits = 0;  // #if and #elif results reused
+  uint64_t includePrefetchHits = 0; // Names an IncludePrefetcher looked up
+  uint64_t tokenCacheHits = 0;      // Headers read from their cached tokens
+  uint64_t phaseNanos[kPhases] = {};
+  std::vector<Header> headers; // In order of first inclusion
+  std::vector<Macro> macros;   // Most expanded first
+
+  uint64_t tokenCount(TokenKind kind) const {
+    return tokens[static_cast<size_t>(static_cast<int>(kind) + 1)];
+  }
+
+  uint64_t tokenCount() const {
+    uint64_t total = 0;
+    for (uint64_t count : tokens)
+      total += count;
+    return total;
+  }
+
+  // Everything above as one JSON object. Token kinds never lexed are left
+  // out.
+  std::string toJson() const {
+    static const char *const phases[] = {"lex", "directive", "expand",
+                                         "output"};
+    std::string json = "{\n  \"enabled\": ";
+    json += kEnabled ? "true" : "false";
+    json += ",\n  \"tokens\": {";
+    const char *separator = "";
+    for (size_t i = 0; i < kTokenKinds; i++) {
+      if (!tokens[i])
+        continue;
+      json += separator;
+      appendString(json, tokenKindName(static_cast<TokenKind>(int(i) - 1)));
+      json += ": " + std::to_string(tokens[i]);
+      separator = ", ";
+    }
+    json += "},\n";
+    auto field = [&json](const char *name, uint64_t value) {
+      json += "  \"";
+      json += name;
+      json += "\": " + std::to_string(value) + ",\n";
+    };
+    field("skippedBytes", skippedBytes);
+    field("macroLookups", macroLookups);
+    field("macroHits", macroHits);
+    field("objectExpansions", objectExpansions);
+    field("functionExpansions", functionExpansions);
+    field("rescannedTokens", rescannedTokens);
+    field("peakExpansionDepth", peakExpansionDepth);
+    field("includeCacheHits", includeCacheHits);
+    field("includeCacheMisses", includeCacheMisses);
+    field("expansionCacheHits", expansionCacheHits);
+    field("expansionCacheMisses", expansionCacheMisses);
+    field("indexedSkips", indexedSkips);
+    field("conditionCacheHits", conditionCacheHits);
+    field("includePrefetchHits", includePrefetchHits);
+    field("tokenCacheHits", tokenCacheHits);
+    json += "  \"phaseNanos\": {";
+    for (size_t i = 0; i < kPhases; i++) {
+      json += i ? ", \"" : "\"";
+      json += phases[i];
+      json += "\": " + std::to_string(phaseNanos[i]);
+    }
+    json += "},\n  \"headers\": [";
+    separator = "\n    ";
+    for (const Header &header : headers) {
+      json += separator;
+      json += "{\"path\": ";
+      appendString(json, header.path);
+      json += ", \"entered\": " + std::to_string(header.entered) +
+              ", \"skipped\": " + std::to_string(header.skipped) +
+              ", \"bytes\": " + std::to_string(header.bytes) +
+              ", \"nanos\": " + std::to_string(header.nanos) + "}";
+      separator = ",\n    ";
+    }
+    json += headers.empty() ? "],\n" : "\n  ],\n";
+    json += "  \"macros\": [";
+    separator = "\n    ";
+    for (const Macro &macro : macros) {
+      json += separator;
+      json += "{\"name\": ";
+      appendString(json, macro.name);
+      json += ", \"expansions\": " + std::to_string(macro.expansions) + "}";
+      separator = ",\n    ";
+    }
+    json += macros.empty() ? "]\n}\n" : "\n  ]\n}\n";
+    return json;
+  }
+
+private:
+  static void appendString(std::string &json, std::string_view text) {
+    json += '"';
+    for (char c : text) {
+      if (c == '"' || c == '\\') {
+        json += '\\';
+        json += c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        char escape[8];
+        std::snprintf(escape, sizeof escape, "\\u%04x", c);
+        json += escape;
+      } else {
+        json += c;
+      }
+    }
+    json += '"';
+  }
+};
+
+// IncludeGraph: The files one translation unit reads, as found by
+// PreProcessor::scanDependencies()
+struct IncludeGraph {
+  struct File {
+    std::string path; // As opened, or "<input>" for in-memory input
+    bool system;      // Found through an -isystem directory
+  };
+  struct Edge {
+    unsigned from, to; // Indices into files
+  };
+  std::vector<File> files; // The main file first, then in order of inclusion
+  std::vector<Edge> edges; // Each distinct includer and included pair, once
+
+  // A Make rule naming every file as a prerequisite of target, the way -M
+  // writes it. Without systemHeaders, files found through -isystem are
+  // left out, as with -MM.
+  std::string depfile(std::string_view target,
+                      bool systemHeaders = true) const {
+    std::string rule;
+    appendEscaped(rule, target);
+    rule += ':';
+    size_t column = rule.size();
+    for (const File &file : files) {
+      if ((file.system && !systemHeaders) || file.path == "<input>")
+        continue;
+      if (column + file.path.size() > 76) {
+        rule += " \\\n ";
+        column = 1;
+      }
+      rule += ' ';
+      size_t before = rule.size();
+      appendEscaped(rule, file.path);
+      column += 1 + rule.size() - before;
+    }
+    rule += '\n';
+    return rule;
+  }
+
+private:
+  static void appendEscaped(std::string &out, std::string_view path) {
+    for (char c : path) {
+      if (c == ' ' || c == '\t' || c == '#')
+        out += '\\';
+      else if (c == '$')
+        out += '$';
+      out += c;
+    }
+  }
+};
+
+// ExpansionLimits: Caps on what preprocessing one input may take, for
+// inputs that cannot be trusted. 0 leaves a limit off, as it is by default.
+struct ExpansionLimits {
+  // Macros one token may be expanded from, counting invocations whose
+  // arguments are being expanded around it
+  size_t depth = 0;
+  // Tokens the macros named on one text line or in one #if may produce,
+  // rescans and arguments included
+  size_t tokens = 0;
+  uint64_t outputBytes = 0; // Written to the output, over the whole input
+  // Wall time from setExpansionLimits() or reset(), checked every
+  // kClockInterval expansions and output tokens
+  std::chrono::nanoseconds time{0};
+
+  static constexpr unsigned kClockInterval = 1024;
+};
+
+// ExpansionLimitError: Thrown when preprocessing goes past one of its
+// ExpansionLimits. what() starts with the file, line and column at fault:
+// where the expansion being made started, or the output token or cursor
+// for the byte and time limits.
+class ExpansionLimitError : public std::runtime_error {
+public:
+  enum Limit { Depth, Tokens, OutputBytes, Time };
+
+  ExpansionLimitError(Limit limit, const SourceLocation &where,
+                      const std::string &message)
+      : std::runtime_error(std::string(where.file) + ":" +
+                           std::to_string(where.line) + ":" +
+                           std::to_string(where.column) + ": " + message),
+        limit_(limit), file_(where.file), line_(where.line),
+        column_(where.column) {}
+
+  Limit limit() const { return limit_; }
+  const std::string &file() const { return file_; }
+  unsigned line() const { return line_; }
+  unsigned column() const { return column_; }
+
+private:
+  Limit limit_;
+  std::string file_;
+  unsigned line_;
+  unsigned column_;
+};
+
+// PreProcessor: The main class for the preprocessor
+class PreProcessor {
+private:
+  // Macro definitions, hide sets and expansion scratch space are carved out
+  // of this pool, which only goes to its upstream resource for whole chunks
+  // and hands everything back at once when the PreProcessor is destroyed.
+  // It is never shared, so it takes no locks.
+  std::pmr::unsynchronized_pool_resource memory_;
+  std::string source_;     // The input, owned
+  std::string_view buffer; // The text being lexed
+  unsigned cursor = 0;
+  bool leadingSpace_ = false; // Whitespace preceded the last next() token
+  // setLocationTracking() state: the table, and where buffer's range
+  // starts in it, 0 while buffer is not tracked
+  LocationTable locations_;
+  bool trackLocations_ = false;
+  uint32_t bufferLoc_ = 0;
+  uint32_t outputLoc_ = 0; // Of the token being handed to the sink
+  IdentifierTable identifiers_; // Interned identifier spellings
+  MacroTable macroTable_{&memory_}; // Object and function macros, by ID
+
+  // Macro expansion state. pending_ holds tokens waiting to be rescanned,
+  // next one at the back; the lexer is only consulted when it is empty.
+  HideSetTable hideSets_{&memory_};
+  TokenList pending_{&memory_};
+  StringArena scratchText_; // Spellings made by # and ##
+  bool pasteGuard_ = false;  // Last output came from a macro expansion
+  char lastOutput_ = '\n';   // Last character handed to the output sink
+  // Origin of the tokens being written, for sinks that want it: where the
+  // token or the name of the macro expanding started, and that macro
+  unsigned originAt_ = 0;
+  std::string_view originMacro_;
+  TokenList expansion_{&memory_}; // Substitution results, used as a stack
+  std::string spelling_;          // Scratch for # and ## spellings
+  // #if expression before and after expansion
+  TokenList condition_{&memory_}, conditionExpanded_{&memory_},
+      conditionWork_{&memory_};
+  // Open #if/#ifdef/#ifndef groups, innermost at the back
+  struct Conditional {
+    size_t includeDepth; // includes_.size() when it was opened
+    bool inElse;         // The #else group is the one being read
+    bool hadElse;        // An #else or #elif has been seen
+    bool guard;          // Opened by a possible include guard's #ifndef
+  };
+  std::pmr::vector<Conditional> conditionals_{&memory_};
+
+  // #include state. Every file entered stays in files_ until the
+  // PreProcessor goes away, since macro bodies and tokens point into it.
+  //
+  // GuardScan follows the shape of an included file that has not been
+  // scanned yet: #ifndef X as its first tokens, then nothing after the
+  // matching #endif. next() drives the states up to Open; the #ifndef
+  // handler closes it.
+  struct GuardScan {
+    enum State : unsigned char { Off, Start, SawHash, SawIfndef, Open, Closed };
+    State state = Off;
+    std::string_view macro;
+  };
+  // Tokens lex() returns reading text from the start, in order. Each was
+  // lexed from where the one before it ends, the first from 0.
+  struct PrelexView {
+    const char *text = nullptr;
+    const Token *tokens = nullptr;
+    size_t size = 0;
+    size_t at = 0; // Where the next lookup starts
+  };
+  struct IncludeFrame {
+    std::string_view buffer;
+    uint32_t bufferLoc;
+    unsigned cursor;
+    const FileEntry *file;
+    GuardScan guard;
+    PrelexView prelex;
+  };
+  static constexpr size_t kMaxIncludeDepth = 200;
+  FileCache *fileCache_ = &FileCache::shared();
+  std::vector<std::string> quoteIncludePaths_;  // -iquote
+  std::vector<std::string> includePaths_;       // -I
+  std::vector<std::string> systemIncludePaths_; // -isystem
+  std::vector<IncludeFrame> includes_;
+  std::vector<std::shared_ptr<const FileEntry>> files_;
+  std::unordered_set<const FileEntry *> entered_; // Everything in files_
+  // Resolved header names, keyed on the includer's directory for "name"
+  struct ResolvedInclude {
+    std::shared_ptr<const FileEntry> file;
+    bool system; // Found through an -isystem directory
+  };
+  std::unordered_map<std::string, ResolvedInclude> resolved_;
+  std::string includeKey_;
+  // Lookups queued with prefetcher_, keyed like resolved_, and the buffers
+  // already scanned for them; see setIncludePrefetcher()
+  IncludePrefetcher *prefetcher_ = nullptr;
+  std::unordered_map<std::string, std::shared_ptr<IncludePrefetcher::Request>>
+      prefetched_;
+  std::unordered_set<const char *> prefetchScanned_;
+  const FileEntry *currentFile_ = nullptr; // nullptr for in-memory input
+  GuardScan guard_;
+  StringArena predefined_; // Text of define() and undefine() directives
+  // What scanDependencies() has found so far; null outside a scan
+  struct DependencyScan {
+    IncludeGraph graph;
+    std::unordered_map<const FileEntry *, unsigned> index; // Into files
+    std::unordered_set<uint64_t> edges;                    // from << 32 | to
+  };
+  DependencyScan *scan_ = nullptr;
+  std::vector<size_t> *macroReads_ = nullptr; // See trackMacroReads()
+  std::function<bool(unsigned)> restartPoint_; // See onRestartPoint()
+  size_t macroChanges_ = 0;
+  // Reused function macro results. An entry is fresh while no macro it
+  // looked up has changed since: macroStamps_ holds macroChanges_ as of
+  // each ID's last #define or #undef, newNameStamp_ as of the last #define
+  // of a name never seen before. While a result is being made, memoReads_
+  // collects what it looks up, and memoLeaked_ is set if its rescan of
+  // memoWork_ would have read past the end, making it depend on context.
+  ExpansionCache expansionCache_{&memory_};
+  std::pmr::vector<size_t> macroStamps_{&memory_};
+  size_t newNameStamp_ = 0;
+  ExpansionCache::Reads *memoReads_ = nullptr;
+  bool memoReadUnknown_ = false;
+  const TokenList *memoWork_ = nullptr;
+  bool memoLeaked_ = false;
+  // #if and #elif results in files, by the address of the expression,
+  // reused while no macro they read has changed. Views into files_ keep
+  // the addresses stable.
+  struct CachedCondition {
+    explicit CachedCondition(std::pmr::memory_resource *memory)
+        : reads(memory) {}
+    // Times found stale, after which it is no longer kept up to date
+    static constexpr unsigned kMaxStale = 3;
+    unsigned stale = 0;
+    bool result = false;
+    bool readUnknown = false;
+    unsigned end = 0; // The cursor after the expression
+    size_t stamp = 0;
+    ExpansionCache::Reads reads;
+  };
+  std::pmr::unordered_map<const char *, CachedCondition> conditionCache_{
+      &memory_};
+  // See setExpansionLimits(). The counts are charged as expansions are
+  // made and output is written; off limits are the type's maximum.
+  ExpansionLimits limits_;
+  size_t depthLimit_ = std::numeric_limits<size_t>::max();
+  size_t tokenLimit_ = std::numeric_limits<size_t>::max();
+  uint64_t outputLimit_ = std::numeric_limits<uint64_t>::max();
+  std::chrono::steady_clock::time_point deadline_;
+  unsigned clockCountdown_ = ExpansionLimits::kClockInterval;
+  size_t argumentDepth_ = 0;   // expandArgument() calls running
+  size_t expansionTokens_ = 0; // Produced since expansionStart_
+  uint64_t outputBytes_ = 0;
+  unsigned expansionStart_ = 0;     // Offset in buffer of the expansion
+  std::string_view expansionName_; // Its macro, or "#if"
+  // nextBatch() state: the sink it drives, tokens one step produced past
+  // the caller's cap, and whether the next token starts a line
+  class BatchSink;
+  BatchSink *batch_ = nullptr;
+  TokenBatch batchOverflow_;
+  size_t batchOverflowHead_ = 0;
+  bool batchLineStart_ = true;
+  // Streaming input, for PreProcessor(InputSource &). The window holds
+  // whole lines of the input, from where the current step started to a
+  // little past the cursor. Within a step it only grows, and a window it
+  // outgrows is retired rather than freed, since tokens of the step may
+  // still point into it; between steps the consumed part is dropped.
+  InputSource *stream_ = nullptr;
+  size_t streamWindow_ = 0; // Size the window is topped up to
+  std::unique_ptr<char[]> window_;
+  size_t windowSize_ = 0, windowCapacity_ = 0;
+  std::vector<std::unique_ptr<char[]>> retiredWindows_;
+  std::string streamTail_;  // Read from stream_ but not a whole line yet
+  bool streamDone_ = false; // stream_ returned 0
+  unsigned streamCompactAt_ = ~0u; // Cursor offset that triggers a drop
+  uint64_t streamOffset_ = 0;      // Input bytes dropped so far
+  unsigned streamLines_ = 0;       // Line ends among them
+  StringArena streamText_; // Macro definitions read from the window
+  // Tokens for the text at prelex_.text: what lex() returns reading it
+  // from the start, in order. They are prelex() results, kept in
+  // prelexed_, or a header's FileEntry::tokens().
+  PrelexView prelex_;
+  std::vector<Token> prelexed_;
+  // Line tables for location(), per buffer, built on first use. Tables
+  // are kept over reset() so their capacity is reused.
+  mutable std::unordered_map<const char *, LinColQuery> lineTables_;
+#if defined(PP_ENABLE_STATS)
+  // Counters behind stats(). Headers are added to totals as they are
+  // first seen; macro names are only looked up when stats() is called.
+  struct StatsState {
+    using Clock = std::chrono::steady_clock;
+    PreprocessStats totals;
+    std::unordered_map<const FileEntry *, size_t> headerIndex; // Into headers
+    std::unordered_map<uint32_t, uint64_t> expansions; // By macro ID
+    std::vector<Clock::time_point> includeStarts; // Parallel to includes_
+    PreprocessStats::Phase phase = PreprocessStats::kPhases; // None running
+    Clock::time_point mark; // When phase started running
+
+    // Charge the time since mark to the phase running and start phase
+    void switchTo(PreprocessStats::Phase next) {
+      Clock::time_point now = Clock::now();
+      if (phase != PreprocessStats::kPhases)
+        totals.phaseNanos[phase] += static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now - mark)
+                .count());
+      phase = next;
+      mark = now;
+    }
+
+    PreprocessStats::Header &header(const FileEntry &file) {
+      auto found = headerIndex.emplace(&file, totals.headers.size());
+      if (found.second)
+        totals.headers.push_back({file.path()});
+      return totals.headers[found.first->second];
+    }
+  };
+  // Runs phase until the end of the scope, then resumes the phase it
+  // interrupted
+  class PhaseScope {
+  public:
+    PhaseScope(StatsState &stats, PreprocessStats::Phase phase)
+        : stats_(stats), interrupted_(stats.phase) {
+      stats.switchTo(phase);
+    }
+    ~PhaseScope() { stats_.switchTo(interrupted_); }
+
+  private:
+    StatsState &stats_;
+    PreprocessStats::Phase interrupted_;
+  };
+  mutable StatsState stats_;
+#endif
+
+  PreProcessor(std::shared_ptr<const FileEntry> file, FileCache &cache,
+               std::pmr::memory_resource *upstream)
+      : memory_(upstream), buffer(file->text()), fileCache_(&cache),
+        currentFile_(file.get()) {
+    entered_.insert(currentFile_);
+    currentFile_->noteRead();
+    files_.push_back(std::move(file));
+  }
+
+public:
+  // upstream supplies the chunks of the PreProcessor's internal pool
+  PreProcessor(std::string input, std::pmr::memory_resource *upstream =
+                                      std::pmr::get_default_resource())
+      : memory_(upstream), source_(std::move(input)), buffer(source_) {}
+
+  // Preprocess input read from source as it goes, keeping about window
+  // bytes of it in memory at a time (more only while one line, comment or
+  // macro invocation needs it). source must outlive the PreProcessor or
+  // its next reset().
+  static constexpr size_t kStreamWindow = 1 << 20;
+  explicit PreProcessor(InputSource &source, size_t window = kStreamWindow,
+                        std::pmr::memory_resource *upstream =
+                            std::pmr::get_default_resource())
+      : memory_(upstream), stream_(&source),
+        streamWindow_(std::max<size_t>(window, 1)),
+        streamCompactAt_(static_cast<unsigned>(streamWindow_ / 2)) {
+    buffer = std::string_view("", 0);
+    growWindow(streamWindow_);
+  }
+
+  // Preprocess the file at path, which is mapped read-only rather than
+  // copied. Quoted includes are looked up next to it first.
+  static PreProcessor
+  fromFile(const std::string &path, FileCache &cache = FileCache::shared(),
+           std::pmr::memory_resource *upstream =
+               std::pmr::get_default_resource()) {
+    std::shared_ptr<const FileEntry> file = cache.load(path);
+    if (!file)
+      throw std::runtime_error("'" + path + "' file not found");
+    return PreProcessor(std::move(file), cache, upstream);
+  }
+
+  // Search paths for #include, in the order -iquote, -I, -isystem. Quoted
+  // names try the including file's directory and the quote paths first.
+  void addQuoteIncludePath(std::string dir) {
+    quoteIncludePaths_.push_back(std::move(dir));
+  }
+  void addIncludePath(std::string dir) {
+    includePaths_.push_back(std::move(dir));
+  }
+  void addSystemIncludePath(std::string dir) {
+    systemIncludePaths_.push_back(std::move(dir));
+  }
+
+  // Load #included files through cache instead of FileCache::shared()
+  void setFileCache(FileCache &cache) { fileCache_ = &cache; }
+
+  // Look up the #includes of each file entered ahead of time on
+  // prefetcher's threads, and load files through its FileCache. A file is
+  // scanned when it is entered, the main file at its first #include.
+  void setIncludePrefetcher(IncludePrefetcher &prefetcher) {
+    prefetcher_ = &prefetcher;
+    fileCache_ = &prefetcher.fileCache();
+  }
+
+  // Fail with ExpansionLimitError past any of limits; see ExpansionLimits.
+  // Also restarts the clock of limits.time.
+  void setExpansionLimits(const ExpansionLimits &limits) {
+    auto orMax = [](auto limit) {
+      return limit ? limit : std::numeric_limits<decltype(limit)>::max();
+    };
+    limits_ = limits;
+    depthLimit_ = orMax(limits.depth);
+    tokenLimit_ = orMax(limits.tokens);
+    outputLimit_ = orMax(limits.outputBytes);
+    startClock();
+  }
+  const ExpansionLimits &expansionLimits() const { return limits_; }
+
+  // Keep the results of up to entries function macro invocations for
+  // reuse, ExpansionCache::kDefaultCapacity unless set. 0 turns it off.
+  void setExpansionCacheSize(size_t entries) {
+    expansionCache_.setCapacity(entries);
+  }
+
+  // Give every token a 32-bit location in locations(), from its buffer or
+  // the macro expansion that made it: nextBatch() fills TokenBatch::locs
+  // and sinks that want origins get TokenOrigin::loc. Off unless set; call
+  // before processing. Text streamed from an InputSource has no locations.
+  void setLocationTracking(bool on) {
+    expansionCache_.clear(); // Results made the other way round
+    trackLocations_ = on;
+    bufferLoc_ = 0;
+    if (on && !inWindow())
+      bufferLoc_ = locations_.addBuffer(locate(0).file, buffer);
+  }
+
+  const LocationTable &locations() const { return locations_; }
+
+  // Intern identifiers on top of table, which must not change while this
+  // PreProcessor uses it. Call before anything has been processed.
+  void setSharedIdentifiers(std::shared_ptr<const IdentifierTable> table) {
+    if (identifiers_.size() != 0)
+      throw std::runtime_error(
+          "Shared identifiers must be set before preprocessing");
+    identifiers_.reset(std::move(table));
+  }
+
+  // Freeze the macros defined so far into a snapshot other PreProcessors
+  // can start from. This PreProcessor carries on unaffected.
+  std::shared_ptr<const MacroSnapshot> snapshotMacros() const {
+    return std::make_shared<const MacroSnapshot>(identifiers_, macroTable_);
+  }
+
+  // Start from the macros in snapshot. The snapshot is shared rather than
+  // copied; later #define and #undef directives only change this
+  // PreProcessor. Call before anything has been processed.
+  void setMacroSnapshot(std::shared_ptr<const MacroSnapshot> snapshot) {
+    if (identifiers_.size() != 0)
+      throw std::runtime_error(
+          "A macro snapshot must be set before preprocessing");
+    const MacroSnapshot &frozen = *snapshot;
+    identifiers_.reset(
+        std::shared_ptr<const IdentifierTable>(snapshot, &frozen.identifiers()));
+    macroTable_.reset(
+        std::shared_ptr<const MacroTable>(std::move(snapshot), &frozen.macros()));
+  }
+
+  // Start over on input as if newly constructed, but keep the capacity
+  // built up so far: the pool, the token buffers, the line table and the
+  // hash tables. Search paths and the file cache stay as configured.
+  void reset(std::string_view input) {
+    source_.assign(input.data(), input.size());
+    buffer = source_;
+    cursor = 0;
+    locations_.clear();
+    bufferLoc_ = trackLocations_ ? locations_.addBuffer("<input>", buffer) : 0;
+    leadingSpace_ = false;
+    identifiers_.reset();
+    macroTable_.reset();
+    hideSets_.clear();
+    pending_.clear();
+    scratchText_.clear();
+    pasteGuard_ = false;
+    lastOutput_ = '\n';
+    expansion_.clear();
+    condition_.clear();
+    conditionExpanded_.clear();
+    conditionWork_.clear();
+    conditionals_.clear();
+    includes_.clear();
+    files_.clear();
+    entered_.clear();
+    resolved_.clear();
+    prefetched_.clear();
+    prefetchScanned_.clear();
+    currentFile_ = nullptr;
+    guard_ = GuardScan();
+    predefined_.clear();
+    macroChanges_ = 0;
+    expansionCache_.clear();
+    conditionCache_.clear();
+    macroStamps_.clear();
+    newNameStamp_ = 0;
+    outputBytes_ = 0;
+    startClock();
+    batchOverflow_.clear();
+    batchOverflowHead_ = 0;
+    batchLineStart_ = true;
+    stream_ = nullptr;
+    retiredWindows_.clear();
+    windowSize_ = 0; // window_ is kept for a later stream's reuse
+    streamTail_.clear();
+    streamDone_ = false;
+    streamCompactAt_ = ~0u;
+    streamOffset_ = 0;
+    streamLines_ = 0;
+    streamText_.clear();
+    prelexed_.clear();
+    prelex_ = PrelexView();
+    for (auto &table : lineTables_)
+      table.second.reset();
+    PP_STAT(stats_ = StatsState());
+  }
+
+  // Start over on input streamed from source, as if newly constructed
+  // with it
+  void reset(InputSource &source, size_t window = kStreamWindow) {
+    reset(std::string_view());
+    bufferLoc_ = 0;
+    stream_ = &source;
+    streamWindow_ = std::max<size_t>(window, 1);
+    streamCompactAt_ = static_cast<unsigned>(streamWindow_ / 2);
+    growWindow(streamWindow_);
+  }
+
+  // Start over on input from the macros in snapshot
+  void reset(std::string_view input,
+             std::shared_ptr<const MacroSnapshot> snapshot) {
+    reset(input);
+    setMacroSnapshot(std::move(snapshot));
+  }
+
+  // Define a macro the way -D does: "NAME" defines NAME as 1, "NAME=text"
+  // and "NAME(params)=text" define it as text.
+  void define(std::string_view definition) {
+    size_t eq = definition.find('=');
+    std::string line(definition.substr(0, eq));
+    line += ' ';
+    if (eq == std::string_view::npos)
+      line += '1';
+    else
+      line += definition.substr(eq + 1);
+    line += '\n';
+    runDirective(predefined_.store(line), &PreProcessor::handle_define);
+  }
+
+  // Undefine a macro the way -U does
+  void undefine(std::string_view name) {
+    std::string line(name);
+    line += '\n';
+    runDirective(predefined_.store(line), &PreProcessor::handle_undef);
+  }
+
+  // Number of #define and #undef directives run since construction or
+  // reset(), define() and undefine() included
+  size_t macroChanges() const { return macroChanges_; }
+
+  // What this PreProcessor has done since construction or reset(). All
+  // zeros unless pp.hpp was included with PP_ENABLE_STATS defined.
+  PreprocessStats stats() const {
+#if defined(PP_ENABLE_STATS)
+    PreprocessStats result = stats_.totals;
+    for (const auto &[id, count] : stats_.expansions)
+      result.macros.push_back({std::string(identifiers_.spelling(id)), count});
+    std::sort(result.macros.begin(), result.macros.end(),
+              [](const PreprocessStats::Macro &a,
+                 const PreprocessStats::Macro &b) {
+                return a.expansions != b.expansions
+                           ? a.expansions > b.expansions
+                           : a.name < b.name;
+              });
+    return result;
+#else
+    return {};
+#endif
+  }
+
+  // Call callback at every line start that run() reaches with no
+  // conditional or #include open, passing its offset in the input. Nothing
+  // but the macros carries over such a point, so preprocessing could
+  // restart there. Returning false stops preprocessing at that point. Kept
+  // over reset().
+  void onRestartPoint(std::function<bool(unsigned offset)> callback) {
+    restartPoint_ = std::move(callback);
+  }
+
+  // Add a hash of every name looked up as a macro, whether or not it is
+  // one, to reads; null stops. Kept over reset(). IncrementalPreProcessor
+  // uses this to tell which regions a changed macro can affect.
+  void trackMacroReads(std::vector<size_t> *reads) { macroReads_ = reads; }
+  static size_t macroNameHash(std::string_view name) {
+    return std::hash<std::string_view>()(name);
+  }
+
+  // Get the text content of a token as a view into the buffer. The view is
+  // valid for as long as the PreProcessor is.
+  std::string_view getTokenView(const Token &token) const {
+    if (token.begin + token.len > buffer.size()) {
+      return {};
+    }
+    return std::string_view(buffer.data() + token.begin, token.len);
+  }
+
+  // Get the text content of a token
+  std::string getTokenText(const Token &token) const {
+    return std::string(getTokenView(token));
+  }
+
+  // Where lexing has got to, for diagnostics: the file being read, or the
+  // input or define()/undefine() text, with the line and column of the
+  // cursor in it. Costs nothing until first called.
+  SourceLocation location() const { return locate(cursor); }
+
+  // Views into source_ and the macro tables make copies unsafe.
+  PreProcessor(const PreProcessor &) = delete;
+  PreProcessor &operator=(const PreProcessor &) = delete;
+
+private:
+  // location() for another offset into buffer
+  SourceLocation locate(unsigned offset) const {
+    std::string_view file = "<command line>";
+    bool streamed = inWindow();
+    if (currentFile_ && buffer.data() == currentFile_->text().data())
+      file = currentFile_->path();
+    else if (buffer.data() == source_.data() || streamed)
+      file = "<input>";
+
+    LinColQuery &table =
+        lineTables_.try_emplace(buffer.data(), buffer).first->second;
+    if (table.text().data() != buffer.data() ||
+        table.text().size() != buffer.size())
+      table.reset(buffer);
+    auto [line, column] = table.getLineCol(offset);
+    if (streamed)
+      line += streamLines_;
+    return {file, line, column};
+  }
+
+public:
+  // Get the current buffer (for testing purposes)
+  const std::string &getBuffer() const { return source_; }
+
+  // Expand macros in the input and return the result
+  std::string expandMacros() {
+    // Text lines only ever shrink or gain separating spaces, so this is
+    // usually the only allocation for macro-free input.
+    std::string result;
+    result.reserve(buffer.size() + buffer.size() / 2);
+    StringSink sink(result);
+    expandMacros(sink);
+    return result;
+  }
+
+  // Expand macros in the input, streaming the result to out
+  void expandMacros(OutputSink &out) {
+    processAndExpand(out);
+    out.flush();
+  }
+
+  void processAndExpand(OutputSink &result) { run(&result); }
+
+  // Tokenize the input buffer
+  Token next() {
+    Token token = lex();
+    PP_STAT(stats_.totals.tokens[static_cast<int>(token.kind) + 1]++);
+    if (guard_.state != GuardScan::Off)
+      trackGuard(token);
+    return token;
+  }
+
+  // Process the buffer and handle preprocessor directives
+  void process() { run(nullptr); }
+
+  // Pull-based alternative to expandMacros(): replace out's contents with
+  // the next fully expanded tokens, at most cap of them, and return how
+  // many there are; 0 once the input is exhausted. Line ends are not
+  // tokens but set StartOfLine on the token after them, and LeadingSpace
+  // only reflects the source, without the spaces expandMacros() adds to
+  // keep tokens apart. A #pragma other than once passes through as '#',
+  // "pragma" and the rest of its line as one Unknown token.
+  //
+  // The texts point into the input and included files, which last as long
+  // as the PreProcessor, or for spellings made by # and ## into scratch
+  // space the next call may reuse.
+  size_t nextBatch(TokenBatch &out, size_t cap) {
+    PP_STAT(PhaseScope phase(stats_, PreprocessStats::Lex));
+    out.clear();
+    size_t left = batchOverflow_.size() - batchOverflowHead_;
+    if (left == 0) {
+      batchOverflow_.clear();
+      batchOverflowHead_ = 0;
+      scratchText_.clear();
+      expansionCache_.releaseRetired();
+      if (cursor >= streamCompactAt_)
+        compactWindow(); // The last batch may have pointed into it
+    }
+    for (; out.size() < cap && batchOverflowHead_ < batchOverflow_.size();
+         batchOverflowHead_++) {
+      out.push(batchOverflow_.kinds[batchOverflowHead_],
+               batchOverflow_.texts[batchOverflowHead_],
+               batchOverflow_.flags[batchOverflowHead_]);
+      if (batchOverflowHead_ < batchOverflow_.locs.size())
+        out.locs.push_back(batchOverflow_.locs[batchOverflowHead_]);
+    }
+
+    BatchSink sink(*this, out, cap);
+    batch_ = &sink;
+    try {
+      while (out.size() < cap && step(&sink, false)) {
+      }
+    } catch (...) {
+      batch_ = nullptr;
+      throw;
+    }
+    batch_ = nullptr;
+    return out.size();
+  }
+
+  // Tokenize the input up front on up to threads threads (0 for one per
+  // core), so that preprocessing it only looks tokens up. Worth it for a
+  // single large file; smaller inputs, and streamed ones, are left alone.
+  // The text is cut at line starts into a chunk per thread. Where a comment
+  // or string literal runs over a cut, the next chunk's tokens are wrong
+  // until they meet up with the ones before again, and that stretch is
+  // lexed once more here. Call before processing.
+  static constexpr size_t kPrelexChunk = 256 * 1024; // Least bytes a thread
+  void prelex(unsigned threads = 0) {
+    if (stream_ || includes_.size() || buffer.size() < 2 * kPrelexChunk)
+      return;
+    if (threads == 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t chunks = std::min<size_t>(threads, buffer.size() / kPrelexChunk);
+    const char *text = buffer.data();
+    std::vector<unsigned> cuts{0};
+    for (size_t i = 1; i < chunks; i++) {
+      size_t at = buffer.find('\n', std::max<size_t>(
+                                         cuts.back(), buffer.size() * i / chunks));
+      if (at == std::string_view::npos)
+        break;
+      cuts.push_back(static_cast<unsigned>(at + 1));
+    }
+    cuts.push_back(static_cast<unsigned>(buffer.size()));
+
+    // A chunk that fails to lex, say on a token too long for Token, or
+    // whose thread cannot be started, leaves the whole input to be lexed
+    // as it is read, which raises any error where it belongs
+    std::vector<std::vector<Token>> lexed(cuts.size() - 1);
+    std::vector<std::exception_ptr> errors(lexed.size());
+    std::vector<std::thread> workers;
+    workers.reserve(lexed.size() - 1);
+    for (size_t i = 1; i < lexed.size(); i++) {
+      try {
+        workers.emplace_back([&, i] {
+          try {
+            PreProcessor lexer(buffer, Lexer());
+            lexed[i].reserve((cuts[i + 1] - cuts[i]) / 3);
+            lexer.lexRange(cuts[i], cuts[i + 1], lexed[i]);
+          } catch (...) {
+            errors[i] = std::current_exception();
+          }
+        });
+      } catch (...) {
+        errors[i] = std::current_exception();
+        break;
+      }
+    }
+    prelexed_.clear();
+    prelex_ = PrelexView();
+    unsigned savedCursor = cursor;
+    bool savedSpace = leadingSpace_;
+    try {
+      lexed[0].reserve(buffer.size() / 3); // Becomes the whole table
+      lexRange(cuts[0], cuts[1], lexed[0]);
+    } catch (...) {
+      errors[0] = std::current_exception();
+    }
+    for (std::thread &worker : workers)
+      worker.join();
+    std::vector<Token> tokens;
+    bool lexedAll =
+        std::none_of(errors.begin(), errors.end(),
+                     [](const std::exception_ptr &e) { return e != nullptr; });
+    if (lexedAll) {
+      try {
+        tokens = stitchPrelexed(lexed, cuts);
+      } catch (...) {
+        lexedAll = false;
+      }
+    }
+    cursor = savedCursor;
+    leadingSpace_ = savedSpace;
+    if (!lexedAll)
+      return;
+    prelexed_ = std::move(tokens);
+    prelex_ = {text, prelexed_.data(), prelexed_.size(), 0};
+  }
+
+  // Tokens prelex() made, 0 if it left the input alone
+  size_t prelexedTokens() const { return prelexed_.size(); }
+
+  // Find every file the input includes, the way -M does, without
+  // producing any output. Conditionals, #define and #undef are evaluated
+  // as usual, but text lines are never tokenized past their first token or
+  // expanded: the scanner jumps straight to the next directive.
+  IncludeGraph scanDependencies() {
+    DependencyScan scan;
+    scan.graph.files.push_back(
+        {currentFile_ ? currentFile_->path() : "<input>", false});
+    if (currentFile_)
+      scan.index.emplace(currentFile_, 0);
+    scan_ = &scan;
+    try {
+      run(nullptr, true);
+    } catch (...) {
+      scan_ = nullptr;
+      throw;
+    }
+    scan_ = nullptr;
+    return std::move(scan.graph);
+  }
+
+private:
+  // The one driver loop behind process(), processAndExpand() and
+  // scanDependencies(). Text is expanded into out, dropped when out is
+  // null, or with skipText not even read; directives run the same either
+  // way. Open conditionals live on conditionals_, not on the C stack, so
+  // nesting depth costs nothing but a frame each.
+  void run(OutputSink *out, bool skipText = false) {
+    PP_STAT(PhaseScope phase(stats_, PreprocessStats::Lex));
+    while (step(out, skipText)) {
+    }
+  }
+
+  // One turn of the driver loop: a directive, a line end or a text token
+  // with everything its expansion reads. False once preprocessing stops.
+  bool step(OutputSink *out, bool skipText) {
+    if (cursor >= streamCompactAt_ && !batch_)
+      compactWindow();
+    Token token = next();
+    switch (token.kind) {
+    case TokenKind::Hash:
+      handle_directive(next().kind, out);
+      break;
+    case TokenKind::Unknown: // Newline
+      if (out)
+        writeNewline(*out);
+      if (restartPoint_ && isNewline(token) && conditionals_.empty() &&
+          includes_.empty() && !restartPoint_(cursor))
+        return false;
+      break;
+    case TokenKind::T_EOF:
+      if (atEnd()) {
+        if (!conditionals_.empty()) {
+          conditionals_.clear();
+          throw std::runtime_error("unterminated #if");
+        }
+        return false;
+      }
+      break;
+    default:
+      // Expand macros, or copy the token through with its source spacing
+      if (out)
+        emitExpanded(token, *out);
+      else if (skipText)
+        skipToDirective();
+      break;
+    }
+    return true;
+  }
+
+  // Run the directive whose name has just been read. Unknown directives
+  // are ignored.
+  void handle_directive(TokenKind kind, OutputSink *out) {
+    PP_STAT(PhaseScope phase(stats_, PreprocessStats::Directive));
+    switch (kind) {
+    case TokenKind::Include:
+      handle_include();
+      break;
+    case TokenKind::Define:
+      handle_define();
+      break;
+    case TokenKind::Undef:
+      handle_undef();
+      break;
+    case TokenKind::If:
+      openConditional(evaluate_condition(), false);
+      break;
+    case TokenKind::IfDef:
+    case TokenKind::IfNDef: {
+      bool guardCandidate = guard_.state == GuardScan::SawIfndef;
+      bool negate = kind == TokenKind::IfNDef;
+      openConditional((read_ifdef_name() != nullptr) != negate,
+                      guardCandidate);
+      break;
+    }
+    case TokenKind::Elif:
+    case TokenKind::Else:
+      handle_else(kind);
+      break;
+    case TokenKind::Endif:
+      if (!openInThisFile())
+        throw std::runtime_error("#endif without #if");
+      closeConditional();
+      break;
+    case TokenKind::Pragma:
+      handle_pragma(out);
+      break;
+    default:
+      break;
+    }
+  }
+
+  // Push a conditional whose directive line has been read, and skip to
+  // the group that is taken when taken is false.
+  void openConditional(bool taken, bool guard) {
+    conditionals_.push_back({includes_.size(), false, false, guard});
+    if (taken)
+      return;
+    while (true) {
+      TokenKind end = skipConditionalBlock(true);
+      if (end == TokenKind::Elif) {
+        conditionals_.back().hadElse = true;
+        if (evaluate_condition())
+          return;
+      } else if (end == TokenKind::Else) {
+        conditionals_.back().hadElse = true;
+        conditionals_.back().inElse = true;
+        return;
+      } else {
+        if (end == TokenKind::Endif)
+          closeConditional();
+        return; // At the end of the buffer, which reports the group
+      }
+    }
+  }
+
+  // #else or #elif reached while reading a taken group: the rest of the
+  // conditional is skipped, a group at a time, so that an #else or #elif
+  // after its #else is caught whichever group was taken.
+  void handle_else(TokenKind kind) {
+    if (!openInThisFile())
+      throw std::runtime_error(kind == TokenKind::Else ? "#else without #if"
+                                                       : "#elif without #if");
+    Conditional &current = conditionals_.back();
+    bool afterElse = current.inElse;
+    current.hadElse = true;
+    while (kind == TokenKind::Else || kind == TokenKind::Elif) {
+      if (afterElse)
+        throw std::runtime_error(kind == TokenKind::Else ? "#else after #else"
+                                                         : "#elif after #else");
+      afterElse = kind == TokenKind::Else;
+      kind = skipConditionalBlock(true);
+    }
+    if (kind == TokenKind::Endif)
+      closeConditional();
+  }
+
+  // Is the innermost conditional one the current file opened? A header's
+  // #else, #elif and #endif never reach those of its includer.
+  bool openInThisFile() const {
+    return !conditionals_.empty() &&
+           conditionals_.back().includeDepth == includes_.size();
+  }
+
+  // Pop the innermost conditional at its #endif. A guard candidate with no
+  // #else leaves the scan waiting to see whether the file ends here.
+  void closeConditional() {
+    Conditional closed = conditionals_.back();
+    conditionals_.pop_back();
+    if (closed.guard) {
+      guard_.state = guard_.state == GuardScan::Open && !closed.hadElse
+                         ? GuardScan::Closed
+                         : GuardScan::Off;
+    }
+  }
+
+  Token lex() {
+    if (prelex_.text == buffer.data() && prelex_.text) {
+      if (const Token *token = findPrelexed()) {
+        leadingSpace_ = token->begin != cursor;
+        cursor = token->begin + token->len;
+        return *token;
+      }
+    }
+    unsigned entry = cursor;
+    skip_whitespace_and_comments();
+    leadingSpace_ = cursor != entry;
+
+    if (cursor >= buffer.size()) {
+      if (!includes_.empty() && buffer.data() == currentFile_->text().data()) {
+        exitInclude();
+        return lex();
+      }
+      if (inWindow() && growWindow(std::max(streamWindow_, windowSize_)))
+        return lex();
+      return {cursor, 0, TokenKind::T_EOF};
+    }
+
+    unsigned start = cursor;
+    char c = buffer[cursor];
+
+    // Newline
+    if (c == '\n') {
+      cursor++;
+      return {start, 1, TokenKind::Unknown};
+    }
+
+    // Identifier or Keyword
+    if (pp_detail::hasClass(c, pp_detail::CC_IdentStart)) {
+      const char *data = buffer.data();
+      const unsigned size = static_cast<unsigned>(buffer.size());
+      cursor++;
+      while (cursor < size &&
+             pp_detail::hasClass(data[cursor], pp_detail::CC_IdentBody)) {
         cursor++;
-      } else if (cursor < buffer.size() && buffer[cursor] == ')') {
+      }
+      return {start, cursor - start,
+              pp_detail::lookupKeyword(data + start, cursor - start)};
+    }
+
+    // PPNumber - C preprocessor number parsing
+    if (pp_detail::hasClass(c, pp_detail::CC_Digit) ||
+        (c == '.' && cursor + 1 < buffer.size() &&
+         pp_detail::hasClass(buffer[cursor + 1], pp_detail::CC_Digit))) {
+      return parsePPNumber(start);
+    }
+
+    // String Literal
+    if (c == '"') {
+      cursor++;
+      while (cursor < buffer.size() && buffer[cursor] != '"') {
+        if (buffer[cursor] == '\\')
+          cursor++; // Skip escaped characters
         cursor++;
-        break;
       }
+      if (cursor < buffer.size())
+        cursor++; // Skip closing quote
+      else if (inWindow() && growWindow(std::max(streamWindow_, windowSize_)))
+        return lexAgain(start); // Runs on past the window
+      return {start, cursor - start, TokenKind::StringLiteral};
     }
 
-    // Read the replacement text
-    std::string replacement = read_line();
+    // Character constant. An unterminated one stops at the end of the line.
+    if (c == '\'') {
+      cursor++;
+      while (cursor < buffer.size() && buffer[cursor] != '\'' &&
+             buffer[cursor] != '\n') {
+        if (buffer[cursor] == '\\' && cursor + 1 < buffer.size())
+          cursor++; // Skip escaped characters
+        cursor++;
+      }
+      if (cursor < buffer.size() && buffer[cursor] == '\'')
+        cursor++; // Skip closing quote
+      return {start, cursor - start, TokenKind::CharLiteral};
+    }
 
-    // Store the function macro
-    functionMacros[macroName] = parameters;
-    // Store replacement text separately for function macros
-    functionMacroReplacements[macroName] = replacement;
+    return lexPunctuator(start, c);
   }
 
-  std::string read_line() {
-    std::string line;
-    while (cursor < buffer.size() && buffer[cursor] != '\n') {
-      line += buffer[cursor];
+  // Lex the punctuator starting with c at start, dispatching on its first
+  // byte through pp_detail::kPunctTable. Unlisted bytes yield Unknown.
+  Token lexPunctuator(unsigned start, char c) {
+    const pp_detail::PunctRule &rule =
+        pp_detail::kPunctTable.rules[static_cast<unsigned char>(c)];
+    cursor++;
+    char n = cursor < buffer.size() ? buffer[cursor] : '\0';
+
+    if (c == '-' && n == '>') {
+      cursor++;
+      return {start, 2, TokenKind::Arrow};
+    }
+    if (c == '.') {
+      if (n == '.' && cursor + 1 < buffer.size() && buffer[cursor + 1] == '.') {
+        cursor += 2;
+        return {start, 3, TokenKind::Ellipsis};
+      }
+      return {start, 1, TokenKind::Dot};
+    }
+    if (n == c && rule.doubled != TokenKind::Unknown) {
       cursor++;
+      if (rule.doubledEqual != TokenKind::Unknown && cursor < buffer.size() &&
+          buffer[cursor] == '=') {
+        cursor++;
+        return {start, 3, rule.doubledEqual};
+      }
+      return {start, 2, rule.doubled};
+    }
+    if (n == '=' && rule.withEqual != TokenKind::Unknown) {
+      cursor++;
+      return {start, 2, rule.withEqual};
     }
-    // Trim trailing whitespace
-    while (!line.empty() && std::isspace(line.back())) {
-      line.pop_back();
+    return {start, 1, rule.single};
+  }
+
+  void skip_whitespace_and_comments() {
+    const char *data = buffer.data();
+    size_t size = buffer.size();
+    while (cursor < size) {
+      if (pp_detail::isHorizontalSpace(
+              static_cast<unsigned char>(data[cursor]))) {
+        cursor = static_cast<unsigned>(
+            pp_detail::skipHorizontalSpace(data, cursor + 1, size));
+        continue;
+      }
+      if (data[cursor] != '/' || cursor + 1 >= size)
+        break;
+      // Single-line comment
+      if (data[cursor + 1] == '/') {
+        cursor = static_cast<unsigned>(
+            pp_detail::findNewline(data, cursor + 2, size));
+        continue;
+      }
+      // Multi-line comment
+      if (data[cursor + 1] == '*') {
+        cursor += 2;
+        size_t end = pp_detail::findBlockCommentEnd(data, cursor, size);
+        // A comment running past the window is scanned again once it has
+        // grown, which at least doubles it each time.
+        while (end >= size && inWindow() &&
+               growWindow(std::max(streamWindow_, windowSize_))) {
+          data = buffer.data();
+          size = buffer.size();
+          end = pp_detail::findBlockCommentEnd(data, cursor, size);
+        }
+        if (end < size) {
+          cursor = static_cast<unsigned>(end + 2);
+        } else if (cursor + 1 < size) {
+          // Unterminated: stop on the last byte, as the byte loop did.
+          cursor = static_cast<unsigned>(size - 1);
+        }
+        continue;
+      }
+      break;
     }
-    return line;
   }
 
-  bool evaluate_condition(const std::string &condition) {
-    // Simple condition evaluation
-    std::string trimmed = condition;
+  // #include "name" or #include <name>. The header name is read as raw
+  // text, so <sys/stat.h> is not split into tokens.
+  void handle_include() {
+    if (prefetcher_ && !inWindow() &&
+        prefetchScanned_.insert(buffer.data()).second)
+      prefetchIncludes(cursor);
+    char open;
+    std::string_view name;
+    if (!readHeaderName(open, name))
+      throw std::runtime_error("Expected a header name after #include");
+
+    setIncludeKey(open, name);
+    auto it = resolved_.find(includeKey_);
+    PP_STAT(it == resolved_.end() ? stats_.totals.includeCacheMisses++
+                                  : stats_.totals.includeCacheHits++);
+    if (it == resolved_.end()) {
+      bool system = false;
+      std::shared_ptr<const FileEntry> found;
+      auto prefetched = prefetched_.find(includeKey_);
+      if (prefetched != prefetched_.end()) {
+        PP_STAT(stats_.totals.includePrefetchHits++);
+        found = prefetcher_->wait(*prefetched->second, system);
+        prefetched_.erase(prefetched);
+      } else {
+        found = findInclude(std::string(name), open == '"', system);
+      }
+      if (!found)
+        throw std::runtime_error("'" + std::string(name) +
+                                 "' file not found");
+      it = resolved_.emplace(includeKey_, ResolvedInclude{std::move(found),
+                                                          system})
+               .first;
+    }
+    const std::shared_ptr<const FileEntry> &file = it->second.file;
+    if (scan_)
+      recordInclude(*file, it->second.system);
+
+    // Multiple-include optimisation: skip the file without lexing it.
+    if ((file->pragmaOnce() && entered_.count(file.get())) ||
+        (!file->guardMacro().empty() && findMacro(file->guardMacro()))) {
+      PP_STAT(stats_.header(*file).skipped++);
+      return;
+    }
+    enterInclude(file);
+  }
 
-    // Remove leading/trailing whitespace
-    size_t start = trimmed.find_first_not_of(" \t");
-    if (start == std::string::npos)
+  // Read a "name" or <name> header name from the cursor, leaving the
+  // cursor at the end of the line. False, with the cursor unmoved past the
+  // whitespace, if there is none.
+  bool readHeaderName(char &open, std::string_view &name) {
+    skip_whitespace_and_comments();
+    open = cursor < buffer.size() ? buffer[cursor] : '\0';
+    char close = open == '<' ? '>' : '"';
+    size_t end = std::string_view::npos;
+    if (open == '"' || open == '<')
+      end = buffer.find_first_of(std::string_view(&close, 1), cursor + 1);
+    size_t eol = pp_detail::findNewline(buffer.data(), cursor, buffer.size());
+    if (end == std::string_view::npos || end > eol)
       return false;
+    name = buffer.substr(cursor + 1, end - cursor - 1);
+    cursor = static_cast<unsigned>(eol);
+    return true;
+  }
 
-    size_t end = trimmed.find_last_not_of(" \t");
-    trimmed = trimmed.substr(start, end - start + 1);
+  // The same spelling from the same directory always names the same file
+  // within one translation unit, so resolved_ is keyed on both.
+  void setIncludeKey(char open, std::string_view name) {
+    includeKey_.clear();
+    if (open == '"' && currentFile_)
+      includeKey_ += currentFile_->directory();
+    includeKey_ += open;
+    includeKey_ += name;
+  }
 
-    // Check for "defined(MACRO)" syntax first
-    if (trimmed.find("defined(") == 0 && trimmed.back() == ')') {
-      std::string macroName = trimmed.substr(8, trimmed.length() - 9);
-      return macros.find(macroName) != macros.end() ||
-             functionMacros.find(macroName) != functionMacros.end();
+  // Queue a prefetcher_ lookup for each #include line in the buffer from
+  // pos on whose name is not resolved or queued yet. Names in groups that
+  // turn out not to be taken are looked up too; only the time is lost.
+  // The cursor is left as it was.
+  void prefetchIncludes(size_t pos) {
+    unsigned saved = cursor;
+    // With the cursor just past the name of an #include
+    auto queue = [&] {
+      char open;
+      std::string_view name;
+      if (!readHeaderName(open, name))
+        return;
+      setIncludeKey(open, name);
+      if (resolved_.count(includeKey_) || prefetched_.count(includeKey_))
+        return;
+      std::vector<std::string> candidates;
+      size_t systemFrom = ~size_t(0);
+      forEachIncludeCandidate(name, open == '"', [&](const std::string &path,
+                                                     bool system) {
+        if (system)
+          systemFrom = std::min(systemFrom, candidates.size());
+        candidates.push_back(path);
+        return false;
+      });
+      prefetched_.emplace(includeKey_, prefetcher_->prefetch(
+                                           std::move(candidates), systemFrom));
+    };
+    const DirectiveIndex *index =
+        currentFile_ && buffer.data() == currentFile_->text().data()
+            ? currentFile_->builtDirectiveIndex()
+            : nullptr;
+    if (index) {
+      for (const DirectiveIndex::Entry &entry : index->entries)
+        if (entry.kind == TokenKind::Include && entry.nameEnd >= pos) {
+          cursor = entry.nameEnd;
+          queue();
+        }
+    } else {
+      for (size_t hash = findDirective(pos, pos == 0); hash < buffer.size();
+           hash = findDirective(cursor, false))
+        if (readDirectiveName(hash) == TokenKind::Include)
+          queue();
     }
+    cursor = saved;
+  }
 
-    // Expand macros in the condition before evaluation
-    std::string expandedCondition = expandMacrosInCondition(trimmed);
+  // Look name up along the search paths; system is set when it is found
+  // through an -isystem directory.
+  std::shared_ptr<const FileEntry> findInclude(const std::string &name,
+                                               bool quoted, bool &system) {
+    std::shared_ptr<const FileEntry> file;
+    forEachIncludeCandidate(name, quoted, [&](const std::string &path,
+                                              bool fromSystem) {
+      system = fromSystem;
+      return (file = fileCache_->load(path)) != nullptr;
+    });
+    return file;
+  }
 
-    // Check if it's a number after expansion
-    if (!expandedCondition.empty() &&
-        (std::isdigit(expandedCondition[0]) || expandedCondition[0] == '-' || 
-         (expandedCondition.length() > 2 && expandedCondition[0] == '0' && 
-          (expandedCondition[1] == 'x' || expandedCondition[1] == 'X')))) {
-      try {
-        int value;
-        if (expandedCondition.length() > 2 && expandedCondition[0] == '0' && 
-            (expandedCondition[1] == 'x' || expandedCondition[1] == 'X')) {
-          // Hexadecimal number
-          value = std::stoi(expandedCondition, nullptr, 16);
-        } else if (expandedCondition[0] == '0' && expandedCondition.length() > 1 && 
-                   std::isdigit(expandedCondition[1])) {
-          // Octal number
-          value = std::stoi(expandedCondition, nullptr, 8);
-        } else {
-          // Decimal number
-          value = std::stoi(expandedCondition, nullptr, 10);
-        }
-        return value != 0;
-      } catch (...) {
-        return false;
-      }
+  // Call visit(path, system) with each path the search for name tries, in
+  // order, until it returns true
+  template <class Visit>
+  void forEachIncludeCandidate(std::string_view name, bool quoted,
+                               Visit visit) const {
+    std::string path;
+    if (!name.empty() && (name[0] == '/' || name[0] == '\\')) {
+      path.assign(name.data(), name.size());
+      visit(path, false);
+      return;
     }
+    auto tryDir = [&](std::string_view dir, bool system) {
+      path.assign(dir.data(), dir.size());
+      if (!path.empty() && path.back() != '/' && path.back() != '\\')
+        path += '/';
+      path += name;
+      return visit(path, system);
+    };
+    if (quoted) {
+      if (tryDir(currentFile_ ? currentFile_->directory() : "", false))
+        return;
+      for (const std::string &dir : quoteIncludePaths_)
+        if (tryDir(dir, false))
+          return;
+    }
+    for (const std::string &dir : includePaths_)
+      if (tryDir(dir, false))
+        return;
+    for (const std::string &dir : systemIncludePaths_)
+      if (tryDir(dir, true))
+        return;
+  }
 
-    // If it's still an identifier after expansion, it's undefined (false)
-    return false;
+  // Add the edge from the current file to file, and file itself when it
+  // is new, to the graph being scanned
+  void recordInclude(const FileEntry &file, bool system) {
+    IncludeGraph &graph = scan_->graph;
+    auto found = scan_->index.emplace(
+        &file, static_cast<unsigned>(graph.files.size()));
+    if (found.second)
+      graph.files.push_back({file.path(), system});
+    unsigned from = currentFile_ ? scan_->index.at(currentFile_) : 0;
+    unsigned to = found.first->second;
+    if (scan_->edges.insert(uint64_t(from) << 32 | to).second)
+      graph.edges.push_back({from, to});
+  }
+
+  // True once the main file and every file it included are exhausted
+  bool atEnd() const { return cursor >= buffer.size() && includes_.empty(); }
+
+  // Move the cursor to the next directive for scanDependencies(). In a
+  // streaming window that runs out first, stop where the scan can pick up
+  // again once lex() has read on, so a comment is never entered halfway.
+  void skipToDirective() {
+    size_t resume;
+    size_t pos = findDirective(cursor, false, &resume);
+    if (pos >= buffer.size() && inWindow() &&
+        !(streamDone_ && streamTail_.empty()))
+      pos = resume;
+    cursor = static_cast<unsigned>(pos);
   }
 
-  void skip_until_else_or_endif() {
-    int depth = 1;
+  // Streaming input
 
-    while (cursor < buffer.size() && depth > 0) {
-      Token token = next();
+  // The buffer being read is the streaming window
+  bool inWindow() const {
+    return stream_ && window_ && buffer.data() == window_.get();
+  }
 
-      if (token.kind == TokenKind::Hash) {
-        Token directive = next();
-        if (directive.kind == TokenKind::If) {
-          depth++;
-        } else if (directive.kind == TokenKind::Endif) {
-          depth--;
-        } else if (directive.kind == TokenKind::Else && depth == 1) {
-          return; // Found matching else
-        }
+  // Append at least atLeast more bytes of the input to the window, ending
+  // just after a line end unless the input ends first. False if nothing
+  // was left. Existing text never moves: a window that fills up is
+  // replaced by a larger one and retired.
+  bool growWindow(size_t atLeast) {
+    if (!stream_)
+      return false;
+    size_t lineEnd = streamTail_.rfind('\n') + 1; // 0 without one
+    while (!streamDone_ && lineEnd < atLeast) {
+      size_t from = streamTail_.size();
+      size_t want = std::max<size_t>(atLeast - std::min(atLeast, from), 4096);
+      streamTail_.resize(from + want);
+      size_t got = stream_->read(&streamTail_[from], want);
+      streamTail_.resize(from + got);
+      if (got == 0)
+        streamDone_ = true;
+      size_t last = std::string_view(streamTail_).substr(from).rfind('\n');
+      if (last != std::string_view::npos)
+        lineEnd = from + last + 1;
+    }
+    size_t take = streamDone_ ? streamTail_.size() : lineEnd;
+    if (take == 0)
+      return false;
+
+    if (windowSize_ + take > windowCapacity_) {
+      size_t capacity = std::max(windowSize_ + take, windowCapacity_ * 2);
+      std::unique_ptr<char[]> grown(new char[capacity]);
+      if (windowSize_)
+        std::memcpy(grown.get(), window_.get(), windowSize_);
+      if (window_) {
+        lineTables_.erase(window_.get());
+        retiredWindows_.push_back(std::move(window_));
       }
+      window_ = std::move(grown);
+      windowCapacity_ = capacity;
     }
+    std::memcpy(window_.get() + windowSize_, streamTail_.data(), take);
+    windowSize_ += take;
+    streamTail_.erase(0, take);
+    buffer = std::string_view(window_.get(), windowSize_);
+    return true;
   }
 
-  void skip_until_endif() {
-    int depth = 1;
+  // Forget the first keep bytes of the window, and every retired window.
+  // Moves the rest of the text, so nothing may point into it.
+  void dropWindowPrefix(size_t keep) {
+    retiredWindows_.clear();
+    if (keep == 0)
+      return;
+    char *data = window_.get();
+    streamLines_ += static_cast<unsigned>(std::count(data, data + keep, '\n'));
+    streamOffset_ += keep;
+    std::memmove(data, data + keep, windowSize_ - keep);
+    windowSize_ -= keep;
+    cursor -= static_cast<unsigned>(keep);
+    lineTables_.erase(data);
+    buffer = std::string_view(data, windowSize_);
+  }
 
-    while (cursor < buffer.size() && depth > 0) {
-      Token token = next();
+  // Between steps, when nothing points into the window: drop the part
+  // already read and top it back up
+  void compactWindow() {
+    if (!inWindow())
+      return; // Reading an included file; the window waits
+    dropWindowPrefix(cursor);
+    if (windowSize_ < streamWindow_)
+      growWindow(streamWindow_ - windowSize_);
+  }
 
-      if (token.kind == TokenKind::Hash) {
-        Token directive = next();
-        if (directive.kind == TokenKind::If) {
-          depth++;
-        } else if (directive.kind == TokenKind::Endif) {
-          depth--;
-        }
+  // Run a directive handler over text instead of the input
+  void runDirective(std::string_view text, void (PreProcessor::*handler)()) {
+    PP_STAT(PhaseScope phase(stats_, PreprocessStats::Directive));
+    std::string_view savedBuffer = buffer;
+    unsigned savedCursor = cursor;
+    uint32_t savedLoc = bufferLoc_;
+    buffer = text;
+    cursor = 0;
+    if (trackLocations_)
+      bufferLoc_ = locations_.addBuffer("<command line>", text);
+    (this->*handler)();
+    buffer = savedBuffer;
+    cursor = savedCursor;
+    bufferLoc_ = savedLoc;
+  }
+
+  // Continue lexing in file; next() returns here once it is exhausted.
+  void enterInclude(const std::shared_ptr<const FileEntry> &file) {
+    if (includes_.size() >= kMaxIncludeDepth)
+      throw std::runtime_error("#include nested too deeply");
+    includes_.push_back(
+        {buffer, bufferLoc_, cursor, currentFile_, guard_, prelex_});
+    currentFile_ = file.get();
+    buffer = file->text();
+    cursor = 0;
+    if (trackLocations_)
+      bufferLoc_ = locations_.addBuffer(file->path(), buffer);
+    guard_ = GuardScan();
+    if (!file->guardScanned())
+      guard_.state = GuardScan::Start;
+    if (entered_.insert(file.get()).second)
+      files_.push_back(file);
+    prelex_ = PrelexView();
+    if (file->noteRead() >= kTokenCacheReads || file->hasTokens())
+      readCachedTokens(*file);
+    if (prefetcher_ && prefetchScanned_.insert(buffer.data()).second)
+      prefetchIncludes(0);
+    PP_STAT(PreprocessStats::Header &header = stats_.header(*file));
+    PP_STAT(header.entered++, header.bytes += file->text().size());
+    PP_STAT(stats_.includeStarts.push_back(StatsState::Clock::now()));
+  }
+
+  void exitInclude() {
+    // A file must close the conditionals it opens
+    if (openInThisFile())
+      throw std::runtime_error("unterminated #if in '" +
+                               std::string(currentFile_->path()) + "'");
+    if (guard_.state == GuardScan::Closed)
+      currentFile_->setGuard(guard_.macro);
+    else
+      currentFile_->setNoGuard();
+    PP_STAT(stats_.header(*currentFile_).nanos += static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    StatsState::Clock::now() - stats_.includeStarts.back())
+                    .count()));
+    PP_STAT(stats_.includeStarts.pop_back());
+
+    const IncludeFrame &frame = includes_.back();
+    buffer = frame.buffer;
+    bufferLoc_ = frame.bufferLoc;
+    cursor = frame.cursor;
+    currentFile_ = frame.file;
+    guard_ = frame.guard;
+    prelex_ = frame.prelex;
+    includes_.pop_back();
+  }
+
+  // Read file, being entered, through its FileEntry::tokens(): lexed in
+  // full once it is read a second time, by this PreProcessor or any other
+  // sharing the FileCache, so that later reads only look tokens up
+  static constexpr unsigned kTokenCacheReads = 2;
+  void readCachedTokens(const FileEntry &file) {
+    std::string_view text = file.text();
+    if (text.size() > std::numeric_limits<uint32_t>::max())
+      return;
+    const std::vector<Token> &tokens = file.tokens([text] {
+      PreProcessor lexer(text, Lexer());
+      std::vector<Token> lexed;
+      lexed.reserve(text.size() / 4);
+      lexer.lexRange(0, static_cast<unsigned>(text.size()), lexed);
+      lexed.shrink_to_fit();
+      return lexed;
+    });
+    prelex_ = {text.data(), tokens.data(), tokens.size(), 0};
+    PP_STAT(stats_.totals.tokenCacheHits++);
+  }
+
+  // Advance the guard scan past token. Only the leading "# ifndef X" and
+  // anything after the guard's #endif matter; line ends never do.
+  void trackGuard(const Token &token) {
+    if (token.kind == TokenKind::T_EOF || isNewline(token))
+      return;
+    switch (guard_.state) {
+    case GuardScan::Start:
+      guard_.state =
+          token.kind == TokenKind::Hash ? GuardScan::SawHash : GuardScan::Off;
+      break;
+    case GuardScan::SawHash:
+      guard_.state = token.kind == TokenKind::IfNDef ? GuardScan::SawIfndef
+                                                     : GuardScan::Off;
+      break;
+    case GuardScan::SawIfndef:
+      if (isIdentifierLike(token.kind)) {
+        guard_.state = GuardScan::Open;
+        guard_.macro = getTokenView(token);
+      } else {
+        guard_.state = GuardScan::Off;
       }
+      break;
+    case GuardScan::Closed:
+      guard_.state = GuardScan::Off; // Text after the guard's #endif
+      break;
+    default:
+      break;
     }
   }
 
-  void handle_if_with_expansion(std::ostringstream &result) {
-    // Read and evaluate the condition
-    std::string condition = read_line();
-    bool conditionResult = evaluate_condition(condition);
+  void handle_define() {
+    Token name = next();
+    if (!isIdentifierLike(name.kind)) {
+      throw std::runtime_error("Expected identifier after #define");
+    }
+
+    size_t known = identifiers_.size();
+    uint32_t macroId = identifiers_.intern(
+        std::string_view(buffer.data() + name.begin, name.len));
+    noteMacroChange(macroId, identifiers_.size() != known);
 
-    if (conditionResult) {
-      // Process the true branch
-      processConditionalBlock(result, true);
+    // Check if it's a function-like macro
+    if (cursor < buffer.size() && buffer[cursor] == '(') {
+      handle_function_macro(macroId);
     } else {
-      // Skip the true branch and look for else
-      skipConditionalBlock();
-
-      // Check if there's an else clause
-      unsigned savedCursor = cursor;
-      if (findMatchingElse()) {
-        // Process the else branch
-        processConditionalBlock(result, false);
-      } else {
-        cursor = savedCursor;
-      }
+      handle_object_macro(macroId);
     }
   }
 
-  void processConditionalBlock(std::ostringstream &result, bool isIfBranch) {
-    int depth = 1;
+  void handle_undef() {
+    Token name = next();
+    if (!isIdentifierLike(name.kind)) {
+      throw std::runtime_error("Expected identifier after #undef");
+    }
 
-    while (cursor < buffer.size() && depth > 0) {
-      Token token = next();
-      if (token.kind == TokenKind::T_EOF) {
+    uint32_t macroId =
+        identifiers_.find(std::string_view(buffer.data() + name.begin, name.len));
+    macroTable_.undef(macroId);
+    noteMacroChange(macroId, false);
+  }
+
+  void noteMacroChange(uint32_t id, bool newName) {
+    macroChanges_++;
+    if (newName)
+      newNameStamp_ = macroChanges_;
+    if (id == IdentifierTable::kInvalidId)
+      return;
+    if (id >= macroStamps_.size())
+      macroStamps_.resize(id + 1);
+    macroStamps_[id] = macroChanges_;
+  }
+
+  // Look up the macro called name without interning it.
+  const MacroDef *findMacro(std::string_view name) {
+    if (macroReads_)
+      macroReads_->push_back(macroNameHash(name));
+    uint32_t id = identifiers_.find(name);
+    if (memoReads_) {
+      if (id == IdentifierTable::kInvalidId)
+        memoReadUnknown_ = true;
+      else
+        memoReads_->push_back(id);
+    }
+    const MacroDef *macro = macroTable_.find(id);
+    PP_STAT(stats_.totals.macroLookups++, stats_.totals.macroHits += !!macro);
+    return macro;
+  }
+
+  void handle_object_macro(uint32_t macroId) {
+    MacroDef &macro = macroTable_.define(macroId);
+    read_replacement_list(macro);
+  }
+
+  void handle_function_macro(uint32_t macroId) {
+    // Skip the opening parenthesis
+    cursor++;
+
+    std::pmr::vector<std::string_view> parameters(&memory_);
+    bool variadic = false;
+
+    // Parse parameters
+    while (cursor < buffer.size()) {
+      skip_whitespace_and_comments();
+
+      if (cursor < buffer.size() && buffer[cursor] == ')') {
+        cursor++;
         break;
       }
 
-      if (token.kind == TokenKind::Hash) {
-        Token directive = next();
-        if (directive.kind == TokenKind::If) {
-          depth++;
-          // Handle nested #if by recursively processing it
-          handle_if_with_expansion(result);
-          depth--; // The recursive call handles the entire nested block
-        } else if (directive.kind == TokenKind::Endif) {
-          depth--;
-          if (depth == 0) {
-            return; // End of our conditional block
-          }
-        } else if (directive.kind == TokenKind::Else && depth == 1) {
-          if (isIfBranch) {
-            return; // End of if branch, don't process else
-          }
-        } else {
-          // Other directives - process them
-          if (directive.kind == TokenKind::Define) {
-            handle_define();
-          } else if (directive.kind == TokenKind::Undef) {
-            handle_undef();
-          }
+      Token param = next();
+      if (param.kind == TokenKind::Ellipsis) {
+        variadic = true;
+        parameters.push_back("__VA_ARGS__");
+        skip_whitespace_and_comments();
+        if (cursor >= buffer.size() || buffer[cursor] != ')') {
+          throw std::runtime_error("Expected ')' after '...' in macro "
+                                   "parameter list");
         }
-        continue;
+        cursor++;
+        break;
+      }
+      if (!isIdentifierLike(param.kind)) {
+        throw std::runtime_error("Expected parameter name in function macro");
+      }
+
+      parameters.push_back(getTokenView(param));
+
+      skip_whitespace_and_comments();
+      if (cursor < buffer.size() && buffer[cursor] == ',') {
+        cursor++;
+      } else if (cursor < buffer.size() && buffer[cursor] == ')') {
+        cursor++;
+        break;
       }
+    }
+
+    // Store the function macro
+    MacroDef &macro = macroTable_.define(macroId);
+    macro.kind = MacroKind::Function;
+    macro.params = std::move(parameters);
+    macro.variadic = variadic;
+    read_replacement_list(macro);
+  }
 
-      // Handle newlines
-      if (token.kind == TokenKind::Unknown) {
-        result << "\n";
+  // Lex the rest of the directive line into macro.body and compile it:
+  // parameters become slot indices, and '#'/'##' become operand flags.
+  // Leaves the cursor on the terminating newline, like read_line().
+  void read_replacement_list(MacroDef &macro) {
+    skip_whitespace_and_comments();
+    unsigned textBegin = cursor;
+    unsigned textEnd = cursor;
+    bool pasteNext = false;
+    bool stringifyNext = false;
+    bool stringifySpaced = false;
+    bool isFunction = macro.kind == MacroKind::Function;
+    while (true) {
+      unsigned before = cursor;
+      skip_whitespace_and_comments();
+      if (cursor >= buffer.size() || buffer[cursor] == '\n')
+        break;
+      Token token = next();
+      bool spaced = cursor != before + token.len && !macro.body.empty();
+      textEnd = token.begin + token.len;
+
+      if (token.kind == TokenKind::HashHash) {
+        if (macro.body.empty() || pasteNext || stringifyNext)
+          throw std::runtime_error(
+              "'##' cannot appear at either end of a macro expansion");
+        macro.body.back().flags |= ReplacementToken::PasteRight;
+        pasteNext = true;
+        continue;
+      }
+      if (isFunction && token.kind == TokenKind::Hash && !stringifyNext) {
+        stringifyNext = true;
+        stringifySpaced = spaced;
         continue;
       }
 
-      // Process regular tokens with macro expansion
-      if (token.kind == TokenKind::Ident) {
-        std::string tokenText = getTokenText(token);
+      ReplacementToken element(
+          {token.begin - textBegin, token.len, token.kind});
+      if (isIdentifierLike(token.kind))
+        element.param = findParam(macro, getTokenView(token));
+      if (stringifyNext) {
+        if (element.param < 0)
+          throw std::runtime_error("'#' is not followed by a macro parameter");
+        element.flags |= ReplacementToken::Stringify;
+        spaced = stringifySpaced;
+        stringifyNext = false;
+      }
+      if (spaced)
+        element.flags |= ReplacementToken::LeadingSpace;
+      if (pasteNext)
+        element.flags |= ReplacementToken::PasteLeft;
+      pasteNext = false;
+      macro.body.push_back(element);
+    }
+    if (pasteNext)
+      throw std::runtime_error(
+          "'##' cannot appear at either end of a macro expansion");
+    if (stringifyNext)
+      throw std::runtime_error("'#' is not followed by a macro parameter");
+    macro.text =
+        std::string_view(buffer.data() + textBegin, textEnd - textBegin);
+    if (inWindow()) {
+      // The window moves on, but definitions must stay
+      macro.text = streamText_.store(macro.text);
+      for (std::string_view &param : macro.params)
+        param = streamText_.store(param);
+    }
+  }
 
-        // Check for function macro first
-        if (functionMacros.find(tokenText) != functionMacros.end()) {
-          unsigned savedCursor = cursor;
-          skip_whitespace_and_comments();
+  static int findParam(const MacroDef &macro, std::string_view name) {
+    for (size_t i = 0; i < macro.params.size(); i++) {
+      if (macro.params[i] == name)
+        return static_cast<int>(i);
+    }
+    return -1;
+  }
 
-          if (cursor < buffer.size() && buffer[cursor] == '(') {
-            std::string expanded = expandFunctionMacro(tokenText);
-            result << expanded;
-            continue;
-          } else {
-            cursor = savedCursor;
-          }
-        }
+  // Return the rest of the line, without its trailing whitespace, as a view
+  // into the buffer.
+  std::string_view read_line() {
+    unsigned begin = cursor;
+    cursor = static_cast<unsigned>(
+        pp_detail::findNewline(buffer.data(), cursor, buffer.size()));
+    unsigned end = cursor;
+    while (end > begin && std::isspace(static_cast<unsigned char>(
+                              buffer[end - 1]))) {
+      end--;
+    }
+    return std::string_view(buffer.data() + begin, end - begin);
+  }
 
-        // Check for object macro
-        if (macros.find(tokenText) != macros.end()) {
-          result << macros[tokenText];
-          continue;
+  // Read the rest of the directive line as an #if expression: resolve
+  // defined, expand macros, then evaluate. The token lists are members so
+  // that conditions do not allocate once they have warmed up.
+  bool evaluate_condition() {
+    // In a file, a result is kept with the macros it read, as for
+    // expansions; see expandCached()
+    CachedCondition *cached = nullptr;
+    const char *key = buffer.data() + cursor;
+    if (!macroReads_ && !memoReads_ && currentFile_ &&
+        buffer.data() == currentFile_->text().data()) {
+      auto found = conditionCache_.try_emplace(key, &memory_);
+      cached = &found.first->second;
+      bool known = !found.second; // Else a new entry, filled in below
+      if (known && isFresh(cached->reads.data(), cached->reads.size(),
+                           cached->readUnknown, cached->stamp)) {
+        PP_STAT(stats_.totals.conditionCacheHits++);
+        cursor = cached->end;
+        return cached->result;
+      } else if (known && ++cached->stale > CachedCondition::kMaxStale) {
+        cached = nullptr; // Its macros change too often to be worth it
+      }
+      if (cached) {
+        cached->reads.clear();
+        memoReads_ = &cached->reads;
+        memoReadUnknown_ = false;
+      }
+    }
+    bool result;
+    try {
+      result = evaluateLine();
+    } catch (...) {
+      memoReads_ = nullptr;
+      if (cached)
+        conditionCache_.erase(key);
+      throw;
+    }
+    if (cached) {
+      memoReads_ = nullptr;
+      cached->result = result;
+      cached->readUnknown = memoReadUnknown_;
+      cached->end = cursor;
+      cached->stamp = macroChanges_;
+    }
+    return result;
+  }
+
+  bool evaluateLine() {
+    expansionStart_ = static_cast<unsigned>(
+        pp_detail::skipHorizontalSpace(buffer.data(), cursor, buffer.size()));
+    expansionName_ = "#if";
+    expansionTokens_ = 0;
+    condition_.clear();
+    while (true) {
+      unsigned before = cursor;
+      skip_whitespace_and_comments();
+      if (cursor >= buffer.size() || buffer[cursor] == '\n')
+        break;
+      Token token = next();
+      PPToken tok = makePPToken(token);
+      if (token.begin != before)
+        tok.flags |= PPToken::LeadingSpace;
+      if (tok.kind == TokenKind::Ident && tok.text == "defined")
+        tok = read_defined_operand();
+      condition_.push_back(tok);
+    }
+
+    expandList(condition_, conditionExpanded_, conditionWork_);
+    ConditionEvaluator evaluator(
+        conditionExpanded_.data(),
+        conditionExpanded_.data() + conditionExpanded_.size());
+    bool result = evaluator.evaluate();
+    if (!batch_) { // Batched tokens may still point into these
+      scratchText_.clear();
+      expansionCache_.releaseRetired();
+    }
+    return result;
+  }
+
+  // The operand of defined, as "defined X" or "defined(X)", replaced by the
+  // number 1 or 0. The name itself is never macro-expanded.
+  PPToken read_defined_operand() {
+    auto onLine = [this] {
+      skip_whitespace_and_comments();
+      return cursor < buffer.size() && buffer[cursor] != '\n';
+    };
+    Token name = onLine() ? next() : Token(cursor, 0, TokenKind::T_EOF);
+    bool paren = name.kind == TokenKind::L_Paren;
+    if (paren)
+      name = onLine() ? next() : Token(cursor, 0, TokenKind::T_EOF);
+    if (!isIdentifierLike(name.kind))
+      throw std::runtime_error(
+          "Operator \"defined\" requires an identifier");
+    bool defined = findMacro(getTokenView(name)) != nullptr;
+    if (paren && (!onLine() || next().kind != TokenKind::R_Paren))
+      throw std::runtime_error("Missing ')' after \"defined\"");
+    return PPToken{defined ? "1" : "0", TokenKind::PPNumber, 0, 0};
+  }
+
+
+  // Read the macro name of #ifdef/#ifndef and look it up
+  const MacroDef *read_ifdef_name() {
+    Token name = next();
+    if (!isIdentifierLike(name.kind))
+      throw std::runtime_error("Macro names must be identifiers");
+    return findMacro(getTokenView(name));
+  }
+
+  // #pragma once marks the current file; other pragmas are passed through
+  // to result, if there is one.
+  void handle_pragma(OutputSink *result) {
+    std::string_view line = read_line();
+    size_t start = line.find_first_not_of(" \t");
+    line = start == std::string_view::npos ? std::string_view()
+                                           : line.substr(start);
+    if (line == "once") {
+      if (currentFile_)
+        currentFile_->setPragmaOnce();
+      return;
+    }
+    if (result) {
+      // The cursor is still on the pragma's line
+      auto emit = [&](std::string_view text, TokenKind kind, bool spaced) {
+        outputLoc_ = bufferLoc_ ? bufferLoc_ + cursor : 0;
+        if (result->wantsOrigins())
+          writeOrigin(*result, cursor, {});
+        result->token(text, kind, spaced);
+      };
+      emit("#", TokenKind::Hash, lastOutput_ != '\n');
+      emit("pragma", TokenKind::Pragma, false);
+      if (!line.empty())
+        emit(line, TokenKind::Unknown, true);
+      lastOutput_ = 'a';
+    }
+  }
+
+  // Skip the rest of a conditional group without tokenizing it. Stops
+  // just past the name of the #endif closing the group or, with
+  // stopAtElse, an #else or #elif at the same level, and returns which it
+  // was (T_EOF if the buffer ends first).
+  TokenKind skipConditionalBlock(bool stopAtElse) {
+    PP_STAT(const uint64_t start = streamOffset_ + cursor);
+    int depth = 0;
+    TokenKind end = TokenKind::T_EOF;
+
+    // Called with the directive line partly read
+    if (skipIndexed(stopAtElse, end)) {
+      PP_STAT(stats_.totals.indexedSkips++);
+      PP_STAT(stats_.totals.skippedBytes += streamOffset_ + cursor - start);
+      return end;
+    }
+    while (true) {
+      size_t resume;
+      size_t pos = findDirective(cursor, false, &resume);
+      if (pos >= buffer.size()) {
+        // Nothing in a skipped group is kept, so a streaming window can let
+        // go of everything the scan is done with before reading on.
+        if (!inWindow())
+          break;
+        cursor = static_cast<unsigned>(resume);
+        if (!batch_)
+          dropWindowPrefix(cursor);
+        if (!growWindow(std::max(streamWindow_, windowSize_)))
+          break;
+        continue;
+      }
+      TokenKind kind = readDirectiveName(pos);
+      if (opensConditional(kind)) {
+        depth++;
+      } else if (kind == TokenKind::Endif) {
+        if (depth-- == 0) {
+          end = kind;
+          break;
         }
+      } else if ((kind == TokenKind::Else || kind == TokenKind::Elif) &&
+                 depth == 0 && stopAtElse) {
+        end = kind;
+        break;
       }
+    }
+    if (end == TokenKind::T_EOF)
+      cursor = static_cast<unsigned>(buffer.size());
+    PP_STAT(stats_.totals.skippedBytes += streamOffset_ + cursor - start);
+    return end;
+  }
 
-      // Regular token
-      std::string tokenText = getTokenText(token);
-
-      // Add space before certain operators
-      if (token.kind == TokenKind::Assign || token.kind == TokenKind::Plus ||
-          token.kind == TokenKind::Minus || token.kind == TokenKind::Star ||
-          token.kind == TokenKind::Slash) {
-        result << " ";
-      }
-
-      result << tokenText;
-
-      // Add space after certain tokens for readability
-      if ((token.kind == TokenKind::Ident || token.kind == TokenKind::PPNumber ||
-           token.kind == TokenKind::Assign || token.kind == TokenKind::Plus ||
-           token.kind == TokenKind::Minus || token.kind == TokenKind::Star ||
-           token.kind == TokenKind::Slash) &&
-          cursor < buffer.size() && buffer[cursor] != ';' &&
-          buffer[cursor] != '(' && buffer[cursor] != ')') {
-        result << " ";
-      }
+  // Move the cursor just past the name of the directive whose '#' is at
+  // hash, and return the name's kind
+  TokenKind readDirectiveName(size_t hash) {
+    using namespace pp_detail;
+    cursor = static_cast<unsigned>(hash + 1);
+    skip_whitespace_and_comments();
+    const char *data = buffer.data();
+    const size_t size = buffer.size();
+    size_t name = cursor;
+    while (cursor < size && hasClass(data[cursor], CC_IdentBody))
+      cursor++;
+    return lookupKeyword(data + name, cursor - name);
+  }
 
-      // Add space after semicolon
-      if (token.kind == TokenKind::Semicolon) {
-        result << " ";
+  // skipConditionalBlock() through the current file's DirectiveIndex.
+  // The scan from the cursor to the end of its line must reach the same
+  // line end as the one that made the index did after some directive;
+  // from there on both see the same directives. The index is made the
+  // first time a file read more than once skips a group. False, having
+  // done nothing, when it cannot be used.
+  bool skipIndexed(bool stopAtElse, TokenKind &end) {
+    if (!currentFile_ || buffer.data() != currentFile_->text().data() ||
+        buffer.size() > DirectiveIndex::kNone ||
+        (currentFile_->reads() < 2 && !currentFile_->hasDirectiveIndex()))
+      return false;
+    const DirectiveIndex &index =
+        currentFile_->directiveIndex([this] { return indexDirectives(); });
+    uint32_t at = index.atLineEnd(findLineEnd(cursor));
+    if (at == DirectiveIndex::kNone)
+      return false;
+    for (at = index.entries[at].next; at != DirectiveIndex::kNone;
+         at = index.entries[at].next) {
+      const DirectiveIndex::Entry &entry = index.entries[at];
+      if (entry.kind == TokenKind::Endif || stopAtElse) {
+        cursor = entry.nameEnd;
+        end = entry.kind;
+        return true;
       }
     }
+    cursor = static_cast<unsigned>(buffer.size());
+    end = TokenKind::T_EOF;
+    return true;
   }
 
-  void skipConditionalBlock() {
-    int depth = 1;
-
-    while (cursor < buffer.size() && depth > 0) {
-      Token token = next();
-
-      if (token.kind == TokenKind::Hash) {
-        Token directive = next();
-        if (directive.kind == TokenKind::If) {
-          depth++;
-        } else if (directive.kind == TokenKind::Endif) {
-          depth--;
-        } else if (directive.kind == TokenKind::Else && depth == 1) {
-          return; // Found matching else
-        }
+  // Find every directive in buffer as skipConditionalBlock() would, and
+  // link each to where its group continues. The cursor is left as it was.
+  DirectiveIndex indexDirectives() {
+    DirectiveIndex index;
+    std::vector<DirectiveIndex::Entry> &entries = index.entries;
+    // Per open group, innermost last: the entries whose next is the
+    // group's next #elif, #else or #endif
+    std::vector<std::vector<uint32_t>> waiting(1);
+    unsigned saved = cursor;
+    for (size_t pos = findDirective(0, true); pos < buffer.size();
+         pos = findDirective(cursor, false)) {
+      TokenKind kind = readDirectiveName(pos);
+      uint32_t i = static_cast<uint32_t>(entries.size());
+      entries.push_back({static_cast<uint32_t>(findLineEnd(cursor)), cursor,
+                         DirectiveIndex::kNone, kind});
+      if (kind == TokenKind::Elif || kind == TokenKind::Else ||
+          kind == TokenKind::Endif) {
+        for (uint32_t from : waiting.back())
+          entries[from].next = i;
+        waiting.back().clear();
+        if (kind == TokenKind::Endif && waiting.size() > 1)
+          waiting.pop_back();
+        waiting.back().push_back(i);
+      } else if (opensConditional(kind)) {
+        waiting.emplace_back(1, i);
+      } else {
+        waiting.back().push_back(i);
       }
     }
+    cursor = saved;
+    return index;
   }
 
-  bool findMatchingElse() {
-    unsigned savedCursor = cursor;
-
-    // Look for #else at the same nesting level
-    while (cursor < buffer.size()) {
-      Token token = next();
+  // Find the next '#' that starts a line, reading from pos, which is at
+  // the start of a line only if lineStart. Only lines starting with '#'
+  // are looked at; the rest of each line is scanned for the bytes that
+  // start comments and literals, so a '#' inside either is never mistaken
+  // for a directive. Returns the offset of the '#', or the buffer size.
+  // Then resume, if given, is set to where a search with more text after
+  // the buffer should start over: a line end outside any comment, or pos.
+  // With untilLineEnd it stops at the first such line end instead.
+  size_t findDirective(size_t pos, bool lineStart,
+                       size_t *resume = nullptr,
+                       bool untilLineEnd = false) const {
+    using namespace pp_detail;
+    const char *data = buffer.data();
+    const size_t size = buffer.size();
+    size_t lastLineEnd = pos;
+
+    while (pos < size) {
+      if (lineStart) {
+        lineStart = false;
+        pos = skipHorizontalSpace(data, pos, size);
+        while (pos + 1 < size && data[pos] == '/' && data[pos + 1] == '*') {
+          pos = findBlockCommentEnd(data, pos + 2, size);
+          pos = pos < size ? pos + 2 : size;
+          pos = skipHorizontalSpace(data, pos, size);
+        }
+        if (pos < size && data[pos] == '#')
+          return pos;
+      }
 
-      if (token.kind == TokenKind::Hash) {
-        Token directive = next();
-        if (directive.kind == TokenKind::Else) {
-          return true; // Found else
-        } else if (directive.kind == TokenKind::Endif) {
-          cursor = savedCursor;
-          return false; // Found endif without else
+      pos = findSkipStop(data, pos, size);
+      if (pos >= size)
+        break;
+      char c = data[pos];
+      if (c == '\n') {
+        if (untilLineEnd)
+          return pos;
+        lastLineEnd = pos++;
+        lineStart = true;
+      } else if (c == '/') {
+        if (pos + 1 < size && data[pos + 1] == '*') {
+          pos = findBlockCommentEnd(data, pos + 2, size);
+          pos = pos < size ? pos + 2 : size;
+        } else if (pos + 1 < size && data[pos + 1] == '/') {
+          pos = findNewline(data, pos, size);
+        } else {
+          pos++;
+        }
+      } else {
+        // A literal ends at its closing quote or, unterminated, the line end
+        for (pos++; pos < size && data[pos] != c && data[pos] != '\n'; pos++) {
+          if (data[pos] == '\\' && pos + 1 < size)
+            pos++;
         }
+        if (pos < size && data[pos] == c)
+          pos++;
       }
     }
+    if (resume)
+      *resume = lastLineEnd;
+    return size;
+  }
 
-    cursor = savedCursor;
-    return false;
+  // The first line end findDirective() passes from pos, outside comments
+  // and literals, or the buffer size
+  size_t findLineEnd(size_t pos) const {
+    return findDirective(pos, false, nullptr, true);
+  }
+
+  static bool opensConditional(TokenKind kind) {
+    return kind == TokenKind::If || kind == TokenKind::IfDef ||
+           kind == TokenKind::IfNDef;
   }
 
   void skipDirectiveLine() {
@@ -1083,6 +5424,16 @@ private:
     }
   }
 
+  // Lex the token at start again once the window has grown, keeping the
+  // spacing seen before it
+  Token lexAgain(unsigned start) {
+    bool spaced = leadingSpace_;
+    cursor = start;
+    Token token = lex();
+    leadingSpace_ = spaced;
+    return token;
+  }
+
   // Parse a preprocessor number according to C standard
   Token parsePPNumber(unsigned start) {
     // PPNumber grammar (simplified):
@@ -1099,14 +5450,8 @@ private:
     while (cursor < buffer.size()) {
       char c = buffer[cursor];
       
-      // Digits are always valid
-      if (std::isdigit(c)) {
-        cursor++;
-        continue;
-      }
-      
-      // Letters are valid (for hex, scientific notation, suffixes)
-      if (std::isalpha(c)) {
+      // Digits and letters (hex, scientific notation, suffixes) are valid
+      if (pp_detail::hasClass(c, pp_detail::CC_Digit | pp_detail::CC_Letter)) {
         cursor++;
         continue;
       }
@@ -1133,97 +5478,1227 @@ private:
     return {start, cursor - start, TokenKind::PPNumber};
   }
 
-  std::string expandMacrosInCondition(const std::string &condition) {
-    // Simple macro expansion for conditions
-    std::string result = condition;
+  // Macro expansion engine
+  //
+  // Expansion works on PPToken lists using Prosser's algorithm: a token
+  // naming a macro expands unless that macro is in the token's hide set, and
+  // everything an expansion produces has the macro added to its hide set
+  // before it is pushed back onto pending_ and rescanned. Function macro
+  // arguments are read from pending_ first and then from the buffer, so an
+  // invocation may be completed by the text after the macro that produced
+  // its name.
+
+  PPToken makePPToken(const Token &token) const {
+    PPToken t;
+    t.text = getTokenView(token);
+    t.kind = token.kind;
+    t.loc = bufferLoc_ ? bufferLoc_ + token.begin : 0;
+    t.flags = leadingSpace_ ? PPToken::LeadingSpace : 0;
+    return t;
+  }
+
+  bool isNewline(const Token &token) const {
+    return token.kind == TokenKind::Unknown && token.len == 1 &&
+           buffer[token.begin] == '\n';
+  }
 
-    // Check if the entire condition is a macro name
-    if (macros.find(result) != macros.end()) {
-      return macros[result];
+  // Write token (just returned by next()) to result, fully macro-expanded.
+  void emitExpanded(const Token &token, OutputSink &result) {
+    PP_STAT(PhaseScope phase(stats_, PreprocessStats::Expand));
+    PPToken first = makePPToken(token);
+    originAt_ = token.begin;
+    if (!isIdentifierLike(token.kind) || !findMacro(first.text)) {
+      originMacro_ = {};
+      writeToken(first, result, pasteGuard_);
+      pasteGuard_ = false;
+      return;
     }
 
-    // For more complex expressions, we'd need a proper tokenizer
-    // For now, just return the original condition
-    return result;
+    originMacro_ = first.text;
+    expansionStart_ = token.begin;
+    expansionName_ = first.text;
+    expansionTokens_ = 0;
+
+    pending_.push_back(first);
+    while (!pending_.empty()) {
+      PPToken tok = pending_.back();
+      pending_.pop_back();
+      if (!expandOne(tok, pending_, true))
+        writeToken(tok, result, true);
+    }
+    // The rescanned output may end in a token the next source token would
+    // otherwise merge with.
+    pasteGuard_ = true;
+    if (!batch_) { // nextBatch() clears these once the tokens are read
+      scratchText_.clear();
+      expansionCache_.releaseRetired();
+    }
   }
 
-  std::string expandFunctionMacro(const std::string &macroName) {
-    // Check if next token is '('
-    skip_whitespace_and_comments();
-    if (cursor >= buffer.size() || buffer[cursor] != '(') {
-      // Not a function call, treat as identifier
-      return macroName;
+  // Fills the batch a nextBatch() call returns up to its cap, and
+  // batchOverflow_ after that
+  class BatchSink : public OutputSink {
+  public:
+    BatchSink(PreProcessor &pp, TokenBatch &out, size_t cap)
+        : pp_(pp), out_(out), cap_(cap) {}
+
+    void token(std::string_view text, TokenKind kind, bool spaced) override {
+      unsigned char flags =
+          (spaced ? TokenBatch::LeadingSpace : 0) |
+          (pp_.batchLineStart_ ? TokenBatch::StartOfLine : 0);
+      pp_.batchLineStart_ = false;
+      TokenBatch &to = out_.size() < cap_ ? out_ : pp_.batchOverflow_;
+      to.push(kind, text, flags);
+      if (pp_.trackLocations_)
+        to.locs.push_back(pp_.outputLoc_);
     }
+    void newline() override { pp_.batchLineStart_ = true; }
+
+  private:
+    PreProcessor &pp_;
+    TokenBatch &out_;
+    size_t cap_;
+  };
+
+  void writeToken(const PPToken &tok, OutputSink &result, bool guard) {
+    PP_STAT(PhaseScope phase(stats_, PreprocessStats::Output));
+    bool spaced = (tok.flags & PPToken::LeadingSpace) ||
+                  (guard && !batch_ && !tok.text.empty() &&
+                   wouldPaste(lastOutput_, tok.text.front()));
+    outputLoc_ = tok.loc;
+    chargeOutput(tok.text.size() + spaced, originAt_);
+    if (result.wantsOrigins())
+      writeOrigin(result, originAt_, originMacro_);
+    result.token(tok.text, tok.kind, spaced);
+    if (!tok.text.empty())
+      lastOutput_ = tok.text.back();
+  }
 
-    cursor++; // Skip '('
+  void writeOrigin(OutputSink &result, unsigned offset,
+                   std::string_view macro) {
+    SourceLocation where = locate(offset);
+    result.origin({where.file, where.line, macro, outputLoc_});
+  }
 
-    // Parse arguments
-    std::vector<std::string> args;
-    std::string currentArg;
-    int parenDepth = 0;
+  void writeNewline(OutputSink &result) {
+    PP_STAT(PhaseScope phase(stats_, PreprocessStats::Output));
+    chargeOutput(1, cursor);
+    result.newline();
+    lastOutput_ = '\n';
+  }
 
-    while (cursor < buffer.size()) {
-      char c = buffer[cursor];
+  // Would printing b straight after a change how the output lexes?
+  bool wouldPaste(char a, char b) {
+    // A closed literal never merges with what follows.
+    if (a == '\n' || a == ' ' || a == '"' || a == '\'')
+      return false;
+    char pair[2] = {a, b};
+    Token t = lexStandalone(std::string_view(pair, 2));
+    return t.begin != 0 || t.len != 1;
+  }
 
-      if (c == '(') {
-        parenDepth++;
-        currentArg += c;
-      } else if (c == ')') {
-        if (parenDepth == 0) {
-          // End of function call
-          if (!currentArg.empty()) {
-            args.push_back(currentArg);
-          }
-          cursor++; // Skip closing ')'
+  // A PreProcessor that only lexes text, for prelex() workers
+  struct Lexer {};
+  PreProcessor(std::string_view text, Lexer) : buffer(text) {}
+
+  // Append what lex() returns from begin on to out, until it is called at
+  // end or past it
+  void lexRange(unsigned begin, unsigned end, std::vector<Token> &out) {
+    cursor = begin;
+    while (cursor < end) {
+      Token token = lex();
+      if (token.kind == TokenKind::T_EOF)
+        break;
+      out.push_back(token);
+    }
+  }
+
+  // Stitch prelex() chunks, lexed from each of cuts, together from where
+  // the tokens before end, lexing again here until the two agree on where a
+  // token was lexed from
+  std::vector<Token> stitchPrelexed(std::vector<std::vector<Token>> &lexed,
+                                    const std::vector<unsigned> &cuts) {
+    std::vector<Token> tokens = std::move(lexed[0]);
+    auto endOf = [](const Token &t) { return t.begin + t.len; };
+    unsigned from = tokens.empty() ? 0 : endOf(tokens.back());
+    for (size_t i = 1; i < lexed.size(); i++) {
+      const std::vector<Token> &chunk = lexed[i];
+      while (true) {
+        auto next = std::lower_bound(
+            chunk.begin(), chunk.end(), from,
+            [](const Token &t, unsigned at) { return t.begin < at; });
+        if (next == chunk.end())
+          break; // Lexed past this chunk
+        unsigned lexedFrom =
+            next == chunk.begin() ? cuts[i] : endOf(*std::prev(next));
+        if (lexedFrom == from) {
+          tokens.insert(tokens.end(), next, chunk.end());
+          from = endOf(tokens.back());
+          break;
+        }
+        size_t before = tokens.size();
+        lexRange(from, from + 1, tokens); // One token
+        if (tokens.size() == before)
+          break; // End of input
+        from = endOf(tokens.back());
+      }
+    }
+    lexRange(from, static_cast<unsigned>(buffer.size()), tokens);
+    return tokens;
+  }
+
+  // The prelex() token lex() would return from cursor, or null: the one
+  // lexed from there, or starting there once whitespace was skipped
+  const Token *findPrelexed() {
+    const Token *tokens = prelex_.tokens;
+    auto lexedFrom = [tokens](size_t i) {
+      return i ? tokens[i - 1].begin + tokens[i - 1].len : 0u;
+    };
+    size_t i = prelex_.at;
+    if (i >= prelex_.size ||
+        (lexedFrom(i) != cursor && tokens[i].begin != cursor)) {
+      // The cursor was moved by hand, e.g. past a skipped group
+      i = static_cast<size_t>(
+          std::lower_bound(
+              tokens, tokens + prelex_.size, cursor,
+              [](const Token &t, unsigned at) { return t.begin < at; }) -
+          tokens);
+      if (i == prelex_.size ||
+          (lexedFrom(i) != cursor && tokens[i].begin != cursor))
+        return nullptr;
+    }
+    prelex_.at = i + 1;
+    return &tokens[i];
+  }
+
+  // Lex the first token of text with the normal lexer.
+  Token lexStandalone(std::string_view text) {
+    std::string_view savedBuffer = buffer;
+    unsigned savedCursor = cursor;
+    bool savedSpace = leadingSpace_;
+    buffer = text;
+    cursor = 0;
+    Token t = lex();
+    buffer = savedBuffer;
+    cursor = savedCursor;
+    leadingSpace_ = savedSpace;
+    return t;
+  }
+
+  // If tok starts a macro invocation, consume its arguments from in (and
+  // the buffer, if fromLexer), push the expansion onto in and return true.
+  bool expandOne(const PPToken &tok, TokenList &in,
+                 bool fromLexer) {
+    if (!isIdentifierLike(tok.kind))
+      return false;
+    if (macroReads_)
+      macroReads_->push_back(macroNameHash(tok.text));
+    uint32_t id = identifiers_.find(tok.text);
+    if (memoReads_) {
+      if (id == IdentifierTable::kInvalidId)
+        memoReadUnknown_ = true;
+      else
+        memoReads_->push_back(id);
+    }
+    const MacroDef *macro = macroTable_.find(id);
+    PP_STAT(stats_.totals.macroLookups++, stats_.totals.macroHits += !!macro);
+    if (!macro || hideSets_.contains(tok.hideSet, id))
+      return false;
+
+    size_t mark = expansion_.size();
+    uint32_t hs;
+    if (macro->kind == MacroKind::Object) {
+      hs = hideSets_.add(tok.hideSet, id);
+      substitute(*macro, nullptr, hs, tok.loc);
+      PP_STAT(stats_.totals.objectExpansions++);
+    } else {
+      if (!nextIsLParen(in, fromLexer)) {
+        memoLeaked_ |= &in == memoWork_ && in.empty();
+        return false;
+      }
+      std::pmr::vector<TokenList> args(&memory_);
+      PPToken rparen = collectArgs(*macro, tok.text, in, fromLexer, args);
+      hs = hideSets_.add(hideSets_.intersect(tok.hideSet, rparen.hideSet), id);
+      PP_STAT(stats_.totals.functionExpansions++);
+      if (expandCached(*macro, id, hs, tok, args, in)) {
+        PP_STAT(stats_.expansions[id]++);
+        PP_STAT(stats_.totals.peakExpansionDepth = std::max<uint64_t>(
+                    stats_.totals.peakExpansionDepth, hideSets_.size(hs)));
+        return true;
+      }
+      substitute(*macro, &args, hs, tok.loc);
+    }
+    chargeExpansion(hs, expansion_.size() - mark);
+    PP_STAT(stats_.expansions[id]++);
+    PP_STAT(stats_.totals.rescannedTokens += expansion_.size() - mark);
+    PP_STAT(stats_.totals.peakExpansionDepth = std::max<uint64_t>(
+                stats_.totals.peakExpansionDepth, hideSets_.size(hs)));
+
+    // The expansion takes the place of the macro name, spacing included.
+    if (expansion_.size() > mark) {
+      PPToken &head = expansion_[mark];
+      head.flags = static_cast<unsigned char>(
+          (head.flags & ~PPToken::LeadingSpace) |
+          (tok.flags & PPToken::LeadingSpace));
+    } else if (!in.empty()) {
+      in.back().flags |= tok.flags & PPToken::LeadingSpace;
+    } else {
+      memoLeaked_ |= &in == memoWork_ && (tok.flags & PPToken::LeadingSpace);
+    }
+    in.insert(in.end(), expansion_.rbegin(),
+              expansion_.rbegin() + (expansion_.size() - mark));
+    expansion_.resize(mark);
+    return true;
+  }
+
+  // Push the fully rescanned result of invoking macro (ID id) with args
+  // onto in, from expansionCache_ or made and stored there. False, having
+  // done nothing, if the cache is off or the result cannot be reused: its
+  // rescan reached past the end of the expansion into what follows, so
+  // must be redone in place.
+  bool expandCached(const MacroDef &macro, uint32_t id, uint32_t hs,
+                    const PPToken &tok, const ExpansionCache::Args &args,
+                    TokenList &in) {
+    if (expansionCache_.capacity() == 0 || macroReads_)
+      return false;
+    bool spaced = tok.flags & PPToken::LeadingSpace;
+    uint64_t h = ExpansionCache::hash(id, hs, spaced, args);
+    if (ExpansionCache::Entry *entry =
+            expansionCache_.find(h, id, hs, spaced, args)) {
+      if (isFresh(*entry)) {
+        PP_STAT(stats_.totals.expansionCacheHits++);
+        PP_STAT(stats_.totals.rescannedTokens += entry->resultSize);
+        chargeExpansion(hs, entry->resultSize);
+        if (memoReads_) {
+          memoReads_->insert(memoReads_->end(), entry->reads,
+                             entry->reads + entry->readCount);
+          memoReadUnknown_ |= entry->readUnknown;
+        }
+        pushResult(entry->result(), entry->resultSize, tok, in);
+        if (trackLocations_)
+          relocateResult(*entry, tok, args, in);
+        return true;
+      }
+      expansionCache_.erase(entry);
+    }
+    PP_STAT(stats_.totals.expansionCacheMisses++);
+
+    // Expand as expandOne() would, then rescan on a list of its own
+    uint32_t locBegin = locations_.end();
+    size_t firstExpansion = locations_.expansions();
+    size_t mark = expansion_.size();
+    substitute(macro, &args, hs, tok.loc);
+    chargeExpansion(hs, expansion_.size() - mark);
+    PP_STAT(stats_.totals.rescannedTokens += expansion_.size() - mark);
+    if (expansion_.size() > mark) {
+      PPToken &head = expansion_[mark];
+      head.flags = static_cast<unsigned char>(
+          (head.flags & ~PPToken::LeadingSpace) |
+          (tok.flags & PPToken::LeadingSpace));
+    }
+    TokenList work(expansion_.rbegin(),
+                   expansion_.rbegin() + (expansion_.size() - mark), &memory_);
+    expansion_.resize(mark);
+    TokenList result(&memory_);
+    ExpansionCache::Reads reads(1, id, &memory_);
+
+    ExpansionCache::Reads *outerReads = memoReads_;
+    bool outerUnknown = memoReadUnknown_;
+    const TokenList *outerWork = memoWork_;
+    bool outerLeaked = memoLeaked_;
+    memoReads_ = &reads;
+    memoReadUnknown_ = false;
+    memoWork_ = &work;
+    memoLeaked_ = false;
+    auto restore = [&] {
+      bool unknown = memoReadUnknown_;
+      memoReads_ = outerReads;
+      memoReadUnknown_ = outerUnknown || unknown;
+      memoWork_ = outerWork;
+      memoLeaked_ = outerLeaked;
+      if (outerReads) // What this result read, the one containing it read
+        outerReads->insert(outerReads->end(), reads.begin(), reads.end());
+      return unknown;
+    };
+    try {
+      while (!work.empty()) {
+        PPToken next = work.back();
+        work.pop_back();
+        if (!expandOne(next, work, false))
+          result.push_back(next);
+      }
+    } catch (...) {
+      bool leaked = memoLeaked_;
+      restore();
+      expansion_.resize(mark);
+      if (!leaked)
+        throw; // The same error in place
+      return false;
+    }
+    bool leaked = memoLeaked_;
+    bool unknown = restore();
+    if (leaked)
+      return false;
+
+    std::sort(reads.begin(), reads.end());
+    reads.erase(std::unique(reads.begin(), reads.end()), reads.end());
+    ExpansionCache::Entry *entry = expansionCache_.insert(
+        h, id, hs, spaced, args, result.data(), result.size(), reads, unknown,
+        macroChanges_);
+    if (entry && trackLocations_) {
+      entry->locBegin = locBegin;
+      entry->locEnd = locations_.end();
+      entry->invocationLoc = tok.loc;
+      entry->firstExpansion = firstExpansion;
+      entry->lastExpansion = locations_.expansions();
+    }
+    pushResult(result.data(), result.size(), tok, in);
+    return true;
+  }
+
+  // Give the cached result just pushed onto in the locations expanding it
+  // again at tok would have: its expansions are copied to a new range, and
+  // locations of the old invocation and arguments become tok's and args'.
+  void relocateResult(const ExpansionCache::Entry &entry, const PPToken &tok,
+                      const ExpansionCache::Args &args, TokenList &in) {
+    auto map = [&](uint32_t loc) {
+      if (loc == entry.invocationLoc)
+        return tok.loc;
+      const PPToken *old = entry.tokens;
+      for (const TokenList &arg : args)
+        for (const PPToken &now : arg)
+          if ((old++)->loc == loc)
+            return now.loc;
+      return loc;
+    };
+    uint32_t delta =
+        locations_.copyExpansions(entry.firstExpansion, entry.lastExpansion,
+                                  entry.locBegin, entry.locEnd, map);
+    for (size_t i = in.size() - entry.resultSize; i < in.size(); i++) {
+      uint32_t &loc = in[i].loc;
+      loc = loc >= entry.locBegin && loc < entry.locEnd ? loc + delta
+                                                        : map(loc);
+    }
+  }
+
+  // Account for an expansion with hide set hs that produced count tokens
+  void chargeExpansion(uint32_t hs, size_t count) {
+    if (hideSets_.size(hs) + argumentDepth_ > depthLimit_)
+      exceededDepth();
+    expansionTokens_ += count;
+    if (expansionTokens_ > tokenLimit_)
+      exceeded(ExpansionLimitError::Tokens, expansionStart_,
+               "expanding '" + std::string(expansionName_) +
+                   "' produced more than " + std::to_string(limits_.tokens) +
+                   " tokens");
+    if (--clockCountdown_ == 0)
+      checkClock(expansionStart_);
+  }
+
+  void chargeOutput(size_t bytes, unsigned offset) {
+    outputBytes_ += bytes;
+    if (outputBytes_ > outputLimit_)
+      exceeded(ExpansionLimitError::OutputBytes, offset,
+               "output is longer than " + std::to_string(limits_.outputBytes) +
+                   " bytes");
+    if (--clockCountdown_ == 0)
+      checkClock(offset);
+  }
+
+  void startClock() {
+    deadline_ = std::chrono::steady_clock::now() + limits_.time;
+    clockCountdown_ = ExpansionLimits::kClockInterval;
+  }
+
+  // Fail if limits_.time is up, blaming offset
+  void checkClock(unsigned offset) {
+    clockCountdown_ = ExpansionLimits::kClockInterval;
+    if (limits_.time.count() && std::chrono::steady_clock::now() > deadline_)
+      exceeded(ExpansionLimitError::Time, offset,
+               "preprocessing took longer than " +
+                   std::to_string(
+                       std::chrono::duration_cast<std::chrono::milliseconds>(
+                           limits_.time)
+                           .count()) +
+                   " ms");
+  }
+
+  [[noreturn]] void exceededDepth() {
+    exceeded(ExpansionLimitError::Depth, expansionStart_,
+             "expanding '" + std::string(expansionName_) +
+                 "' nests macros more than " + std::to_string(limits_.depth) +
+                 " deep");
+  }
+
+  [[noreturn]] void exceeded(ExpansionLimitError::Limit limit, unsigned offset,
+                             const std::string &message) {
+    throw ExpansionLimitError(
+        limit, locate(std::min<unsigned>(offset, buffer.size())), message);
+  }
+
+  bool isFresh(const ExpansionCache::Entry &entry) const {
+    return isFresh(entry.reads, entry.readCount, entry.readUnknown,
+                   entry.stamp);
+  }
+
+  // Has no macro among reads, nor a name never seen before if readUnknown,
+  // been defined or undefined since macroChanges() was stamp?
+  bool isFresh(const uint32_t *reads, size_t count, bool readUnknown,
+               size_t stamp) const {
+    if (readUnknown && newNameStamp_ > stamp)
+      return false;
+    for (size_t i = 0; i < count; i++)
+      if (reads[i] < macroStamps_.size() && macroStamps_[reads[i]] > stamp)
+        return false;
+    return true;
+  }
+
+  // Push a rescanned result in place of the invocation tok started. Its
+  // head already has tok's spacing, which is part of the cache key.
+  void pushResult(const PPToken *result, size_t count, const PPToken &tok,
+                  TokenList &in) {
+    if (count == 0) {
+      if (!in.empty())
+        in.back().flags |= tok.flags & PPToken::LeadingSpace;
+      else
+        memoLeaked_ |= &in == memoWork_ && (tok.flags & PPToken::LeadingSpace);
+      return;
+    }
+    in.insert(in.end(), std::make_reverse_iterator(result + count),
+              std::make_reverse_iterator(result));
+  }
+
+  // Is the next token '('? Looking into the buffer, line ends count as
+  // whitespace, as they do between arguments (C99 6.10.3p10). The cursor
+  // is put back either way; readToken() reads the '(' itself.
+  bool nextIsLParen(const TokenList &in, bool fromLexer) {
+    if (!in.empty())
+      return in.back().kind == TokenKind::L_Paren;
+    if (!fromLexer)
+      return false;
+    unsigned savedCursor = cursor;
+    while (true) {
+      skip_whitespace_and_comments();
+      if (cursor < buffer.size() && buffer[cursor] == '\n') {
+        cursor++;
+        continue;
+      }
+      if (cursor >= buffer.size() && inWindow() &&
+          growWindow(std::max(streamWindow_, windowSize_)))
+        continue;
+      break;
+    }
+    bool result = cursor < buffer.size() && buffer[cursor] == '(';
+    cursor = savedCursor;
+    return result;
+  }
+
+  // Pop the next token of an invocation. Newlines between arguments only
+  // count as whitespace.
+  bool readToken(TokenList &in, bool fromLexer, PPToken &out) {
+    if (!in.empty()) {
+      out = in.back();
+      in.pop_back();
+      return true;
+    }
+    if (!fromLexer) {
+      memoLeaked_ |= &in == memoWork_;
+      return false;
+    }
+    bool sawNewline = false;
+    while (true) {
+      Token token = next();
+      if (token.kind == TokenKind::T_EOF)
+        return false;
+      if (isNewline(token)) {
+        sawNewline = true;
+        continue;
+      }
+      out = makePPToken(token);
+      if (sawNewline)
+        out.flags |= PPToken::LeadingSpace;
+      return true;
+    }
+  }
+
+  // Read the parenthesised arguments of an invocation of macro; the next
+  // token must be '('. Returns the closing ')'.
+  PPToken collectArgs(const MacroDef &macro, std::string_view name,
+                      TokenList &in, bool fromLexer,
+                      std::pmr::vector<TokenList> &args) {
+    PPToken tok;
+    readToken(in, fromLexer, tok); // '('
+    args.emplace_back();
+    int depth = 0;
+    while (true) {
+      if (!readToken(in, fromLexer, tok))
+        throw std::runtime_error("Unterminated argument list invoking macro \"" +
+                                 std::string(name) + "\"");
+      if (tok.kind == TokenKind::L_Paren) {
+        depth++;
+      } else if (tok.kind == TokenKind::R_Paren) {
+        if (depth == 0)
           break;
+        depth--;
+      } else if (tok.kind == TokenKind::Comma && depth == 0 &&
+                 !(macro.variadic && args.size() == macro.params.size())) {
+        args.emplace_back();
+        continue;
+      }
+      args.back().push_back(tok);
+    }
+
+    if (macro.params.empty() && args.size() == 1 && args[0].empty())
+      args.clear();
+    if (macro.variadic && args.size() + 1 == macro.params.size())
+      args.emplace_back();
+    if (args.size() != macro.params.size()) {
+      throw std::runtime_error(
+          "Macro \"" + std::string(name) + "\" requires " +
+          std::to_string(macro.params.size()) + " arguments, but " +
+          std::to_string(args.size()) + " given");
+    }
+    return tok;
+  }
+
+  // Fully expand an argument on its own, as done before substitution.
+  TokenList expandArgument(const TokenList &raw) {
+    struct Nested {
+      size_t &depth;
+      ~Nested() { depth--; }
+    } nested{++argumentDepth_};
+    if (argumentDepth_ > depthLimit_)
+      exceededDepth();
+    TokenList in(&memory_);
+    TokenList result(&memory_);
+    expandList(raw, result, in);
+    return result;
+  }
+
+  // Fully expand list into out without reading past its end; work is
+  // scratch space for the rescan stack.
+  void expandList(const TokenList &list, TokenList &out, TokenList &work) {
+    work.assign(list.rbegin(), list.rend());
+    out.clear();
+    while (!work.empty()) {
+      PPToken tok = work.back();
+      work.pop_back();
+      if (!expandOne(tok, work, false))
+        out.push_back(tok);
+    }
+  }
+
+  // Instantiate macro's replacement list onto the end of expansion_, and
+  // add hs to the hide set of everything produced. Arguments are expanded
+  // before anything is appended, since that expansion uses expansion_ too.
+  // With location tracking on, the tokens of the list get locations in a
+  // new expansion range for the invocation at loc; arguments keep theirs.
+  void substitute(const MacroDef &macro,
+                  const std::pmr::vector<TokenList> *args, uint32_t hs,
+                  uint32_t loc) {
+    std::pmr::vector<TokenList> expanded(&memory_);
+    if (args) {
+      expanded.resize(args->size());
+      std::pmr::vector<bool> needed(args->size(), false, &memory_);
+      for (const ReplacementToken &element : macro.body) {
+        if (element.param >= 0 &&
+            !(element.flags &
+              (ReplacementToken::Stringify | ReplacementToken::PasteLeft |
+               ReplacementToken::PasteRight)))
+          needed[element.param] = true;
+      }
+      for (size_t i = 0; i < args->size(); i++) {
+        if (needed[i])
+          expanded[i] = expandArgument((*args)[i]);
+      }
+    }
+
+    uint32_t base =
+        trackLocations_ ? locations_.addExpansion(macro.text, loc) : 0;
+    TokenList &out = expansion_;
+    size_t start = out.size();
+    PPToken literal;
+    bool lhsIsPlacemarker = true; // Nothing to paste onto yet
+
+    for (const ReplacementToken &element : macro.body) {
+      const PPToken *piece = &literal;
+      size_t count = 1;
+      if (element.param >= 0 && args) {
+        const TokenList &raw = (*args)[element.param];
+        if (element.flags & ReplacementToken::Stringify) {
+          literal = stringify(raw);
+          literal.loc = base ? base + element.token.begin : 0;
+        } else if (element.flags & (ReplacementToken::PasteLeft |
+                                    ReplacementToken::PasteRight)) {
+          // Operands of ## are not macro-expanded
+          piece = raw.data();
+          count = raw.size();
         } else {
-          parenDepth--;
-          currentArg += c;
+          piece = expanded[element.param].data();
+          count = expanded[element.param].size();
         }
-      } else if (c == ',' && parenDepth == 0) {
-        // Argument separator
-        args.push_back(currentArg);
-        currentArg.clear();
       } else {
-        currentArg += c;
+        literal = PPToken{macro.tokenText(element.token), element.token.kind,
+                          0, base ? base + element.token.begin : 0};
       }
 
-      cursor++;
+      size_t first = 0;
+      if ((element.flags & ReplacementToken::PasteLeft) && !lhsIsPlacemarker) {
+        if (count == 0)
+          continue; // x ## <empty> is just x
+        out.back() = paste(out.back(), piece[0]);
+        first = 1;
+      } else {
+        lhsIsPlacemarker = count == 0;
+        if (count != 0) {
+          out.push_back(piece[0]);
+          PPToken &head = out.back();
+          head.flags = static_cast<unsigned char>(
+              (head.flags & ~PPToken::LeadingSpace) |
+              ((element.flags & ReplacementToken::LeadingSpace)
+                   ? PPToken::LeadingSpace
+                   : 0));
+          first = 1;
+        }
+      }
+      out.insert(out.end(), piece + first, piece + count);
+    }
+
+    for (size_t i = start; i < out.size(); i++)
+      out[i].hideSet = hideSets_.unite(out[i].hideSet, hs);
+  }
+
+  // The # operator: spell raw as a string literal.
+  PPToken stringify(const TokenList &raw) {
+    std::string &spelled = spelling_;
+    spelled.assign(1, '"');
+    for (size_t i = 0; i < raw.size(); i++) {
+      const PPToken &tok = raw[i];
+      if (i > 0 && (tok.flags & PPToken::LeadingSpace))
+        spelled += ' ';
+      if (tok.kind == TokenKind::StringLiteral ||
+          tok.kind == TokenKind::CharLiteral) {
+        for (char c : tok.text) {
+          if (c == '"' || c == '\\')
+            spelled += '\\';
+          spelled += c;
+        }
+      } else {
+        spelled += tok.text;
+      }
     }
+    spelled += '"';
+    return PPToken{scratchText_.store(spelled), TokenKind::StringLiteral, 0,
+                   0};
+  }
 
-    // Get the macro replacement text
-    if (functionMacroReplacements.find(macroName) ==
-        functionMacroReplacements.end()) {
-      return macroName; // Macro not found
+  // The ## operator: join two tokens and relex the result as one token.
+  PPToken paste(const PPToken &lhs, const PPToken &rhs) {
+    std::string &joined = spelling_;
+    joined.assign(lhs.text);
+    joined += rhs.text;
+    std::string_view text = scratchText_.store(joined);
+
+    Token t = lexStandalone(text);
+    if (t.begin != 0 || t.len != text.size()) {
+      throw std::runtime_error("Pasting \"" + std::string(lhs.text) +
+                               "\" and \"" + std::string(rhs.text) +
+                               "\" does not give a valid preprocessing token");
     }
+    PPToken result;
+    result.text = text;
+    result.kind = t.kind;
+    result.hideSet = hideSets_.intersect(lhs.hideSet, rhs.hideSet);
+    result.loc = lhs.loc;
+    result.flags = lhs.flags;
+    return result;
+  }
+};
 
-    std::string replacement = functionMacroReplacements[macroName];
+// IncrementalPreProcessor: Keeps the expansion of a buffer up to date as
+// it is edited
+//
+// The text is cut into regions of about kRegionLines lines at the restart
+// points PreProcessor reports: line starts outside any conditional, where
+// nothing but the macros carries over from the lines before. Each region
+// records the spans it covers in the text and the output, a hash of every
+// name it looked up as a macro, and the macros in force after it, taken as
+// a snapshot; a region that defines nothing shares the one before it.
+//
+// An edit preprocesses again from the start of the region it falls in,
+// with the macros in force there, until a restart point where an old
+// region starts past the edit, and splices the new output in. While the
+// macros from there on differ from before, a later region runs again if
+// it read a changed name or defines macros itself; the rest keep their
+// output.
+//
+// Each run resolves #include afresh, so a #pragma once header included
+// both before and after an edit point is read twice.
+class IncrementalPreProcessor {
+public:
+  static constexpr unsigned kRegionLines = 64;
+
+  // Preprocess text, starting from the macros in predefined if given
+  explicit IncrementalPreProcessor(
+      std::string text,
+      std::shared_ptr<const MacroSnapshot> predefined = nullptr)
+      : text_(std::move(text)), pp_("") {
+    initial_ = predefined ? std::move(predefined) : pp_.snapshotMacros();
+    pp_.trackMacroReads(&reads_);
+    pp_.onRestartPoint([this](unsigned offset) { return restartAt(offset); });
+  }
 
-    // Simple parameter substitution
-    if (functionMacros.find(macroName) != functionMacros.end()) {
-      const auto &params = functionMacros[macroName];
+  // The callback registered on pp_ points back at this object.
+  IncrementalPreProcessor(const IncrementalPreProcessor &) = delete;
+  IncrementalPreProcessor &operator=(const IncrementalPreProcessor &) = delete;
 
-      for (size_t i = 0; i < params.size() && i < args.size(); i++) {
-        // Replace parameter with argument in replacement text
-        std::string param = params[i];
-        std::string arg = args[i];
+  // Search paths and the file cache are configured here, before the first
+  // call to output() or edit().
+  PreProcessor &preprocessor() { return pp_; }
 
-        // Trim whitespace from argument
-        size_t start = arg.find_first_not_of(" \t");
-        size_t end = arg.find_last_not_of(" \t");
-        if (start != std::string::npos) {
-          arg = arg.substr(start, end - start + 1);
-        }
+  const std::string &text() const { return text_; }
+
+  // The expansion of text(), as PreProcessor::expandMacros() gives it
+  const std::string &output() {
+    if (regions_.empty())
+      rebuild();
+    return output_;
+  }
+
+  // Replace [begin, end) of the text with replacement and bring output()
+  // up to date. After an exception the next call preprocesses everything.
+  void edit(size_t begin, size_t end, std::string_view replacement) {
+    if (begin > end || end > text_.size())
+      throw std::runtime_error("Edit range is outside the text");
+    size_t inserted = replacement.size();
+    text_.replace(begin, end - begin, std::string(replacement));
+    try {
+      if (regions_.empty())
+        rebuild();
+      else
+        update(begin, end, inserted);
+    } catch (...) {
+      regions_.clear();
+      output_.clear();
+      throw;
+    }
+  }
 
-        // Simple string replacement
-        size_t pos = 0;
-        while ((pos = replacement.find(param, pos)) != std::string::npos) {
-          replacement.replace(pos, param.length(), arg);
-          pos += arg.length();
+  size_t regionCount() const { return regions_.size(); }
+
+  // Regions preprocessed by the last output() or edit() that did any work
+  size_t regionsRun() const { return regionsRun_; }
+
+private:
+  struct Region {
+    size_t begin, end;         // Span of text_
+    size_t outBegin, outEnd;   // Span of output_
+    std::vector<size_t> reads; // Sorted macroNameHash() of names looked up
+    std::shared_ptr<const MacroSnapshot> after; // Macros in force after it
+  };
+
+  // The run in progress, as restartAt() sees it
+  struct Run {
+    size_t from;         // Offset in text_ of the PreProcessor's input
+    size_t resyncFrom;   // Old regions starting here or later can end it
+    size_t candidate;    // Index of the next old region that might
+    unsigned lines;      // Restart points passed in the open region
+    size_t regionBegin;  // Where the open region starts in text_
+    size_t outBegin;     // ... and in scratch_
+    size_t changesMark;  // macroChanges() when its macros were taken
+    std::shared_ptr<const MacroSnapshot> macros; // In force at its start
+    bool stopped;        // Ended where an old region starts
+  };
+
+  std::string text_;
+  std::string output_;
+  PreProcessor pp_;
+  std::shared_ptr<const MacroSnapshot> initial_;
+  std::vector<Region> regions_;
+  std::vector<Region> fresh_; // Regions made by the run in progress
+  std::vector<size_t> reads_; // Names read in the open region
+  std::string scratch_;       // Output of the run in progress
+  Run run_{};
+  size_t regionsRun_ = 0;
+
+  void rebuild() {
+    regions_.clear();
+    output_.clear();
+    regionsRun_ = 0;
+    std::shared_ptr<const MacroSnapshot> unused;
+    reprocess(0, 0, initial_, unused);
+  }
+
+  // Bring the regions and output up to date after [begin, end) of the old
+  // text became inserted bytes
+  void update(size_t begin, size_t end, size_t inserted) {
+    const ptrdiff_t shift =
+        static_cast<ptrdiff_t>(inserted) - static_cast<ptrdiff_t>(end - begin);
+    regionsRun_ = 0;
+    auto touched = std::upper_bound(
+        regions_.begin(), regions_.end(), begin,
+        [](size_t offset, const Region &region) { return offset < region.end; });
+    size_t first = touched == regions_.end()
+                       ? regions_.size() - 1
+                       : static_cast<size_t>(touched - regions_.begin());
+
+    // Regions starting inside the replaced text are merged into the first
+    size_t merged = first + 1;
+    while (merged < regions_.size() && regions_[merged].begin < end)
+      merged++;
+    if (merged > first + 1) {
+      regions_[first].end = regions_[merged - 1].end;
+      regions_[first].outEnd = regions_[merged - 1].outEnd;
+      regions_[first].after = regions_[merged - 1].after;
+      regions_.erase(regions_.begin() + first + 1, regions_.begin() + merged);
+    }
+    regions_[first].end += shift;
+    for (size_t i = first + 1; i < regions_.size(); i++)
+      shiftRegion(regions_[i], shift, 0);
+
+    // Whether the last line before a region invokes a function-like macro
+    // depends on the region's first token, so an edit reaching back to it
+    // starts a region earlier.
+    while (first > 0 && begin <= firstToken(regions_[first].begin))
+      first--;
+
+    std::shared_ptr<const MacroSnapshot> oldMacros;
+    size_t i = reprocess(first, begin + inserted,
+                         first ? regions_[first - 1].after : initial_,
+                         oldMacros);
+
+    // Carry changed macros forward for as long as they differ
+    std::shared_ptr<const MacroSnapshot> newMacros = regions_[i - 1].after;
+    std::vector<size_t> changed;
+    if (newMacros != oldMacros)
+      changed = changedMacros(*oldMacros, *newMacros);
+    while (i < regions_.size() && !changed.empty()) {
+      Region &region = regions_[i];
+      if (region.after == oldMacros && !readsAny(region.reads, changed)) {
+        region.after = newMacros;
+        i++;
+        continue;
+      }
+      i = reprocess(i, region.begin + 1, newMacros, oldMacros);
+      newMacros = regions_[i - 1].after;
+      changed.clear();
+      if (newMacros != oldMacros)
+        changed = changedMacros(*oldMacros, *newMacros);
+    }
+  }
+
+  // Preprocess from the start of regions_[first] (the text, if there are
+  // no regions) with the macros in start until a restart point at or past
+  // resyncFrom where an old region starts, or the end of the text. The new
+  // regions replace the old ones they cover, whose final macros go to
+  // oldMacros. Returns the index after the new regions.
+  size_t reprocess(size_t first, size_t resyncFrom,
+                   std::shared_ptr<const MacroSnapshot> start,
+                   std::shared_ptr<const MacroSnapshot> &oldMacros) {
+    size_t from = first < regions_.size() ? regions_[first].begin : 0;
+    run_ = {from, resyncFrom, first + 1, 0, from, 0, 0, start, false};
+    fresh_.clear();
+    scratch_.clear();
+    reads_.clear();
+    pp_.reset(std::string_view(text_).substr(from), std::move(start));
+    StringSink sink(scratch_);
+    pp_.expandMacros(sink);
+    if (!run_.stopped)
+      closeRegion(text_.size());
+
+    size_t last = run_.stopped ? run_.candidate : regions_.size();
+    size_t outBegin = first < regions_.size() ? regions_[first].outBegin : 0;
+    size_t outEnd = last > first ? regions_[last - 1].outEnd : outBegin;
+    oldMacros = last > first ? regions_[last - 1].after : nullptr;
+    output_.replace(outBegin, outEnd - outBegin, scratch_);
+    const ptrdiff_t outShift = static_cast<ptrdiff_t>(scratch_.size()) -
+                               static_cast<ptrdiff_t>(outEnd - outBegin);
+    for (Region &region : fresh_)
+      shiftRegion(region, 0, static_cast<ptrdiff_t>(outBegin));
+    for (size_t i = last; i < regions_.size(); i++)
+      shiftRegion(regions_[i], 0, outShift);
+    regions_.erase(regions_.begin() + first, regions_.begin() + last);
+    regions_.insert(regions_.begin() + first,
+                    std::make_move_iterator(fresh_.begin()),
+                    std::make_move_iterator(fresh_.end()));
+    regionsRun_ += fresh_.size();
+    return first + fresh_.size();
+  }
+
+  // PreProcessor::onRestartPoint() callback: end the open region here
+  // every kRegionLines restart points, and the run where an old region
+  // starts past the edit.
+  bool restartAt(unsigned offset) {
+    size_t at = run_.from + offset;
+    if (at >= text_.size())
+      return true;
+    while (run_.candidate < regions_.size() &&
+           regions_[run_.candidate].begin < at)
+      run_.candidate++;
+    if (at >= run_.resyncFrom && run_.candidate < regions_.size() &&
+        regions_[run_.candidate].begin == at) {
+      closeRegion(at);
+      run_.stopped = true;
+      return false;
+    }
+    if (++run_.lines >= kRegionLines)
+      closeRegion(at);
+    return true;
+  }
+
+  void closeRegion(size_t end) {
+    Region region{run_.regionBegin, end, run_.outBegin, scratch_.size(), {},
+                  nullptr};
+    std::sort(reads_.begin(), reads_.end());
+    region.reads.assign(reads_.begin(),
+                        std::unique(reads_.begin(), reads_.end()));
+    reads_.clear();
+    if (pp_.macroChanges() != run_.changesMark) {
+      run_.macros = pp_.snapshotMacros();
+      run_.changesMark = pp_.macroChanges();
+    }
+    region.after = run_.macros;
+    fresh_.push_back(std::move(region));
+    run_.regionBegin = end;
+    run_.outBegin = scratch_.size();
+    run_.lines = 0;
+  }
+
+  // Offset of the first byte at or after pos that is not whitespace or
+  // part of a comment
+  size_t firstToken(size_t pos) const {
+    using namespace pp_detail;
+    const char *data = text_.data();
+    const size_t size = text_.size();
+    while (pos < size) {
+      if (data[pos] == '\n' ||
+          isHorizontalSpace(static_cast<unsigned char>(data[pos]))) {
+        pos++;
+      } else if (data[pos] == '/' && pos + 1 < size && data[pos + 1] == '*') {
+        pos = findBlockCommentEnd(data, pos + 2, size);
+        pos = pos < size ? pos + 2 : size;
+      } else if (data[pos] == '/' && pos + 1 < size && data[pos + 1] == '/') {
+        pos = findNewline(data, pos, size);
+      } else {
+        break;
+      }
+    }
+    return pos;
+  }
+
+  static void shiftRegion(Region &region, ptrdiff_t shift,
+                          ptrdiff_t outShift) {
+    region.begin += shift;
+    region.end += shift;
+    region.outBegin += outShift;
+    region.outEnd += outShift;
+  }
+
+  static bool readsAny(const std::vector<size_t> &reads,
+                       const std::vector<size_t> &names) {
+    for (size_t name : names) {
+      if (std::binary_search(reads.begin(), reads.end(), name))
+        return true;
+    }
+    return false;
+  }
+
+  // Sorted hashes of the names a and b do not define the same way
+  static std::vector<size_t> changedMacros(const MacroSnapshot &a,
+                                           const MacroSnapshot &b) {
+    std::vector<size_t> changed;
+    auto compare = [&](const MacroSnapshot &from, const MacroSnapshot &to,
+                       bool bodies) {
+      from.macros().forEach([&](uint32_t id, const MacroDef &def) {
+        std::string_view name = from.identifiers().spelling(id);
+        const MacroDef *other = to.macros().find(to.identifiers().find(name));
+        if (!other || (bodies && !sameDefinition(def, *other)))
+          changed.push_back(PreProcessor::macroNameHash(name));
+      });
+    };
+    compare(a, b, true);
+    compare(b, a, false);
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    return changed;
+  }
+
+  static bool sameDefinition(const MacroDef &a, const MacroDef &b) {
+    return a.kind == b.kind && a.variadic == b.variadic &&
+           a.params.size() == b.params.size() &&
+           std::equal(a.params.begin(), a.params.end(), b.params.begin()) &&
+           a.text == b.text;
+  }
+};
+
+// parallelFor: Runs task(i) for every i in [0, count) on up to threads
+// threads (0 means one per hardware thread).
+//
+// Each worker starts with a contiguous block of indices in its own deque,
+// takes work from the front of it and, once it runs dry, steals from the
+// back of the other workers' deques. Tasks are never added after the start,
+// so a worker that finds every deque empty is done. The first exception a
+// task throws is rethrown once all workers have stopped.
+inline void parallelFor(size_t count, unsigned threads,
+                        const std::function<void(size_t)> &task) {
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = static_cast<unsigned>(std::min<size_t>(threads, count));
+  if (threads <= 1) {
+    for (size_t i = 0; i < count; i++)
+      task(i);
+    return;
+  }
+
+  struct Lane {
+    std::mutex mutex;
+    std::deque<size_t> work;
+  };
+  std::deque<Lane> lanes(threads);
+  for (unsigned w = 0; w < threads; w++) {
+    for (size_t i = count * w / threads; i < count * (w + 1) / threads; i++)
+      lanes[w].work.push_back(i);
+  }
+
+  std::mutex errorMutex;
+  std::exception_ptr error;
+  std::atomic<bool> failed{false};
+
+  auto worker = [&](unsigned self) {
+    while (!failed.load(std::memory_order_relaxed)) {
+      size_t index = 0;
+      bool found = false;
+      {
+        Lane &own = lanes[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.work.empty()) {
+          index = own.work.front();
+          own.work.pop_front();
+          found = true;
+        }
+      }
+      for (unsigned k = 1; !found && k < threads; k++) {
+        Lane &victim = lanes[(self + k) % threads];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.work.empty()) {
+          index = victim.work.back();
+          victim.work.pop_back();
+          found = true;
         }
       }
+      if (!found)
+        return;
+
+      try {
+        task(index);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        if (!error)
+          error = std::current_exception();
+        failed.store(true);
+      }
+    }
+  };
+
+  // A lane whose thread cannot be started is emptied by the others
+  // stealing from it, this thread at least
+  std::vector<std::thread> pool;
+  pool.reserve(threads - 1);
+  for (unsigned w = 1; w < threads; w++) {
+    try {
+      pool.emplace_back(worker, w);
+    } catch (...) {
+      break;
+    }
+  }
+  worker(0);
+  for (std::thread &thread : pool)
+    thread.join();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+// BatchOptions: Command-line state shared by every translation unit
+struct BatchOptions {
+  std::vector<std::string> defines;   // -D, as NAME or NAME=text
+  std::vector<std::string> undefines; // -U, applied after the defines
+  std::vector<std::string> quoteIncludePaths;  // -iquote
+  std::vector<std::string> includePaths;       // -I
+  std::vector<std::string> systemIncludePaths; // -isystem
+  unsigned threads = 0;           // 0: one per hardware thread
+  FileCache *fileCache = nullptr; // nullptr: FileCache::shared()
+  // Looks up #includes ahead of time, through its own FileCache
+  IncludePrefetcher *prefetcher = nullptr;
+  // Macros every translation unit starts from, before the -D/-U options
+  std::shared_ptr<const MacroSnapshot> snapshot;
+};
+
+// BatchResult: The outcome of preprocessing one translation unit
+struct BatchResult {
+  std::string path;
+  std::string output;
+  std::string error; // Empty on success
+};
+
+// BatchPreprocessor: Preprocesses many translation units in parallel
+//
+// Every translation unit gets its own PreProcessor, so macro state never
+// leaks between them, but they all read headers through one FileCache and
+// start from one macro snapshot, so the -D/-U options are parsed once per
+// batch rather than once per file. Results come back in input order
+// whatever the scheduling was.
+class BatchPreprocessor {
+public:
+  explicit BatchPreprocessor(BatchOptions options)
+      : options_(std::move(options)) {
+    PreProcessor base("");
+    if (options_.snapshot)
+      base.setMacroSnapshot(options_.snapshot);
+    for (const std::string &definition : options_.defines)
+      base.define(definition);
+    for (const std::string &name : options_.undefines)
+      base.undefine(name);
+    snapshot_ = base.snapshotMacros();
+  }
+
+  std::vector<BatchResult> run(const std::vector<std::string> &paths) const {
+    std::vector<BatchResult> results(paths.size());
+    parallelFor(paths.size(), options_.threads,
+                [&](size_t i) { results[i] = preprocess(paths[i]); });
+    return results;
+  }
+
+  // Preprocess a single file with the batch options
+  BatchResult preprocess(const std::string &path) const {
+    BatchResult result;
+    result.path = path;
+    try {
+      FileCache &cache = options_.prefetcher ? options_.prefetcher->fileCache()
+                         : options_.fileCache ? *options_.fileCache
+                                              : FileCache::shared();
+      PreProcessor pp = PreProcessor::fromFile(path, cache);
+      configure(pp);
+      result.output = pp.expandMacros();
+    } catch (const std::exception &e) {
+      result.output.clear();
+      result.error = e.what();
     }
+    return result;
+  }
 
-    return replacement;
+private:
+  void configure(PreProcessor &pp) const {
+    pp.setMacroSnapshot(snapshot_);
+    if (options_.prefetcher)
+      pp.setIncludePrefetcher(*options_.prefetcher);
+    for (const std::string &dir : options_.quoteIncludePaths)
+      pp.addQuoteIncludePath(dir);
+    for (const std::string &dir : options_.includePaths)
+      pp.addIncludePath(dir);
+    for (const std::string &dir : options_.systemIncludePaths)
+      pp.addSystemIncludePath(dir);
   }
+
+  BatchOptions options_;
+  std::shared_ptr<const MacroSnapshot> snapshot_;
 };
@@ -31,8 +31,8 @@ float f = FLOAT_SUFFIX;)";
 #if 0x10
     int hex_condition = 16;
 #endif
-#if 3.14
-    int float_condition = 1;
+#if 0x10 > 010
+    int radix_condition = 1;
 #endif)";
     
     PreProcessor pp2(input2);
@@ -0,0 +1,204 @@
+#include "pp.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <memory_resource>
+#include <new>
+#include <string>
+
+// Counts global heap allocations made while expanding macro-free and
+// object-macro input, and checks the count does not depend on input size.
+// A whole macro-heavy translation unit must stay under a fixed budget, and
+// a PreProcessor reused through reset() must not allocate at all.
+static std::atomic<size_t> allocationCount{0};
+
+void *operator new(std::size_t size) {
+  allocationCount++;
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+// GCC cannot see that the replaced operator new pairs with these, and warns
+// about every inlined delete.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  allocationCount++;
+  size_t align = static_cast<size_t>(alignment);
+  if (void *p = std::aligned_alloc(align, (size + align - 1) / align * align))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+// Upstream resource that counts the chunks a PreProcessor asks it for
+class CountingResource : public std::pmr::memory_resource {
+public:
+  size_t allocations = 0;
+
+private:
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    allocations++;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+  }
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+    std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+  }
+  bool do_is_equal(const memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+};
+
+class AllocationTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+  static std::string repeat(const std::string &unit, int times) {
+    std::string out;
+    for (int i = 0; i < times; i++)
+      out += unit;
+    return out;
+  }
+
+  static size_t allocationsFor(const std::string &input) {
+    PreProcessor pp(input);
+    size_t before = allocationCount.load();
+    std::string output = pp.expandMacros();
+    size_t after = allocationCount.load();
+    return after - before;
+  }
+
+public:
+  void runTest(const std::string &testName, const std::string &prefix,
+               const std::string &unit) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+
+    size_t small = allocationsFor(prefix + repeat(unit, 10));
+    size_t large = allocationsFor(prefix + repeat(unit, 10000));
+    std::cout << "Allocations: " << small << " (10 lines), " << large
+              << " (10000 lines)\n";
+
+    if (small == large) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  // Everything from construction to destruction, output growth excluded
+  void runBudgetTest(const std::string &testName, const std::string &input,
+                     size_t budget) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+
+    std::string output;
+    output.reserve(input.size() * 2);
+    CountingResource upstream;
+    size_t before = allocationCount.load();
+    {
+      PreProcessor pp(input, &upstream);
+      StringSink sink(output);
+      pp.expandMacros(sink);
+    }
+    size_t count = allocationCount.load() - before;
+    std::cout << "Allocations: " << count << " (budget " << budget << "), "
+              << upstream.allocations << " from the upstream resource\n";
+
+    if (count < budget && upstream.allocations > 0) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  // Reset one PreProcessor onto input repeatedly; once warm, a round should
+  // find everything it needs already allocated.
+  void runResetTest(const std::string &testName, const std::string &input) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+
+    std::string output;
+    output.reserve(input.size() * 2);
+    PreProcessor pp("");
+    size_t warm = 0;
+    for (int round = 0; round < 20; round++) {
+      size_t before = allocationCount.load();
+      pp.reset(input);
+      output.clear();
+      StringSink sink(output);
+      pp.expandMacros(sink);
+      size_t count = allocationCount.load() - before;
+      if (round == 0)
+        std::cout << "First round: " << count << " allocations\n";
+      else
+        warm += count;
+    }
+    std::cout << "Later rounds: " << warm << " allocations\n";
+
+    if (warm == 0) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+int main() {
+  AllocationTester tester;
+
+  tester.runTest("Macro-free Source", "",
+                 "static int counter = compute(value, 42); // comment\n"
+                 "/* block */ if (counter > limit) { return \"text\"; }\n");
+
+  tester.runTest("Object Macros", "#define LIMIT 100\n#define NAME \"pp\"\n",
+                 "int limit = LIMIT; const char *name = NAME;\n");
+
+  tester.runTest("Conditionals", "#define VERSION 3\n#define __GNUC__ 9\n",
+                 "#if defined(VERSION) && VERSION >= 2 && (__GNUC__ << 1) > 4\n"
+                 "int modern;\n#elif 1\nint old;\n#endif\n");
+
+  std::string unit;
+  for (int i = 0; i < 400; i++)
+    unit += "#define OPT_" + std::to_string(i) + " " + std::to_string(i) + "\n";
+  unit += "#define MAX(a, b) ((a) > (b) ? (a) : (b))\n#define STR(x) #x\n"
+          "#define CAT(a, b) a ## b\n"
+          "#define LOG(fmt, ...) printf(fmt, __VA_ARGS__)\n";
+  for (int i = 0; i < 2000; i++)
+    unit += "int CAT(v, " + std::to_string(i) + ") = MAX(OPT_" +
+            std::to_string(i % 400) +
+            ", OPT_1); LOG(STR(x), 1, MAX(2, 3));\n"
+            "#if OPT_5 > 3 && defined(MAX)\nint a;\n#else\nint b;\n#endif\n";
+  tester.runBudgetTest("Whole Translation Unit", unit, 100);
+  tester.runResetTest(
+      "Reset Reuses Capacity",
+      unit.substr(0, unit.find("#endif\n", 8 * 1024) + 7)); // ~8 KB
+
+  return tester.printSummary();
+}
@@ -0,0 +1,176 @@
+#include "pp.hpp"
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Covers BatchPreprocessor and the pieces it is built from: parallelFor,
+// -D/-U handling and identifier tables layered on a shared parent.
+class BatchTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+  std::string root;
+
+  void report(bool passed) {
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  void begin(const std::string &testName) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+  }
+
+  void write(const std::string &name, const std::string &text) {
+    std::ofstream(root + "/" + name, std::ios::binary) << text;
+  }
+
+public:
+  std::vector<std::string> units;
+
+  BatchTester() {
+    char pattern[] = "/tmp/pp_batch_XXXXXX";
+    root = mkdtemp(pattern);
+    std::system(("mkdir -p " + root + "/inc").c_str());
+    write("inc/common.h", "#ifndef COMMON_H\n#define COMMON_H\n"
+                          "#define SCALE(x) ((x) * FACTOR)\n#endif\n");
+    for (int i = 0; i < 200; i++) {
+      std::string name = "tu" + std::to_string(i) + ".c";
+      write(name, "#include <common.h>\n#include <common.h>\n"
+                  "int v" + std::to_string(i) + " = SCALE(" +
+                      std::to_string(i) + ");\n"
+                  "#ifdef DROPPED\nint dropped;\n#endif\n"
+                  "#define LOCAL_" + std::to_string(i) + " 1\n"
+                  "#ifdef LOCAL_" + std::to_string(i == 0 ? 1 : 0) +
+                      "\nint leaked;\n#endif\n");
+      units.push_back(root + "/" + name);
+    }
+    write("broken.c", "#include \"missing.h\"\n");
+  }
+
+  ~BatchTester() { std::system(("rm -rf " + root).c_str()); }
+
+  BatchOptions options(unsigned threads) const {
+    BatchOptions opts;
+    opts.defines = {"FACTOR=3", "DROPPED"};
+    opts.undefines = {"DROPPED"};
+    opts.includePaths = {root + "/inc"};
+    opts.threads = threads;
+    return opts;
+  }
+
+  void runOutputTest() {
+    begin("Single Unit Output");
+    BatchPreprocessor batch(options(1));
+    BatchResult result = batch.preprocess(units[7]);
+    bool ok = result.error.empty() &&
+              result.output.find("int v7 = ((7) * 3);") != std::string::npos &&
+              result.output.find("dropped") == std::string::npos &&
+              result.output.find("leaked") == std::string::npos;
+    std::cout << "Output:\n" << result.output << "Error: " << result.error
+              << "\n";
+    report(ok);
+  }
+
+  void runDeterminismTest() {
+    begin("Same Results On 1 And 8 Threads");
+    std::vector<std::string> paths = units;
+    paths.insert(paths.begin() + 50, root + "/broken.c");
+    std::vector<BatchResult> serial = BatchPreprocessor(options(1)).run(paths);
+    std::vector<BatchResult> parallel =
+        BatchPreprocessor(options(8)).run(paths);
+
+    bool same = serial.size() == paths.size() &&
+                parallel.size() == paths.size();
+    for (size_t i = 0; same && i < paths.size(); i++) {
+      same = serial[i].path == paths[i] && parallel[i].path == paths[i] &&
+             serial[i].output == parallel[i].output &&
+             serial[i].error == parallel[i].error;
+    }
+    bool brokenReported =
+        parallel[50].error.find("'missing.h' file not found") !=
+        std::string::npos;
+    std::cout << "Identical: " << same << ", error reported: "
+              << brokenReported << "\n";
+    report(same && brokenReported);
+  }
+
+  void runParallelForTest() {
+    begin("parallelFor Visits Every Index Once");
+    std::vector<std::atomic<int>> visits(10007);
+    parallelFor(visits.size(), 16, [&](size_t i) { visits[i]++; });
+    bool once = true;
+    for (const std::atomic<int> &v : visits)
+      once = once && v.load() == 1;
+
+    bool rethrown = false;
+    try {
+      parallelFor(100, 4, [](size_t i) {
+        if (i == 42)
+          throw std::runtime_error("task failed");
+      });
+    } catch (const std::runtime_error &e) {
+      rethrown = std::string(e.what()) == "task failed";
+    }
+    std::cout << "Once: " << once << ", rethrown: " << rethrown << "\n";
+    report(once && rethrown);
+  }
+
+  void runSharedIdentifiersTest() {
+    begin("Identifier Table Over A Shared Parent");
+    auto parent = std::make_shared<IdentifierTable>();
+    uint32_t shared = parent->intern("shared");
+    IdentifierTable a(parent), b(parent);
+    uint32_t aLocal = a.intern("local_a");
+    uint32_t bLocal = b.intern("local_b");
+    bool ok = a.intern("shared") == shared && b.find("shared") == shared &&
+              aLocal == 1 && bLocal == 1 && a.spelling(aLocal) == "local_a" &&
+              b.spelling(bLocal) == "local_b" &&
+              a.spelling(shared) == "shared" &&
+              a.find("local_b") == IdentifierTable::kInvalidId &&
+              parent->size() == 1 && a.size() == 2;
+
+    PreProcessor pp("#if defined(X) && Y == 2 && !defined(Z)\nok\n#endif\n");
+    pp.setSharedIdentifiers(parent);
+    pp.define("X");
+    pp.define("Y=2");
+    pp.define("Z=1");
+    pp.undefine("Z");
+    ok = ok && pp.expandMacros().find("ok") != std::string::npos;
+
+    std::cout << "IDs: shared " << shared << ", a " << aLocal << ", b "
+              << bLocal << "\n";
+    report(ok);
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+int main() {
+  BatchTester tester;
+
+  tester.runOutputTest();
+  tester.runDeterminismTest();
+  tester.runParallelForTest();
+  tester.runSharedIdentifiersTest();
+
+  return tester.printSummary();
+}
@@ -0,0 +1,242 @@
+#include "pp.hpp"
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Covers BinarySink and BinaryReader: the binary form of the output must
+// decode to exactly the tokens, spacing and line ends of the text form,
+// with origins that point back at the source.
+class BinaryOutputTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+public:
+  std::string root;
+
+  BinaryOutputTester() {
+    char pattern[] = "/tmp/pp_binary_XXXXXX";
+    root = mkdtemp(pattern);
+  }
+
+  ~BinaryOutputTester() { std::system(("rm -rf '" + root + "'").c_str()); }
+
+  std::string write(const std::string &name, const std::string &text) {
+    std::ofstream(root + "/" + name, std::ios::binary) << text;
+    return root + "/" + name;
+  }
+
+  void check(const std::string &testName, bool passed) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+static std::string binary(const std::string &text, bool origins = false) {
+  std::string out;
+  BinarySink sink(out, origins);
+  PreProcessor(text).expandMacros(sink);
+  return out;
+}
+
+static std::string replayed(const std::string &data) {
+  std::string text;
+  StringSink sink(text);
+  BinaryReader(data).replay(sink);
+  return text;
+}
+
+static const std::string kMixed =
+    "#define CAT(a, b) a ## b\n#define STR(x) #x\n"
+    "#define ADD(a, b) ((a) + (b))\n"
+    "int v = ADD(1,\n        2) + CAT(x, 1);\n"
+    "char *s = \"a string\", t = STR( two  words );\n"
+    "#pragma pack(1)\n#define PLUS +\nint w = v PLUS+ 1;\n"
+    "#if 0\nhidden\n#endif\n\n\nlast ADD(p, q)";
+
+// Decoding gives back the text output, with and without origins
+static bool testRoundTrip() {
+  std::string expected = PreProcessor(kMixed).expandMacros();
+  return replayed(binary(kMixed)) == expected &&
+         replayed(binary(kMixed, true)) == expected &&
+         expected.find("#pragma pack(1)") != std::string::npos;
+}
+
+// Random programs round-trip too
+static bool testRandomPrograms() {
+  static const std::vector<std::string> pieces = {
+      "#define F(x) x G\n", "#define G(y) [y]\n", "#define G 1\n",
+      "#undef G\n", "#define H(a, b) a ## b F(a)\n", "#define E(x)\n",
+      "#define S(x) #x H(x, x)\n", "F(1)", "F(F(2))", "(3)", "G", "H(p, q)",
+      " E(1) ", "S( a  b )", "\n", "x", ",", "+", "-", "\n\n", "#pragma x\n"};
+  std::mt19937 rng(25);
+  for (int round = 0; round < 1000; round++) {
+    std::string text;
+    for (size_t n = rng() % 80; n; n--)
+      text += pieces[rng() % pieces.size()];
+    std::string expected;
+    try {
+      expected = PreProcessor(text).expandMacros();
+    } catch (const std::runtime_error &) {
+      continue;
+    }
+    if (replayed(binary(text, round % 2)) != expected) {
+      std::cout << "Mismatch in round " << round << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Batches carry the tokens nextBatch() gives, whatever the cap
+static bool testBatches() {
+  std::string text;
+  for (int i = 0; i < 200; i++)
+    text += kMixed + "\n";
+  std::vector<std::string> want, got;
+  std::vector<TokenKind> wantKinds, gotKinds;
+  std::vector<bool> wantLines, gotLines;
+  TokenBatch batch;
+  PreProcessor pp(text);
+  while (size_t n = pp.nextBatch(batch, 64))
+    for (size_t i = 0; i < n; i++) {
+      want.emplace_back(batch.texts[i]);
+      wantKinds.push_back(batch.kinds[i]);
+      wantLines.push_back(batch.flags[i] & TokenBatch::StartOfLine);
+    }
+  std::string data = binary(text);
+  BinaryReader reader(data);
+  size_t cap = 1;
+  while (size_t n = reader.nextBatch(batch, cap++))
+    for (size_t i = 0; i < n; i++) {
+      got.emplace_back(batch.texts[i]);
+      gotKinds.push_back(batch.kinds[i]);
+      gotLines.push_back(batch.flags[i] & TokenBatch::StartOfLine);
+    }
+  return reader.done() && want == got && wantKinds == gotKinds &&
+         wantLines == gotLines && got.size() > 1000;
+}
+
+// Repetitive source code comes out far smaller than its text
+static bool testSize() {
+  std::string text = "#define REG(base, i) ((base) + (i) * 4)\n";
+  for (int i = 0; i < 20000; i++)
+    text += "static unsigned value_" + std::to_string(i % 500) +
+            " = REG(CONTROL_BASE, " + std::to_string(i % 32) +
+            ") | flags;\n";
+  std::string plain = PreProcessor(text).expandMacros();
+  std::string packed = binary(text), mapped = binary(text, true);
+  std::cout << plain.size() << " bytes of text, " << packed.size()
+            << " binary, " << mapped.size() << " with origins\n";
+  return packed.size() * 3 < plain.size() && mapped.size() * 2 < plain.size();
+}
+
+// Each token maps to its file and line, expanded ones to the line and
+// name of the outermost macro
+static bool testOrigins(BinaryOutputTester &t) {
+  t.write("inc.h", "#define TWICE(x) x x\nint inc;\n");
+  std::string path = t.write(
+      "main.c", "#include \"inc.h\"\nint a;\n#define ONE 1\n"
+                "TWICE(ONE\n) b\n#pragma weak a\n");
+  std::string data;
+  BinarySink sink(data, true);
+  PreProcessor::fromFile(path).expandMacros(sink);
+  BinaryReader reader(data);
+  TokenBatch batch;
+  std::vector<TokenOrigin> origins;
+  size_t n = reader.nextBatch(batch, 100, &origins);
+  auto is = [&](size_t i, std::string_view text, const std::string &file,
+                unsigned line, std::string_view macro) {
+    return i < n && batch.texts[i] == text && origins[i].file == file &&
+           origins[i].line == line && origins[i].macro == macro;
+  };
+  return is(0, "int", t.root + "/inc.h", 2, "") &&
+         is(2, ";", t.root + "/inc.h", 2, "") &&
+         is(3, "int", path, 2, "") && is(4, "a", path, 2, "") &&
+         is(6, "1", path, 4, "TWICE") && is(7, "1", path, 4, "TWICE") &&
+         is(8, "b", path, 5, "") && is(9, "#", path, 6, "") &&
+         is(11, "weak a", path, 6, "") && n == 12;
+}
+
+// Output goes out in chunks while it is made, not all at the end
+static bool testStreamingWrites() {
+  std::string text;
+  for (int i = 0; i < 2000; i++)
+    text += "#define N" + std::to_string(i) + " " + std::to_string(i) +
+            "\nint x" + std::to_string(i) + " = N" + std::to_string(i) +
+            ";\n";
+  std::string joined;
+  size_t writes = 0, beforeFlush = 0;
+  {
+    BinarySink sink(
+        [&](std::string_view bytes) {
+          joined += bytes;
+          writes++;
+          if (bytes.size() > 256)
+            writes = 1u << 30;
+        },
+        true, 256);
+    PreProcessor pp(text);
+    pp.processAndExpand(sink);
+    beforeFlush = writes;
+    sink.flush();
+  }
+  return beforeFlush > 100 && writes < (1u << 30) &&
+         joined == binary(text, true) &&
+         replayed(joined) == PreProcessor(text).expandMacros();
+}
+
+// Anything but a whole stream is refused
+static bool testMalformed() {
+  std::string data = binary(kMixed, true);
+  auto throws = [](std::string_view bytes) {
+    try {
+      std::string text;
+      StringSink sink(text);
+      BinaryReader(bytes).replay(sink);
+    } catch (const std::runtime_error &) {
+      return true;
+    }
+    return false;
+  };
+  std::string corrupt = data;
+  corrupt[4] = '\x7f';
+  return throws("int x;") && throws(std::string_view(data).substr(0, 20)) &&
+         throws(std::string_view(data).substr(0, data.size() - 1)) &&
+         throws(corrupt) && !throws(data);
+}
+
+int main() {
+  BinaryOutputTester tester;
+  tester.check("Round Trip", testRoundTrip());
+  tester.check("Random Programs", testRandomPrograms());
+  tester.check("Batches", testBatches());
+  tester.check("Smaller Than Text", testSize());
+  tester.check("Origins", testOrigins(tester));
+  tester.check("Streaming Writes", testStreamingWrites());
+  tester.check("Malformed Streams", testMalformed());
+  return tester.printSummary();
+}
@@ -0,0 +1,196 @@
+#include "pp.hpp"
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// Covers the byte-level skipping of false conditional groups: nesting,
+// #else/#elif selection and the comments and literals that may hide a '#'.
+class ConditionalSkipTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+  static std::string normalizeSpaces(const std::string &str) {
+    std::string result;
+    bool lastWasSpace = false;
+    for (char c : str) {
+      if (std::isspace(static_cast<unsigned char>(c))) {
+        if (!lastWasSpace && !result.empty()) {
+          result += ' ';
+          lastWasSpace = true;
+        }
+      } else {
+        result += c;
+        lastWasSpace = false;
+      }
+    }
+    if (!result.empty() && result.back() == ' ')
+      result.pop_back();
+    return result;
+  }
+
+public:
+  void runTest(const std::string &testName, const std::string &input,
+               const std::string &expected) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    std::cout << "Input:\n" << input << "\n";
+    try {
+      PreProcessor pp(input);
+      std::string result = normalizeSpaces(pp.expandMacros());
+      std::cout << "Output:\n" << result << "\n";
+      std::cout << "Expected:\n" << expected << "\n";
+      if (result == expected) {
+        std::cout << "✓ PASSED\n";
+        passedTests++;
+        return;
+      }
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+    }
+    std::cout << "✗ FAILED\n";
+  }
+
+  // header is written to a scratch directory and included by main
+  void runErrorTest(const std::string &testName, const std::string &main,
+                    const std::string &expectedMessage,
+                    const std::string &header = "") {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    std::cout << "Input:\n" << main << "\n";
+    char pattern[] = "/tmp/pp_conditional_XXXXXX";
+    std::string root = mkdtemp(pattern);
+    std::ofstream(root + "/header.h", std::ios::binary) << header;
+    bool passed = false;
+    try {
+      PreProcessor pp(main);
+      pp.addIncludePath(root);
+      pp.expandMacros();
+      std::cout << "No error raised\n";
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      passed = std::string(e.what()).find(expectedMessage) != std::string::npos;
+    }
+    std::system(("rm -rf " + root).c_str());
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+int main() {
+  ConditionalSkipTester tester;
+
+  tester.runTest("Else Of True Branch Is Skipped",
+                 "#if 1\na\n#else\nb\n#endif\nc\n", "a c");
+
+  tester.runTest("Nested Groups In Dead Code",
+                 "#if 0\n#ifdef X\n#else\nno\n#endif\n#ifndef Y\n#endif\n"
+                 "#else\nyes\n#endif\n",
+                 "yes");
+
+  tester.runTest("Elif Chain", "#define B 1\n"
+                               "#if 0\na\n#elif B\nb\n#elif 1\nc\n#else\nd\n"
+                               "#endif\n",
+                 "b");
+
+  tester.runTest("Elif Falls Through To Else",
+                 "#ifdef MISSING\na\n#elif 0\nb\n#else\nc\n#endif\n", "c");
+
+  tester.runTest("Directive Inside Block Comment",
+                 "#if 0\n/*\n#endif\n#else\n*/ still dead\n#endif\nlive\n",
+                 "live");
+
+  tester.runTest("Directive Inside String Literal",
+                 "#if 0\nconst char *s = \"/*\";\n#endif\nlive\n", "live");
+
+  tester.runTest("Quotes Inside Dead Code",
+                 "#if 0\nchar q = '\"'; char e = '\\'';\n/* \" */ // \"\n"
+                 "#else\nalive\n#endif\n",
+                 "alive");
+
+  tester.runTest("Line Comment Hides Comment Start",
+                 "#if 0\nx // /* not a comment\n#endif\nlive\n", "live");
+
+  tester.runTest("Indented And Commented Directives",
+                 "#if 0\n  /* c */ #  else\nb\n\t#endif\n", "b");
+
+  tester.runTest("Hash Not At Line Start",
+                 "#if 0\na # endif\n#endif\nlive\n", "live");
+
+  tester.runTest("Long Dead Region",
+                 "#if 0\n" + std::string(5000, 'x') + "\n" +
+                     std::string(300, '\n') + "#endif\nend\n",
+                 "end");
+
+  tester.runErrorTest("Unterminated Group", "#if 0\nnever\n",
+                      "unterminated #if");
+  tester.runErrorTest("Unterminated Taken Group", "#if 1\nx\n#else\n",
+                      "unterminated #if");
+
+  // Open groups are kept on an explicit stack, so depth costs no C stack.
+  std::string deep;
+  for (int i = 0; i < 100000; i++)
+    deep += i % 2 ? "#if 1\n" : "#ifdef UNDEFINED\n#else\n";
+  deep += "deep\n";
+  for (int i = 0; i < 100000; i++)
+    deep += i % 2 ? "#endif\n" : "#elif 1\nbad\n#endif\n";
+  tester.runTest("Very Deep Nesting", deep, "deep");
+
+  tester.runErrorTest("Stray Endif", "a\n#endif\n", "#endif without #if");
+  tester.runErrorTest("Stray Else", "#if 1\n#endif\n#else\nb\n#endif\n",
+                      "#else without #if");
+  tester.runErrorTest("Stray Elif", "#elif 1\n", "#elif without #if");
+
+  // The same mistake gives the same error whichever group is taken
+  for (const char *first : {"0", "1"}) {
+    std::string taken = std::string(" (#if ") + first + ")";
+    tester.runErrorTest("Else After Else" + taken,
+                        std::string("#if ") + first +
+                            "\na\n#else\nb\n#else\nc\n#endif\n",
+                        "#else after #else");
+    tester.runErrorTest("Elif After Else" + taken,
+                        std::string("#if ") + first +
+                            "\na\n#else\nb\n#elif 1\nc\n#endif\n",
+                        "#elif after #else");
+  }
+  tester.runErrorTest("Else After Else Past A Taken Elif",
+                      "#if 0\n#elif 1\na\n#if 1\n#else\n#endif\n#else\n"
+                      "#else\n#endif\n",
+                      "#else after #else");
+
+  // A header's conditionals end with it; its #endif cannot close the
+  // includer's #if
+  tester.runErrorTest("Unbalanced Header",
+                      "#if 1\n#include \"header.h\"\n#else\nY\n#endif\n",
+                      "#endif without #if", "int g2;\n#endif\n");
+  tester.runErrorTest("Unterminated Group In Header",
+                      "#include \"header.h\"\nafter\n",
+                      "unterminated #if in '", "#if 0\nhidden\n");
+  tester.runErrorTest("Unterminated Taken Group In Header",
+                      "#if 1\n#include \"header.h\"\n#endif\n",
+                      "unterminated #if in '", "#if 1\nshown\n");
+  tester.runErrorTest("Else In Header",
+                      "#if 0\n#else\n#include \"header.h\"\n#endif\n",
+                      "#else without #if", "#else\nz\n");
+
+  return tester.printSummary();
+}
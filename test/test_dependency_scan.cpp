@@ -0,0 +1,166 @@
+#include "pp.hpp"
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Covers PreProcessor::scanDependencies() and IncludeGraph::depfile().
+// Headers are written to a scratch directory.
+class DependencyScanTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+public:
+  std::string root;
+
+  DependencyScanTester() {
+    char pattern[] = "/tmp/pp_deps_XXXXXX";
+    root = mkdtemp(pattern);
+    std::system(("mkdir -p " + root + "/sys '" + root + "/with space'").c_str());
+    write("main.c", "#include \"a.h\"\n"
+                    "#include \"b.h\"\n"
+                    "int main() { return A + B; }\n"
+                    "#include <sys.h>\n");
+    write("a.h", "#ifndef A_H\n#define A_H\n#include \"common.h\"\n"
+                 "#define A 1\n#endif\n");
+    write("b.h", "#ifndef B_H\n#define B_H\n#include \"common.h\"\n"
+                 "#include \"a.h\"\n#define B 2\n#endif\n");
+    write("common.h", "#pragma once\ntypedef int common;\n");
+    write("sys/sys.h", "#define SYS 1\n");
+    write("with space/odd$.h", "int odd;\n");
+    write("never.h", "#error never included\n");
+  }
+
+  ~DependencyScanTester() { std::system(("rm -rf '" + root + "'").c_str()); }
+
+  void write(const std::string &name, const std::string &text) {
+    std::ofstream(root + "/" + name, std::ios::binary) << text;
+  }
+
+  IncludeGraph scan(const std::string &file) {
+    FileCache cache;
+    PreProcessor pp = PreProcessor::fromFile(root + "/" + file, cache);
+    pp.addSystemIncludePath(root + "/sys");
+    return pp.scanDependencies();
+  }
+
+  // Paths of graph's files, relative to root
+  std::vector<std::string> names(const IncludeGraph &graph) {
+    std::vector<std::string> result;
+    for (const IncludeGraph::File &file : graph.files)
+      result.push_back(file.path.substr(root.size() + 1));
+    return result;
+  }
+
+  void check(const std::string &testName, bool passed) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+// Files in order of first inclusion, each edge once, guarded and
+// #pragma once headers included again still recorded as edges
+static bool testGraph(DependencyScanTester &t) {
+  IncludeGraph graph = t.scan("main.c");
+  std::vector<std::string> expected = {"main.c", "a.h", "common.h", "b.h",
+                                       "sys/sys.h"};
+  if (t.names(graph) != expected || !graph.files[4].system ||
+      graph.files[1].system)
+    return false;
+  std::vector<std::pair<unsigned, unsigned>> edges;
+  for (const IncludeGraph::Edge &edge : graph.edges)
+    edges.push_back({edge.from, edge.to});
+  return edges == std::vector<std::pair<unsigned, unsigned>>{
+                      {0, 1}, {1, 2}, {0, 3}, {3, 2}, {3, 1}, {0, 4}};
+}
+
+// Conditionals see macros from earlier headers and decide what is read
+static bool testConditionals(DependencyScanTester &t) {
+  t.write("cond.c", "#include \"a.h\"\n"
+                    "#if A == 1 && !defined(B_H)\n"
+                    "#include \"b.h\"\n"
+                    "#else\n"
+                    "#include \"never.h\"\n"
+                    "#endif\n"
+                    "#undef A\n"
+                    "#ifdef A\n"
+                    "#include \"never.h\"\n"
+                    "#endif\n");
+  std::vector<std::string> expected = {"cond.c", "a.h", "common.h", "b.h"};
+  return t.names(t.scan("cond.c")) == expected;
+}
+
+// Text lines are not expanded, and a '#' inside a comment or literal
+// never starts a directive
+static bool testTextLinesSkipped(DependencyScanTester &t) {
+  t.write("text.c", "#define F(a, b) a\n"
+                    "int x = F(1,\n"
+                    "/* a comment\n"
+                    "#include \"never.h\"\n"
+                    "*/ 2); char *s = \"\\\"#include \\\"never.h\\\"\";\n"
+                    "   /* lead */ #include \"a.h\"\n"
+                    "x = '#'; // #include \"never.h\"\n"
+                    "F(1)\n");
+  IncludeGraph graph = t.scan("text.c");
+  std::vector<std::string> expected = {"text.c", "a.h", "common.h"};
+  return t.names(graph) == expected;
+}
+
+// Make rules escape spaces and '$', wrap long lines and drop system
+// headers without systemHeaders
+static bool testDepfile(DependencyScanTester &t) {
+  t.write("odd.c", "#include \"with space/odd$.h\"\n#include <sys.h>\n");
+  IncludeGraph graph = t.scan("odd.c");
+  std::string all = graph.depfile("odd.o");
+  std::string user = graph.depfile("odd.o", false);
+  std::string odd = t.root + "/with\\ space/odd$$.h";
+  bool wrapped = true;
+  for (size_t start = 0, end; (end = all.find('\n', start)) != std::string::npos;
+       start = end + 1)
+    wrapped = wrapped && end - start <= 80;
+  return all.find(odd) != std::string::npos &&
+         all.find(t.root + "/sys/sys.h") != std::string::npos &&
+         all.find(" \\\n ") != std::string::npos && wrapped &&
+         user == "odd.o: " + t.root + "/odd.c " + odd + "\n";
+}
+
+// In-memory input is left out of the rule but still heads the graph
+static bool testInMemoryInput(DependencyScanTester &t) {
+  PreProcessor pp("#include \"" + t.root + "/a.h\"\nint y;\n");
+  IncludeGraph graph = pp.scanDependencies();
+  return graph.files.size() == 3 && graph.files[0].path == "<input>" &&
+         graph.depfile("y.o") ==
+             "y.o: " + t.root + "/a.h " + t.root + "/common.h\n";
+}
+
+int main() {
+  DependencyScanTester tester;
+  tester.check("Include Graph", testGraph(tester));
+  tester.check("Conditionals Decide Includes", testConditionals(tester));
+  tester.check("Text Lines Skipped", testTextLinesSkipped(tester));
+  tester.check("Depfile", testDepfile(tester));
+  tester.check("In-Memory Input", testInMemoryInput(tester));
+  return tester.printSummary();
+}
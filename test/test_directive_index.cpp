@@ -0,0 +1,278 @@
+#define PP_ENABLE_STATS
+#include "pp.hpp"
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+
+// Covers the DirectiveIndex that skips false groups in files read more than
+// once, and the cache of #if and #elif results that goes with it. Each file
+// is checked against the same text given in memory, which takes neither.
+class DirectiveIndexTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+  std::string root;
+
+  static std::string normalizeSpaces(const std::string &str) {
+    std::string result;
+    bool lastWasSpace = false;
+    for (char c : str) {
+      if (std::isspace(static_cast<unsigned char>(c))) {
+        if (!lastWasSpace && !result.empty()) {
+          result += ' ';
+          lastWasSpace = true;
+        }
+      } else {
+        result += c;
+        lastWasSpace = false;
+      }
+    }
+    if (!result.empty() && result.back() == ' ')
+      result.pop_back();
+    return result;
+  }
+
+  void report(bool passed) {
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  void begin(const std::string &testName) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+  }
+
+  void write(const std::string &name, const std::string &text) {
+    std::ofstream(root + "/" + name, std::ios::binary) << text;
+  }
+
+  static std::string expandText(const std::string &text) {
+    PreProcessor pp(text);
+    return normalizeSpaces(pp.expandMacros());
+  }
+
+  std::string expandFile(const std::string &name, PreprocessStats *stats) {
+    FileCache cache;
+    PreProcessor pp = PreProcessor::fromFile(root + "/" + name, cache);
+    pp.addIncludePath(root);
+    std::string result = normalizeSpaces(pp.expandMacros());
+    if (stats)
+      *stats = pp.stats();
+    return result;
+  }
+
+  // Include header once per setup, each setup being directives that come
+  // first, and compare with the header pasted in place of each #include.
+  // Returns the stats of the file run.
+  PreprocessStats runIncludes(const std::string &testName,
+                              const std::string &header,
+                              const std::vector<std::string> &setups) {
+    begin(testName);
+    std::string main, inlined;
+    for (const std::string &setup : setups) {
+      main += setup + "#include \"header.h\"\n";
+      inlined += setup + header + "\n";
+    }
+    write("header.h", header);
+    write("main.c", main);
+    PreprocessStats stats;
+    try {
+      std::string expected = expandText(inlined);
+      std::string result = expandFile("main.c", &stats);
+      std::cout << "Output:\n" << result.substr(0, 200) << "\n";
+      std::cout << "indexedSkips=" << stats.indexedSkips
+                << " conditionCacheHits=" << stats.conditionCacheHits
+                << "\n";
+      report(result == expected && !result.empty());
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      report(false);
+    }
+    return stats;
+  }
+
+  // A random nest of conditional groups over the macros A, B and C
+  static std::string randomGroups(std::mt19937 &rng, int depth) {
+    static const char *conditions[] = {"A", "B > 1", "defined(C)",
+                                       "A && !B", "C + 1 == 2", "0", "1"};
+    static const char *lines[] = {"x", "y A", "/* # not\n#endif */ z",
+                                  "\"str\"", "B C", "// #else\nw"};
+    std::string text;
+    int groups = 1 + rng() % 3;
+    for (int g = 0; g < groups; g++) {
+      text += std::string("#if ") + conditions[rng() % 7] + "\n";
+      int branches = rng() % 3;
+      for (int b = 0;; b++) {
+        text += std::string(lines[rng() % 6]) + "\n";
+        if (depth > 0 && rng() % 2)
+          text += randomGroups(rng, depth - 1);
+        if (b == branches)
+          break;
+        if (rng() % 3)
+          text += std::string("#elif ") + conditions[rng() % 7] + "\n";
+        else
+          text += std::string(rng() % 2 ? "#ifdef A\n#endif\n" : "") +
+                  "#elif 1\n";
+      }
+      if (rng() % 2)
+        text += "#else\nelse\n";
+      text += "#endif\n";
+    }
+    return text;
+  }
+
+public:
+  DirectiveIndexTester() {
+    char pattern[] = "/tmp/pp_directive_index_XXXXXX";
+    root = mkdtemp(pattern);
+  }
+
+  ~DirectiveIndexTester() { std::system(("rm -rf " + root).c_str()); }
+
+  void runHeavyHeaderTest() {
+    std::string header = "#if MODE == 0\nzero\n"
+                         "#elif MODE == 1\n#ifdef EXTRA\nextra\n# else\n"
+                         "plain\n#endif\none\n"
+                         "#elif MODE == 2\ntwo\n"
+                         "#else\nother\n#if 1\nnested\n#endif\n#endif\n"
+                         "#ifndef EXTRA\nno_extra\n#endif\n";
+    std::vector<std::string> setups;
+    for (int i = 0; i < 40; i++)
+      setups.push_back("#undef MODE\n#define MODE " + std::to_string(i % 4) +
+                       "\n" + (i % 5 == 0 ? "#define EXTRA\n" : "") +
+                       (i % 5 == 1 ? "#undef EXTRA\n" : ""));
+    PreprocessStats stats =
+        runIncludes("Heavily Conditioned Header", header, setups);
+    begin("Skips And Conditions Reused");
+    report(stats.indexedSkips > 0 &&
+           stats.conditionCacheHits > 0);
+  }
+
+  void runCommentsAndStringsTest() {
+    std::string header = "#if SEL\n"
+                         "/* a comment\n#else\n#endif */\n"
+                         "s = \"#elif 1 /*\"; c = '#';\n"
+                         "// #endif\n"
+                         "sel\n"
+                         "#else\n"
+                         "/*\n#endif\n*/ not_sel\n"
+                         "#endif\n"
+                         "#if 0 /* comment\n#else\n*/\nhidden\n#endif\n"
+                         "tail\n";
+    runIncludes("Comments And Strings Over Directive Lines", header,
+                {"#define SEL 1\n", "#undef SEL\n#define SEL 0\n",
+                 "#undef SEL\n#define SEL 1\n", "#undef SEL\n#define SEL 0\n"});
+  }
+
+  void runElifChainTest() {
+    std::string header;
+    for (int i = 0; i < 12; i++)
+      header += std::string(i ? "#elif" : "#if") + " N == " +
+                std::to_string(i) + "\nn" + std::to_string(i) + "\n";
+    header += "#else\nnone\n#endif\n";
+    std::vector<std::string> setups;
+    for (int i = 0; i < 14; i++)
+      setups.push_back("#undef N\n#define N " + std::to_string(13 - i) + "\n");
+    runIncludes("Elif Chain", header, setups);
+  }
+
+  void runRandomTest() {
+    std::mt19937 rng(27);
+    bool allPassed = true;
+    for (int round = 0; round < 30; round++) {
+      std::string header = randomGroups(rng, 3);
+      std::vector<std::string> setups;
+      for (int i = 0; i < 8; i++) {
+        std::string setup = "#undef A\n#undef B\n#undef C\n";
+        if (rng() % 2)
+          setup += "#define A " + std::to_string(rng() % 2) + "\n";
+        if (rng() % 2)
+          setup += "#define B " + std::to_string(rng() % 3) + "\n";
+        if (rng() % 2)
+          setup += "#define C 1\n";
+        setups.push_back(setup);
+      }
+      int before = passedTests;
+      runIncludes("Random Groups, Round " + std::to_string(round), header,
+                  setups);
+      allPassed &= passedTests > before;
+      testCount--;
+      passedTests = before;
+    }
+    begin("Random Groups Match In-Memory Input");
+    report(allPassed);
+  }
+
+  // The cache is keyed on the expression, so a result must go stale with
+  // any macro it read, including names that were not defined at the time
+  void runInvalidationTest() {
+    std::string header = "#if X > 1\nbig\n#elif defined(LATER)\nlater\n"
+                         "#else\nsmall\n#endif\n";
+    write("header.h", header);
+    write("main.c", "#define X 1\n#include \"header.h\"\n"
+                    "#include \"header.h\"\n"
+                    "#undef X\n#define X 2\n#include \"header.h\"\n"
+                    "#undef X\n#define LATER\n#include \"header.h\"\n"
+                    "#define X 5\n#include \"header.h\"\n");
+    begin("Redefinition Invalidates Cached Conditions");
+    try {
+      PreprocessStats stats;
+      std::string result = expandFile("main.c", &stats);
+      std::cout << "Output: " << result << "\n";
+      report(result == "small small big later big" &&
+             stats.conditionCacheHits > 0);
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      report(false);
+    }
+  }
+
+  // A condition that no longer parses once a macro changes raises, rather
+  // than reusing the earlier result
+  void runErrorTest() {
+    write("header.h", "#if F(1)\nyes\n#endif\n");
+    write("main.c", "#define F(x) x\n#include \"header.h\"\n"
+                    "#include \"header.h\"\n"
+                    "#undef F\n#define F(x) (x\n#include \"header.h\"\n");
+    begin("Stale Condition Is Evaluated Again");
+    try {
+      expandFile("main.c", nullptr);
+      std::cout << "No error raised\n";
+      report(false);
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      report(true);
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+int main() {
+  DirectiveIndexTester tester;
+  tester.runHeavyHeaderTest();
+  tester.runCommentsAndStringsTest();
+  tester.runElifChainTest();
+  tester.runRandomTest();
+  tester.runInvalidationTest();
+  tester.runErrorTest();
+  return tester.printSummary();
+}
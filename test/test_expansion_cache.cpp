@@ -0,0 +1,158 @@
+#define PP_ENABLE_STATS
+#include "pp.hpp"
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Covers the function macro expansion cache: output must never differ
+// from an uncached run, whatever is redefined between invocations, while
+// repeated invocations are reused.
+class ExpansionCacheTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+public:
+  void check(const std::string &testName, bool passed) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+static std::string uncached(const std::string &text) {
+  PreProcessor pp(text);
+  pp.setExpansionCacheSize(0);
+  return pp.expandMacros();
+}
+
+// Repeated invocations hit; the hit rate shows in the stats
+static bool testReuse() {
+  std::string text = "#define BIT(n) (1u << (n))\n#define CTRL 0x10\n"
+                     "#define REG_OFFSET(r, i) ((r) + (i) * 4)\n";
+  for (int i = 0; i < 100; i++)
+    text += "a = BIT(3) | REG_OFFSET(CTRL, 4);\n";
+  PreProcessor pp(text);
+  std::string out = pp.expandMacros();
+  PreprocessStats stats = pp.stats();
+  std::string json = stats.toJson();
+  return out == uncached(text) &&
+         out.find("a = (1u << (3)) | ((0x10) + (4) * 4);") !=
+             std::string::npos &&
+         stats.expansionCacheMisses == 2 && stats.expansionCacheHits == 198 &&
+         stats.functionExpansions == 200 &&
+         json.find("\"expansionCacheHits\": 198,") != std::string::npos;
+}
+
+// Redefining the macro, or any macro its result read, or defining a name
+// it looked up and found undefined, makes the old result stale
+static bool testInvalidation() {
+  std::string text = "#define F(x) (x + INNER + LATER)\n#define INNER 1\n"
+                     "F(a)\nF(a)\n#undef INNER\n#define INNER 2\nF(a)\n"
+                     "#define LATER 3\nF(a)\n#undef F\n#define F(x) x\nF(a)\n"
+                     "#undef LATER\nF(a) F(LATER)\n";
+  PreProcessor pp(text);
+  std::string out = pp.expandMacros();
+  PreprocessStats stats = pp.stats();
+  return out == uncached(text) &&
+         out.find("(a + 1 + LATER)\n(a + 1 + LATER)") != std::string::npos &&
+         out.find("(a + 2 + LATER)") != std::string::npos &&
+         out.find("(a + 2 + 3)") != std::string::npos &&
+         out.find("a LATER") != std::string::npos &&
+         stats.expansionCacheHits == 2;
+}
+
+// A result whose rescan would read on past the invocation is not reused
+static bool testContextDependent() {
+  std::string text = "#define G(y) [y]\n#define F(x) x G\n#define E()\n"
+                     "F(1)(2) F(1) ; F(1)(3) x E() y E()\n";
+  return uncached(text) == "\n\n\n1 [2] 1 G ; 1 [3] x y\n" &&
+         PreProcessor(text).expandMacros() == uncached(text);
+}
+
+// Random programs match an uncached run at any capacity
+static bool testRandomPrograms() {
+  static const std::vector<std::string> pieces = {
+      "#define F(x) x G\n", "#define G(y) [y]\n", "#define G 1\n",
+      "#undef G\n", "#define H(a, b) a ## b F(a)\n", "#define E(x)\n",
+      "#define S(x) #x H(x, x)\n", "#define J(x) x E(x)\n", "F(1)",
+      "F(F(2))", "(3)", "G", "H(p, q)", " E(1) ", "S( a  b )", "F(G)(4)",
+      "\n", "J(J(1))", "x", ",", "#define K(x) F(x) J(x)\n", "K(K(2))"};
+  std::mt19937 rng(11);
+  for (int round = 0; round < 3000; round++) {
+    std::string text;
+    for (size_t n = rng() % 60; n; n--)
+      text += pieces[rng() % pieces.size()];
+    text += text;
+    PreProcessor pp(text);
+    pp.setExpansionCacheSize(rng() % 4 ? rng() % 8 + 1 : 4096);
+    if (pp.expandMacros() != uncached(text)) {
+      std::cout << "Mismatch in round " << round << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// A full cache evicts the least recently used entry
+static bool testEviction() {
+  std::string text = "#define ID(x) x\n; ID(1) ID(2) ID(1) ID(3) ID(1) ID(2)\n";
+  PreProcessor pp(text);
+  pp.setExpansionCacheSize(2);
+  std::string out = pp.expandMacros();
+  PreprocessStats stats = pp.stats();
+  // 1, 2 miss; 1 hits; 3 evicts 2; 1 hits; 2 misses again
+  return out == "\n; 1 2 1 3 1 2\n" && stats.expansionCacheHits == 2 &&
+         stats.expansionCacheMisses == 4;
+}
+
+// Tokens from the cache stay valid in batches, through eviction
+static bool testBatches() {
+  std::string text = "#define CAT(a, b) a ## b\n#define W(x) CAT(x, _w) x\n";
+  for (int i = 0; i < 300; i++)
+    text += "W(v" + std::to_string(i % 7) + ") ";
+  PreProcessor expected(text);
+  expected.setExpansionCacheSize(0);
+  std::vector<std::string> want, got;
+  TokenBatch batch;
+  while (size_t n = expected.nextBatch(batch, 5))
+    for (size_t i = 0; i < n; i++)
+      want.emplace_back(batch.texts[i]);
+  PreProcessor pp(text);
+  pp.setExpansionCacheSize(3);
+  while (size_t n = pp.nextBatch(batch, 64))
+    for (size_t i = 0; i < n; i++)
+      got.emplace_back(batch.texts[i]);
+  return want == got && got.size() == 600;
+}
+
+int main() {
+  ExpansionCacheTester tester;
+  tester.check("Repeated Invocations Reused", testReuse());
+  tester.check("Redefinitions Invalidate", testInvalidation());
+  tester.check("Context Dependent Results", testContextDependent());
+  tester.check("Random Programs", testRandomPrograms());
+  tester.check("LRU Eviction", testEviction());
+  tester.check("Batches Through Eviction", testBatches());
+  return tester.printSummary();
+}
@@ -0,0 +1,217 @@
+#include "pp.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// Covers ExpansionLimits: each limit must stop pathological input quickly
+// with an ExpansionLimitError naming where it happened, and leave ordinary
+// input alone.
+class ExpansionLimitsTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+  void report(bool passed) {
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+public:
+  // Expect input to fail on limit, within a second, with message
+  void runLimitTest(const std::string &testName, const std::string &input,
+                    const ExpansionLimits &limits,
+                    ExpansionLimitError::Limit limit,
+                    const std::string &message, bool cache = true) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    auto start = std::chrono::steady_clock::now();
+    try {
+      PreProcessor pp(input);
+      if (!cache)
+        pp.setExpansionCacheSize(0);
+      pp.setExpansionLimits(limits);
+      pp.expandMacros();
+      std::cout << "No error raised\n";
+      report(false);
+    } catch (const ExpansionLimitError &e) {
+      double seconds = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+      std::cout << "Error: " << e.what() << "\n";
+      std::cout << "Expected: " << message << "\n";
+      report(e.limit() == limit && e.what() == message && seconds < 1);
+    } catch (const std::exception &e) {
+      std::cout << "Other error: " << e.what() << "\n";
+      report(false);
+    }
+  }
+
+  void runPassTest(const std::string &testName, const std::string &input,
+                   const ExpansionLimits &limits) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    try {
+      PreProcessor plain(input);
+      std::string expected = plain.expandMacros();
+      PreProcessor pp(input);
+      pp.setExpansionLimits(limits);
+      report(pp.expandMacros() == expected);
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      report(false);
+    }
+  }
+
+  void runIncludedTest() {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": Location In A Header ===\n";
+    char pattern[] = "/tmp/pp_limits_XXXXXX";
+    std::string root = mkdtemp(pattern);
+    std::ofstream(root + "/bomb.h") << "#define B0 b b\n#define B1 B0 B0\n"
+                                       "#define B2 B1 B1\n\nint x =\n  B2;\n";
+    ExpansionLimits limits;
+    limits.tokens = 5;
+    bool passed = false;
+    try {
+      PreProcessor pp("#include \"" + root + "/bomb.h\"\n");
+      pp.setExpansionLimits(limits);
+      pp.expandMacros();
+    } catch (const ExpansionLimitError &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      passed = e.file() == root + "/bomb.h" && e.line() == 6 &&
+               e.column() == 3 && e.limit() == ExpansionLimitError::Tokens;
+    }
+    std::system(("rm -rf " + root).c_str());
+    report(passed);
+  }
+
+  // The limits outlast reset(); the counts and the clock start over
+  void runResetTest() {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": Reset Starts Over ===\n";
+    ExpansionLimits limits;
+    limits.outputBytes = 20;
+    PreProcessor pp("");
+    pp.setExpansionLimits(limits);
+    bool passed = true;
+    for (int i = 0; i < 3; i++) {
+      pp.reset("short text\n");
+      passed &= pp.expandMacros() == "short text\n";
+    }
+    pp.reset("a much longer text than allowed\n");
+    try {
+      pp.expandMacros();
+      passed = false;
+    } catch (const std::runtime_error &e) {
+      std::cout << "Error: " << e.what() << "\n";
+    }
+    report(passed && pp.expansionLimits().outputBytes == 20);
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+// #define D0 x x, #define D1 D0 D0, ...: Dn expands to 2^(n+1) tokens
+static std::string doubling(int levels) {
+  std::string text = "#define D0 x x\n";
+  for (int i = 1; i <= levels; i++)
+    text += "#define D" + std::to_string(i) + " D" + std::to_string(i - 1) +
+            " D" + std::to_string(i - 1) + "\n";
+  return text;
+}
+
+int main() {
+  ExpansionLimitsTester tester;
+
+  std::string chain;
+  for (int i = 0; i < 50; i++)
+    chain += "#define A" + std::to_string(i) + " A" + std::to_string(i + 1) +
+             "\n";
+  ExpansionLimits depth;
+  depth.depth = 10;
+  tester.runLimitTest("Object Macro Chain", chain + "int v = A0;\n", depth,
+                      ExpansionLimitError::Depth,
+                      "<input>:51:9: expanding 'A0' nests macros more than 10 "
+                      "deep");
+
+  std::string nested = "#define f(x) (x)\n  ";
+  for (int i = 0; i < 200; i++)
+    nested += "f(";
+  nested += "0" + std::string(200, ')') + "\n";
+  tester.runLimitTest("Nested Arguments", nested, depth,
+                      ExpansionLimitError::Depth,
+                      "<input>:2:3: expanding 'f' nests macros more than 10 "
+                      "deep");
+
+  ExpansionLimits tokens;
+  tokens.tokens = 10000;
+  tester.runLimitTest("Doubling Macros", doubling(40) + "x = D40;\n", tokens,
+                      ExpansionLimitError::Tokens,
+                      "<input>:42:5: expanding 'D40' produced more than 10000 "
+                      "tokens");
+  tester.runLimitTest("Doubling Macros Without The Cache",
+                      doubling(40) + "x = D40;\n", tokens,
+                      ExpansionLimitError::Tokens,
+                      "<input>:42:5: expanding 'D40' produced more than 10000 "
+                      "tokens",
+                      false);
+  tester.runLimitTest("Doubling Macros In #if",
+                      doubling(40) + "\n#if D40 + 1\n#endif\n", tokens,
+                      ExpansionLimitError::Tokens,
+                      "<input>:43:5: expanding '#if' produced more than 10000 "
+                      "tokens");
+
+  std::string exploding = "#define g(x) x x\n#define h(x) g(g(g(g(x))))\n"
+                          "h(h(h(h(h(h(h(1)))))))\n";
+  tester.runLimitTest("Function Macros Multiplying Arguments", exploding,
+                      tokens, ExpansionLimitError::Tokens,
+                      "<input>:3:1: expanding 'h' produced more than 10000 "
+                      "tokens");
+
+  ExpansionLimits output;
+  output.outputBytes = 1000;
+  tester.runLimitTest("Output Bytes",
+                      doubling(10) + "keep\n\nthis D10 and that\n", output,
+                      ExpansionLimitError::OutputBytes,
+                      "<input>:14:6: output is longer than 1000 bytes");
+
+  ExpansionLimits time;
+  time.time = std::chrono::milliseconds(50);
+  tester.runLimitTest("Wall Time", doubling(40) + "x = D40;\n", time,
+                      ExpansionLimitError::Time,
+                      "<input>:42:5: preprocessing took longer than 50 ms");
+
+  // Each text line is charged on its own: D4 makes 2 + 4 + ... + 32 tokens
+  std::string lines = doubling(4);
+  for (int i = 0; i < 200; i++)
+    lines += "D4 ;\n";
+  ExpansionLimits generous;
+  generous.depth = 8;
+  generous.tokens = 62;
+  generous.outputBytes = 1 << 20;
+  generous.time = std::chrono::seconds(10);
+  tester.runPassTest("Ordinary Input Within Limits", lines, generous);
+
+  tester.runIncludedTest();
+  tester.runResetTest();
+
+  return tester.printSummary();
+}
@@ -0,0 +1,141 @@
+#include "pp.hpp"
+#include <iostream>
+#include <string>
+
+// Covers the #if constant-expression evaluator: literals, every operator,
+// precedence, signedness, short-circuiting, defined and macro expansion.
+class IfExpressionTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+  void report(bool passed) {
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  static std::string evaluate(const std::string &defines,
+                              const std::string &expression) {
+    PreProcessor pp(defines + "#if " + expression + "\ntrue\n#else\nfalse\n#endif\n");
+    std::string output = pp.expandMacros();
+    if (output.find("true") != std::string::npos)
+      return "true";
+    if (output.find("false") != std::string::npos)
+      return "false";
+    return "neither";
+  }
+
+public:
+  void runTest(const std::string &expression, bool expected,
+               const std::string &defines = "") {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": #if " << expression
+              << " ===\n";
+    try {
+      std::string result = evaluate(defines, expression);
+      std::cout << "Result: " << result << "\n";
+      report(result == (expected ? "true" : "false"));
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      report(false);
+    }
+  }
+
+  void runErrorTest(const std::string &expression,
+                    const std::string &expectedMessage) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": #if " << expression
+              << " ===\n";
+    try {
+      evaluate("", expression);
+      std::cout << "No error raised\n";
+      report(false);
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      report(std::string(e.what()).find(expectedMessage) != std::string::npos);
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+int main() {
+  IfExpressionTester tester;
+  const std::string gnuc = "#define __GNUC__ 9\n#define __GNUC_MINOR__ 2\n";
+
+  // Literals
+  tester.runTest("0x10 == 16 && 020 == 16 && 0b10000 == 16", true);
+  tester.runTest("10UL == 10 && 7llu == 7 && 5Lu == 5", true);
+  tester.runTest("'a' == 97 && '\\n' == 10 && '\\x41' == 65 && '\\101' == 65",
+                 true);
+  tester.runTest("'\\377' < 0", true);
+  tester.runTest("0", false);
+
+  // Precedence and associativity
+  tester.runTest("2 + 3 * 4 == 14", true);
+  tester.runTest("(2 + 3) * 4 == 20", true);
+  tester.runTest("10 - 4 - 3 == 3", true);
+  tester.runTest("1 << 2 + 1 == 8", true);
+  tester.runTest("1 | 2 ^ 3 & 4 == 3", true);
+  tester.runTest("-7 / 2 == -3 && -7 % 2 == -1", true);
+  tester.runTest("~0 == -1 && !0 == 1 && !5 == 0 && +3 == 3", true);
+  tester.runTest("1 ? 2 ? 3 : 4 : 5", true);
+  tester.runTest("0 ? 1 : 0 ? 1 : 0", false);
+  tester.runTest("(1, 0)", false);
+
+  // Signedness
+  tester.runTest("-1 < 0", true);
+  tester.runTest("-1 < 0u", false);
+  tester.runTest("-1 >> 1 == -1", true);
+  tester.runTest("18446744073709551615 == -1", true);
+  tester.runTest("(0 ? 1u : -1) > 0", true);
+
+  // Short-circuiting: the division is never evaluated
+  tester.runTest("0 && 1 / 0", false);
+  tester.runTest("1 || 1 / 0", true);
+  tester.runTest("1 ? 1 : 1 / 0", true);
+
+  // defined and macros
+  tester.runTest("defined __GNUC__ && defined(__GNUC_MINOR__)", true, gnuc);
+  tester.runTest("__GNUC__ >= 4 && !defined(__clang__)", true, gnuc);
+  tester.runTest("__GNUC__ > 9 || (__GNUC__ == 9 && __GNUC_MINOR__ >= 2)",
+                 true, gnuc);
+  tester.runTest("UNDEFINED_NAME == 0", true);
+  tester.runTest("VERSION(1, 2) == 102", true,
+                 "#define VERSION(a, b) ((a) * 100 + (b))\n");
+  tester.runTest("defined FOO", false, "#define FOO 1\n#undef FOO\n");
+  tester.runTest("defined(EMPTY) && EMPTY 1", true, "#define EMPTY\n");
+
+  // Errors
+  tester.runErrorTest("", "no expression");
+  tester.runErrorTest("1 / 0", "Division by zero");
+  tester.runErrorTest("(1 + 2", "Missing ')'");
+  tester.runErrorTest("1 +", "ends unexpectedly");
+  tester.runErrorTest("1 2", "Invalid token");
+  tester.runErrorTest("3.14", "Invalid integer constant");
+  tester.runErrorTest("09", "Invalid integer constant");
+  tester.runErrorTest("1 ? 2", "Expected ':'");
+  tester.runErrorTest("defined(X", "Missing ')' after \"defined\"");
+  tester.runErrorTest("defined 1", "requires an identifier");
+  tester.runErrorTest("99999999999999999999", "too large");
+  tester.runErrorTest(std::string(300, '(') + "1" + std::string(300, ')'),
+                      "nested too deeply");
+
+  return tester.printSummary();
+}
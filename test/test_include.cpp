@@ -0,0 +1,246 @@
+#include "pp.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Covers #include resolution against the search paths and the shared
+// FileCache behind it. Headers are written to a scratch directory.
+class IncludeTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+  std::string root;
+
+  static std::string normalizeSpaces(const std::string &str) {
+    std::string result;
+    bool lastWasSpace = false;
+    for (char c : str) {
+      if (std::isspace(static_cast<unsigned char>(c))) {
+        if (!lastWasSpace && !result.empty()) {
+          result += ' ';
+          lastWasSpace = true;
+        }
+      } else {
+        result += c;
+        lastWasSpace = false;
+      }
+    }
+    if (!result.empty() && result.back() == ' ')
+      result.pop_back();
+    return result;
+  }
+
+  void report(bool passed) {
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  void begin(const std::string &testName) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+  }
+
+public:
+  IncludeTester() {
+    char pattern[] = "/tmp/pp_include_XXXXXX";
+    root = mkdtemp(pattern);
+    std::system(("mkdir -p " + root + "/inc/sub " + root + "/sys").c_str());
+    write("main.c", "#include \"local.h\"\nint m = LOCAL + USER;\n");
+    write("local.h", "#define LOCAL 1\n#include <user.h>\n");
+    write("inc/user.h", "#define USER 2\n#include \"sub/nested.h\"\n");
+    write("inc/sub/nested.h", "#include \"../../sys/sys.h\"\nint nested = SYS;");
+    write("sys/sys.h", "#define SYS 3\n");
+    write("sys/first.h", "int which = 1;\n");
+    write("inc/first.h", "int which = 0;\n");
+    write("self.h", "#include \"self.h\"\n");
+  }
+
+  ~IncludeTester() { std::system(("rm -rf " + root).c_str()); }
+
+  // Replace the file the way editors do, so mappings of the old version
+  // keep their contents.
+  void write(const std::string &name, const std::string &text) {
+    std::string path = root + "/" + name;
+    std::ofstream(path + ".tmp", std::ios::binary) << text;
+    std::rename((path + ".tmp").c_str(), path.c_str());
+  }
+
+  void runTest(const std::string &testName, const std::string &file,
+               const std::string &expected) {
+    begin(testName);
+    try {
+      FileCache cache;
+      PreProcessor pp = PreProcessor::fromFile(root + "/" + file, cache);
+      pp.addIncludePath(root + "/inc");
+      pp.addSystemIncludePath(root + "/sys");
+      std::string result = normalizeSpaces(pp.expandMacros());
+      std::cout << "Output:\n" << result << "\n";
+      std::cout << "Expected:\n" << expected << "\n";
+      report(result == expected);
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      report(false);
+    }
+  }
+
+  void runErrorTest(const std::string &testName, const std::string &input,
+                    const std::string &expectedMessage) {
+    begin(testName);
+    try {
+      PreProcessor pp(input);
+      pp.addIncludePath(root);
+      pp.expandMacros();
+      std::cout << "No error raised\n";
+      report(false);
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      report(std::string(e.what()).find(expectedMessage) != std::string::npos);
+    }
+  }
+
+  void runSearchOrderTest() {
+    begin("-I Before -isystem");
+    FileCache cache;
+    PreProcessor pp("#include <first.h>\n");
+    pp.setFileCache(cache);
+    pp.addIncludePath(root + "/inc");
+    pp.addSystemIncludePath(root + "/sys");
+    std::string result = normalizeSpaces(pp.expandMacros());
+    std::cout << "Output: " << result << "\n";
+    report(result == "int which = 0;");
+  }
+
+  void runCacheTest() {
+    begin("Cache Reuses And Refreshes Entries");
+    FileCache cache;
+    std::string path = root + "/sys/sys.h";
+    auto first = cache.load(path);
+    auto second = cache.load(path);
+    bool shared = first && first == second;
+
+    write("sys/sys.h", "#define SYS 30 // edited\n");
+    auto third = cache.load(path);
+    bool refreshed = third && third != first &&
+                     third->text() == "#define SYS 30 // edited\n" &&
+                     first->text() == "#define SYS 3\n";
+    write("sys/sys.h", "#define SYS 3\n");
+
+    std::cout << "Shared: " << shared << ", refreshed: " << refreshed
+              << ", missing: " << (cache.load(root + "/none.h") == nullptr)
+              << "\n";
+    report(shared && refreshed && !cache.load(root + "/none.h"));
+  }
+
+  void runThreadTest() {
+    begin("Shared Cache Across Threads");
+    FileCache cache;
+    std::vector<std::string> results(8);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < results.size(); t++) {
+      threads.emplace_back([&, t] {
+        for (int round = 0; round < 50; round++) {
+          PreProcessor pp = PreProcessor::fromFile(root + "/main.c", cache);
+          pp.addIncludePath(root + "/inc");
+          pp.addSystemIncludePath(root + "/sys");
+          results[t] = normalizeSpaces(pp.expandMacros());
+        }
+      });
+    }
+    for (std::thread &thread : threads)
+      thread.join();
+
+    bool same = true;
+    for (const std::string &result : results)
+      same = same && result == "int nested = 3; int m = 1 + 2;";
+    std::cout << "Cached files: " << cache.size() << "\n";
+    report(same && cache.size() == 5);
+  }
+
+  // Include header twice and check what was recorded for it
+  void runGuardTest(const std::string &testName, const std::string &header,
+                    const std::string &expectedGuard,
+                    const std::string &expected,
+                    const std::string &between = "") {
+    begin(testName);
+    try {
+      FileCache cache;
+      write("guard.h", header);
+      PreProcessor pp("#include \"guard.h\"\n" + between +
+                      "#include \"guard.h\"\n");
+      pp.setFileCache(cache);
+      pp.addIncludePath(root);
+      std::string result = normalizeSpaces(pp.expandMacros());
+      std::string guard(cache.load(root + "/guard.h")->guardMacro());
+      std::cout << "Output: " << result << "\n";
+      std::cout << "Guard: '" << guard << "', expected '" << expectedGuard
+                << "'\n";
+      report(result == expected && guard == expectedGuard);
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      report(false);
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+int main() {
+  IncludeTester tester;
+
+  tester.runTest("Nested Quote And Angle Includes", "main.c",
+                 "int nested = 3; int m = 1 + 2;");
+  tester.runSearchOrderTest();
+  tester.runCacheTest();
+  tester.runThreadTest();
+
+  tester.runGuardTest("Include Guard",
+                      "// header comment\n#ifndef GUARD_H\n#define GUARD_H\n"
+                      "#ifdef NESTED\n#endif\nint once;\n#endif /* GUARD_H */\n",
+                      "GUARD_H", "int once;");
+  tester.runGuardTest("Guard Macro Undefined In Between",
+                      "#ifndef GUARD_H\n#define GUARD_H\nint twice;\n#endif\n",
+                      "GUARD_H", "int twice; int twice;", "#undef GUARD_H\n");
+  tester.runGuardTest("Text Before The Guard",
+                      "int before;\n#ifndef GUARD_H\n#define GUARD_H\n#endif\n",
+                      "", "int before; int before;");
+  tester.runGuardTest("Text After The Guard",
+                      "#ifndef GUARD_H\n#define GUARD_H\n#endif\nint after;\n",
+                      "", "int after; int after;");
+  tester.runGuardTest("Guard With Else",
+                      "#ifndef GUARD_H\n#define GUARD_H\n#else\nint again;\n"
+                      "#endif\n",
+                      "", "int again;");
+  tester.runGuardTest("Pragma Once", "#pragma once\nint once;\n", "",
+                      "int once;");
+
+  tester.runErrorTest("Missing Header", "#include \"missing.h\"\n",
+                      "'missing.h' file not found");
+  tester.runErrorTest("Malformed Header Name", "#include stdio.h\n",
+                      "Expected a header name");
+  tester.runErrorTest("Unterminated Header Name", "#include <stdio.h\n",
+                      "Expected a header name");
+  tester.runErrorTest("Recursive Include", "#include \"self.h\"\n",
+                      "nested too deeply");
+
+  return tester.printSummary();
+}
@@ -0,0 +1,243 @@
+#define PP_ENABLE_STATS
+#include "pp.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Covers IncludePrefetcher: lookups queued ahead of #include must resolve
+// every name exactly as the search would. Headers are written to a scratch
+// directory, and each file is checked against a run without prefetching.
+class IncludePrefetchTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+  std::string root;
+
+  void report(bool passed) {
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  void begin(const std::string &testName) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+  }
+
+  void write(const std::string &name, const std::string &text) {
+    std::ofstream(root + "/" + name, std::ios::binary) << text;
+  }
+
+  void configure(PreProcessor &pp) {
+    pp.addQuoteIncludePath(root + "/quote");
+    pp.addIncludePath(root + "/inc");
+    pp.addSystemIncludePath(root + "/sys");
+  }
+
+  std::string expand(const std::string &file, IncludePrefetcher *prefetcher,
+                     PreprocessStats *stats = nullptr) {
+    FileCache cache;
+    PreProcessor pp = PreProcessor::fromFile(
+        root + "/" + file, prefetcher ? prefetcher->fileCache() : cache);
+    configure(pp);
+    if (prefetcher)
+      pp.setIncludePrefetcher(*prefetcher);
+    std::string out = pp.expandMacros();
+    if (stats)
+      *stats = pp.stats();
+    return out;
+  }
+
+public:
+  IncludePrefetchTester() {
+    char pattern[] = "/tmp/pp_prefetch_XXXXXX";
+    root = mkdtemp(pattern);
+    std::system(("mkdir -p " + root + "/inc/sub " + root + "/sys " + root +
+                 "/quote")
+                    .c_str());
+    write("main.c", "#include \"local.h\"\n"
+                    "#include <user.h>\n"
+                    "#if 0\n#include \"missing.h\"\n#endif\n"
+                    "#include \"quoted.h\"\n"
+                    "#include <first.h>\n"
+                    "# include /* c */ <sys.h>\n"
+                    "int m = LOCAL + USER + SYS + QUOTED;\n");
+    write("local.h", "#define LOCAL 1\n#include \"sub.h\"\n");
+    write("sub.h", "int top_sub;\n");
+    write("inc/user.h", "#define USER 2\n#include \"sub/nested.h\"\n"
+                        "#include \"sub.h\"\n");
+    write("inc/sub.h", "int inc_sub;\n");
+    write("inc/sub/nested.h", "#include \"../../sys/sys.h\"\nint nested;\n");
+    write("sys/sys.h", "#ifndef SYS\n#define SYS 3\n#endif\n");
+    write("sys/first.h", "int which = 1;\n");
+    write("inc/first.h", "int which = 0;\n");
+    write("quote/quoted.h", "#define QUOTED 4\n");
+  }
+
+  ~IncludePrefetchTester() { std::system(("rm -rf " + root).c_str()); }
+
+  void runSameOutputTest() {
+    begin("Same Output As Without Prefetching");
+    try {
+      FileCache cache;
+      IncludePrefetcher prefetcher(cache, 2);
+      std::string expected = expand("main.c", nullptr);
+      PreprocessStats stats;
+      std::string result = expand("main.c", &prefetcher, &stats);
+      std::cout << "Output:\n" << result << "\n";
+      std::cout << "includePrefetchHits=" << stats.includePrefetchHits << "\n";
+      report(result == expected && stats.includePrefetchHits >= 5 &&
+             result.find("int which = 0;") != std::string::npos &&
+             result.find("int top_sub;") != std::string::npos &&
+             result.find("int inc_sub;") != std::string::npos);
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      report(false);
+    }
+  }
+
+  void runMissingHeaderTest() {
+    begin("Missing Header Still Fails");
+    write("broken.c", "#include \"nowhere.h\"\n");
+    FileCache cache;
+    IncludePrefetcher prefetcher(cache, 1);
+    try {
+      expand("broken.c", &prefetcher);
+      std::cout << "No error raised\n";
+      report(false);
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      report(std::string(e.what()).find("'nowhere.h' file not found") !=
+             std::string::npos);
+    }
+  }
+
+  void runRequestTest() {
+    begin("Lookups Try Candidates In Order");
+    FileCache cache;
+    IncludePrefetcher prefetcher(cache, 1);
+    auto first = prefetcher.prefetch(
+        {root + "/inc/none.h", root + "/inc/first.h", root + "/sys/first.h"},
+        2);
+    auto system = prefetcher.prefetch(
+        {root + "/inc/none.h", root + "/sys/first.h"}, 1);
+    auto none = prefetcher.prefetch({root + "/none.h"}, 1);
+    bool firstSystem = true, systemSystem = false, noneSystem = false;
+    auto firstFile = prefetcher.wait(*first, firstSystem);
+    auto systemFile = prefetcher.wait(*system, systemSystem);
+    auto noneFile = prefetcher.wait(*none, noneSystem);
+    report(firstFile && firstFile->path() == root + "/inc/first.h" &&
+           !firstSystem && systemFile &&
+           systemFile->path() == root + "/sys/first.h" && systemSystem &&
+           !noneFile && cache.size() == 2);
+  }
+
+  // Every translation unit of a batch shares the pool
+  void runBatchTest() {
+    begin("Batch Shares The Prefetcher");
+    std::vector<std::string> paths;
+    for (int i = 0; i < 24; i++) {
+      std::string name = "unit" + std::to_string(i) + ".c";
+      write(name, "#include <user.h>\n#include \"local.h\"\n"
+                  "#include \"sub/nested.h\"\nint unit = " +
+                      std::to_string(i) + " + USER;\n");
+      paths.push_back(root + "/" + name);
+    }
+    BatchOptions options;
+    options.quoteIncludePaths.push_back(root + "/quote");
+    options.includePaths.push_back(root + "/inc");
+    options.systemIncludePaths.push_back(root + "/sys");
+    options.threads = 4;
+    std::vector<BatchResult> expected = BatchPreprocessor(options).run(paths);
+    FileCache cache;
+    IncludePrefetcher prefetcher(cache);
+    options.prefetcher = &prefetcher;
+    std::vector<BatchResult> results = BatchPreprocessor(options).run(paths);
+    bool same = results.size() == expected.size();
+    for (size_t i = 0; same && i < results.size(); i++)
+      same = results[i].error.empty() &&
+             results[i].output == expected[i].output;
+    report(same);
+  }
+
+  // Names queued and then never needed, because the preprocessor is reset
+  // or destroyed first, are harmless
+  void runAbandonedTest() {
+    begin("Abandoned Lookups");
+    std::string many;
+    for (int i = 0; i < 50; i++)
+      many += "#include \"gone" + std::to_string(i) + ".h\"\n";
+    write("abandoned.c", "#include \"local.h\"\n" + many);
+    FileCache cache;
+    IncludePrefetcher prefetcher(cache, 1);
+    bool passed = true;
+    for (int round = 0; round < 3; round++) {
+      PreProcessor pp = PreProcessor::fromFile(root + "/abandoned.c", cache);
+      configure(pp);
+      pp.setIncludePrefetcher(prefetcher);
+      try {
+        pp.expandMacros();
+        passed = false;
+      } catch (const std::exception &e) {
+        passed &= std::string(e.what()).find("gone0.h") != std::string::npos;
+      }
+      pp.reset("#include <sys.h>\nx SYS\n");
+      std::string out = pp.expandMacros();
+      passed &= out.find("x 3") != std::string::npos;
+    }
+    report(passed);
+  }
+
+  // A file read again, here by a second run, has a DirectiveIndex; its
+  // #include lines are found through that
+  void runIndexedFileTest() {
+    begin("Includes Found Through The Directive Index");
+    write("indexed.h", "#if PICK\n#include \"sub.h\"\n#else\n"
+                       "#include <first.h>\n#endif\n");
+    write("twice.c", "#define PICK 1\n#include \"indexed.h\"\n#undef PICK\n"
+                     "#define PICK 0\n#include \"indexed.h\"\n");
+    FileCache cache;
+    IncludePrefetcher prefetcher(cache, 2);
+    std::string expected = expand("twice.c", nullptr);
+    bool passed = true;
+    for (int run = 0; run < 3; run++) {
+      PreprocessStats stats;
+      std::string result = expand("twice.c", &prefetcher, &stats);
+      std::cout << "includePrefetchHits=" << stats.includePrefetchHits << "\n";
+      passed &= result == expected && stats.includePrefetchHits == 3;
+    }
+    auto entry = cache.load(root + "/indexed.h");
+    report(passed && entry && entry->hasDirectiveIndex());
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+int main() {
+  IncludePrefetchTester tester;
+  tester.runSameOutputTest();
+  tester.runMissingHeaderTest();
+  tester.runRequestTest();
+  tester.runBatchTest();
+  tester.runAbandonedTest();
+  tester.runIndexedFileTest();
+  return tester.printSummary();
+}
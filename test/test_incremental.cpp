@@ -0,0 +1,196 @@
+#include "pp.hpp"
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Covers IncrementalPreProcessor: after any sequence of edits its output
+// must match a fresh expansion of the text, while re-preprocessing only
+// the regions an edit can affect.
+class IncrementalTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+public:
+  void check(const std::string &testName, bool passed) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+// A source file of about lines lines mixing macros, conditionals and
+// invocations spanning lines
+static std::string makeSource(size_t lines) {
+  std::string text = "#define ADD(a, b) ((a) + (b))\n#define LIMIT 10\n";
+  for (size_t i = 0; text.size() < lines * 24; i++) {
+    std::string n = std::to_string(i);
+    switch (i % 8) {
+    case 0:
+      text += "#define M" + n + " ADD(" + n + ", LIMIT)\n";
+      break;
+    case 1:
+      text += "int v" + n + " = M" + std::to_string(i - 1) + ";\n";
+      break;
+    case 2:
+      text += "#ifdef M" + std::to_string(i - 2) + "\nint on" + n +
+              ";\n#else\nint off" + n + ";\n#endif\n";
+      break;
+    case 3:
+      text += "int w" + n + " = ADD(1,\n    2); /* note\n   */\n";
+      break;
+    case 4:
+      text += "void f" + n + "() { return; }\n";
+      break;
+    default:
+      text += "char *s" + n + " = \"ADD(x, y) #if\"; // LIMIT\n";
+      break;
+    }
+  }
+  return text;
+}
+
+static bool expandsLike(IncrementalPreProcessor &inc) {
+  return inc.output() == PreProcessor(inc.text()).expandMacros();
+}
+
+// The first output is the plain expansion
+static bool testInitialOutput() {
+  IncrementalPreProcessor inc(makeSource(2000));
+  return expandsLike(inc) && inc.regionCount() > 10;
+}
+
+// Compare inc after an edit with a fresh run over the same text, errors
+// included
+static bool matchesFresh(IncrementalPreProcessor &inc, size_t begin,
+                         size_t end, const std::string &piece, bool &failed) {
+  std::string text = inc.text();
+  text.replace(begin, end - begin, piece);
+  std::string expected, got;
+  bool expectedError = false, gotError = false;
+  try {
+    expected = PreProcessor(text).expandMacros();
+  } catch (const std::runtime_error &) {
+    expectedError = true;
+  }
+  try {
+    inc.edit(begin, end, piece);
+    got = inc.output();
+  } catch (const std::runtime_error &) {
+    gotError = true;
+  }
+  failed = gotError;
+  return inc.text() == text && expectedError == gotError && expected == got;
+}
+
+// Random edits, including ones that open comments and conditionals across
+// regions or break the code, keep the output identical to a fresh run.
+// Edits that break the code are undone.
+static bool testRandomEdits() {
+  static const std::vector<std::string> pieces = {
+      "#define LIMIT 20\n", "#undef LIMIT\n", "LIMIT", "ADD(", ")", "/*",
+      "*/", "#if 0\n", "#endif\n", "#else\n", "\n", ";", "}", "x ",
+      "\"", "M9", "#define ADD(a, b) a\n", "\\\n", "#ifdef LIMIT\n",
+      "#define M9 LIMIT\n"};
+  std::mt19937 rng(5);
+  IncrementalPreProcessor inc(makeSource(600));
+  inc.output();
+  int broken = 0;
+  for (int round = 0; round < 1500; round++) {
+    size_t size = inc.text().size();
+    size_t begin = size ? rng() % (size + 1) : 0;
+    size_t end = std::min(size, begin + (rng() % 3 ? 0 : rng() % 40));
+    std::string piece = rng() % 4 ? pieces[rng() % pieces.size()] : "";
+    std::string removed = inc.text().substr(begin, end - begin);
+    bool failed = false;
+    if (!matchesFresh(inc, begin, end, piece, failed)) {
+      std::cout << "Mismatch after edit " << round << "\n";
+      return false;
+    }
+    if (failed) {
+      broken++;
+      if (!matchesFresh(inc, begin, begin + piece.size(), removed, failed) ||
+          failed) {
+        std::cout << "Mismatch undoing edit " << round << "\n";
+        return false;
+      }
+    }
+  }
+  std::cout << broken << " edits broke the code and were undone\n";
+  return true;
+}
+
+// Typing inside a text line of a large file reruns one region
+static bool testTypingReruns() {
+  IncrementalPreProcessor inc(makeSource(50000));
+  inc.output();
+  size_t at = inc.text().find("void f5004()");
+  auto start = std::chrono::steady_clock::now();
+  for (const char *key : {"i", "n", "t", " ", "z", ";"})
+    inc.edit(at, at, key), at++;
+  double ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  std::cout << "6 keystrokes in " << inc.regionCount() << " regions: " << ms
+            << " ms\n";
+  return inc.regionsRun() == 1 && expandsLike(inc);
+}
+
+// Changing a macro reruns the regions that read it and no others
+static bool testMacroChangeSpreads() {
+  std::string text = "#define X 1\n#define Y 2\n";
+  for (int i = 0; i < 40 * 64; i++)
+    text += i == 30 * 64 ? "int x = X;\n" : "int y = Y;\n";
+  IncrementalPreProcessor inc(text);
+  inc.output();
+  size_t regions = inc.regionCount();
+  size_t at = inc.text().find("X 1") + 2;
+  inc.edit(at, at + 1, "3");
+  bool changedX = inc.regionsRun() == 2;
+  at = inc.text().find("Y 2") + 2;
+  inc.edit(at, at + 1, "4");
+  bool changedY = inc.regionsRun() == regions;
+  return regions >= 40 && changedX && changedY && expandsLike(inc) &&
+         inc.output().find("int x = 3;") != std::string::npos;
+}
+
+// The starting macros come from a snapshot when one is given
+static bool testPredefined() {
+  PreProcessor setup("#define BASE 7\n");
+  setup.expandMacros();
+  IncrementalPreProcessor inc("int b = BASE;\n", setup.snapshotMacros());
+  bool first = inc.output() == "int b = 7;\n";
+  inc.edit(0, 0, "#undef BASE\n");
+  return first && inc.output() == "\nint b = BASE;\n";
+}
+
+int main() {
+  IncrementalTester tester;
+  tester.check("Initial Output", testInitialOutput());
+  tester.check("Random Edits Match A Fresh Run", testRandomEdits());
+  tester.check("Typing Reruns One Region", testTypingReruns());
+  tester.check("Macro Change Spreads To Readers", testMacroChangeSpreads());
+  tester.check("Predefined Macros", testPredefined());
+  return tester.printSummary();
+}
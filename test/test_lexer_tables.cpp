@@ -0,0 +1,116 @@
+#include "pp.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Covers the table-driven lexer: every directive keyword, every punctuator
+// and the identifier/number boundaries.
+class LexerTableTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+public:
+  void runTest(const std::string &testName, const std::string &input,
+               const std::vector<TokenKind> &expected) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    std::cout << "Input: " << input << "\n";
+
+    PreProcessor pp(input);
+    std::vector<TokenKind> kinds;
+    std::vector<std::string> texts;
+    while (true) {
+      Token token = pp.next();
+      if (token.kind == TokenKind::T_EOF)
+        break;
+      kinds.push_back(token.kind);
+      texts.push_back(pp.getTokenText(token));
+    }
+
+    if (kinds == expected) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "Got " << kinds.size() << " tokens:";
+      for (const auto &text : texts)
+        std::cout << " [" << text << "]";
+      std::cout << "\n✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+int main() {
+  LexerTableTester tester;
+  using K = TokenKind;
+
+  tester.runTest("Directive Keywords",
+                 "include define undef if else endif ifdef ifndef elif line "
+                 "error pragma",
+                 {K::Include, K::Define, K::Undef, K::If, K::Else, K::Endif,
+                  K::IfDef, K::IfNDef, K::Elif, K::Line, K::Error,
+                  K::Pragma});
+
+  tester.runTest("Keyword Lookalikes",
+                 "i includes defin _if elsewhere endif_ ifdefx Line PRAGMA e",
+                 {K::Ident, K::Ident, K::Ident, K::Ident, K::Ident, K::Ident,
+                  K::Ident, K::Ident, K::Ident, K::Ident});
+
+  tester.runTest("Single Character Punctuators", "[ ] ( ) { } . ~ ? : ; , #",
+                 {K::L_Bracket, K::R_Bracket, K::L_Paren, K::R_Paren,
+                  K::L_Brace, K::R_Brace, K::Dot, K::Tilde, K::Question,
+                  K::Colon, K::Semicolon, K::Comma, K::Hash});
+
+  tester.runTest("Operators", "+ - & | < > = ! * / % ^",
+                 {K::Plus, K::Minus, K::Ampersand, K::BitOr, K::Less,
+                  K::Greater, K::Assign, K::Not, K::Star, K::Slash, K::Percent,
+                  K::XOR});
+
+  tester.runTest("Compound Operators",
+                 "+= -= &= |= <= >= == != *= /= %= ^=",
+                 {K::AddAssign, K::MinusEqual, K::BitAndEqual, K::OrAssign,
+                  K::LessEqual, K::GreaterEqual, K::EqualEqual,
+                  K::ExclamationEqual, K::MulAssign, K::DivAssign,
+                  K::ModAssign, K::XorAssign});
+
+  tester.runTest("Doubled Operators", "++ -- && || << >> <<= >>= ## -> ...",
+                 {K::PlusPlus, K::MinusMinus, K::LogicAnd, K::LogicOr,
+                  K::LessLess, K::GreaterGreater, K::LessLessEqual,
+                  K::GreaterGreaterEqual, K::HashHash, K::Arrow,
+                  K::Ellipsis});
+
+  tester.runTest("Maximal Munch", "a+++b<<=c..d", {K::Ident, K::PlusPlus,
+                                                   K::Plus, K::Ident,
+                                                   K::LessLessEqual, K::Ident,
+                                                   K::Dot, K::Dot, K::Ident});
+
+  tester.runTest("Ellipsis At End Of Input", "f(a, ...",
+                 {K::Ident, K::L_Paren, K::Ident, K::Comma, K::Ellipsis});
+
+  tester.runTest("Numbers And Identifiers", "x1 _y2 0x1fULL 3.5e+10 .5 9abc",
+                 {K::Ident, K::Ident, K::PPNumber, K::PPNumber, K::PPNumber,
+                  K::PPNumber});
+
+  tester.runTest("Unknown Bytes", "@ $ `",
+                 {K::Unknown, K::Unknown, K::Unknown});
+
+  tester.runTest("Directive Line", "#ifndef GUARD\n#elif X\n#pragma once",
+                 {K::Hash, K::IfNDef, K::Ident, K::Unknown, K::Hash, K::Elif,
+                  K::Ident, K::Unknown, K::Hash, K::Pragma, K::Ident});
+
+  return tester.printSummary();
+}
@@ -0,0 +1,175 @@
+#include "pp.hpp"
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Covers the lazily built line tables behind PreProcessor::location(): the
+// vectorised newline scan, chunked growth and mapping into included files.
+class LineTableTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+public:
+  void check(const std::string &testName, bool passed) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+// Line and column of offset, counted the slow way
+static std::pair<unsigned, unsigned> referenceLineCol(const std::string &text,
+                                                      unsigned offset) {
+  unsigned line = 1, lineStart = 0;
+  for (unsigned i = 0; i < offset && i < text.size(); i++) {
+    if (text[i] == '\n') {
+      line++;
+      lineStart = i + 1;
+    }
+  }
+  return {line, offset - lineStart + 1};
+}
+
+static std::string randomText(std::mt19937 &rng, size_t size) {
+  static const char *pieces[] = {"\n", "a", " ", "/* x\ny */", "//c\n",
+                                 "\"s\"", "+", "\n\n\n", "id_1"};
+  std::uniform_int_distribution<int> pick(0, 8);
+  std::string text;
+  while (text.size() < size)
+    text += pieces[pick(rng)];
+  return text;
+}
+
+// The vector scan finds the same line starts as a byte loop, whatever the
+// alignment and length of the range
+static bool testScanMatchesBytes() {
+  std::mt19937 rng(7);
+  for (int round = 0; round < 500; round++) {
+    std::string text = randomText(rng, rng() % 300);
+    size_t from = text.empty() ? 0 : rng() % text.size();
+    std::vector<unsigned> got, expected;
+    pp_detail::appendLineStarts(text.data(), from, text.size(), got);
+    for (size_t i = from; i < text.size(); i++)
+      if (text[i] == '\n')
+        expected.push_back(static_cast<unsigned>(i + 1));
+    if (got != expected)
+      return false;
+  }
+  return true;
+}
+
+// Locations after every token match, newlines inside comments included
+static bool testLocationsWhileLexing() {
+  std::mt19937 rng(11);
+  for (int round = 0; round < 50; round++) {
+    std::string text = randomText(rng, 2000);
+    PreProcessor pp(text);
+    for (int guard = 0; guard < 100000; guard++) {
+      Token token = pp.next();
+      SourceLocation where = pp.location();
+      auto expected = referenceLineCol(text, token.begin + token.len);
+      if (where.file != "<input>" || where.line != expected.first ||
+          where.column != expected.second)
+        return false;
+      if (token.kind == TokenKind::T_EOF)
+        break;
+    }
+  }
+  return true;
+}
+
+// Queries out of order across chunk boundaries of a large buffer
+static bool testLargeBufferQueries() {
+  std::string text;
+  for (int i = 0; i < 40000; i++)
+    text += "line " + std::to_string(i) + (i % 7 ? "\n" : " /* a\nb */\n");
+  LinColQuery table(text);
+  std::mt19937 rng(3);
+  for (int q = 0; q < 2000; q++) {
+    unsigned offset = rng() % (text.size() + 10);
+    if (table.getLineCol(offset) != referenceLineCol(text, offset))
+      return false;
+  }
+  return true;
+}
+
+// An error inside an included file is reported against that file
+static bool testIncludedFile() {
+  char pattern[] = "/tmp/pp_lines_XXXXXX";
+  std::string dir = mkdtemp(pattern);
+  std::string header = dir + "/bad.h";
+  std::ofstream(header) << "#define F(a, b) a\n\nint x = F(1);\n";
+  std::ofstream(dir + "/main.c") << "int a;\n\n\n#include \"bad.h\"\n";
+
+  PreProcessor pp = PreProcessor::fromFile(dir + "/main.c");
+  bool raised = false;
+  try {
+    pp.expandMacros();
+  } catch (const std::runtime_error &) {
+    raised = true;
+  }
+  SourceLocation where = pp.location();
+  std::remove(header.c_str());
+  std::remove((dir + "/main.c").c_str());
+  rmdir(dir.c_str());
+  return raised && where.file == header && where.line == 3 &&
+         where.column == 13;
+}
+
+// Errors in define() text are not blamed on the input
+static bool testCommandLine() {
+  PreProcessor pp("int a;\nint b;\n");
+  pp.process();
+  try {
+    pp.define("F(=1");
+  } catch (const std::runtime_error &) {
+    return pp.location().file == "<command line>";
+  }
+  return false;
+}
+
+// After reset() locations refer to the new input
+static bool testAfterReset() {
+  PreProcessor pp("a\nb\nc\nd\n");
+  pp.process();
+  SourceLocation before = pp.location();
+  pp.reset("x y");
+  pp.next();
+  SourceLocation after = pp.location();
+  return before.line == 5 && after.line == 1 && after.column == 2;
+}
+
+int main() {
+  LineTableTester tester;
+  tester.check("Vector Scan Matches Byte Loop", testScanMatchesBytes());
+  tester.check("Locations While Lexing", testLocationsWhileLexing());
+  tester.check("Large Buffer Queries", testLargeBufferQueries());
+  tester.check("Error In Included File", testIncludedFile());
+  tester.check("Command Line Text", testCommandLine());
+  tester.check("Locations After Reset", testAfterReset());
+  return tester.printSummary();
+}
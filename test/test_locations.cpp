@@ -0,0 +1,282 @@
+#include "pp.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Covers PreProcessor::setLocationTracking(): every token gets a 32-bit
+// location that leads back to where it was written and, for expanded
+// tokens, to each invocation it came through.
+class LocationTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+public:
+  std::string root;
+
+  LocationTester() {
+    char pattern[] = "/tmp/pp_locations_XXXXXX";
+    root = mkdtemp(pattern);
+  }
+
+  ~LocationTester() { std::system(("rm -rf '" + root + "'").c_str()); }
+
+  std::string write(const std::string &name, const std::string &text) {
+    std::ofstream(root + "/" + name, std::ios::binary) << text;
+    return root + "/" + name;
+  }
+
+  void check(const std::string &testName, bool passed) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+// All of pp's tokens, read in small batches
+struct Tokens {
+  std::vector<std::string> texts; // Copied; batches point into scratch
+  std::vector<uint32_t> locs;
+  size_t size() const { return texts.size(); }
+};
+
+static Tokens readAll(PreProcessor &pp) {
+  Tokens all;
+  TokenBatch batch;
+  while (pp.nextBatch(batch, 7)) {
+    all.texts.insert(all.texts.end(), batch.texts.begin(), batch.texts.end());
+    all.locs.insert(all.locs.end(), batch.locs.begin(), batch.locs.end());
+  }
+  return all;
+}
+
+static bool at(const SourceLocation &where, std::string_view file,
+               unsigned line, unsigned column) {
+  return where.file == file && where.line == line && where.column == column;
+}
+
+// Nothing is recorded unless asked for
+static bool testOffByDefault() {
+  PreProcessor pp("#define F(x) x\nF(1) 2\n");
+  Tokens all = readAll(pp);
+  return all.size() == 2 && all.locs.empty() && pp.locations().size() == 0;
+}
+
+// Tokens copied through point at their file, line and column, in the
+// input, an included file or command-line text
+static bool testBufferLocations(LocationTester &t) {
+  std::string inc = t.write("inc.h", "int in_header;\n");
+  std::string path = t.write("main.c", "#include \"inc.h\"\n  first\nsecond X\n");
+  PreProcessor pp = PreProcessor::fromFile(path);
+  pp.setLocationTracking(true);
+  pp.define("X=value");
+  Tokens all = readAll(pp);
+  const LocationTable &locs = pp.locations();
+  return all.size() == 6 && all.locs.size() == 6 &&
+         at(locs.resolve(all.locs[0]), inc, 1, 1) &&
+         at(locs.resolve(all.locs[1]), inc, 1, 5) &&
+         at(locs.resolve(all.locs[3]), path, 2, 3) &&
+         at(locs.resolve(all.locs[4]), path, 3, 1) &&
+         all.texts[5] == "value" && locs.isExpansion(all.locs[5]) &&
+         at(locs.resolve(locs.spellingLoc(all.locs[5])), "<command line>", 1,
+            3) &&
+         at(locs.resolve(all.locs[5]), path, 3, 8);
+}
+
+// Replacement tokens are spelled in the #define and expanded at the
+// invocation; arguments keep their own locations
+static bool testExpansion() {
+  PreProcessor pp("#define ADD(a, b) ((a) + (b))\nint x = ADD(1,\n  2);\n");
+  pp.setLocationTracking(true);
+  Tokens all = readAll(pp);
+  const LocationTable &locs = pp.locations();
+  // int x = ( ( 1 ) + ( 2 ) ) ;
+  uint32_t paren = all.locs[3], one = all.locs[5], two = all.locs[9];
+  return all.size() == 13 && all.texts[5] == "1" && all.texts[9] == "2" &&
+         locs.isExpansion(paren) && !locs.isExpansion(one) &&
+         at(locs.resolve(locs.spellingLoc(paren)), "<input>", 1, 19) &&
+         at(locs.resolve(paren), "<input>", 2, 9) &&
+         at(locs.resolve(locs.spellingLoc(all.locs[7])), "<input>", 1, 24) &&
+         at(locs.resolve(one), "<input>", 2, 13) &&
+         at(locs.resolve(two), "<input>", 3, 3) &&
+         at(locs.resolve(all.locs[12]), "<input>", 3, 5);
+}
+
+// A macro expanded from another's result chains back through both
+static bool testNested() {
+  PreProcessor pp("#define INNER 7\n#define OUTER (INNER + 1)\nx OUTER\n");
+  pp.setLocationTracking(true);
+  Tokens all = readAll(pp);
+  const LocationTable &locs = pp.locations();
+  uint32_t seven = all.locs[2];
+  uint32_t inner = locs.invocationLoc(seven); // INNER in OUTER's result
+  return all.size() == 6 && all.texts[2] == "7" && locs.isExpansion(seven) &&
+         locs.isExpansion(inner) &&
+         at(locs.resolve(locs.spellingLoc(seven)), "<input>", 1, 15) &&
+         at(locs.resolve(locs.spellingLoc(inner)), "<input>", 2, 16) &&
+         locs.expansionLoc(seven) == locs.invocationLoc(inner) &&
+         at(locs.resolve(seven), "<input>", 3, 3) &&
+         at(locs.resolve(locs.spellingLoc(all.locs[4])), "<input>", 2, 24);
+}
+
+// # gives the parameter's place in the #define, ## the left operand's
+static bool testStringifyAndPaste() {
+  PreProcessor pp("#define S(x) #x\n#define CAT(a, b) a ## b\nS(v w) CAT(p, q)\n");
+  pp.setLocationTracking(true);
+  Tokens all = readAll(pp);
+  const LocationTable &locs = pp.locations();
+  return all.size() == 2 && all.texts[0] == "\"v w\"" && all.texts[1] == "pq" &&
+         at(locs.resolve(locs.spellingLoc(all.locs[0])), "<input>", 1, 15) &&
+         at(locs.resolve(all.locs[0]), "<input>", 3, 1) &&
+         at(locs.resolve(all.locs[1]), "<input>", 3, 12);
+}
+
+// Where a token came from, every step of the way back
+static std::string describe(const LocationTable &locs, uint32_t loc) {
+  std::string steps;
+  auto add = [&](uint32_t at) {
+    SourceLocation where = locs.resolve(at);
+    steps += std::to_string(where.line) + ":" + std::to_string(where.column);
+    steps += locs.isExpansion(at) ? "m " : " ";
+  };
+  for (; locs.isExpansion(loc); loc = locs.invocationLoc(loc)) {
+    add(loc);
+    add(locs.spellingLoc(loc));
+  }
+  add(loc);
+  return steps;
+}
+
+// Output is unchanged, and a result from the expansion cache gets the
+// locations expanding it again would have given
+static bool testRandomPrograms() {
+  static const std::vector<std::string> pieces = {
+      "#define F(x) x G\n", "#define G(y) [y]\n", "#define G 1\n",
+      "#undef G\n", "#define H(a, b) a ## b F(a)\n", "#define E(x)\n",
+      "#define S(x) #x H(x, x)\n", "F(1)", "F(F(2))", "(3)", "G", "H(p, q)",
+      " E(1) ", "S( a  b )", "\n", "x", ",", "#if G\ny\n#endif\n",
+      "#define K(x) F(x) H(x, x)\n", "K(K(2))"};
+  std::mt19937 rng(26);
+  for (int round = 0; round < 1000; round++) {
+    std::string text;
+    for (size_t n = rng() % 60; n; n--)
+      text += pieces[rng() % pieces.size()];
+    text += text;
+    std::string expected;
+    try {
+      expected = PreProcessor(text).expandMacros();
+    } catch (const std::runtime_error &) {
+      continue;
+    }
+    PreProcessor pp(text);
+    pp.setLocationTracking(true);
+    bool same = pp.expandMacros() == expected;
+    PreProcessor cached(text), uncached(text);
+    cached.setLocationTracking(true);
+    uncached.setLocationTracking(true);
+    uncached.setExpansionCacheSize(0);
+    Tokens a = readAll(cached), b = readAll(uncached);
+    same &= a.texts == b.texts && a.locs.size() == a.size() &&
+            b.locs.size() == b.size();
+    for (size_t i = 0; same && i < a.size(); i++)
+      same = a.locs[i] != LocationTable::kNone &&
+             describe(cached.locations(), a.locs[i]) ==
+                 describe(uncached.locations(), b.locs[i]);
+    if (!same) {
+      std::cout << "Mismatch in round " << round << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// reset() starts a new table; streamed text has no locations
+static bool testResetAndStreams() {
+  PreProcessor pp("#define A 1\nA\n");
+  pp.setLocationTracking(true);
+  readAll(pp);
+  size_t before = pp.locations().size();
+  pp.reset("b\n");
+  Tokens all = readAll(pp);
+  bool reset = before == 2 && pp.locations().size() == 1 &&
+               at(pp.locations().resolve(all.locs[0]), "<input>", 1, 1);
+
+  class OneRead : public InputSource {
+  public:
+    size_t read(char *out, size_t size) override {
+      std::string_view text = done_ ? "" : "s\n";
+      done_ = true;
+      size_t n = std::min(size, text.size());
+      std::memcpy(out, text.data(), n);
+      return n;
+    }
+
+  private:
+    bool done_ = false;
+  } source;
+  pp.reset(source);
+  all = readAll(pp);
+  return reset && all.size() == 1 && all.locs.size() == 1 &&
+         all.locs[0] == LocationTable::kNone;
+}
+
+// Timing for macro-heavy text, tracking off and on
+static bool testTiming() {
+  std::string text = "#define MAX(a, b) ((a) > (b) ? (a) : (b))\n"
+                     "#define CLAMP(x, lo, hi) MAX(MAX(x, lo), hi)\n";
+  for (int i = 0; text.size() < (8u << 20); i++)
+    text += "int v" + std::to_string(i) + " = CLAMP(v[i], 0, 255); /* c */\n";
+  auto time = [&](bool track, size_t &tokens) {
+    auto start = std::chrono::steady_clock::now();
+    PreProcessor pp(text);
+    pp.setLocationTracking(track);
+    TokenBatch batch;
+    tokens = 0;
+    while (size_t n = pp.nextBatch(batch, 4096))
+      tokens += n;
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  };
+  size_t off = 0, on = 0;
+  double untracked = time(false, off), tracked = time(true, on);
+  std::cout << "8 MB: " << untracked << " ms untracked, " << tracked
+            << " ms tracked\n";
+  return off == on && off > 1000000;
+}
+
+int main() {
+  LocationTester tester;
+  tester.check("Off By Default", testOffByDefault());
+  tester.check("Buffer Locations", testBufferLocations(tester));
+  tester.check("Expansion Locations", testExpansion());
+  tester.check("Nested Expansions", testNested());
+  tester.check("Stringify And Paste", testStringifyAndPaste());
+  tester.check("Random Programs", testRandomPrograms());
+  tester.check("Reset And Streams", testResetAndStreams());
+  tester.check("Timing", testTiming());
+  return tester.printSummary();
+}
@@ -0,0 +1,207 @@
+#include "pp.hpp"
+#include <iostream>
+#include <string>
+
+// Exercises the token-based expansion engine: rescanning, hide sets, the #
+// and ## operators, variadic macros and the diagnostics they raise.
+class MacroEngineTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+  static std::string normalizeSpaces(const std::string &str) {
+    std::string result;
+    bool lastWasSpace = false;
+    for (char c : str) {
+      if (std::isspace(static_cast<unsigned char>(c))) {
+        if (!lastWasSpace && !result.empty()) {
+          result += ' ';
+          lastWasSpace = true;
+        }
+      } else {
+        result += c;
+        lastWasSpace = false;
+      }
+    }
+    if (!result.empty() && result.back() == ' ')
+      result.pop_back();
+    return result;
+  }
+
+  void report(bool passed) {
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+public:
+  void runTest(const std::string &testName, const std::string &input,
+               const std::string &expected) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    std::cout << "Input:\n" << input << "\n";
+    try {
+      PreProcessor pp(input);
+      std::string result = normalizeSpaces(pp.expandMacros());
+      std::cout << "Output:\n" << result << "\n";
+      std::cout << "Expected:\n" << expected << "\n";
+      report(result == expected);
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      report(false);
+    }
+  }
+
+  void runErrorTest(const std::string &testName, const std::string &input,
+                    const std::string &expectedMessage) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    std::cout << "Input:\n" << input << "\n";
+    try {
+      PreProcessor pp(input);
+      pp.expandMacros();
+      std::cout << "No error raised\n";
+      report(false);
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      report(std::string(e.what()).find(expectedMessage) != std::string::npos);
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+int main() {
+  MacroEngineTester tester;
+
+  tester.runTest("Nested Invocation Is Rescanned",
+                 "#define DOUBLE(x) ((x) * 2)\n"
+                 "#define TRIPLE(x) ((x) * 3)\n"
+                 "int r = DOUBLE(TRIPLE(5));\n",
+                 "int r = ((((5) * 3)) * 2);");
+
+  tester.runTest("Parameter Inside Longer Identifier",
+                 "#define F(x) x x_y y_x (x)\n"
+                 "F(1)\n",
+                 "1 x_y y_x (1)");
+
+  tester.runTest("Self Reference Stops",
+                 "#define foo foo\n"
+                 "#define bar baz + bar\n"
+                 "foo bar\n",
+                 "foo baz + bar");
+
+  tester.runTest("Mutual Recursion Stops",
+                 "#define a b\n"
+                 "#define b a\n"
+                 "a b\n",
+                 "a b");
+
+  tester.runTest("Function Name Without Parens", "#define f(x) [x]\n"
+                                                 "#define g f\n"
+                                                 "g(1) g\n",
+                 "[1] f");
+
+  tester.runTest("Invocation Completed After Rescan",
+                 "#define CALL(m) m(7)\n"
+                 "#define ID(x) x\n"
+                 "CALL(ID)\n",
+                 "7");
+
+  tester.runTest("X-Macro",
+                 "#define COLORS(X) X(Red) X(Green) X(Blue)\n"
+                 "#define AS_ENUM(name) Color_##name,\n"
+                 "enum { COLORS(AS_ENUM) };\n",
+                 "enum { Color_Red, Color_Green, Color_Blue, };");
+
+  tester.runTest("Stringify", "#define STR(x) #x\n"
+                              "STR(a  +   b) STR(\"q\\n\") STR()\n",
+                 "\"a + b\" \"\\\"q\\\\n\\\"\" \"\"");
+
+  tester.runTest("Stringify Is Not Expanded",
+                 "#define N 42\n"
+                 "#define STR(x) #x\n"
+                 "#define XSTR(x) STR(x)\n"
+                 "STR(N) XSTR(N)\n",
+                 "\"N\" \"42\"");
+
+  tester.runTest("Token Pasting", "#define CAT(a, b) a ## b\n"
+                                  "CAT(x, 1) CAT(<, <=) CAT(, y) CAT(z, )\n",
+                 "x1 <<= y z");
+
+  tester.runTest("Pasted Name Is Rescanned",
+                 "#define CAT(a, b) a ## b\n"
+                 "#define ab done\n"
+                 "CAT(a, b)\n",
+                 "done");
+
+  tester.runTest("Variadic Arguments",
+                 "#define LOG(fmt, ...) printf(fmt, __VA_ARGS__)\n"
+                 "#define COUNT(...) #__VA_ARGS__\n"
+                 "LOG(\"%d %d\", 1, (2, 3)) COUNT(a, b) COUNT()\n",
+                 "printf(\"%d %d\", 1, (2, 3)) \"a, b\" \"\"");
+
+  tester.runTest("Arguments Across Lines", "#define ADD(a, b) a + b\n"
+                                           "int x = ADD(1,\n"
+                                           "            2);\n",
+                 "int x = 1 + 2;");
+
+  // C99 6.10.3.5 EXAMPLE 3: a newline may come before the '(' too
+  tester.runTest("Standard Rescan Example",
+                 "#define x 3\n"
+                 "#define f(a) f(x * (a))\n"
+                 "#undef x\n"
+                 "#define x 2\n"
+                 "#define g f\n"
+                 "#define z z[0]\n"
+                 "#define h g(~\n"
+                 "#define m(a) a(w)\n"
+                 "#define w 0,1\n"
+                 "#define t(a) a\n"
+                 "f(y+1) + f(f(z)) % t(t(g)(0) + t)(1);\n"
+                 "g(x+(3,4)-w) | h 5) & m\n"
+                 "(f)^m(m);\n",
+                 "f(2 * (y+1)) + f(2 * (f(2 * (z[0])))) % f(2 * (0)) + "
+                 "t(1); f(2 * (2+(3,4)-0,1)) | f(2 * (~ 5)) & "
+                 "f(2 * (0,1))^m(0,1);");
+
+  tester.runTest("Name Before A Directive Line", "#define m(a) [a]\n"
+                                                 "m\n"
+                                                 "\n"
+                                                 "#define n 1\n"
+                                                 "n m (2)\n",
+                 "m 1 [2]");
+
+  tester.runTest("Adjacent Tokens Stay Apart", "#define PLUS +\n"
+                                               "a+PLUS b PLUS+c\n",
+                 "a+ + b + +c");
+
+  tester.runErrorTest("Wrong Argument Count", "#define F(a, b) a\nF(1)\n",
+                      "requires 2 arguments, but 1 given");
+
+  tester.runErrorTest("Unterminated Arguments", "#define F(a) a\nF(1, \n",
+                      "Unterminated argument list");
+
+  tester.runErrorTest("Paste At Edge", "#define F(a) ## a\n",
+                      "'##' cannot appear at either end");
+
+  tester.runErrorTest("Invalid Paste", "#define CAT(a, b) a ## b\nCAT(+, /)\n",
+                      "does not give a valid preprocessing token");
+
+  return tester.printSummary();
+}
@@ -0,0 +1,195 @@
+#include "pp.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+// Covers MacroSnapshot: taking one from a configured PreProcessor, starting
+// new PreProcessors from it copy-on-write, and the binary file format.
+class MacroSnapshotTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+public:
+  void check(const std::string &testName, bool passed) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+static const char *kPrelude = "#define VERSION 3\n"
+                              "#define STR(x) #x\n"
+                              "#define CAT(a, b) a ## b\n"
+                              "#define LOG(fmt, ...) log(fmt, __VA_ARGS__)\n"
+                              "#define TWICE(x) ((x) + (x))\n"
+                              "#define GONE 1\n"
+                              "#undef GONE\n";
+
+static const char *kUse = "int v = VERSION; STR(a + b) CAT(x, VERSION) "
+                          "LOG(\"%d\", TWICE(2)) GONE\n";
+
+static std::shared_ptr<const MacroSnapshot> preludeSnapshot() {
+  PreProcessor pp(kPrelude);
+  pp.expandMacros();
+  return pp.snapshotMacros();
+}
+
+static std::string expandWith(std::shared_ptr<const MacroSnapshot> snapshot,
+                              const std::string &input) {
+  PreProcessor pp(input);
+  pp.setMacroSnapshot(std::move(snapshot));
+  return pp.expandMacros();
+}
+
+static std::string tempPath() {
+  char pattern[] = "/tmp/pp_snapshot_XXXXXX";
+  int fd = mkstemp(pattern);
+  close(fd);
+  return pattern;
+}
+
+// Starting from a snapshot gives the same output as lexing the prelude
+static bool testMatchesPrelude() {
+  std::string direct = PreProcessor(std::string(kPrelude) + kUse).expandMacros();
+  return expandWith(preludeSnapshot(), kUse) == direct.substr(direct.rfind("int"));
+}
+
+// The snapshot owns its text, so it outlives the PreProcessor it came from
+static bool testOutlivesSource() {
+  std::shared_ptr<const MacroSnapshot> snapshot;
+  {
+    PreProcessor pp(std::string("#define LONG ") + std::string(200, 'z') +
+                    "\n#define F(p) [p]\n");
+    pp.expandMacros();
+    snapshot = pp.snapshotMacros();
+  }
+  return expandWith(snapshot, "F(LONG)") ==
+         "[" + std::string(200, 'z') + "]";
+}
+
+// Defines and undefs in one PreProcessor are invisible to its siblings
+static bool testCopyOnWrite() {
+  auto snapshot = preludeSnapshot();
+  std::string a = expandWith(snapshot, "#undef VERSION\n#define STR(x) x\n"
+                                       "VERSION STR(y)\n");
+  std::string b = expandWith(snapshot, "#define VERSION 4\nVERSION STR(y)\n");
+  std::string c = expandWith(snapshot, "#undef VERSION\n#define VERSION 5\n"
+                                       "#ifdef VERSION\nVERSION\n#endif\n");
+  std::string d = expandWith(snapshot, "VERSION STR(y)\n");
+  return a.find("VERSION y") != std::string::npos &&
+         b.find("4 \"y\"") != std::string::npos &&
+         c.find("5") != std::string::npos &&
+         d.find("3 \"y\"") != std::string::npos &&
+         snapshot->macros().size() == 5;
+}
+
+// A layered table counts the base's macros unless hidden or shadowed
+static bool testLayeredTable() {
+  auto base = std::make_shared<MacroTable>();
+  for (uint32_t id = 0; id < 100; id++)
+    base->define(id).text = "base";
+  MacroTable top(base);
+  top.define(5).text = "top";                  // Shadow
+  top.define(500).text = "new";                // Local only
+  bool undefs = top.undef(6) && top.undef(5) && // Hide, hide over shadow
+                !top.undef(6) && !top.undef(1000);
+  top.define(6).text = "again";
+  size_t visited = 0;
+  top.forEach([&](uint32_t, const MacroDef &) { visited++; });
+  return undefs && top.size() == 100 && visited == 100 &&
+         top.find(5) == nullptr && top.find(6)->text == "again" &&
+         top.find(7)->text == "base" && top.find(500)->text == "new" &&
+         base->size() == 100 && base->find(5)->text == "base";
+}
+
+// A snapshot taken from a PreProcessor that started from one flattens both
+static bool testSnapshotOfSnapshot() {
+  PreProcessor pp("#undef TWICE\n#define EXTRA VERSION\n");
+  pp.setMacroSnapshot(preludeSnapshot());
+  pp.expandMacros();
+  auto second = pp.snapshotMacros();
+  return second->macros().size() == 5 &&
+         expandWith(second, "EXTRA TWICE(1) STR(q)") == "3 TWICE(1) \"q\"";
+}
+
+// Saved snapshots load back to the same macros
+static bool testSaveLoad() {
+  std::string path = tempPath();
+  preludeSnapshot()->save(path);
+  auto loaded = MacroSnapshot::load(path);
+  std::remove(path.c_str());
+  return loaded->macros().size() == 5 &&
+         expandWith(loaded, kUse) == expandWith(preludeSnapshot(), kUse);
+}
+
+// Damaged files are rejected rather than trusted
+static bool testRejectsDamagedFile() {
+  std::string path = tempPath();
+  preludeSnapshot()->save(path);
+  std::string data;
+  {
+    std::ifstream in(path, std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(in), {});
+  }
+  int rejected = 0;
+  for (std::string bad : {data.substr(0, data.size() - 3), "PPSNAP" + data,
+                          data + "x", std::string()}) {
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << bad;
+    try {
+      MacroSnapshot::load(path);
+    } catch (const std::runtime_error &e) {
+      rejected += std::string(e.what()).find("valid macro snapshot") !=
+                  std::string::npos;
+    }
+  }
+  std::remove(path.c_str());
+  return rejected == 4;
+}
+
+// A snapshot must be installed before anything has been interned
+static bool testLateSnapshotRejected() {
+  PreProcessor pp("#define A 1\n");
+  pp.expandMacros();
+  try {
+    pp.setMacroSnapshot(preludeSnapshot());
+  } catch (const std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+int main() {
+  MacroSnapshotTester tester;
+  tester.check("Matches Lexing The Prelude", testMatchesPrelude());
+  tester.check("Outlives Its Source", testOutlivesSource());
+  tester.check("Copy On Write", testCopyOnWrite());
+  tester.check("Layered Macro Table", testLayeredTable());
+  tester.check("Snapshot Of A Snapshot", testSnapshotOfSnapshot());
+  tester.check("Save And Load", testSaveLoad());
+  tester.check("Damaged File Rejected", testRejectsDamagedFile());
+  tester.check("Late Snapshot Rejected", testLateSnapshotRejected());
+  return tester.printSummary();
+}
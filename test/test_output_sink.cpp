@@ -0,0 +1,127 @@
+#include "pp.hpp"
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+// Checks that every OutputSink produces the same text as expandMacros()
+// returning a std::string, including when the output is much larger than
+// the FileSink chunk.
+class OutputSinkTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+  static std::string readBack(std::FILE *file) {
+    std::string text;
+    std::rewind(file);
+    char chunk[4096];
+    size_t n;
+    while ((n = std::fread(chunk, 1, sizeof(chunk), file)) > 0)
+      text.append(chunk, n);
+    return text;
+  }
+
+  void check(const std::string &sinkName, const std::string &got,
+             const std::string &expected, bool &ok) {
+    if (got != expected) {
+      std::cout << sinkName << " output differs (" << got.size() << " vs "
+                << expected.size() << " bytes)\n";
+      ok = false;
+    }
+  }
+
+public:
+  void runTest(const std::string &testName, const std::string &input,
+               size_t chunkSize) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+
+    std::string expected = PreProcessor(input).expandMacros();
+    bool ok = true;
+
+    std::FILE *file = std::tmpfile();
+    {
+      PreProcessor pp(input);
+      FileSink sink(file, chunkSize);
+      pp.expandMacros(sink);
+    }
+    check("FILE*", readBack(file), expected, ok);
+    std::fclose(file);
+
+    file = std::tmpfile();
+    {
+      PreProcessor pp(input);
+      FileSink sink(fileno(file), chunkSize);
+      pp.expandMacros(sink);
+    }
+    check("fd", readBack(file), expected, ok);
+    std::fclose(file);
+
+    std::string rebuilt;
+    size_t tokens = 0;
+    {
+      PreProcessor pp(input);
+      TokenCallbackSink sink(
+          [&](std::string_view text, TokenKind, bool spaced) {
+            if (spaced)
+              rebuilt += ' ';
+            rebuilt += text;
+            tokens++;
+          });
+      pp.expandMacros(sink);
+    }
+    check("callback", rebuilt, expected, ok);
+
+    std::cout << "Output: " << expected.size() << " bytes, " << tokens
+              << " tokens\n";
+    if (ok) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+int main() {
+  OutputSinkTester tester;
+
+  tester.runTest("Empty Input", "", 16);
+
+  std::string macros = "#define PI 3.14159\n"
+                       "#define SQUARE(x) ((x) * (x))\n"
+                       "#if 1\n"
+                       "double area = PI * SQUARE(r);\n"
+                       "#else\n"
+                       "double area = 0;\n"
+                       "#endif\n";
+  tester.runTest("Macros And Conditionals", macros, FileSink::kChunkSize);
+
+  // Longer tokens than the chunk, so writes span several drains.
+  std::string longTokens = "#define LONG " + std::string(100, 'x') + "\n";
+  for (int i = 0; i < 50; i++)
+    longTokens += "LONG \"" + std::string(40, 's') + "\" LONG\n";
+  tester.runTest("Tokens Longer Than Chunk", longTokens, 7);
+
+  std::string big = "#define ADD(a, b) ((a) + (b))\n";
+  for (int i = 0; i < 20000; i++)
+    big += "int v" + std::to_string(i) + " = ADD(" + std::to_string(i) +
+           ", 1);\n";
+  tester.runTest("Output Many Times The Chunk", big, 4096);
+
+  return tester.printSummary();
+}
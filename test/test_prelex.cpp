@@ -0,0 +1,229 @@
+#include "pp.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Covers PreProcessor::prelex(): tokenizing the input on several threads
+// up front must not change the output, however the chunk cuts fall
+// relative to comments, string literals and skipped groups.
+class PrelexTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+public:
+  std::string root;
+
+  PrelexTester() {
+    char pattern[] = "/tmp/pp_prelex_XXXXXX";
+    root = mkdtemp(pattern);
+  }
+
+  ~PrelexTester() { std::system(("rm -rf '" + root + "'").c_str()); }
+
+  std::string write(const std::string &name, const std::string &text) {
+    std::ofstream(root + "/" + name, std::ios::binary) << text;
+    return root + "/" + name;
+  }
+
+  void check(const std::string &testName, bool passed) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+static bool expandsLikeSequential(const std::string &text, unsigned threads,
+                                  size_t *tokens = nullptr) {
+  std::string expected, got;
+  bool expectedError = false, gotError = false;
+  try {
+    expected = PreProcessor(text).expandMacros();
+  } catch (const std::runtime_error &) {
+    expectedError = true;
+  }
+  PreProcessor pp(text);
+  pp.prelex(threads);
+  if (tokens)
+    *tokens = pp.prelexedTokens();
+  try {
+    got = pp.expandMacros();
+  } catch (const std::runtime_error &) {
+    gotError = true;
+  }
+  return expected == got && expectedError == gotError;
+}
+
+// Text made of pieces that often leave a comment or literal open over a
+// line end, and so over a cut
+static std::string randomText(std::mt19937 &rng, size_t size) {
+  static const std::vector<std::string> pieces = {
+      "#define F(x) x + 1\n", "F(2)", " a ", " b\n", "/* c\n\n */",
+      "\"s\ns\"", "'c'", "#if 0\n'\n#endif\n", "// x\n", "123.4e+5", " ( ",
+      ")", ",", "\n", "#ifdef F\nq\n#else\nr\n#endif\n", "/*", "*/", "\"",
+      "#undef F\n"};
+  std::string text;
+  while (text.size() < size)
+    text += pieces[rng() % pieces.size()];
+  return text;
+}
+
+// Random text on any number of threads expands as it does sequentially
+static bool testRandomText() {
+  std::mt19937 rng(21);
+  for (int round = 0; round < 12; round++) {
+    size_t tokens = 0;
+    std::string text = randomText(rng, 600000 + rng() % 600000);
+    if (!expandsLikeSequential(text, 2 + rng() % 7, &tokens) || tokens == 0) {
+      std::cout << "Mismatch in round " << round << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// A comment and a string literal each spanning several whole chunks
+static bool testSpanningChunks() {
+  std::string line = "int v = ADD(1, 2); /* note */ char *s = \"text\";\n";
+  std::string body;
+  while (body.size() < 300000)
+    body += line;
+  std::string text = "#define ADD(a, b) ((a) + (b))\n" + body + "/*\n" +
+                     body + "*/\n" + body + "char *big = \"\n" + body +
+                     "\";\n" + body;
+  return expandsLikeSequential(text, 8) && expandsLikeSequential(text, 3);
+}
+
+// Streams a copy of one string
+class StringSource : public InputSource {
+public:
+  explicit StringSource(std::string text) : text_(std::move(text)) {}
+
+  size_t read(char *out, size_t size) override {
+    size_t n = std::min(size, text_.size() - at_);
+    std::memcpy(out, text_.data() + at_, n);
+    at_ += n;
+    return n;
+  }
+
+private:
+  std::string text_;
+  size_t at_ = 0;
+};
+
+// Inputs too small to split and streamed inputs are left alone
+static bool testLeftAlone() {
+  PreProcessor small("#define X 1\nX\n");
+  small.prelex(8);
+  std::string text(600000, ' ');
+  text += "x\n";
+  StringSource source(text);
+  PreProcessor streamed(source);
+  streamed.prelex(8);
+  PreProcessor large(text);
+  large.prelex(4);
+  return small.prelexedTokens() == 0 && small.expandMacros() == "\n1\n" &&
+         streamed.prelexedTokens() == 0 && large.prelexedTokens() == 2 &&
+         streamed.expandMacros() == large.expandMacros();
+}
+
+// A file input with includes, and reset() dropping the tokens
+static bool testFileAndReset(PrelexTester &t) {
+  t.write("inc.h", "#define FROM_INC 42\n/* open\n*/ int inc;\n");
+  std::string text;
+  for (int i = 0; i < 20000; i++)
+    text += "#include \"inc.h\"\nint y" + std::to_string(i) +
+            " = FROM_INC; // done\n";
+  std::string path = t.write("main.c", text);
+  std::string expected = PreProcessor::fromFile(path).expandMacros();
+  PreProcessor pp = PreProcessor::fromFile(path);
+  pp.prelex(4);
+  bool used = pp.prelexedTokens() > 100000;
+  bool same = pp.expandMacros() == expected;
+  pp.reset("a b\n");
+  return used && same && pp.prelexedTokens() == 0 &&
+         pp.expandMacros() == "a b\n";
+}
+
+// A token too long for Token, lexed by the calling thread or by a worker,
+// leaves the input alone, and lexing it as it is read raises the error
+static bool testOverlongToken() {
+  bool passed = true;
+  for (size_t prefix : {size_t(2) << 20, size_t(12) << 20}) {
+    std::string text;
+    while (text.size() < prefix)
+      text += "int x; /* filler */\n";
+    text += "char *s = \"" + std::string(17u << 20, 'a') + "\";\n";
+    PreProcessor pp(text);
+    pp.prelex(4);
+    passed &= pp.prelexedTokens() == 0;
+    try {
+      pp.expandMacros();
+      passed = false;
+    } catch (const std::runtime_error &e) {
+      passed &= std::string(e.what()).find("16 MiB") != std::string::npos;
+    }
+  }
+  return passed;
+}
+
+// Timing for a large file, sequential against pre-lexed
+static bool testTiming() {
+  std::string text = "#define ADD(a, b) ((a) + (b))\n";
+  for (int i = 0; text.size() < (16u << 20); i++)
+    text += "static int v" + std::to_string(i) + " = ADD(x, " +
+            std::to_string(i) + "); /* comment */ char *s = \"text\";\n";
+  auto time = [&](unsigned threads, std::string &out) {
+    auto start = std::chrono::steady_clock::now();
+    PreProcessor pp(text);
+    if (threads)
+      pp.prelex(threads);
+    out = pp.expandMacros();
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  };
+  std::string sequential, prelexed;
+  double before = time(0, sequential);
+  double after = time(std::max(2u, std::thread::hardware_concurrency()),
+                      prelexed);
+  std::cout << "16 MB: " << before << " ms sequential, " << after
+            << " ms pre-lexed on "
+            << std::max(2u, std::thread::hardware_concurrency())
+            << " threads\n";
+  return sequential == prelexed;
+}
+
+int main() {
+  PrelexTester tester;
+  tester.check("Random Text", testRandomText());
+  tester.check("Comment And String Spanning Chunks", testSpanningChunks());
+  tester.check("Small And Streamed Inputs Left Alone", testLeftAlone());
+  tester.check("File Input And Reset", testFileAndReset(tester));
+  tester.check("Token Too Long On Any Thread", testOverlongToken());
+  tester.check("Large File Timing", testTiming());
+  return tester.printSummary();
+}
@@ -0,0 +1,110 @@
+#include "pp.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Covers PreProcessor::reset(): a reused instance must behave exactly like
+// a fresh one, whatever the previous input left behind.
+class ResetTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+public:
+  void check(const std::string &testName, bool passed) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+static const std::vector<std::string> kInputs = {
+    "#define A 1\n#define F(x, ...) [x __VA_ARGS__]\nA F(2, 3) F(A)\n",
+    "A F(2)\n#ifdef A\nbad\n#else\ngood\n#endif\n",
+    "#define CAT(a, b) a ## b\n#define STR(x) #x\nCAT(x, y) STR(a  b)\n",
+    "#if defined(CAT) || 2 > 3\nleak\n#elif 1\nclean\n#endif\nCAT(x, y)\n",
+    "#define N 5\n#undef N\n#define N 6\nN\n",
+    "",
+};
+
+static std::string fresh(const std::string &input) {
+  return PreProcessor(input).expandMacros();
+}
+
+// Every input expands the same after any other input
+static bool testMatchesFresh() {
+  PreProcessor pp("");
+  for (size_t round = 0; round < 3; round++) {
+    for (size_t i = 0; i < kInputs.size(); i++) {
+      const std::string &input = kInputs[(i * (round + 1)) % kInputs.size()];
+      pp.reset(input);
+      if (pp.expandMacros() != fresh(input))
+        return false;
+    }
+  }
+  return true;
+}
+
+// A failed run leaves nothing behind for the next one
+static bool testAfterError() {
+  PreProcessor pp("#define F(a, b) a\n#if 1\nF(1)\n#endif\n");
+  try {
+    pp.expandMacros();
+    return false;
+  } catch (const std::runtime_error &) {
+  }
+  pp.reset("F(1, 2)\n#ifdef F\nno\n#endif\nyes\n");
+  return pp.expandMacros() == fresh("F(1, 2)\n#ifdef F\nno\n#endif\nyes\n");
+}
+
+// Resetting onto a snapshot starts from its macros, discarding local ones
+static bool testResetWithSnapshot() {
+  PreProcessor setup("#define BASE 7\n#define TWICE(x) ((x) * 2)\n");
+  setup.expandMacros();
+  auto snapshot = setup.snapshotMacros();
+
+  PreProcessor pp("#define LOCAL 1\n#undef BASE\n");
+  pp.setMacroSnapshot(snapshot);
+  pp.expandMacros();
+  pp.reset("BASE TWICE(BASE) LOCAL\n", snapshot);
+  std::string first = pp.expandMacros();
+  pp.reset("BASE LOCAL\n");
+  std::string second = pp.expandMacros();
+  return first == "7 ((7) * 2) LOCAL\n" && second == "BASE LOCAL\n";
+}
+
+// The input may be a view of the instance's own buffer
+static bool testResetFromOwnBuffer() {
+  PreProcessor pp("#define X 1\nX\n");
+  std::string first = pp.expandMacros();
+  pp.reset(pp.getBuffer());
+  return pp.expandMacros() == first;
+}
+
+int main() {
+  ResetTester tester;
+  tester.check("Matches A Fresh Instance", testMatchesFresh());
+  tester.check("Recovers After An Error", testAfterError());
+  tester.check("Reset Onto A Snapshot", testResetWithSnapshot());
+  tester.check("Reset From Own Buffer", testResetFromOwnBuffer());
+  return tester.printSummary();
+}
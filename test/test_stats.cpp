@@ -0,0 +1,193 @@
+#define PP_ENABLE_STATS
+#include "pp.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Covers PreProcessor::stats() and PreprocessStats::toJson() in a build
+// with PP_ENABLE_STATS defined. Headers are written to a scratch directory.
+class StatsTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+public:
+  std::string root;
+
+  StatsTester() {
+    char pattern[] = "/tmp/pp_stats_XXXXXX";
+    root = mkdtemp(pattern);
+    write("guarded.h", "#ifndef GUARDED_H\n#define GUARDED_H\n"
+                       "#include \"once.h\"\nint guarded;\n#endif\n");
+    write("once.h", "#pragma once\nint once;\n");
+    write("q\"uote.h", "int odd;\n");
+  }
+
+  ~StatsTester() { std::system(("rm -rf '" + root + "'").c_str()); }
+
+  void write(const std::string &name, const std::string &text) {
+    std::ofstream(root + "/" + name, std::ios::binary) << text;
+  }
+
+  void check(const std::string &testName, bool passed) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+// Every token next() returns is counted under its kind
+static bool testTokenCounts() {
+  const std::string text = "int x = (a + b) * 3;\nchar *s = \"str\";\n";
+  std::vector<uint64_t> expected(PreprocessStats::kTokenKinds);
+  PreProcessor lexer(text);
+  for (Token token = lexer.next();; token = lexer.next()) {
+    expected[static_cast<int>(token.kind) + 1]++;
+    if (token.kind == TokenKind::T_EOF)
+      break;
+  }
+
+  PreProcessor pp(text);
+  pp.process();
+  PreprocessStats stats = pp.stats();
+  for (size_t i = 0; i < expected.size(); i++)
+    if (stats.tokens[i] != expected[i])
+      return false;
+  return stats.tokenCount(TokenKind::Ident) == 6 &&
+         stats.tokenCount(TokenKind::StringLiteral) == 1 &&
+         stats.tokenCount() == lexer.stats().tokenCount();
+}
+
+// Groups not taken count their bytes and none of their tokens
+static bool testSkippedBytes() {
+  std::string dead(1000, 'x');
+  dead += '\n';
+  PreProcessor pp("#if 0\n" + dead + "#elif 0\n" + dead + "#else\nlive\n#endif\n");
+  pp.process();
+  PreprocessStats stats = pp.stats();
+  return stats.skippedBytes >= 2 * dead.size() &&
+         stats.skippedBytes < 2 * dead.size() + 40 &&
+         stats.tokenCount(TokenKind::Ident) == 1;
+}
+
+// Lookups, hits, expansions by kind and by name, rescans and depth
+static bool testMacroCounters() {
+  PreProcessor pp("#define A B\n#define B C\n#define C D\n#define D 1\n"
+                  "#define F(x) (x + A)\n"
+                  "A F(2) F(F(3)) plain\n");
+  std::string out = pp.expandMacros();
+  PreprocessStats stats = pp.stats();
+  bool names = stats.macros.size() == 5 && stats.macros[0].name == "A" &&
+               stats.macros[0].expansions == 4 &&
+               stats.macros[1].name == "B" && stats.macros[4].name == "F" &&
+               stats.macros[4].expansions == 3;
+  return out == "\n\n\n\n\n1 (2 + 1) ((3 + 1) + 1) plain\n" && names &&
+         stats.functionExpansions == 3 && stats.objectExpansions == 16 &&
+         stats.macroHits < stats.macroLookups && stats.rescannedTokens > 20 &&
+         stats.peakExpansionDepth == 5;
+}
+
+// Headers are reported in order of first inclusion with their entries and
+// skips; repeated names hit the include cache
+static bool testHeaders(StatsTester &t) {
+  t.write("main.c", "#include \"guarded.h\"\n#include \"guarded.h\"\n"
+                    "#include \"once.h\"\n#include <q\"uote.h>\n");
+  PreProcessor pp = PreProcessor::fromFile(t.root + "/main.c");
+  pp.addIncludePath(t.root);
+  pp.process();
+  PreprocessStats stats = pp.stats();
+  if (stats.headers.size() != 3)
+    return false;
+  const PreprocessStats::Header &guarded = stats.headers[0];
+  const PreprocessStats::Header &once = stats.headers[1];
+  return guarded.path == t.root + "/guarded.h" && guarded.entered == 1 &&
+         guarded.skipped == 1 && guarded.bytes == 74 &&
+         guarded.nanos >= once.nanos && once.entered == 1 &&
+         once.skipped == 1 && stats.headers[2].entered == 1 &&
+         stats.includeCacheHits == 2 && stats.includeCacheMisses == 3;
+}
+
+// Phases each get some time, all of it spent inside the run
+static bool testPhases() {
+  std::string text = "#define F(a, b) ((a) * (b))\n";
+  for (int i = 0; i < 20000; i++)
+    text += "#define M" + std::to_string(i % 50) + " F(" + std::to_string(i) +
+            ", 2)\nint v" + std::to_string(i) + " = M" +
+            std::to_string(i % 50) + ";\n";
+  PreProcessor pp(text);
+  auto start = std::chrono::steady_clock::now();
+  pp.expandMacros();
+  uint64_t wall = static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start)
+          .count());
+  PreprocessStats stats = pp.stats();
+  uint64_t total = 0;
+  for (uint64_t nanos : stats.phaseNanos) {
+    if (nanos == 0)
+      return false;
+    total += nanos;
+  }
+  std::cout << "lex " << stats.phaseNanos[PreprocessStats::Lex] / 1000
+            << " us, directive "
+            << stats.phaseNanos[PreprocessStats::Directive] / 1000
+            << " us, expand " << stats.phaseNanos[PreprocessStats::Expand] / 1000
+            << " us, output " << stats.phaseNanos[PreprocessStats::Output] / 1000
+            << " us of " << wall / 1000 << " us\n";
+  return total <= wall;
+}
+
+// The dump has every counter and escapes names; reset() starts from zero
+static bool testJsonAndReset(StatsTester &t) {
+  PreProcessor pp("#include <q\"uote.h>\n#define ONE 1\nONE\n");
+  pp.addIncludePath(t.root);
+  pp.expandMacros();
+  std::string json = pp.stats().toJson();
+  bool dumped = json.find("\"enabled\": true") != std::string::npos &&
+                json.find("\"Ident\": ") != std::string::npos &&
+                json.find("\"includeCacheMisses\": 1,") != std::string::npos &&
+                json.find("q\\\"uote.h\"") != std::string::npos &&
+                json.find("{\"name\": \"ONE\", \"expansions\": 1}") !=
+                    std::string::npos &&
+                json.front() == '{' && json.substr(json.size() - 2) == "}\n";
+
+  pp.reset("x\n");
+  pp.process();
+  PreprocessStats stats = pp.stats();
+  return dumped && stats.tokenCount() == 3 && stats.headers.empty() &&
+         stats.macros.empty() && stats.includeCacheMisses == 0 &&
+         stats.phaseNanos[PreprocessStats::Expand] == 0;
+}
+
+int main() {
+  StatsTester tester;
+  tester.check("Token Counts By Kind", testTokenCounts());
+  tester.check("Bytes Skipped In Dead Groups", testSkippedBytes());
+  tester.check("Macro Counters", testMacroCounters());
+  tester.check("Headers And Include Cache", testHeaders(tester));
+  tester.check("Phase Times", testPhases());
+  tester.check("JSON Dump And Reset", testJsonAndReset(tester));
+  return tester.printSummary();
+}
@@ -0,0 +1,263 @@
+#include "pp.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+// Covers PreProcessor(InputSource &): streamed input must expand exactly
+// like the same text held in memory, however the source splits its reads
+// and however small the window, while memory stays flat.
+class StreamTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+public:
+  std::string root;
+
+  StreamTester() {
+    char pattern[] = "/tmp/pp_stream_XXXXXX";
+    root = mkdtemp(pattern);
+  }
+
+  ~StreamTester() { std::system(("rm -rf '" + root + "'").c_str()); }
+
+  std::string write(const std::string &name, const std::string &text) {
+    std::ofstream(root + "/" + name, std::ios::binary) << text;
+    return root + "/" + name;
+  }
+
+  void check(const std::string &testName, bool passed) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+// Hands out text in pieces of random size, sometimes a single byte
+class PieceSource : public InputSource {
+public:
+  PieceSource(std::string text, unsigned seed)
+      : text_(std::move(text)), rng_(seed) {}
+
+  size_t read(char *out, size_t size) override {
+    size_t piece = rng_() % 4 ? rng_() % 300 + 1 : 1;
+    size_t n = std::min({size, piece, text_.size() - at_});
+    std::memcpy(out, text_.data() + at_, n);
+    at_ += n;
+    return n;
+  }
+
+private:
+  std::string text_;
+  size_t at_ = 0;
+  std::mt19937 rng_;
+};
+
+static std::string streamed(const std::string &text, size_t window,
+                            unsigned seed = 1) {
+  PieceSource source(text, seed);
+  PreProcessor pp(source, window);
+  return pp.expandMacros();
+}
+
+static const std::string kMixed =
+    "#define CAT(a, b) a ## b\n#define STR(x) #x\n"
+    "#define ADD(a, b) ((a) + (b))\n"
+    "int v = ADD(1,\n        2) + CAT(x, 1);\n"
+    "/* a comment running\n   over several lines\n   and more */ int c;\n"
+    "char *s = \"a string\nacross lines\", t = STR( two  words );\n"
+    "#if 0\nhidden ADD(\n /* \" */ #endif\n#if 1\n"
+    "#ifdef ADD\nshown\n#elif 1\nnot\n#endif\n#endif\n"
+    "#undef ADD\n#define ADD(a, b) a b\nADD(p, q)\n";
+
+// Any window and any split of the reads gives the in-memory output
+static bool testMatchesMemory() {
+  std::string text;
+  for (int i = 0; i < 100; i++)
+    text += kMixed;
+  text += "#if 0\n" + std::string(20000, 'x') + "\n#endif\nlast ADD(1, 2)";
+  std::string expected = PreProcessor(text).expandMacros();
+  for (size_t window : {1, 7, 64, 1000, 1 << 20})
+    if (streamed(text, window, static_cast<unsigned>(window)) != expected)
+      return false;
+  return expected.find("last 1 2") != std::string::npos;
+}
+
+// Random text, errors included, behaves as it does in memory
+static bool testRandomText() {
+  static const std::vector<std::string> pieces = {
+      "#define M(x) x x\n", "M(", ")", "M", "/*", "*/", "\"", "'", "\n",
+      "#if 1\n", "#if 0\n", "#endif\n", "#else\n", " ", "a", "1", "//",
+      "#undef M\n", "#define N M(1)\n", "N", ",", "##"};
+  std::mt19937 rng(3);
+  for (int round = 0; round < 400; round++) {
+    std::string text;
+    for (size_t n = rng() % 200; n; n--)
+      text += pieces[rng() % pieces.size()];
+    std::string expected, got;
+    bool expectedError = false, gotError = false;
+    try {
+      expected = PreProcessor(text).expandMacros();
+    } catch (const std::runtime_error &) {
+      expectedError = true;
+    }
+    try {
+      got = streamed(text, rng() % 40 + 1, round);
+    } catch (const std::runtime_error &) {
+      gotError = true;
+    }
+    if (expectedError != gotError || expected != got) {
+      std::cout << "Mismatch in round " << round << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writes count copies of a block made up on the fly, never all at once
+class RepeatSource : public InputSource {
+public:
+  RepeatSource(std::string block, size_t count)
+      : block_(std::move(block)), left_(count) {}
+
+  size_t read(char *out, size_t size) override {
+    size_t n = 0;
+    while (n < size && left_) {
+      size_t take = std::min(size - n, block_.size() - at_);
+      std::memcpy(out + n, block_.data() + at_, take);
+      n += take;
+      at_ += take;
+      if (at_ == block_.size())
+        at_ = 0, left_--;
+    }
+    return n;
+  }
+
+private:
+  std::string block_;
+  size_t at_ = 0, left_;
+};
+
+static long peakKilobytes() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// 64MB of input, a live and a dead half, runs in a few windows' worth of
+// memory
+static bool testFlatMemory() {
+  std::string block = "#define SQ(x) ((x) * (x))\nint v = SQ(3) + SQ(4);\n"
+                      "#if 0\n" + std::string(100, 'z') + "\n#endif\n";
+  const size_t count = (64u << 20) / block.size();
+  RepeatSource source(block, count);
+  PreProcessor pp(source, 1 << 16);
+  size_t lines = 0, bytes = 0;
+  TokenCallbackSink sink([&](std::string_view text, TokenKind, bool) {
+    bytes += text.size();
+    lines += text == "\n";
+  });
+  long before = peakKilobytes();
+  pp.expandMacros(sink);
+  long grown = peakKilobytes() - before;
+  std::cout << count * block.size() / (1 << 20) << " MB streamed, peak grew "
+            << grown << " KB\n";
+  return lines == count * 3 && grown < 16 * 1024;
+}
+
+// Errors report lines of the whole input, not of the window
+static bool testLocation() {
+  std::string text;
+  for (int i = 0; i < 5000; i++)
+    text += "int line" + std::to_string(i) + ";\n";
+  text += "#define F(a, b) a\nint bad = F(1);\n";
+  PieceSource source(text, 9);
+  PreProcessor pp(source, 100);
+  try {
+    pp.expandMacros();
+  } catch (const std::runtime_error &) {
+    SourceLocation where = pp.location();
+    return where.file == "<input>" && where.line == 5002 &&
+           where.column == 15;
+  }
+  return false;
+}
+
+// FileSource reads descriptors and stdio streams; quoted includes are
+// found on the include path
+static bool testFileSource(StreamTester &t) {
+  t.write("inc.h", "#define FROM_INC 42\nint inc;\n");
+  std::string text = "#include \"inc.h\"\nint x = FROM_INC;\n";
+  for (int i = 0; i < 2000; i++)
+    text += "int y" + std::to_string(i) + " = FROM_INC;\n";
+  std::string path = t.write("main.c", text);
+  PreProcessor memory(text);
+  memory.addIncludePath(t.root);
+  std::string expected = memory.expandMacros();
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  FileSource fromFd(fd);
+  PreProcessor byFd(fromFd, 512);
+  byFd.addIncludePath(t.root);
+  bool fdMatches = byFd.expandMacros() == expected;
+  ::close(fd);
+
+  FILE *file = std::fopen(path.c_str(), "rb");
+  FileSource fromFile(file);
+  PreProcessor byFile(fromFile, 512);
+  byFile.addIncludePath(t.root);
+  bool fileMatches = byFile.expandMacros() == expected;
+  std::fclose(file);
+  return fdMatches && fileMatches &&
+         expected.find("int y1999 = 42;") != std::string::npos;
+}
+
+// reset() moves between streamed and in-memory input
+static bool testReset() {
+  PieceSource first("#define A 1\nA\n", 1);
+  PreProcessor pp(first, 4);
+  bool one = pp.expandMacros() == "\n1\n";
+  pp.reset("#define B 2\nA B\n");
+  bool two = pp.expandMacros() == "\nA 2\n";
+  PieceSource second(kMixed, 2);
+  pp.reset(second, 16);
+  return one && two &&
+         pp.expandMacros() == PreProcessor(kMixed).expandMacros();
+}
+
+int main() {
+  StreamTester tester;
+  tester.check("Matches In-Memory Output", testMatchesMemory());
+  tester.check("Random Text", testRandomText());
+  tester.check("Flat Memory", testFlatMemory());
+  tester.check("Error Location", testLocation());
+  tester.check("File Source", testFileSource(tester));
+  tester.check("Reset", testReset());
+  return tester.printSummary();
+}
@@ -0,0 +1,117 @@
+#include "pp.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Covers IdentifierTable and MacroTable directly, plus the macro store as
+// seen through expandMacros().
+class SymbolTableTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+public:
+  void check(const std::string &testName, bool ok) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    if (ok) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+static bool testInterning() {
+  IdentifierTable table;
+  uint32_t a = table.intern("alpha");
+  uint32_t b = table.intern("beta");
+  return a == 0 && b == 1 && table.intern("alpha") == a &&
+         table.find("beta") == b &&
+         table.find("gamma") == IdentifierTable::kInvalidId &&
+         table.spelling(a) == "alpha" && table.size() == 2;
+}
+
+static bool testInterningGrowth() {
+  IdentifierTable table;
+  for (int i = 0; i < 50000; i++)
+    if (table.intern("id_" + std::to_string(i)) != uint32_t(i))
+      return false;
+  for (int i = 0; i < 50000; i += 777)
+    if (table.spelling(table.find("id_" + std::to_string(i))) !=
+        "id_" + std::to_string(i))
+      return false;
+  return table.size() == 50000;
+}
+
+static bool testDefineUndefChurn() {
+  MacroTable macros;
+  std::vector<std::string> texts;
+  for (int i = 0; i < 5020; i++)
+    texts.push_back(std::to_string(i));
+  // Repeated define/undef cycles leave tombstones that must be recycled.
+  for (int round = 0; round < 20; round++) {
+    for (uint32_t id = 0; id < 5000; id++)
+      macros.define(id).text = texts[id + round];
+    for (uint32_t id = 0; id < 5000; id += 2)
+      if (!macros.undef(id))
+        return false;
+    for (uint32_t id = 0; id < 5000; id++) {
+      const MacroDef *def = macros.find(id);
+      if ((id % 2 == 0) != (def == nullptr))
+        return false;
+      if (def && def->text != texts[id + round])
+        return false;
+    }
+    for (uint32_t id = 1; id < 5000; id += 2)
+      macros.undef(id);
+    if (macros.size() != 0)
+      return false;
+  }
+  return !macros.undef(42) && macros.find(IdentifierTable::kInvalidId) ==
+                                   nullptr;
+}
+
+static bool testRedefineKind() {
+  PreProcessor pp("#define F(x) (x + 1)\n#define F 7\nint a = F;\n"
+                  "#undef F\n#define F(y) [y]\nint b = F(2);");
+  std::string out = pp.expandMacros();
+  return out.find("7") != std::string::npos &&
+         out.find("[2]") != std::string::npos &&
+         out.find("(x + 1)") == std::string::npos;
+}
+
+static bool testManyMacros() {
+  std::string input;
+  for (int i = 0; i < 20000; i++)
+    input += "#define M" + std::to_string(i) + " " + std::to_string(i) + "\n";
+  input += "int x = M0 + M19999 + M12345;";
+  PreProcessor pp(input);
+  std::string out = pp.expandMacros();
+  return out.find("0 + 19999 + 12345") != std::string::npos;
+}
+
+int main() {
+  SymbolTableTester tester;
+  tester.check("Interning Assigns Dense IDs", testInterning());
+  tester.check("Interning Survives Rehash", testInterningGrowth());
+  tester.check("Define/Undef Churn", testDefineUndefChurn());
+  tester.check("Redefinition Replaces Macro Kind", testRedefineKind());
+  tester.check("Twenty Thousand Macros", testManyMacros());
+  return tester.printSummary();
+}
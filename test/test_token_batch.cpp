@@ -0,0 +1,180 @@
+#include "pp.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Covers PreProcessor::nextBatch(): the batches must carry exactly the
+// tokens expandMacros() produces, whatever the cap, with flags taken from
+// the source rather than from output formatting.
+class TokenBatchTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+public:
+  void check(const std::string &testName, bool passed) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+struct Tokens {
+  std::vector<TokenKind> kinds;
+  std::vector<std::string> texts;
+  std::vector<bool> lineStarts;
+};
+
+// What expandMacros() hands its sink, line ends folded into lineStarts
+static Tokens fromSink(const std::string &input) {
+  Tokens tokens;
+  bool lineStart = true;
+  TokenCallbackSink sink([&](std::string_view text, TokenKind kind, bool) {
+    if (kind == TokenKind::Unknown && text == "\n") {
+      lineStart = true;
+      return;
+    }
+    tokens.kinds.push_back(kind);
+    tokens.texts.emplace_back(text);
+    tokens.lineStarts.push_back(lineStart);
+    lineStart = false;
+  });
+  PreProcessor(input).expandMacros(sink);
+  return tokens;
+}
+
+// Every batch of pp in order, checking none holds more than cap
+static Tokens fromBatches(PreProcessor &pp, size_t cap, bool &overCap) {
+  Tokens tokens;
+  TokenBatch batch;
+  overCap = false;
+  while (size_t n = pp.nextBatch(batch, cap)) {
+    overCap = overCap || n > cap || n != batch.size();
+    for (size_t i = 0; i < n; i++) {
+      tokens.kinds.push_back(batch.kinds[i]);
+      tokens.texts.emplace_back(batch.texts[i]);
+      tokens.lineStarts.push_back(batch.flags[i] & TokenBatch::StartOfLine);
+    }
+  }
+  return tokens;
+}
+
+static bool sameTokens(const Tokens &a, const Tokens &b) {
+  return a.kinds == b.kinds && a.texts == b.texts &&
+         a.lineStarts == b.lineStarts;
+}
+
+static const std::string kMixed =
+    "#define CAT(a, b) a ## b\n#define STR(x) #x\n"
+    "#define LIST(...) { __VA_ARGS__ }\n#define F(x) CAT(x, _suffix) STR(x)\n"
+    "#if defined(CAT) && 1\nint CAT(var, 1) = 10;\n#else\nhidden\n#endif\n"
+    "char *s = STR(  spaced   out  ), c = 'q';\n"
+    "int a[] = LIST(F(one), F(two),\n    F(three));\n"
+    "#pragma pack(push, 1)\n#pragma once\n"
+    "x = y->z ... /* comment */ w;\n";
+
+// Any cap gives the sink's tokens, kinds and line starts
+static bool testMatchesSink() {
+  std::string input;
+  for (int i = 0; i < 200; i++)
+    input += kMixed;
+  Tokens expected = fromSink(input);
+  for (size_t cap : {1, 2, 7, 64, 100000}) {
+    PreProcessor pp(input);
+    bool overCap;
+    if (!sameTokens(fromBatches(pp, cap, overCap), expected) || overCap)
+      return false;
+  }
+  return expected.texts.size() > 5000;
+}
+
+// One invocation producing far more tokens than the cap is split across
+// calls, and spellings made by ## stay readable while their batch is held
+static bool testLongExpansion() {
+  std::string input = "#define P(a) a ## _x a ## _y\n#define Q(a) P(a) P(a)\n"
+                      "#define R(a) Q(a) Q(a) Q(a) Q(a)\n"
+                      "#define S(a) R(a) R(a) R(a) R(a) R(a)\nS(p) S(q)\n";
+  Tokens expected = fromSink(input);
+  PreProcessor pp(input);
+  TokenBatch batch;
+  std::vector<std::string> texts;
+  size_t calls = 0;
+  while (size_t n = pp.nextBatch(batch, 16)) {
+    calls++;
+    for (size_t i = 0; i < n; i++)
+      texts.emplace_back(batch.texts[i]);
+  }
+  return texts == expected.texts && texts.size() == 160 && calls == 10 &&
+         texts.back() == "q_y";
+}
+
+// LeadingSpace comes from the source and macro bodies only
+static bool testSourceSpacing() {
+  PreProcessor pp("#define PLUS +\n#define ID(x) x\n+PLUS ID( a)b  c\n");
+  TokenBatch batch;
+  pp.nextBatch(batch, 100);
+  std::vector<unsigned char> flags(batch.flags.begin(), batch.flags.end());
+  std::vector<unsigned char> expected = {TokenBatch::StartOfLine, 0,
+                                         TokenBatch::LeadingSpace, 0,
+                                         TokenBatch::LeadingSpace};
+  return PreProcessor("#define PLUS +\n+PLUS\n").expandMacros() == "\n+ +\n" &&
+         flags == expected && batch.texts[2] == "a";
+}
+
+// The end of input keeps returning empty batches; reset() starts over
+static bool testEndAndReset() {
+  PreProcessor pp("#define X 1\nX X\n");
+  TokenBatch batch;
+  size_t first = pp.nextBatch(batch, 10);
+  bool ended = pp.nextBatch(batch, 10) == 0 && batch.empty() &&
+               pp.nextBatch(batch, 10) == 0;
+  pp.reset("a b c\n");
+  bool overCap;
+  Tokens again = fromBatches(pp, 2, overCap);
+  return first == 2 && ended &&
+         again.texts == std::vector<std::string>{"a", "b", "c"} &&
+         again.lineStarts == std::vector<bool>{true, false, false};
+}
+
+// An error leaves the instance usable through the other drivers
+static bool testAfterError() {
+  PreProcessor pp("#define F(a, b) a\nok F(1)\n");
+  TokenBatch batch;
+  try {
+    while (pp.nextBatch(batch, 4)) {
+    }
+    return false;
+  } catch (const std::runtime_error &) {
+  }
+  pp.reset("#define PLUS +\n+PLUS\n");
+  return pp.expandMacros() == "\n+ +\n";
+}
+
+int main() {
+  TokenBatchTester tester;
+  tester.check("Matches Sink Tokens At Any Cap", testMatchesSink());
+  tester.check("Long Expansion Split Across Calls", testLongExpansion());
+  tester.check("Source Spacing Only", testSourceSpacing());
+  tester.check("End Of Input And Reset", testEndAndReset());
+  tester.check("Usable After An Error", testAfterError());
+  return tester.printSummary();
+}
@@ -0,0 +1,326 @@
+#define PP_ENABLE_STATS
+#include "pp.hpp"
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Covers the packed Token and the per-file token arrays of FileEntry: a
+// header read again, in the same translation unit or by another sharing the
+// FileCache, is looked up instead of lexed. Each file is checked against the
+// same text given in memory, which is always lexed.
+class TokenCacheTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+  std::string root;
+
+  static std::string normalizeSpaces(const std::string &str) {
+    std::string result;
+    bool lastWasSpace = false;
+    for (char c : str) {
+      if (std::isspace(static_cast<unsigned char>(c))) {
+        if (!lastWasSpace && !result.empty()) {
+          result += ' ';
+          lastWasSpace = true;
+        }
+      } else {
+        result += c;
+        lastWasSpace = false;
+      }
+    }
+    if (!result.empty() && result.back() == ' ')
+      result.pop_back();
+    return result;
+  }
+
+  void report(bool passed) {
+    if (passed) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  void begin(const std::string &testName) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+  }
+
+  void write(const std::string &name, const std::string &text) {
+    std::ofstream(root + "/" + name, std::ios::binary) << text;
+  }
+
+  static std::string expandText(const std::string &text) {
+    PreProcessor pp(text);
+    return normalizeSpaces(pp.expandMacros());
+  }
+
+  std::string expandFile(const std::string &name, FileCache &cache,
+                         PreprocessStats *stats = nullptr) {
+    PreProcessor pp = PreProcessor::fromFile(root + "/" + name, cache);
+    pp.addIncludePath(root);
+    std::string result = normalizeSpaces(pp.expandMacros());
+    if (stats)
+      *stats = pp.stats();
+    return result;
+  }
+
+  // Include header once per setup and compare with the header pasted in
+  // place of each #include
+  bool matchesInlined(const std::string &header,
+                      const std::vector<std::string> &setups,
+                      PreprocessStats *stats = nullptr) {
+    std::string main, inlined;
+    for (const std::string &setup : setups) {
+      main += setup + "#include \"header.h\"\n";
+      inlined += setup + header + "\n";
+    }
+    write("header.h", header);
+    write("main.c", main);
+    try {
+      FileCache cache;
+      std::string expected = expandText(inlined);
+      std::string result = expandFile("main.c", cache, stats);
+      if (result != expected)
+        std::cout << "Output:\n"
+                  << result.substr(0, 200) << "\nExpected:\n"
+                  << expected.substr(0, 200) << "\n";
+      return result == expected && !result.empty();
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      return false;
+    }
+  }
+
+  // Random lines of tokens, comments, literals and conditionals over A
+  static std::string randomHeader(std::mt19937 &rng) {
+    static const char *pieces[] = {
+        "x", "A", "a+++b", "1.5e+3", ".9", "\"s /* q\"", "'\\''", "u8\"t\"",
+        "/* c\n   # x */", "// line\n", "\\\n", "<<=", "%:%:", "#if A\n",
+        "#else\n", "#endif\n", "\n", " ", "\t", "F(1, (2))", "L'w'"};
+    std::string text = "#define F(a, b) a b\n";
+    std::vector<bool> hadElse; // Per open group
+    for (int i = 0; i < 200; i++) {
+      std::string piece = pieces[rng() % std::size(pieces)];
+      if (piece == "#if A\n") {
+        hadElse.push_back(false);
+      } else if (piece == "#else\n") {
+        if (hadElse.empty() || hadElse.back())
+          continue;
+        hadElse.back() = true;
+      } else if (piece == "#endif\n") {
+        if (hadElse.empty())
+          continue;
+        hadElse.pop_back();
+      }
+      if (piece[0] == '#' && text.back() != '\n')
+        text += "\n";
+      text += piece;
+    }
+    text += "\n";
+    for (; !hadElse.empty(); hadElse.pop_back())
+      text += "#endif\n";
+    return text;
+  }
+
+public:
+  TokenCacheTester() {
+    char pattern[] = "/tmp/pp_token_cache_XXXXXX";
+    root = mkdtemp(pattern);
+  }
+
+  ~TokenCacheTester() { std::system(("rm -rf " + root).c_str()); }
+
+  void runPackingTest() {
+    begin("Token Packs Into Eight Bytes");
+    Token longest(~0u, Token::kMaxLen, TokenKind::HashHash);
+    Token eof(7, 0, TokenKind::T_EOF);
+    bool passed = sizeof(Token) == 8 && longest.begin == ~0u &&
+                  longest.len == Token::kMaxLen &&
+                  longest.kind == TokenKind::HashHash &&
+                  eof.kind == TokenKind::T_EOF;
+    try {
+      Token(0, Token::kMaxLen + 1, TokenKind::Ident);
+      passed = false;
+    } catch (const std::runtime_error &e) {
+      std::cout << "Error: " << e.what() << "\n";
+    }
+    report(passed);
+  }
+
+  void runRepeatedHeaderTest() {
+    begin("Header Included Again Uses Its Tokens");
+    std::string header = "#if MODE\nint on = MODE; /* #else */\n#else\n"
+                         "char *off = \"#endif\";\n#endif\n"
+                         "#define TWICE(x) x x\nTWICE(MODE) a ## b\n";
+    std::vector<std::string> setups;
+    for (int i = 0; i < 6; i++)
+      setups.push_back("#undef MODE\n#define MODE " + std::to_string(i % 2) +
+                       "\n");
+    PreprocessStats stats;
+    bool passed = matchesInlined(header, setups, &stats);
+    std::cout << "tokenCacheHits=" << stats.tokenCacheHits << "\n";
+    report(passed && stats.tokenCacheHits == 5);
+  }
+
+  // A header read once per translation unit gets tokens as soon as a
+  // second unit reads it through the same FileCache
+  void runSharedCacheTest() {
+    begin("Tokens Shared Between Translation Units");
+    write("shared.h", "#define SHARED 1\nint shared = SHARED;\n");
+    write("unit.c", "#include \"shared.h\"\nint unit = SHARED + 1;\n");
+    FileCache cache;
+    std::string expected = normalizeSpaces(
+        "int shared = 1;\nint unit = 1 + 1;\n");
+    bool passed = true;
+    for (int run = 0; run < 3; run++) {
+      PreprocessStats stats;
+      std::string result = expandFile("unit.c", cache, &stats);
+      std::cout << "Run " << run << ": " << result
+                << " tokenCacheHits=" << stats.tokenCacheHits << "\n";
+      passed &= result == expected &&
+                stats.tokenCacheHits == (run == 0 ? 0u : 1u);
+    }
+    auto entry = cache.load(root + "/shared.h");
+    report(passed && entry && entry->hasTokens() &&
+           !entry->tokens([] { return std::vector<Token>(); }).empty());
+  }
+
+  // Leaving a header picks the includer's tokens back up, cached or not
+  void runNestedTest() {
+    begin("Nested Cached Headers");
+    write("inner.h", "inner INNER\n");
+    std::string header = "outer_before\n#include \"inner.h\"\nouter_after\n";
+    std::vector<std::string> setups;
+    for (int i = 0; i < 4; i++)
+      setups.push_back("#define INNER " + std::to_string(i) + "\n");
+    std::string main, expectedText;
+    for (const std::string &setup : setups) {
+      main += setup + "#include \"header.h\"\n#undef INNER\n";
+      expectedText += setup + "outer_before\ninner INNER\nouter_after\n"
+                              "#undef INNER\n";
+    }
+    write("header.h", header);
+    write("main.c", main);
+    try {
+      FileCache cache;
+      PreprocessStats stats;
+      std::string result = expandFile("main.c", cache, &stats);
+      std::cout << "Output: " << result << "\n";
+      report(result == expandText(expectedText) && stats.tokenCacheHits == 6);
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      report(false);
+    }
+  }
+
+  void runRandomTest() {
+    std::mt19937 rng(30);
+    bool allPassed = true;
+    for (int round = 0; round < 40; round++) {
+      std::string header = randomHeader(rng);
+      std::vector<std::string> setups = {"#define A 1\n", "#undef A\n",
+                                         "#define A 0\n"};
+      allPassed &= matchesInlined(header, setups);
+    }
+    begin("Random Headers Match In-Memory Input");
+    report(allPassed);
+  }
+
+  // A prelexed main file keeps its own tokens around cached headers
+  void runPrelexedMainTest() {
+    begin("Prelexed Input Around Cached Headers");
+    write("small.h", "small_header\n");
+    std::string text;
+    for (int i = 0; text.size() < 3 * PreProcessor::kPrelexChunk; i++) {
+      text += "int v" + std::to_string(i) + " = " + std::to_string(i) +
+              "; /* comment */\n";
+      if (i % 5000 == 0)
+        text += "#include \"small.h\"\n";
+    }
+    write("large.c", text);
+    try {
+      FileCache cache;
+      PreProcessor plain = PreProcessor::fromFile(root + "/large.c", cache);
+      plain.addIncludePath(root);
+      std::string expected = plain.expandMacros();
+      PreprocessStats stats;
+      PreProcessor pp = PreProcessor::fromFile(root + "/large.c", cache);
+      pp.addIncludePath(root);
+      pp.prelex(4);
+      std::string result = pp.expandMacros();
+      stats = pp.stats();
+      std::cout << "prelexedTokens=" << pp.prelexedTokens()
+                << " tokenCacheHits=" << stats.tokenCacheHits << "\n";
+      report(result == expected && pp.prelexedTokens() > 0 &&
+             stats.tokenCacheHits > 0);
+    } catch (const std::exception &e) {
+      std::cout << "Error: " << e.what() << "\n";
+      report(false);
+    }
+  }
+
+  // Threads of a batch reach the same headers at once; one of them lexes
+  // each, and every unit still matches a run of its own
+  void runBatchTest() {
+    begin("Batch Builds Each Header's Tokens Once");
+    std::vector<std::string> paths;
+    std::string common;
+    for (int i = 0; i < 300; i++)
+      common += "#if N % 2\nodd" + std::to_string(i) + " N\n#else\neven N\n"
+                "#endif\n";
+    write("common.h", common);
+    for (int i = 0; i < 16; i++) {
+      std::string name = "batch" + std::to_string(i) + ".c";
+      write(name, "#define N " + std::to_string(i) +
+                      "\n#include \"common.h\"\n#undef N\n#define N 1\n"
+                      "#include \"common.h\"\n");
+      paths.push_back(root + "/" + name);
+    }
+    FileCache cache;
+    BatchOptions options;
+    options.includePaths.push_back(root);
+    options.threads = 4;
+    options.fileCache = &cache;
+    std::vector<BatchResult> results = BatchPreprocessor(options).run(paths);
+    bool same = results.size() == paths.size();
+    for (size_t i = 0; same && i < results.size(); i++) {
+      FileCache fresh;
+      PreProcessor pp = PreProcessor::fromFile(paths[i], fresh);
+      pp.addIncludePath(root);
+      same = results[i].error.empty() && results[i].output == pp.expandMacros();
+    }
+    auto entry = cache.load(root + "/common.h");
+    report(same && entry && entry->hasTokens());
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+int main() {
+  TokenCacheTester tester;
+  tester.runPackingTest();
+  tester.runRepeatedHeaderTest();
+  tester.runSharedCacheTest();
+  tester.runNestedTest();
+  tester.runRandomTest();
+  tester.runPrelexedMainTest();
+  tester.runBatchTest();
+  return tester.printSummary();
+}
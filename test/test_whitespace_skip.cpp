@@ -0,0 +1,137 @@
+#include "pp.hpp"
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Checks that the vectorised whitespace/comment skipping in next() lands on
+// exactly the same token starts as the original byte-at-a-time loop.
+class WhitespaceSkipTester {
+private:
+  int testCount = 0;
+  int passedTests = 0;
+
+  // The byte-at-a-time skip loop next() used before the vector paths.
+  static unsigned referenceSkip(const std::string &buffer, unsigned cursor) {
+    while (cursor < buffer.size()) {
+      if (std::isspace(static_cast<unsigned char>(buffer[cursor])) &&
+          buffer[cursor] != '\n') {
+        cursor++;
+        continue;
+      }
+      if (cursor + 1 < buffer.size() && buffer[cursor] == '/' &&
+          buffer[cursor + 1] == '/') {
+        while (cursor < buffer.size() && buffer[cursor] != '\n')
+          cursor++;
+        continue;
+      }
+      if (cursor + 1 < buffer.size() && buffer[cursor] == '/' &&
+          buffer[cursor + 1] == '*') {
+        cursor += 2;
+        while (cursor + 1 < buffer.size() &&
+               !(buffer[cursor] == '*' && buffer[cursor + 1] == '/'))
+          cursor++;
+        if (cursor + 1 < buffer.size())
+          cursor += 2;
+        continue;
+      }
+      break;
+    }
+    return cursor;
+  }
+
+  // Token starts as seen through next(), compared with the reference skip
+  // applied at each token end.
+  bool sameTokenStarts(const std::string &input) {
+    PreProcessor pp(input);
+    unsigned expectedStart = referenceSkip(input, 0);
+    for (int guard = 0; guard < 100000; guard++) {
+      Token token = pp.next();
+      if (token.kind == TokenKind::T_EOF)
+        return expectedStart >= input.size();
+      if (token.begin != expectedStart) {
+        std::cout << "  token at " << token.begin << ", expected "
+                  << expectedStart << "\n";
+        return false;
+      }
+      expectedStart = referenceSkip(input, token.begin + token.len);
+    }
+    return false;
+  }
+
+public:
+  void runTest(const std::string &testName, const std::string &input) {
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    if (sameTokenStarts(input)) {
+      std::cout << "✓ PASSED\n";
+      passedTests++;
+    } else {
+      std::cout << "✗ FAILED\n";
+    }
+  }
+
+  void runRandomTests(const std::string &testName, unsigned seed, int rounds) {
+    static const char *pieces[] = {" ",  "\t", "\v", "\f",  "\r", "\n",
+                                   "/*", "*/", "*",  "/",   "//", "a",
+                                   "1",  "+",  "\"", "  ", "\t\t\t\t"};
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> pick(0, sizeof(pieces) /
+                                                   sizeof(pieces[0]) - 1);
+    std::uniform_int_distribution<int> len(0, 200);
+
+    testCount++;
+    std::cout << "\n=== Test " << testCount << ": " << testName << " ===\n";
+    for (int round = 0; round < rounds; round++) {
+      std::string input;
+      int n = len(rng);
+      for (int i = 0; i < n; i++)
+        input += pieces[pick(rng)];
+      if (!sameTokenStarts(input)) {
+        std::cout << "Mismatch for input of size " << input.size() << "\n";
+        std::cout << "✗ FAILED\n";
+        return;
+      }
+    }
+    std::cout << "✓ PASSED\n";
+    passedTests++;
+  }
+
+  int printSummary() {
+    std::cout << "\n=== Test Summary ===\n";
+    std::cout << "Total tests: " << testCount << "\n";
+    std::cout << "Passed: " << passedTests << "\n";
+    std::cout << "Failed: " << (testCount - passedTests) << "\n";
+
+    if (passedTests == testCount) {
+      std::cout << "🎉 All tests passed!\n";
+      return 0;
+    }
+    std::cout << "❌ Some tests failed.\n";
+    return 1;
+  }
+};
+
+int main() {
+  WhitespaceSkipTester tester;
+
+  tester.runTest("Long Whitespace Run",
+                 "a" + std::string(100, ' ') + "b\t\t\v\f\r c");
+  tester.runTest("Whitespace Up To EOF", "x" + std::string(70, '\t'));
+  tester.runTest("Block Comment Across Vector Boundary",
+                 "a /*" + std::string(29, 'x') + "*/ b /*" +
+                     std::string(14, '*') + "*/c");
+  tester.runTest("Star At Last Lane", std::string(15, ' ') + "/*" +
+                                          std::string(13, '-') + "*" + "/" +
+                                          "z");
+  tester.runTest("Multi-line Block Comment", "int a; /* one\ntwo\n*/ int b;");
+  tester.runTest("Unterminated Block Comment",
+                 "int a; /* never closed " + std::string(40, '*'));
+  tester.runTest("Unterminated Short Comment", "/*");
+  tester.runTest("Line Comment", "a // comment\nb // trailing");
+  tester.runTest("Line Comment At EOF", "a //");
+  tester.runTest("Lone Slash At EOF", "a /");
+  tester.runRandomTests("Randomised Inputs", 12345, 2000);
+
+  return tester.printSummary();
+}